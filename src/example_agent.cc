@@ -7,7 +7,7 @@
 using nova::guest::agent::execute_main;
 using namespace nova::flags;
 using namespace nova::guest;
-using nova::utils::ThreadBasedJobRunner;
+using nova::utils::JobScheduler;
 using nova::rpc::ResilientSenderPtr;
 using std::vector;
 
@@ -29,7 +29,7 @@ struct Func {
     boost::tuple<vector<MessageHandlerPtr>, EmptyAppUpdatePtr>
         operator() (const FlagValues & flags,
                     ResilientSenderPtr & sender,
-                    ThreadBasedJobRunner & job_runner)
+                    JobScheduler & job_runner)
     {
         /* Create JSON message handlers. */
         vector<MessageHandlerPtr> handlers;
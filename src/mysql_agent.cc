@@ -60,7 +60,7 @@ using namespace nova::db::mysql;
 using namespace nova::guest::mysql;
 using nova::guest::common::PrepareHandler;
 using nova::guest::common::PrepareHandlerPtr;
-using nova::utils::ThreadBasedJobRunner;
+using nova::utils::JobScheduler;
 using namespace nova::rpc;
 using std::string;
 using nova::utils::Thread;
@@ -107,6 +107,9 @@ struct Func {
     // threads.
     nova::db::mysql::MySqlApiScope mysql_api_scope;
 
+    // Connections to the local server are kept open between messages.
+    MySqlLocalPoolScope mysql_pool_scope;
+
     static bool is_mysql_installed(std::list<std::string> package_list,
                                    AptGuestPtr & apt_worker) {
         BOOST_FOREACH(const auto & package_name, package_list) {
@@ -124,7 +127,7 @@ struct Func {
     boost::tuple<std::vector<MessageHandlerPtr>, PeriodicTasksPtr>
         operator() (const FlagValues & flags,
                     ResilientSenderPtr sender,
-                    ThreadBasedJobRunner & job_runner)
+                    JobScheduler & job_runner)
     {
         /* Create JSON message handlers. */
         vector<MessageHandlerPtr> handlers;
@@ -193,7 +196,7 @@ struct Func {
         /* Create the Interrogator for the guest. */
         Interrogator interrogator(MOUNT_POINT);
         MessageHandlerPtr handler_interrogator(
-            new InterrogatorMessageHandler(interrogator));
+            new InterrogatorMessageHandler(interrogator, &job_runner));
         handlers.push_back(handler_interrogator);
 
         /* Backup task */
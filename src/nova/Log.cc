@@ -1,24 +1,52 @@
 #include "pch.hpp"
 #include "nova/Log.h"
 
+#include <algorithm>
+#include "nova/json_escape.h"
+#include <boost/foreach.hpp>
 #include <boost/format.hpp>
 #include <iostream>
+#include <list>
 #include <boost/optional.hpp>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <time.h>
-#include "nova/guest/utils.h"
+#include <unistd.h>
+#include <vector>
 
 using boost::format;
 using nova::Log;
-using nova::guest::utils::IsoDateTime;
 using boost::optional;
 using std::string;
 
 namespace nova {
 
+/* One key and value added by a LogContextScope. Queued lines hold a
+ * reference to the innermost one, as do nested ones to their parents, so
+ * the writer can still read them after the scope has ended. */
+struct LogContext : boost::noncopyable {
+    const string key;
+    LogContext * const parent;
+    volatile int references;
+    const string value;
+
+    LogContext(const char * key, const string & value, LogContext * parent)
+    :   key(key),
+        parent(parent),
+        references(1),
+        value(value)
+    {
+    }
+};
+
 namespace {
 
     const char * const ANSI_RESET = "\033[0m";
@@ -59,24 +87,465 @@ namespace {
 
     boost::thread::id main_thread;
     boost::thread::id status_thread;
-    boost::thread::id job_thread;
+    // There can be several job threads, so each marks itself.
+    __thread bool is_job_thread = false;
 
     const char * thread_to_string(const boost::thread::id & id) {
         if (id == main_thread) {
             return "main    ";
         } else if (id == status_thread) {
             return " status ";
-        } else if (id == job_thread) {
+        } else if (is_job_thread && id == boost::this_thread::get_id()) {
             return "    job ";
         } else {
             return " ?????? ";
         }
     }
 
+    /* Numbers for the binary format, which mustn't change if the enum
+     * does. */
+    uint8_t level_to_number(Log::Level level) {
+        switch(level) {
+            case Log::LEVEL_DEBUG:
+                return NOVA_LOG_LEVEL_DEBUG;
+            case Log::LEVEL_ERROR:
+                return NOVA_LOG_LEVEL_ERROR;
+            case Log::LEVEL_INFO:
+                return NOVA_LOG_LEVEL_INFO;
+            default:
+                return NOVA_LOG_LEVEL_TRACE;
+        }
+    }
+
+    __thread LogContext * this_thread_context = 0;
+
+    LogContext * acquire_context(LogContext * context) {
+        if (context) {
+            __sync_fetch_and_add(&context->references, 1);
+        }
+        return context;
+    }
+
+    void release_context(LogContext * context) {
+        while(context
+              && __sync_sub_and_fetch(&context->references, 1) == 0) {
+            LogContext * parent = context->parent;
+            delete context;
+            context = parent;
+        }
+    }
+
+    /* The thread and level names are padded to line up in the text
+     * format, which the structured formats don't want. */
+    void trim(const char * text, const char * & start, size_t & length) {
+        start = text;
+        while(*start == ' ') {
+            ++ start;
+        }
+        length = strlen(start);
+        while(length > 0 && start[length - 1] == ' ') {
+            -- length;
+        }
+    }
+
+    void append_trimmed_json(string & line, const char * text) {
+        const char * start;
+        size_t length;
+        trim(text, start, length);
+        json_append_string(line, start, length);
+    }
+
+    /* Writes the outermost context first, so a key used twice ends up with
+     * the innermost value in most JSON parsers. */
+    void append_context_json(string & line, const LogContext * context) {
+        if (context->parent) {
+            append_context_json(line, context->parent);
+            line.append(",");
+        }
+        json_append_string(line, context->key.c_str(), context->key.size());
+        line.append(":");
+        json_append_string(line, context->value.c_str(),
+                           context->value.size());
+    }
+
+    void append_number(string & line, uint64_t number, int bytes) {
+        for (int i = bytes - 1; i >= 0; i --) {
+            line.push_back((char) ((number >> (i * 8)) & 0xff));
+        }
+    }
+
+    /* Fills in a number whose space was reserved before its value was
+     * known. */
+    void set_uint32(string & line, size_t index, uint32_t number) {
+        for (int i = 0; i < 4; i ++) {
+            line[index + i] = (char) ((number >> ((3 - i) * 8)) & 0xff);
+        }
+    }
+
+    void append_binary_string(string & line, const char * text,
+                              size_t length) {
+        append_number(line, length, 4);
+        line.append(text, length);
+    }
+
+    void append_trimmed_binary(string & line, const char * text) {
+        const char * start;
+        size_t length;
+        trim(text, start, length);
+        append_binary_string(line, start, length);
+    }
+
+    uint32_t append_context_binary(string & line,
+                                   const LogContext * context) {
+        if (!context) {
+            return 0;
+        }
+        const uint32_t count = append_context_binary(line, context->parent);
+        append_binary_string(line, context->key.c_str(), context->key.size());
+        append_binary_string(line, context->value.c_str(),
+                             context->value.size());
+        return count + 1;
+    }
+
     static boost::mutex global_mutex;
 
     static time_t start_time;
 
+    // Read without a lock by the logging threads; set under global_mutex.
+    volatile bool initialized = false;
+
+    void format_time(time_t time, char * buffer, size_t buffer_size) {
+        tm parts;
+        if (localtime_r(&time, &parts) == 0
+            || strftime(buffer, buffer_size, "%Y-%m-%d %H:%M:%S", &parts) == 0) {
+            buffer[0] = '\0';
+        }
+    }
+
+    double monotonic_now() {
+        timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return now.tv_sec + (now.tv_nsec / 1000000000.0);
+    }
+
+    /* Writes the first "count" lines with as few calls as possible. Errors
+     * go to STDERR, since there's nowhere else to log them. */
+    void write_lines(int fd, const std::vector<string> & lines, size_t count) {
+        iovec iov[IOV_MAX];
+        size_t index = 0;
+        while(index < count) {
+            int iov_count = 0;
+            for (size_t i = index; i < count && iov_count < IOV_MAX; i ++) {
+                iov[iov_count].iov_base = (void *) lines[i].data();
+                iov[iov_count].iov_len = lines[i].size();
+                ++ iov_count;
+            }
+            index += iov_count;
+            iovec * next = iov;
+            while(iov_count > 0) {
+                ssize_t written = ::writev(fd, next, iov_count);
+                if (written < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    std::cerr << "Error writing log file: " << strerror(errno)
+                              << std::endl;
+                    return;
+                }
+                // Skip whatever made it out; partial writes are rare.
+                while(iov_count > 0 && (size_t) written >= next->iov_len) {
+                    written -= next->iov_len;
+                    ++ next;
+                    -- iov_count;
+                }
+                if (iov_count > 0) {
+                    next->iov_base = (char *) next->iov_base + written;
+                    next->iov_len -= written;
+                }
+            }
+        }
+    }
+
+
+    /* A line waiting to be written. The message strings are reused, so once
+     * a buffer has been around for a while queueing a line doesn't allocate
+     * anything. */
+    struct LogEntry {
+        unsigned long sequence;
+        timespec time;
+        const char * thread_name;
+        const char * file_name;
+        int line_number;
+        Log::Level level;
+        string message;
+        // Holds a reference, released once the line is written.
+        LogContext * context;
+    };
+
+    bool entry_less_than(const LogEntry & a, const LogEntry & b) {
+        return a.sequence < b.sequence;
+    }
+
+    unsigned long next_sequence = 0;
+
+
+    /* A ring of entries written by one thread and read by the writer. Each
+     * side only moves its own index, so neither needs a lock. */
+    class LogBuffer : boost::noncopyable {
+        public:
+            LogBuffer(size_t capacity)
+            :   abandoned(false),
+                entries(capacity),
+                head(0),
+                tail(0)
+            {
+                BOOST_FOREACH(LogEntry & entry, entries) {
+                    entry.message.reserve(256);
+                }
+            }
+
+            // Set when the thread exits, so the writer can delete it once
+            // it's empty.
+            volatile bool abandoned;
+
+            /* Producer: returns the slot to fill in, or null if full. */
+            LogEntry * next_free() {
+                if (head - tail >= entries.size()) {
+                    return 0;
+                }
+                return &entries[head % entries.size()];
+            }
+
+            void publish() {
+                __sync_synchronize();
+                head = head + 1;
+            }
+
+            /* Consumer: returns the oldest filled slot, or null if empty. */
+            LogEntry * next_ready() {
+                if (tail == head) {
+                    return 0;
+                }
+                __sync_synchronize();
+                return &entries[tail % entries.size()];
+            }
+
+            void release() {
+                __sync_synchronize();
+                tail = tail + 1;
+            }
+
+        private:
+            std::vector<LogEntry> entries;
+            volatile size_t head;
+            volatile size_t tail;
+    };
+
+    const size_t LOG_BUFFER_SIZE = 1024;
+
+
+    /* Owns every thread's buffer and the thread which empties them. */
+    class LogWriter : boost::noncopyable {
+        public:
+            LogWriter()
+            :   buffers(),
+                condition(),
+                flush_requests(0),
+                flushed(),
+                flushes_done(0),
+                mutex(),
+                pending(),
+                stopping(false),
+                thread(0),
+                wake(false)
+            {
+            }
+
+            void add(LogBuffer * buffer) {
+                boost::lock_guard<boost::mutex> lock(mutex);
+                buffers.push_back(buffer);
+            }
+
+            void flush() {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                if (!thread) {
+                    lock.unlock();
+                    drain(true);
+                    return;
+                }
+                const unsigned long ticket = ++ flush_requests;
+                condition.notify_all();
+                while(flushes_done < ticket) {
+                    flushed.wait(lock);
+                }
+            }
+
+            void start() {
+                boost::lock_guard<boost::mutex> lock(mutex);
+                if (!thread) {
+                    stopping = false;
+                    thread = new boost::thread(&LogWriter::run, this);
+                }
+            }
+
+            /* Writes whatever is left and waits for the thread to exit. */
+            void stop() {
+                boost::thread * old_thread;
+                {
+                    boost::lock_guard<boost::mutex> lock(mutex);
+                    old_thread = thread;
+                    stopping = true;
+                    condition.notify_all();
+                }
+                if (old_thread) {
+                    old_thread->join();
+                    delete old_thread;
+                    boost::lock_guard<boost::mutex> lock(mutex);
+                    thread = 0;
+                }
+            }
+
+            /* Asks for the buffers to be emptied soon. Doesn't lock, so a
+             * wake up can be missed, but then the writer's time out covers
+             * it. */
+            void poke() {
+                wake = true;
+                condition.notify_one();
+            }
+
+        private:
+            std::list<LogBuffer *> buffers;
+            boost::condition_variable condition;
+            unsigned long flush_requests;
+            boost::condition_variable flushed;
+            unsigned long flushes_done;
+            boost::mutex mutex;
+            std::vector<LogEntry> pending;
+            bool stopping;
+            boost::thread * thread;
+            volatile bool wake;
+
+            /* Moves everything queued so far into "pending", then writes it in
+             * the order it was logged. If "force" is false the file may hold
+             * on to it for a while. */
+            void drain(bool force) {
+                std::list<LogBuffer *> current;
+                {
+                    boost::lock_guard<boost::mutex> lock(mutex);
+                    current = buffers;
+                }
+                size_t count = 0;
+                BOOST_FOREACH(LogBuffer * buffer, current) {
+                    LogEntry * entry;
+                    while((entry = buffer->next_ready())) {
+                        if (pending.size() <= count) {
+                            pending.resize(count + 1);
+                        }
+                        LogEntry & copy = pending[count ++];
+                        copy.sequence = entry->sequence;
+                        copy.time = entry->time;
+                        copy.thread_name = entry->thread_name;
+                        copy.file_name = entry->file_name;
+                        copy.line_number = entry->line_number;
+                        copy.level = entry->level;
+                        copy.message.swap(entry->message);
+                        copy.context = entry->context;
+                        entry->context = 0;
+                        buffer->release();
+                    }
+                }
+                std::sort(pending.begin(), pending.begin() + count,
+                          entry_less_than);
+                if (initialized) {
+                    try {
+                        nova::LogPtr log = Log::get_instance();
+                        for (size_t i = 0; i < count; i ++) {
+                            const LogEntry & entry = pending[i];
+                            log->write(entry.time, entry.thread_name,
+                                       entry.file_name, entry.line_number,
+                                       entry.level, entry.message.c_str(),
+                                       entry.context);
+                        }
+                        log->flush_file(force);
+                    } catch(const LogException & le) {
+                        // Shut down while these were queued; nowhere to
+                        // write them.
+                    }
+                }
+                for (size_t i = 0; i < count; i ++) {
+                    release_context(pending[i].context);
+                    pending[i].context = 0;
+                }
+                remove_abandoned_buffers();
+            }
+
+            void remove_abandoned_buffers() {
+                boost::lock_guard<boost::mutex> lock(mutex);
+                std::list<LogBuffer *>::iterator itr = buffers.begin();
+                while(itr != buffers.end()) {
+                    LogBuffer * buffer = *itr;
+                    if (buffer->abandoned && !buffer->next_ready()) {
+                        delete buffer;
+                        itr = buffers.erase(itr);
+                    } else {
+                        ++ itr;
+                    }
+                }
+            }
+
+            void run() {
+                while(true) {
+                    unsigned long ticket;
+                    bool stop;
+                    {
+                        boost::unique_lock<boost::mutex> lock(mutex);
+                        if (!wake && !stopping
+                            && flush_requests == flushes_done) {
+                            condition.timed_wait(
+                                lock, boost::posix_time::milliseconds(20));
+                        }
+                        wake = false;
+                        ticket = flush_requests;
+                        stop = stopping;
+                    }
+                    drain(stop || ticket != flushes_done);
+                    {
+                        boost::lock_guard<boost::mutex> lock(mutex);
+                        flushes_done = ticket;
+                    }
+                    flushed.notify_all();
+                    if (stop) {
+                        return;
+                    }
+                }
+            }
+    };
+
+    LogWriter & writer() {
+        // Never deleted, as the thread may still be running at exit if
+        // shutdown wasn't called.
+        static LogWriter * instance = new LogWriter();
+        return *instance;
+    }
+
+    void abandon_buffer(LogBuffer * buffer) {
+        buffer->abandoned = true;
+    }
+
+    __thread LogBuffer * this_thread_buffer = 0;
+
+    // Only here to tell us when a thread exits.
+    boost::thread_specific_ptr<LogBuffer> buffer_owner(abandon_buffer);
+
+    LogBuffer & get_this_thread_buffer() {
+        if (!this_thread_buffer) {
+            this_thread_buffer = new LogBuffer(LOG_BUFFER_SIZE);
+            buffer_owner.reset(this_thread_buffer);
+            writer().add(this_thread_buffer);
+        }
+        return *this_thread_buffer;
+    }
+
 } // end anonymous namespace
 
 
@@ -106,21 +575,43 @@ const char * LogException::what() const throw() {
 
 LogFileOptions::LogFileOptions(string path, optional<size_t> max_size,
                                optional<double> max_time_in_seconds,
-                               int max_old_files)
-:   max_old_files(max_old_files),
+                               int max_old_files, bool compress_old_files,
+                               optional<size_t> max_old_files_size,
+                               Format format)
+:   compress_old_files(compress_old_files),
+    format(format),
+    max_old_files(max_old_files),
+    max_old_files_size(max_old_files_size),
     max_size(max_size),
     max_time_in_seconds(max_time_in_seconds),
     path(path) {
 }
 
 
+/**---------------------------------------------------------------------------
+ *- LogFlushPolicy
+ *---------------------------------------------------------------------------*/
+
+LogFlushPolicy::LogFlushPolicy(bool every_line, double interval, size_t size)
+:   every_line(every_line),
+    interval(interval),
+    size(size) {
+}
+
+LogFlushPolicy LogFlushPolicy::buffered() {
+    return LogFlushPolicy(false, 0.5, 64 * 1024);
+}
+
+
 /**---------------------------------------------------------------------------
  *- LogOptions
  *---------------------------------------------------------------------------*/
 
 LogOptions::LogOptions(boost::optional<LogFileOptions> file,
-                       bool use_std_streams, bool show_trace)
- : file(file), show_trace(show_trace), use_std_streams(use_std_streams) {
+                       bool use_std_streams, bool show_trace,
+                       const LogFlushPolicy & flush)
+ : file(file), flush(flush), show_trace(show_trace),
+   use_std_streams(use_std_streams) {
 }
 
 LogOptions LogOptions::simple() {
@@ -146,6 +637,23 @@ LogApiScope::~LogApiScope() {
     Log::shutdown();
 }
 
+/**---------------------------------------------------------------------------
+ *- LogContextScope
+ *---------------------------------------------------------------------------*/
+
+LogContextScope::LogContextScope(const char * key, const string & value)
+// The new context takes over the thread's reference to its parent.
+:   context(new LogContext(key, value, this_thread_context))
+{
+    this_thread_context = context;
+}
+
+LogContextScope::~LogContextScope() {
+    this_thread_context = acquire_context(context->parent);
+    release_context(context);
+}
+
+
 /**---------------------------------------------------------------------------
  *- Log
  *---------------------------------------------------------------------------*/
@@ -168,7 +676,18 @@ void intrusive_ptr_release(Log * ref) {
 }
 
 Log::Log(const LogOptions & options)
-: file(), mutex(), options(options), reference_count(0) {
+:   cached_time(0),
+    file(-1),
+    file_size(0),
+    mutex(),
+    pending_bytes(0),
+    pending_count(0),
+    pending_lines(),
+    pending_since(0),
+    options(options),
+    reference_count(0)
+{
+    cached_time_string[0] = '\0';
     open_file();
 }
 
@@ -177,32 +696,42 @@ Log::~Log() {
 }
 
 void Log::close_file() {
-    if (options.file) {
-        file.close();
+    if (file >= 0) {
+        write_pending_lines();
+        ::close(file);
+        file = -1;
     }
 }
 
-boost::optional<size_t> Log::current_log_file_size() {
-    if (options.file) {
-        struct stat buf;
-        if (::stat(options.file.get().path.c_str(), &buf) == 0) {
-            return boost::optional<size_t>(buf.st_size);
-        } else {
-            write(__FILE__, __LINE__, LEVEL_ERROR, "Could not stat log file!");
-        }
+void Log::flush_file(bool force) {
+    boost::lock_guard<boost::mutex> lock(mutex);
+    if (pending_count > 0 && (force || pending_bytes >= options.flush.size
+        || monotonic_now() - pending_since >= options.flush.interval)) {
+        write_pending_lines();
+        rotate_if_too_big();
     }
-    return boost::none;
+}
+
+void Log::flush() {
+    writer().flush();
 }
 
 void Log::initialize(const LogOptions & options) {
-    boost::lock_guard<boost::mutex> lock(global_mutex);
-    main_thread = boost::this_thread::get_id();
-    _open_log(options);
-    ::time(&start_time);
+    // Lines queued for the old log go to the old log.
+    writer().flush();
+    {
+        boost::lock_guard<boost::mutex> lock(global_mutex);
+        main_thread = boost::this_thread::get_id();
+        _open_log(options);
+        ::time(&start_time);
+        trace_enabled = options.show_trace;
+        initialized = true;
+    }
+    writer().start();
 }
 
 void Log::initialize_job_thread() {
-    job_thread = boost::this_thread::get_id();
+    is_job_thread = true;
 }
 
 void Log::initialize_status_thread() {
@@ -210,6 +739,8 @@ void Log::initialize_status_thread() {
 }
 
 
+volatile bool Log::trace_enabled = false;
+
 LogPtr & Log::_get_instance() {
     static LogPtr instance(0);
     return instance;
@@ -229,8 +760,7 @@ void Log::handle_fmt_error(const char * filename, const int line_number,
                            const boost::io::format_error & fe) {
     boost::format fmt("! FORMAT ERROR for string %s: %s");
     const std::string msg(str(fmt % fmt_string % fe.what()));
-    nova::Log::get_instance()->write(filename, line_number, LEVEL_ERROR,
-                                     msg.c_str());
+    queue_line(filename, line_number, LEVEL_ERROR, msg.c_str());
     #if defined(_DEBUG) || defined(BOOST_TEST_MODULE)
         // Throw the exception only if we can afford to.
         // Don't crash the app or a method over something
@@ -241,8 +771,17 @@ void Log::handle_fmt_error(const char * filename, const int line_number,
 
 void Log::open_file() {
     if (options.file) {
-        file.open(options.file.get().path.c_str(),
-                  std::ios::out | std::ios::app);
+        file = ::open(options.file.get().path.c_str(),
+                      O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+        if (file < 0) {
+            std::cerr << "Could not open log file "
+                      << options.file.get().path << ": " << strerror(errno)
+                      << std::endl;
+            return;
+        }
+        // The only time the size is read from disk; after this it's counted.
+        struct stat buf;
+        file_size = (::fstat(file, &buf) == 0) ? buf.st_size : 0;
     }
 }
 
@@ -256,6 +795,8 @@ void Log::_open_log(const LogOptions & options) {
 }
 
 void Log::rotate_files() {
+    // Lines logged before the rotation belong in the old file.
+    writer().flush();
     boost::lock_guard<boost::mutex> lock(global_mutex);
     LogPtr old = _get_instance();
     if (!old) {
@@ -287,13 +828,6 @@ bool Log::should_rotate_logs() {
             if (diff > file_options.max_time_in_seconds.get()) {
                 return true;
             }
-        } else if (file_options.max_size) {
-            boost::optional<size_t> size = current_log_file_size();
-            if (size) { // ignore if we couldn't stat the file.
-                if (size > file_options.max_size) {
-                    return true;
-                }
-            }
         }
     }
     return false;
@@ -301,40 +835,194 @@ bool Log::should_rotate_logs() {
 
 
 
+void Log::queue_line(const char * file_name, int line_number,
+                     Log::Level level, const char * message) {
+    if (!initialized) {
+        std::cerr << "Logging system not initialized!" << std::endl;
+        throw LogException(LogException::NOT_INITIALIZED);
+    }
+    if (!is_enabled(level)) {
+        return;
+    }
+    LogBuffer & buffer = get_this_thread_buffer();
+    LogEntry * entry;
+    while(!(entry = buffer.next_free())) {
+        // Rather than lose lines, wait for the writer to catch up.
+        writer().poke();
+        boost::this_thread::yield();
+    }
+    entry->sequence = __sync_fetch_and_add(&next_sequence, 1);
+    clock_gettime(CLOCK_REALTIME, &entry->time);
+    entry->thread_name = thread_to_string(boost::this_thread::get_id());
+    entry->file_name = file_name;
+    entry->line_number = line_number;
+    entry->level = level;
+    entry->message.assign(message);
+    entry->context = acquire_context(this_thread_context);
+    buffer.publish();
+    if (level == LEVEL_ERROR) {
+        writer().poke();
+    }
+}
+
 void Log::write(const char * file_name, int line_number, Log::Level level,
                 const char * message)
 {
     if (level == LEVEL_TRACE && !options.show_trace) {
         return;
     }
-    IsoDateTime time;
+    timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    write(now, thread_to_string(boost::this_thread::get_id()),
+          file_name, line_number, level, message, this_thread_context);
+    flush_file(true);
+}
+
+void Log::write(const timespec & time, const char * thread_name,
+                const char * file_name, int line_number, Log::Level level,
+                const char * message, const LogContext * context)
+{
     const char * level_string = level_to_string(level);
     boost::lock_guard<boost::mutex> lock(mutex);
     if (options.use_std_streams) {
+        const char * time_string = time_to_string(time.tv_sec);
         std::ostream & out = (level == LEVEL_INFO) ? std::cout : std::cerr;
-        out << time.c_str() << " "
-            << thread_to_string(boost::this_thread::get_id()) << " "
+        out << time_string << " "
+            << thread_name << " "
             << level_string << " "
             << level_color(level) << message << ANSI_RESET
             << " for " << file_name <<  ":" << line_number << std::endl;
     }
-    {
-        if (file.is_open()) {
-            file << time.c_str() << " "
-                 << thread_to_string(boost::this_thread::get_id()) << " "
-                 << level_string << " " << message
-                 << " for " << file_name <<  ":" << line_number << std::endl;
-            file.flush();
+    if (file >= 0) {
+        // Reuse the strings from the last batch to avoid allocating.
+        if (pending_lines.size() <= pending_count) {
+            pending_lines.resize(pending_count + 1);
+        }
+        string & line = pending_lines[pending_count];
+        format_line(line, time, thread_name, file_name, line_number, level,
+                    message, context);
+        if (pending_count == 0) {
+            pending_since = monotonic_now();
+        }
+        ++ pending_count;
+        pending_bytes += line.size();
+        if (options.flush.every_line || level == LEVEL_ERROR
+            || pending_bytes >= options.flush.size) {
+            write_pending_lines();
+            rotate_if_too_big();
+        }
+    }
+}
 
+void Log::rotate_if_too_big() {
+    if (file < 0) {
+        return;
+    }
+    // Logs rotated by time ignore max_size, as they always have.
+    const LogFileOptions & file_options = options.file.get();
+    if (file_options.max_size && !file_options.max_time_in_seconds
+        && file_size >= file_options.max_size.get()) {
+        close_file();
+        _rotate_files(file_options);
+        open_file();
+    }
+}
+
+/* The binary format is a series of records, each of them:
+ *     uint32 length of the rest of the record
+ *     uint64 nanoseconds since the epoch
+ *     uint8  level, as in NOVA_LOG_LEVEL_*
+ *     uint32 line number
+ *     string thread, string file, string message
+ *     uint32 context count, followed by that many key and value strings
+ * Integers are big endian and strings are a uint32 length then the bytes. */
+void Log::format_line(string & line, const timespec & time,
+                      const char * thread_name, const char * file_name,
+                      int line_number, Log::Level level, const char * message,
+                      const LogContext * context) {
+    const uint64_t time_ns = (uint64_t) time.tv_sec * 1000000000ULL
+                             + time.tv_nsec;
+    char number_string[32];
+    switch(options.file.get().format) {
+        case LogFileOptions::FORMAT_BINARY: {
+            line.assign(4, '\0');
+            append_number(line, time_ns, 8);
+            append_number(line, level_to_number(level), 1);
+            append_number(line, (uint32_t) line_number, 4);
+            append_trimmed_binary(line, thread_name);
+            append_binary_string(line, file_name, strlen(file_name));
+            append_binary_string(line, message, strlen(message));
+            const size_t count_index = line.size();
+            line.append(4, '\0');
+            const uint32_t count = append_context_binary(line, context);
+            set_uint32(line, count_index, count);
+            set_uint32(line, 0, line.size() - 4);
+            break;
         }
+        case LogFileOptions::FORMAT_JSON_LINES:
+            snprintf(number_string, sizeof(number_string), "%llu",
+                     (unsigned long long) time_ns);
+            line.assign("{\"time_ns\":").append(number_string);
+            line.append(",\"level\":");
+            append_trimmed_json(line, level_to_string(level));
+            line.append(",\"thread\":");
+            append_trimmed_json(line, thread_name);
+            line.append(",\"file\":");
+            json_append_string(line, file_name);
+            snprintf(number_string, sizeof(number_string), "%d", line_number);
+            line.append(",\"line\":").append(number_string);
+            line.append(",\"message\":");
+            json_append_string(line, message);
+            if (context) {
+                line.append(",\"context\":{");
+                append_context_json(line, context);
+                line.append("}");
+            }
+            line.append("}\n");
+            break;
+        default:
+            snprintf(number_string, sizeof(number_string), "%d\n",
+                     line_number);
+            line.assign(time_to_string(time.tv_sec));
+            line.append(" ").append(thread_name).append(" ")
+                .append(level_to_string(level)).append(" ").append(message)
+                .append(" for ").append(file_name).append(":")
+                .append(number_string);
+    }
+}
+
+const char * Log::time_to_string(time_t time) {
+    // Most lines are logged in the same second as the one before.
+    if (time != cached_time || cached_time_string[0] == '\0') {
+        format_time(time, cached_time_string, sizeof(cached_time_string));
+        cached_time = time;
+    }
+    return cached_time_string;
+}
+
+void Log::write_pending_lines() {
+    if (pending_count > 0) {
+        write_lines(file, pending_lines, pending_count);
+        file_size += pending_bytes;
+        pending_count = 0;
+        pending_bytes = 0;
     }
 }
 
 void Log::shutdown() {
+    // Stopping the writer writes out anything still queued and drops the
+    // reference it holds while writing.
+    writer().stop();
+    _stop_compressing();
+    {
+        boost::lock_guard<boost::mutex> lock(global_mutex);
+        initialized = false;
+    }
     if (_get_instance().get() != 0 && _get_instance()->reference_count > 1) {
-        _get_instance()->write(__FILE__, __LINE__, LEVEL_ERROR,
-            "On shutdown, %d instances of the logger remain.",
-            _get_instance()->reference_count);
+        const string msg = str(format(
+            "On shutdown, %d instances of the logger remain.")
+            % _get_instance()->reference_count);
+        _get_instance()->write(__FILE__, __LINE__, LEVEL_ERROR, msg.c_str());
         throw LogException(LogException::STRAY_LOG_EXCEPTION);
     }
     _get_instance().reset(0);
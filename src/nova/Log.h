@@ -8,6 +8,21 @@
 #include <boost/smart_ptr.hpp>
 #include <string>
 #include <boost/thread.hpp>
+#include <time.h>
+#include <vector>
+
+/* Levels in order of importance, for NOVA_LOG_MIN_LEVEL. */
+#define NOVA_LOG_LEVEL_TRACE 0
+#define NOVA_LOG_LEVEL_DEBUG 1
+#define NOVA_LOG_LEVEL_INFO 2
+#define NOVA_LOG_LEVEL_ERROR 3
+
+/* Log macros below this level compile to nothing, so their arguments are
+ * never evaluated and show_trace can't turn them back on. Release builds
+ * set this to NOVA_LOG_LEVEL_DEBUG. */
+#ifndef NOVA_LOG_MIN_LEVEL
+    #define NOVA_LOG_MIN_LEVEL NOVA_LOG_LEVEL_TRACE
+#endif
 
 /**
  * Cheezy mini-logging system.
@@ -34,25 +49,64 @@ namespace nova {
     };
 
     struct LogFileOptions {
+        /** How lines are written to the file. TEXT is for people; the
+         *  others carry the same fields plus any LogContextScope values
+         *  for the log pipeline, so it doesn't have to parse the text.
+         *  JSON_LINES writes one object per line. BINARY writes records
+         *  of big endian integers and length prefixed strings; see
+         *  Log.cc. */
+        enum Format {
+            FORMAT_BINARY,
+            FORMAT_JSON_LINES,
+            FORMAT_TEXT
+        };
+
+        // Gzip old files (name.1.gz and so on) on a background thread.
+        bool compress_old_files;
+        Format format;
         int max_old_files;
+        // The most space old files may take up; the oldest are deleted to
+        // stay under it.
+        boost::optional<size_t> max_old_files_size;
         boost::optional<size_t> max_size;
         boost::optional<double> max_time_in_seconds;
         std::string path;
         LogFileOptions(std::string path, boost::optional<size_t> max_size,
-                       boost::optional<double> max_time_in_seconds, int max_old_files);
+                       boost::optional<double> max_time_in_seconds, int max_old_files,
+                       bool compress_old_files=false,
+                       boost::optional<size_t> max_old_files_size=boost::none,
+                       Format format=FORMAT_TEXT);
 
         static void rotate_files();
     };
 
 
 
+    /** When lines are written to the log file. Normally they're collected
+     *  and written together once "interval" seconds have passed since the
+     *  first one or "size" bytes are waiting, and right away for ERROR
+     *  lines. */
+    struct LogFlushPolicy {
+        // Write every line as soon as it's logged, which is slower but
+        // handy when debugging.
+        bool every_line;
+        double interval;
+        size_t size;
+
+        LogFlushPolicy(bool every_line, double interval, size_t size);
+
+        static LogFlushPolicy buffered();
+    };
+
     struct LogOptions {
         boost::optional<LogFileOptions> file;
+        LogFlushPolicy flush;
         bool show_trace;
         bool use_std_streams;
 
         LogOptions(boost::optional<LogFileOptions> file, bool use_std_streams,
-                   bool show_trace);
+                   bool show_trace,
+                   const LogFlushPolicy & flush=LogFlushPolicy::buffered());
 
         /** Creates a simple set of LogOptions. Useful for tests. */
         static LogOptions simple();
@@ -66,6 +120,21 @@ namespace nova {
             ~LogApiScope();
     };
 
+    struct LogContext;
+
+    /** Adds a key and value to every line this thread logs until the scope
+     *  ends, such as the method being run or the backup being made. Only
+     *  the structured formats write them. Scopes nest; if a key is used
+     *  twice the innermost value comes last. */
+    class LogContextScope : boost::noncopyable {
+        public:
+            LogContextScope(const char * key, const std::string & value);
+            ~LogContextScope();
+
+        private:
+            LogContext * context;
+    };
+
     class Log;
 
     void intrusive_ptr_add_ref(Log * ref);
@@ -90,7 +159,13 @@ namespace nova {
                 LEVEL_TRACE
             };
 
-            boost::optional<size_t> current_log_file_size();
+            /** Writes lines waiting to go to the file if the flush policy
+             *  says they've waited long enough, or always if "force" is
+             *  true. */
+            void flush_file(bool force);
+
+            /** Blocks until every line logged so far has been written. */
+            static void flush();
 
             /* Call this to retrieve an instance of the Logger.
              * The instance returned may need to be taken out of rotation
@@ -98,9 +173,10 @@ namespace nova {
              * of rotation. */
             static LogPtr get_instance();
 
-            void handle_fmt_error(const char * filename, const int line_number,
-                                  const char * fmt_string,
-                                  const boost::io::format_error & fe);
+            static void handle_fmt_error(const char * filename,
+                                         const int line_number,
+                                         const char * fmt_string,
+                                         const boost::io::format_error & fe);
 
             static void initialize(const LogOptions & options);
 
@@ -108,26 +184,48 @@ namespace nova {
 
             static void initialize_status_thread();
 
+            /** True if lines at this level are written. Checked by the
+             *  macros before they evaluate any arguments. */
+            static inline bool is_enabled(Level level) {
+                return level != LEVEL_TRACE || trace_enabled;
+            }
+
             /** Saves the current log to name.1, after first renaming all other
              *  backed up logs from 1 - options.max_old_files. */
             static void rotate_files();
 
-            /* Checks if rotation of the logs is necessary given the options
-             * and the current state of the log file and the options. */
+            /* Rotates the logs if max_time_in_seconds has passed. Logs with
+             * a max_size instead rotate themselves as they're written. */
             static void rotate_logs_if_needed();
 
+            /** Writes a line right away, on this thread. The macros don't use
+             *  this; see queue_line. */
             void write(const char * file_name, int line_number,
                        Level level, const char * message);
 
+            /** Writes a line queued earlier, with the time, thread and
+             *  context it was logged from. Used by the background writer. */
+            void write(const timespec & time, const char * thread_name,
+                       const char * file_name, int line_number,
+                       Level level, const char * message,
+                       const LogContext * context);
+
+            /** Copies the line into this thread's log buffer, from which a
+             *  background thread writes it out. Doesn't lock anything unless
+             *  the buffer is full. */
+            static void queue_line(const char * file_name, int line_number,
+                                   Level level, const char * message);
+
             template<typename... Types>
-            void write(const char * filename, const int line_number,
-                       const nova::Log::Level level, const char * fmt_string,
-                       const Types... args) {
+            static void queue_line(const char * filename,
+                                   const int line_number,
+                                   const nova::Log::Level level,
+                                   const char * fmt_string,
+                                   const Types... args) {
                 try {
                     boost::format fmt = boost::format(fmt_string);
                     const std::string msg(boost::str(decompose_fmt(fmt, args...)));
-                    nova::Log::get_instance()->write(filename, line_number, level,
-                                                     msg.c_str());
+                    queue_line(filename, line_number, level, msg.c_str());
                 } catch (const boost::io::format_error & fe) {
                     handle_fmt_error(filename, line_number, fmt_string, fe);
                 }
@@ -163,19 +261,54 @@ namespace nova {
 
             static LogPtr & _get_instance();
 
-            std::ofstream file;
+            time_t cached_time;
+
+            char cached_time_string[20];
+
+            int file;
+
+            // Bytes in the file, counted as they're written.
+            size_t file_size;
 
             boost::mutex mutex;
 
             void open_file();
 
+            size_t pending_bytes;
+
+            size_t pending_count;
+
+            std::vector<std::string> pending_lines;
+
+            double pending_since;
+
+            const char * time_to_string(time_t time);
+
+            void format_line(std::string & line, const timespec & time,
+                             const char * thread_name,
+                             const char * file_name, int line_number,
+                             Level level, const char * message,
+                             const LogContext * context);
+
+            void write_pending_lines();
+
             static void _open_log(const LogOptions & options);
 
             const LogOptions options;
 
             int reference_count;
 
+            /** Rotates the file if it has grown past max_size. Called
+             *  with the mutex held right after lines are written, so no
+             *  line can slip in between the check and the rotation. */
+            void rotate_if_too_big();
+
             static void _rotate_files(LogFileOptions options);
+
+            /** Waits for any old file being compressed. */
+            static void _stop_compressing();
+
+            static volatile bool trace_enabled;
     };
 
     class LogLine {
@@ -198,15 +331,18 @@ namespace nova {
 }
 
 /* It is necessary to use macros here to automatically insert the file
- * name and line numbers. */
-#define NOVA_LOG_DEBUG(fmt, ...) { ::nova::Log::get_instance()->write( \
-    __FILE__, __LINE__, nova::Log::LEVEL_DEBUG, fmt, ##__VA_ARGS__); }
-#define NOVA_LOG_INFO(fmt, ...) { ::nova::Log::get_instance()->write( \
-    __FILE__, __LINE__, nova::Log::LEVEL_INFO, fmt, ##__VA_ARGS__); }
-#define NOVA_LOG_ERROR(fmt, ...) { ::nova::Log::get_instance()->write( \
-    __FILE__, __LINE__, nova::Log::LEVEL_ERROR, fmt, ##__VA_ARGS__); }
-#define NOVA_LOG_TRACE(fmt, ...) { ::nova::Log::get_instance()->write( \
-    __FILE__, __LINE__, nova::Log::LEVEL_TRACE, fmt, ##__VA_ARGS__); }
+ * name and line numbers. The level is checked first so nothing is formatted
+ * (or even evaluated) for lines which won't be written. */
+#define NOVA_LOG_AT(level, fmt, ...) { \
+    if (NOVA_LOG_MIN_LEVEL <= NOVA_LOG_##level \
+        && ::nova::Log::is_enabled(::nova::Log::level)) { \
+        ::nova::Log::queue_line(__FILE__, __LINE__, ::nova::Log::level, \
+                                fmt, ##__VA_ARGS__); \
+    } }
+#define NOVA_LOG_DEBUG(fmt, ...) NOVA_LOG_AT(LEVEL_DEBUG, fmt, ##__VA_ARGS__)
+#define NOVA_LOG_INFO(fmt, ...) NOVA_LOG_AT(LEVEL_INFO, fmt, ##__VA_ARGS__)
+#define NOVA_LOG_ERROR(fmt, ...) NOVA_LOG_AT(LEVEL_ERROR, fmt, ##__VA_ARGS__)
+#define NOVA_LOG_TRACE(fmt, ...) NOVA_LOG_AT(LEVEL_TRACE, fmt, ##__VA_ARGS__)
 
 
 #endif
@@ -4,23 +4,51 @@
 #include "nova/flags.h"
 #include "nova/Log.h"
 #include <boost/optional.hpp>
+#include <string>
 
 namespace nova {
 
+    LogFileOptions::Format log_file_format_from_flags(
+        const flags::FlagValues & flags)
+    {
+        const std::string format = flags.log_file_format();
+        if (format == "text") {
+            return LogFileOptions::FORMAT_TEXT;
+        } else if (format == "json") {
+            return LogFileOptions::FORMAT_JSON_LINES;
+        } else if (format == "binary") {
+            return LogFileOptions::FORMAT_BINARY;
+        }
+        throw flags::FlagException(flags::FlagException::INVALID_FORMAT,
+                                   format.c_str());
+    }
+
     LogOptions log_options_from_flags(const flags::FlagValues & flags) {
         boost::optional<LogFileOptions> log_file_options;
         if (flags.log_file_path()) {
             LogFileOptions ops(flags.log_file_path().get(),
                                flags.log_file_max_size(),
                                flags.log_file_max_time(),
-                               flags.log_file_max_old_files().get_value_or(30));
+                               flags.log_file_max_old_files().get_value_or(30),
+                               flags.log_file_compress(),
+                               flags.log_file_max_old_files_size(),
+                               log_file_format_from_flags(flags));
             log_file_options = boost::optional<LogFileOptions>(ops);
         } else {
             log_file_options = boost::none;
         }
+        const std::string policy = flags.log_flush_policy();
+        if (policy != "buffered" && policy != "line") {
+            throw flags::FlagException(flags::FlagException::INVALID_FORMAT,
+                                       policy.c_str());
+        }
+        const LogFlushPolicy flush(policy == "line",
+                                   flags.log_flush_interval(),
+                                   flags.log_flush_size());
         LogOptions log_options(log_file_options,
                                flags.log_use_std_streams(),
-                               flags.log_show_trace());
+                               flags.log_show_trace(),
+                               flush);
 
         return log_options;
     }
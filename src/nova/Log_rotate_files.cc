@@ -1,18 +1,73 @@
 #include "pch.hpp"
 #include "nova/Log.h"
 
+#include <errno.h>
+#include <fcntl.h>
 #include <boost/format.hpp>
+#include <iostream>
 #include "nova/utils/io.h"
 #include <string>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
 
 using boost::format;
 namespace io = nova::utils::io;
+using boost::optional;
 using std::string;
 
 namespace nova {
 
 namespace {
 
+    // Nothing in here logs, as it runs while the log is being rotated.
+    // Errors go to STDERR instead.
+
+    const char * const EXTENSIONS[] = { "", ".gz", 0 };
+
+    size_t file_size(const string & path) {
+        struct stat buffer;
+        return ::stat(path.c_str(), &buffer) == 0 ? buffer.st_size : 0;
+    }
+
+    /* Compresses "path" to "path.gz" and deletes the original. */
+    bool gzip_file(const string & path) {
+        const string gz_path = path + ".gz";
+        const string tmp_path = gz_path + ".tmp";
+        const int input = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (input < 0) {
+            std::cerr << "Could not open old log " << path << ": "
+                      << strerror(errno) << std::endl;
+            return false;
+        }
+        gzFile output = gzopen(tmp_path.c_str(), "wb");
+        bool success = (output != 0);
+        char buffer[64 * 1024];
+        while(success) {
+            const ssize_t count = ::read(input, buffer, sizeof(buffer));
+            if (count < 0 && errno == EINTR) {
+                continue;
+            }
+            if (count <= 0) {
+                success = (count == 0);
+                break;
+            }
+            success = (gzwrite(output, buffer, count) == count);
+        }
+        ::close(input);
+        if (output != 0 && gzclose(output) != Z_OK) {
+            success = false;
+        }
+        if (success && ::rename(tmp_path.c_str(), gz_path.c_str()) == 0) {
+            ::unlink(path.c_str());
+            return true;
+        }
+        std::cerr << "Could not compress old log " << path << "." << std::endl;
+        ::unlink(tmp_path.c_str());
+        return false;
+    }
+
     class LogFileRotater {
     public:
 
@@ -33,38 +88,205 @@ namespace {
          *  last possible index number if one was found. */
         int oldest_log_file_index() {
             for (int i = options.max_old_files; i > 0; i --) {
-                string possible_file = file_path(i);
-                if (io::is_file_sans_logging(possible_file.c_str())) {
-                    return i;
+                for (int e = 0; EXTENSIONS[e] != 0; e ++) {
+                    string possible_file = file_path(i) + EXTENSIONS[e];
+                    if (io::is_file_sans_logging(possible_file.c_str())) {
+                        return i;
+                    }
                 }
             }
             return 0;
         }
 
+        /** Deletes the oldest files until the rest fit in
+         *  max_old_files_size. */
+        void enforce_size_budget() {
+            if (!options.max_old_files_size) {
+                return;
+            }
+            size_t total = 0;
+            for (int i = 1; i <= options.max_old_files; i ++) {
+                for (int e = 0; EXTENSIONS[e] != 0; e ++) {
+                    total += file_size(file_path(i) + EXTENSIONS[e]);
+                }
+            }
+            for (int i = options.max_old_files;
+                 i > 0 && total > options.max_old_files_size.get(); i --) {
+                for (int e = 0; EXTENSIONS[e] != 0; e ++) {
+                    const string old_file = file_path(i) + EXTENSIONS[e];
+                    const size_t size = file_size(old_file);
+                    if (size > 0 && ::remove(old_file.c_str()) == 0) {
+                        total -= size;
+                    }
+                }
+            }
+        }
+
         void rotate() {
             for (int i = oldest_log_file_index(); i >= 0; i --) {
-                string old_file = file_path(i);
-                if (io::is_file_sans_logging(old_file.c_str())) {
-                    if (i == options.max_old_files) {
-                        ::remove(old_file.c_str());
+                // The current log is never compressed.
+                for (int e = 0; EXTENSIONS[e] != 0 && (i > 0 || e == 0); e ++) {
+                    string old_file = file_path(i) + EXTENSIONS[e];
+                    if (io::is_file_sans_logging(old_file.c_str())) {
+                        if (i == options.max_old_files) {
+                            ::remove(old_file.c_str());
+                        } else {
+                            string new_file = file_path(i + 1) + EXTENSIONS[e];
+                            ::rename(old_file.c_str(), new_file.c_str());
+                        }
                     } else {
-                        string new_file = file_path(i + 1);
-                        ::rename(old_file.c_str(), new_file.c_str());
+                        // Just skip it...
                     }
-                } else {
-                    // Just skip it...
                 }
             }
         }
 
     };
 
+
+    /* Rotates the logs and compresses old ones on its own thread, so
+     * whoever rotates the logs (such as the writer thread, which holds
+     * the log's locks) never waits for gzip. The file being compressed is
+     * first moved to a private name so rotations can't rename it out from
+     * under the thread; when it's done the result is put wherever the
+     * rotations since then would have moved it. */
+    class LogCompressor : boost::noncopyable {
+    public:
+        LogCompressor()
+        :   condition(),
+            job(boost::none),
+            mutex(),
+            rotations(0),
+            stopping(false),
+            thread(0)
+        {
+        }
+
+        /* Rotates the files, then compresses every uncompressed old file
+         * in the background or enforces the size budget right away. Only
+         * holds the lock for renames. */
+        void rotate(const LogFileOptions & options) {
+            boost::lock_guard<boost::mutex> lock(mutex);
+            LogFileRotater rotater(options);
+            rotater.rotate();
+            ++ rotations;
+            if (!options.compress_old_files) {
+                rotater.enforce_size_budget();
+                return;
+            }
+            job = options;
+            if (!thread) {
+                stopping = false;
+                thread = new boost::thread(&LogCompressor::run, this);
+            }
+            condition.notify_all();
+        }
+
+        /* Finishes compressing what is already rotated, then stops. */
+        void stop() {
+            boost::thread * old_thread;
+            {
+                boost::lock_guard<boost::mutex> lock(mutex);
+                old_thread = thread;
+                stopping = true;
+                condition.notify_all();
+            }
+            if (old_thread) {
+                old_thread->join();
+                delete old_thread;
+                boost::lock_guard<boost::mutex> lock(mutex);
+                thread = 0;
+            }
+        }
+
+    private:
+        boost::condition_variable condition;
+        optional<LogFileOptions> job;
+        boost::mutex mutex;
+        unsigned long rotations;
+        bool stopping;
+        boost::thread * thread;
+
+        /* Moves the newest uncompressed old file to a private name and
+         * returns its index, or 0 if there is nothing left to compress. */
+        int claim(LogFileRotater & rotater, const string & private_path) {
+            for (int i = 1; i <= rotater.options.max_old_files; i ++) {
+                const string old_file = rotater.file_path(i);
+                if (io::is_file_sans_logging(old_file.c_str())) {
+                    if (::rename(old_file.c_str(), private_path.c_str()) == 0) {
+                        return i;
+                    }
+                    std::cerr << "Could not move old log " << old_file
+                              << ": " << strerror(errno) << std::endl;
+                    return 0;
+                }
+            }
+            return 0;
+        }
+
+        /* Puts a file compressed (or not) under a private name where the
+         * file it came from would be now. Needs the lock. */
+        void place(LogFileRotater & rotater, const string & private_path,
+                   int index, unsigned long started, const char * extension) {
+            const string from = private_path + extension;
+            const unsigned long target = index + (rotations - started);
+            if (target > (unsigned long) rotater.options.max_old_files) {
+                ::remove(from.c_str());
+            } else {
+                const string to = rotater.file_path(target) + extension;
+                ::rename(from.c_str(), to.c_str());
+            }
+        }
+
+        void run() {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            while(true) {
+                while(!job && !stopping) {
+                    condition.wait(lock);
+                }
+                if (!job) {
+                    return;
+                }
+                LogFileRotater rotater(job.get());
+                const string private_path = rotater.options.path
+                                            + ".compressing";
+                const int index = claim(rotater, private_path);
+                if (index == 0) {
+                    job = boost::none;
+                    continue;
+                }
+                const unsigned long started = rotations;
+                lock.unlock();
+                const bool compressed = gzip_file(private_path);
+                lock.lock();
+                if (compressed) {
+                    place(rotater, private_path, index, started, ".gz");
+                } else {
+                    // Leave it uncompressed and don't try again until the
+                    // next rotation.
+                    place(rotater, private_path, index, started, "");
+                    job = boost::none;
+                }
+                rotater.enforce_size_budget();
+            }
+        }
+    };
+
+    LogCompressor & compressor() {
+        // Never deleted, like the log writer.
+        static LogCompressor * instance = new LogCompressor();
+        return *instance;
+    }
+
 } // end anonymous namespace
 
 
 void Log::_rotate_files(LogFileOptions options) {
-    LogFileRotater rotater(options);
-    rotater.rotate();
+    compressor().rotate(options);
+}
+
+void Log::_stop_compressing() {
+    compressor().stop();
 }
 
 } // end nova namespace
@@ -31,7 +31,8 @@ using nova::utils::CurlScope;
 using nova::guest::utils::IsoDateTime;
 using nova::guest::diagnostics::Interrogator;
 using nova::utils::Job;
-using nova::utils::JobRunner;
+using nova::utils::JobProgress;
+using nova::utils::JobScheduler;
 using nova::utils::swift::SwiftClient;
 using nova::utils::swift::SwiftFileInfo;
 using nova::utils::swift::SwiftUploader;
@@ -44,6 +45,28 @@ namespace zlib = nova::utils::zlib;
 namespace nova { namespace backup {
 
 
+/**---------------------------------------------------------------------------
+ *- BackupJobList
+ *---------------------------------------------------------------------------*/
+
+optional<BackupJobList::JobId> BackupJobList::remove(const string & backup_id) {
+    boost::lock_guard<boost::mutex> lock(mutex);
+    std::map<string, JobId>::iterator itr = jobs.find(backup_id);
+    if (itr == jobs.end()) {
+        return boost::none;
+    }
+    const JobId id = itr->second;
+    jobs.erase(itr);
+    return id;
+}
+
+void BackupJobList::submit(JobScheduler & runner, const string & backup_id,
+                           const Job & job) {
+    boost::lock_guard<boost::mutex> lock(mutex);
+    jobs[backup_id] = runner.submit(job);
+}
+
+
 /**---------------------------------------------------------------------------
  *- BackupJob
  *---------------------------------------------------------------------------*/
@@ -57,12 +80,39 @@ BackupJob::BackupJob(const BackupRunnerData & data,
                      const BackupCreationArgs & args)
 :   args(args),
     data(data),
-    file_info(args.location, data.swift_container, args.id) {
+    file_info(args.location, data.swift_container, args.id),
+    job_list(),
+    progress_sender(*this) {
+    set_progress_callback(&progress_sender);
+}
+
+BackupJob::BackupJob(const BackupJob & other)
+:   Job(other),
+    args(other.args),
+    data(other.data),
+    file_info(other.file_info),
+    job_list(other.job_list),
+    progress_sender(*this) {
+    set_progress_callback(&progress_sender);
 }
 
 BackupJob::~BackupJob() {
 }
 
+void BackupJob::abandon() {
+    NOVA_LOG_INFO("Backup %s was cancelled before it started.",
+                  args.id.c_str());
+    update_trove_to_failed();
+}
+
+void BackupJob::set_job_list(BackupJobListPtr job_list) {
+    this->job_list = job_list;
+}
+
+const char * BackupJob::type() const {
+    return "backup";
+}
+
 const char * BackupJob::status_name(const BackupJob::Status status) {
     switch(status) {
         //! BEGIN GENERATED CODE
@@ -92,6 +142,10 @@ void BackupJob::update_trove_to_completed(const string & checksum) {
 
 void BackupJob::update_trove(const BackupJob::Status status,
                              const optional<string> & checksum) {
+    if (status != BUILDING && job_list) {
+        // This is the job's last word, so it can no longer be cancelled.
+        job_list->remove(args.id);
+    }
     FileSystemStatsPtr stats = data.interrogator.get_mount_point_stats();
     const IsoDateTime iso_now;
     JsonObjectBuilder update_args;
@@ -112,13 +166,82 @@ void BackupJob::update_trove(const BackupJob::Status status,
 }
 
 
+/**---------------------------------------------------------------------------
+ *- BackupJob::ProgressSender
+ *---------------------------------------------------------------------------*/
+
+BackupJob::ProgressSender::ProgressSender(BackupJob & job)
+:   backup_job(job) {
+}
+
+void BackupJob::ProgressSender::operator()(const Job & job,
+                                           const JobProgress & progress) {
+    const IsoDateTime iso_now;
+    JsonObjectBuilder update_args;
+    update_args.add("backup_id", backup_job.args.id,
+             "state", backup_job.status_name(BUILDING),
+             "bytes_read", progress.bytes_read,
+             "bytes_compressed", progress.bytes_processed,
+             "bytes_uploaded", progress.bytes_written,
+             "throughput", progress.throughput(),
+             "updated", iso_now.c_str());
+    backup_job.data.sender->send("update_backup", update_args);
+    NOVA_LOG_INFO("Backup %s: read %.0f MB at %.2f MB/s, uploaded %.0f MB",
+                  backup_job.args.id.c_str(),
+                  progress.bytes_read / (1024.0 * 1024.0),
+                  progress.throughput() / (1024.0 * 1024.0),
+                  progress.bytes_written / (1024.0 * 1024.0));
+}
+
+
+/**---------------------------------------------------------------------------
+ *- BackupProgress
+ *---------------------------------------------------------------------------*/
+
+BackupProgress::BackupProgress(const Job & job, double interval)
+:   interval(interval),
+    job(job),
+    last_report(now()),
+    progress(),
+    start(last_report),
+    uploader(0)
+{
+}
+
+void BackupProgress::add_compressed(size_t bytes) {
+    progress.bytes_processed += bytes;
+}
+
+void BackupProgress::add_read(size_t bytes) {
+    progress.bytes_read += bytes;
+}
+
+void BackupProgress::set_uploader(const SwiftUploader * uploader) {
+    this->uploader = uploader;
+}
+
+void BackupProgress::update() {
+    job.cancellation().throw_if_cancelled();
+    const double current = now();
+    if (current - last_report < interval) {
+        return;
+    }
+    last_report = current;
+    progress.elapsed = current - start;
+    if (uploader) {
+        progress.bytes_written = uploader->bytes_uploaded();
+    }
+    job.report_progress(progress);
+}
+
+
 /**---------------------------------------------------------------------------
  *- BackupManagerInfo
  *---------------------------------------------------------------------------*/
 
 BackupManagerInfo::BackupManagerInfo(
     BackupRunnerData data,
-    JobRunner & runner)
+    JobScheduler & runner)
 :   data(data),
     runner(runner)
 {
@@ -139,9 +262,27 @@ BackupManagerInfo::~BackupManagerInfo() {
  *---------------------------------------------------------------------------*/
 
 BackupManager::BackupManager(const BackupManagerInfo & info)
-: BackupManagerInfo(info)
+:   BackupManagerInfo(info),
+    jobs(new BackupJobList())
 {
 }
 
+bool BackupManager::cancel_backup(const string & backup_id) {
+    const optional<JobScheduler::JobId> id = jobs->remove(backup_id);
+    if (!id) {
+        NOVA_LOG_ERROR("No backup %s is queued or running here.",
+                       backup_id.c_str());
+        return false;
+    }
+    // Not under the list's lock, as a queued job abandoned here reports its
+    // failure right away.
+    return runner.cancel(id.get());
+}
+
+void BackupManager::start_job(const string & backup_id, BackupJob & job) {
+    job.set_job_list(jobs);
+    jobs->submit(runner, backup_id, job);
+}
+
 
 } } // end namespace nova::backup
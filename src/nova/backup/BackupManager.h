@@ -3,9 +3,11 @@
 
 #include <boost/optional.hpp>
 #include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
 #include "nova/guest/diagnostics.h"
 #include "nova/guest/guest.h"
 #include "nova/process.h"
+#include "nova/process_cgroup.h"
 #include <map>
 #include <string>
 #include <curl/curl.h>
@@ -52,6 +54,8 @@ namespace nova { namespace backup {
         const int checksum_wait_time;
         const std::string swift_container;
         const double time_out;
+        const double progress_interval;
+        const nova::process::CgroupConfig cgroup;
 
         template<typename Flags>
         static BackupRunnerData from_flags(
@@ -64,19 +68,58 @@ namespace nova { namespace backup {
                 flags.backup_segment_max_size(),
                 flags.checksum_wait_time(),
                 flags.backup_swift_container(),
-                flags.backup_timeout()
+                flags.backup_timeout(),
+                flags.backup_progress_interval(),
+                nova::process::CgroupConfig(flags.cgroup_parent(),
+                                            flags.backup_cgroup_limits())
             };
             return info;
         }
     };
 
+    /** The backups a manager has queued or running, by backup ID. Shared by
+     *  the manager and its jobs, which remove themselves once they've sent
+     *  Trove their final state. */
+    class BackupJobList : boost::noncopyable {
+        public:
+            typedef nova::utils::JobScheduler::JobId JobId;
+
+            /** Forgets the backup, returning its job ID if it was here. */
+            boost::optional<JobId> remove(const std::string & backup_id);
+
+            /** Submits the job to the scheduler and remembers its ID. The
+             *  lock is held throughout, so a job that finishes right away
+             *  can't remove itself before it's added. */
+            void submit(nova::utils::JobScheduler & runner,
+                        const std::string & backup_id,
+                        const nova::utils::Job & job);
+
+        private:
+            std::map<std::string, JobId> jobs;
+            boost::mutex mutex;
+    };
+
+    typedef boost::shared_ptr<BackupJobList> BackupJobListPtr;
+
     class BackupJob : public nova::utils::Job {
         public:
             BackupJob(const BackupRunnerData & data,
                       const BackupCreationArgs & args);
 
+            BackupJob(const BackupJob & other);
+
             ~BackupJob();
 
+            /** Sets the backup to FAILED, as it was cancelled before it
+             *  started. */
+            virtual void abandon();
+
+            /** The list the job removes itself from when it's done. Set by
+             *  BackupManager before the job is queued. */
+            void set_job_list(BackupJobListPtr job_list);
+
+            virtual const char * type() const;
+
         protected:
             const BackupCreationArgs args;
             const BackupRunnerData data;
@@ -100,11 +143,59 @@ namespace nova { namespace backup {
                 //! END GENERATED CODE
             };
 
+            BackupJobListPtr job_list;
+
             const char * status_name(Status status);
 
+            /** Sends progress to Trove as the backup is still BUILDING. */
+            class ProgressSender : public nova::utils::Job::ProgressCallback {
+                public:
+                    ProgressSender(BackupJob & job);
+
+                    virtual void operator()(
+                        const nova::utils::Job & job,
+                        const nova::utils::JobProgress & progress);
+
+                private:
+                    BackupJob & backup_job;
+            };
+
+            ProgressSender progress_sender;
+
             void update_trove(const Status status,
                               const boost::optional<std::string> & checksum);
 
+            // Don't allow this, as progress_sender refers to its job.
+            BackupJob & operator=(const BackupJob & rhs);
+    };
+
+
+    /** Counts the bytes moving through a backup and hands them to the job's
+     *  progress callback every so often. This is also where the backup checks
+     *  if it has been cancelled. */
+    class BackupProgress : boost::noncopyable {
+        public:
+            BackupProgress(const nova::utils::Job & job, double interval);
+
+            void add_compressed(size_t bytes);
+
+            void add_read(size_t bytes);
+
+            /** Swift's count of confirmed bytes is used for bytes_written. */
+            void set_uploader(
+                const nova::utils::swift::SwiftUploader * uploader);
+
+            /** Throws ThreadException if the job was cancelled, then reports
+             *  progress if it's been long enough since the last time. */
+            void update();
+
+        private:
+            const double interval;
+            const nova::utils::Job & job;
+            double last_report;
+            nova::utils::JobProgress progress;
+            const double start;
+            const nova::utils::swift::SwiftUploader * uploader;
     };
 
     /**
@@ -116,7 +207,7 @@ namespace nova { namespace backup {
         public:
             BackupManagerInfo(
                    BackupRunnerData data,
-                   nova::utils::JobRunner & runner);
+                   nova::utils::JobScheduler & runner);
 
             BackupManagerInfo(const BackupManagerInfo & info);
 
@@ -124,7 +215,7 @@ namespace nova { namespace backup {
             static BackupManagerInfo from_flags(
                 const Flags & flags,
                 nova::rpc::ResilientSenderPtr sender,
-                nova::utils::JobRunner & runner,
+                nova::utils::JobScheduler & runner,
                 const nova::guest::diagnostics::Interrogator interrogator) {
                 BackupManagerInfo backup(
                       BackupRunnerData::from_flags(flags, sender, interrogator),
@@ -136,7 +227,7 @@ namespace nova { namespace backup {
 
         protected:
             BackupRunnerData data;
-            nova::utils::JobRunner & runner;
+            nova::utils::JobScheduler & runner;
     };
 
     /**
@@ -146,7 +237,20 @@ namespace nova { namespace backup {
     class BackupManager : public BackupManagerInfo {
         public:
             BackupManager(const BackupManagerInfo & info);
+
+            /** Stops the backup if it's queued or running. Returns false if
+             *  it isn't. */
+            bool cancel_backup(const std::string & backup_id);
+
             virtual void run_backup(const BackupCreationArgs & args) = 0;
+
+        protected:
+            /** Queues the job, remembering it so it can be cancelled until
+             *  it finishes. */
+            void start_job(const std::string & backup_id, BackupJob & job);
+
+        private:
+            BackupJobListPtr jobs;
     };
 
     typedef boost::shared_ptr<BackupManager> BackupManagerPtr;
@@ -1,14 +1,18 @@
 #include "pch.hpp"
 #include "nova/db/mysql.h"
 #include "nova/Log.h"
+#include <boost/foreach.hpp>
 #include <boost/format.hpp>
 #include <fstream>
 #include <iostream>
 #include <boost/lexical_cast.hpp>
+#include <list>
 #include <mysql/mysql.h>
 #include "nova/db/MySqlConfigReader.h"
 #include "nova/rpc/sender.h"
 #include <string.h>
+#include <boost/thread.hpp>
+#include <time.h>
 
 using boost::format;
 using boost::none;
@@ -26,6 +30,22 @@ namespace {
         return (MYSQL *) con;
     }
 
+    const char * const MY_CNF_PATH = "/var/lib/nova/my.cnf";
+
+    /* Once this many statements are cached on a connection they're all
+     * closed, rather than letting one-off statements pile up. */
+    const size_t MAX_CACHED_STATEMENTS = 64;
+
+    /* Batches are split so no request gets near max_allowed_packet, which
+     * is only 1MB by default on older servers. */
+    const size_t MAX_BATCH_LENGTH = 256 * 1024;
+
+    double monotonic_now() {
+        timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return now.tv_sec + (now.tv_nsec / 1000000000.0);
+    }
+
     void append_match_to_string(string & str, regex_t regex,
                                 const char * line) {
         // 2 matches, the 2nd is the ()
@@ -89,13 +109,23 @@ namespace {
     struct StringParameterBuffer {
         char buffer[256];
         my_bool error;
+        // Set for parameters which must be numbers, such as LIMIT's.
+        optional<int> int_value;
+        int int_buffer;
         unsigned long length;
         my_bool is_null;
 
         virtual void bind(MYSQL_BIND & bind) {
-            bind.buffer_type = MYSQL_TYPE_STRING;
-            bind.buffer = buffer;
-            bind.buffer_length = 256;
+            if (int_value) {
+                int_buffer = int_value.get();
+                bind.buffer_type = MYSQL_TYPE_LONG;
+                bind.buffer = (char *) &int_buffer;
+                bind.buffer_length = 0;
+            } else {
+                bind.buffer_type = MYSQL_TYPE_STRING;
+                bind.buffer = buffer;
+                bind.buffer_length = 256;
+            }
             bind.is_null = &is_null;
             bind.length = &length;
             bind.error = &error;
@@ -104,6 +134,14 @@ namespace {
         virtual void set(const char * new_value) {
             length = strnlen(new_value, 256);
             strncpy(buffer, new_value, length);
+            int_value = boost::none;
+            is_null = 0;
+            error = 0;
+        }
+
+        void set_int(int new_value) {
+            int_value = new_value;
+            length = 0;
             is_null = 0;
             error = 0;
         }
@@ -158,6 +196,8 @@ const char *  MySqlException::code_to_string(Code code) {
             return "Can't create user because no password was specified.";
         case PARAMETER_INDEX_OUT_OF_BOUNDS:
             return "Parameter index out of bounds.";
+        case POOL_TIMED_OUT:
+            return "Timed out waiting for a free connection.";
         case PREPARE_BIND_FAILED:
             return "Prepare statement bind failed.";
         case PREPARE_FAILED:
@@ -265,11 +305,12 @@ int MySqlResultSet::get_int_non_null(int index) const {
 class MySqlQueryResultSet : public MySqlResultSet {
 
 public:
-    MySqlQueryResultSet(MYSQL * con)
+    MySqlQueryResultSet(MYSQL * con, MySqlResultMode mode)
     : con(con), current_row(0), field_count(0), finished(false), result(0),
       row_count(0), started(false)
     {
-        result = mysql_store_result(con);
+        result = (mode == STREAM_RESULTS) ? mysql_use_result(con)
+                                          : mysql_store_result(con);
         // The docs imply this is safe to call even if an error occurs.
         if (result == 0) {
             if (mysql_errno(con) == 0) {
@@ -293,6 +334,8 @@ public:
     virtual void close() {
         if (result != 0) {
             finished = true;
+            // For streamed results this also reads and drops whatever rows
+            // are left, so the connection can be used again.
             mysql_free_result(result);
             result = 0;
         }
@@ -357,6 +400,153 @@ private:
 };
 
 
+/**---------------------------------------------------------------------------
+ *- MySqlPreparedResultSet
+ *---------------------------------------------------------------------------*/
+
+/* The rows of an executed prepared statement. Every field is fetched as a
+ * string into a buffer which grows when a value doesn't fit. */
+class MySqlPreparedResultSet : public MySqlResultSet {
+
+public:
+    MySqlPreparedResultSet(MYSQL_STMT * stmt, MySqlResultMode mode)
+    :   binds(), field_count(mysql_stmt_field_count(stmt)), fields(),
+        finished(false), row_count(0), started(false), stmt(stmt)
+    {
+        if (field_count == 0) {
+            // Nothing to fetch, like MySqlQueryResultSet.
+            started = true;
+            finished = true;
+            return;
+        }
+        if (mode == BUFFER_RESULTS && mysql_stmt_store_result(stmt) != 0) {
+            NOVA_LOG_ERROR("Error storing statement result: %s",
+                           mysql_stmt_error(stmt));
+            throw MySqlException(MySqlException::GET_QUERY_RESULT_FAILED);
+        }
+        fields.resize(field_count);
+        binds.resize(field_count);
+        for (int index = 0; index < field_count; index ++) {
+            fields[index].buffer.resize(256);
+            bind_field(index);
+        }
+        if (mysql_stmt_bind_result(stmt, &binds[0]) != 0) {
+            NOVA_LOG_ERROR("Binding statement result failed: %s",
+                           mysql_stmt_error(stmt));
+            close();
+            throw MySqlException(MySqlException::BIND_RESULT_SET_FAILED);
+        }
+    }
+
+    virtual ~MySqlPreparedResultSet() {
+        close();
+    }
+
+    virtual void close() {
+        if (!finished) {
+            finished = true;
+            mysql_stmt_free_result(stmt);
+        }
+    }
+
+    virtual int get_field_count() const {
+        return field_count;
+    }
+
+    virtual int get_row_count() const {
+        return row_count;
+    }
+
+    virtual optional<string> get_string(int index) const {
+        if (index < 0 || index >= field_count) {
+            throw MySqlException(MySqlException::FIELD_INDEX_OUT_OF_BOUNDS);
+        }
+        if (finished) {
+            throw MySqlException(MySqlException::QUERY_RESULT_SET_FINISHED);
+        }
+        if (!started) {
+            throw MySqlException(MySqlException::QUERY_RESULT_SET_NOT_STARTED);
+        }
+        const Field & field = fields[index];
+        if (field.is_null) {
+            return boost::none;
+        }
+        return optional<string>(string(&field.buffer[0], field.length));
+    }
+
+    virtual bool next() {
+        if (finished) {
+            return false;
+        }
+        started = true;
+        const int result = mysql_stmt_fetch(stmt);
+        if (result == MYSQL_NO_DATA) {
+            close();
+            return false;
+        }
+        if (result == MYSQL_DATA_TRUNCATED) {
+            fetch_truncated_fields();
+        } else if (result != 0) {
+            NOVA_LOG_ERROR("Fetch next statement row failed: %s",
+                           mysql_stmt_error(stmt));
+            throw MySqlException(MySqlException::NEXT_FETCH_FAILED);
+        }
+        row_count ++;
+        return true;
+    }
+
+private:
+    struct Field {
+        std::vector<char> buffer;
+        my_bool error;
+        my_bool is_null;
+        unsigned long length;
+    };
+
+    std::vector<MYSQL_BIND> binds;
+    int field_count;
+    std::vector<Field> fields;
+    bool finished;
+    int row_count;
+    bool started;
+    MYSQL_STMT * stmt;
+
+    void bind_field(int index) {
+        Field & field = fields[index];
+        MYSQL_BIND & bind = binds[index];
+        memset(&bind, 0, sizeof(MYSQL_BIND));
+        bind.buffer_type = MYSQL_TYPE_STRING;
+        bind.buffer = &field.buffer[0];
+        bind.buffer_length = field.buffer.size();
+        bind.error = &field.error;
+        bind.is_null = &field.is_null;
+        bind.length = &field.length;
+    }
+
+    /* Grows the buffers which were too small and fetches those fields
+     * again. */
+    void fetch_truncated_fields() {
+        for (int index = 0; index < field_count; index ++) {
+            Field & field = fields[index];
+            if (!field.error) {
+                continue;
+            }
+            field.buffer.resize(field.length + 1);
+            bind_field(index);
+            if (mysql_stmt_fetch_column(stmt, &binds[index], index, 0) != 0) {
+                NOVA_LOG_ERROR("Refetching column %d failed: %s", index,
+                               mysql_stmt_error(stmt));
+                throw MySqlException(MySqlException::NEXT_FETCH_FAILED);
+            }
+        }
+        // The buffers moved, so the next fetch has to know where they are.
+        if (mysql_stmt_bind_result(stmt, &binds[0]) != 0) {
+            throw MySqlException(MySqlException::BIND_RESULT_SET_FAILED);
+        }
+    }
+};
+
+
 /**---------------------------------------------------------------------------
  *- MySqlPreparedStatement
  *---------------------------------------------------------------------------*/
@@ -395,27 +585,21 @@ public:
             NOVA_LOG_ERROR("No memory to make statement?");
             throw MySqlException(MySqlException::PREPARE_FAILED);
         }
-        size_t statement_length = strnlen(statement, 1028);
-        if (mysql_stmt_prepare(stmt, statement, statement_length) != 0) {
+        if (mysql_stmt_prepare(stmt, statement, strlen(statement)) != 0) {
             NOVA_LOG_ERROR("An error occurred preparing statement:%s",
                             mysql_stmt_error(stmt));
+            close();
             throw MySqlException(MySqlException::PREPARE_FAILED);
         }
         parameter_count = mysql_stmt_param_count(stmt);
         bind = new MYSQL_BIND[parameter_count];
-        memset(bind, 0, sizeof(bind));
+        memset(bind, 0, sizeof(MYSQL_BIND) * parameter_count);
         parameter_buffer = new StringParameterBuffer[parameter_count];
         for (size_t index = 0; index < (size_t) parameter_count; index ++) {
             // Initialize parameter to empty string.
             parameter_buffer[index].set("");
-            // The bind buffer stuff just points to memory elsewhere.
-            parameter_buffer[index].bind(bind[index]);
-        }
-        if (mysql_stmt_bind_param(stmt, bind) != 0) {
-            NOVA_LOG_ERROR("Prepared statement bind parm failed: %s",
-                            mysql_stmt_error(stmt));
-            throw MySqlException(MySqlException::PREPARE_BIND_FAILED);
         }
+        bind_parameters();
     }
 
     ~MySqlPreparedStatementImpl() {
@@ -438,6 +622,8 @@ public:
     }
 
     virtual void execute(int result_count) {
+        // Integer parameters change the bind types, so bind every time.
+        bind_parameters();
         if (mysql_stmt_execute(stmt) != 0) {
             NOVA_LOG_ERROR("execute failed: %s", mysql_stmt_error(stmt));
             throw MySqlException(MySqlException::PREPARE_STATEMENT_FAILED);
@@ -448,6 +634,13 @@ public:
         return parameter_count;
     }
 
+    virtual void set_int(int index, int value) {
+        if (index < 0 || index >= parameter_count) {
+            throw MySqlException(MySqlException::PARAMETER_INDEX_OUT_OF_BOUNDS);
+        }
+        parameter_buffer[index].set_int(value);
+    }
+
     virtual void set_string(int index, const char * value) {
         if (index < 0 || index >= parameter_count) {
             throw MySqlException(MySqlException::PARAMETER_INDEX_OUT_OF_BOUNDS);
@@ -455,7 +648,25 @@ public:
         parameter_buffer[index].set(value);
     }
 
+    virtual MySqlResultSetPtr query(MySqlResultMode mode) {
+        execute(0);
+        MySqlResultSetPtr rtn(new MySqlPreparedResultSet(stmt, mode));
+        return rtn;
+    }
+
 private:
+    void bind_parameters() {
+        for (int index = 0; index < parameter_count; index ++) {
+            // The bind buffer stuff just points to memory elsewhere.
+            parameter_buffer[index].bind(bind[index]);
+        }
+        if (mysql_stmt_bind_param(stmt, bind) != 0) {
+            NOVA_LOG_ERROR("Prepared statement bind parm failed: %s",
+                            mysql_stmt_error(stmt));
+            throw MySqlException(MySqlException::PREPARE_BIND_FAILED);
+        }
+    }
+
     MYSQL_BIND * bind;
     MYSQL * con;
     StringParameterBuffer * parameter_buffer;
@@ -490,6 +701,8 @@ bool MySqlConnection::can_connect_to_localhost_with_mycnf() {
 }
 
 void MySqlConnection::close() {
+    // Statements belong to the connection, so they have to go first.
+    statements.clear();
     if (mysql_con(con) != 0) {
         mysql_close(mysql_con(con));
         con = 0;
@@ -517,6 +730,24 @@ std::string MySqlConnection::escape_string(const char * original) {
     return rtn;
 }
 
+std::string MySqlConnection::escape_identifier(const char * original) {
+    size_t len = strnlen(original, 1025);
+    if (len > 1024) {
+        throw MySqlException(MySqlException::ESCAPE_STRING_BUFFER_TOO_SMALL);
+    }
+    // Backslashes mean nothing between backticks, so escape_string would
+    // change the name while leaving backticks free to end it early.
+    string rtn;
+    rtn.reserve(len);
+    for (size_t i = 0; i < len; i ++) {
+        if ('`' == original[i]) {
+            rtn += '`';
+        }
+        rtn += original[i];
+    }
+    return rtn;
+}
+
 void MySqlConnection::flush_privileges() {
     MySqlPreparedStatementPtr stmt = prepare_statement(
         "FLUSH PRIVILEGES;");
@@ -581,7 +812,7 @@ void MySqlConnection::grant_privileges(const char * privs,
         text = str(format(
             "GRANT %s ON `%s`.* TO '%s'@'%s'%s")
             % escape_string(privs)
-            % escape_string(database)
+            % escape_identifier(database)
             % escape_string(username)
             % escape_string(host)
             % (grant_option ? " WITH GRANT OPTION;" : ";"));
@@ -614,7 +845,7 @@ void MySqlConnection::revoke_privileges(const char * privs,
         text = str(format(
             "REVOKE %s ON `%s`.* FROM '%s'@'%s';")
             % escape_string(privs)
-            % escape_string(database)
+            % escape_identifier(database)
             % escape_string(username)
             % escape_string(host));
     }
@@ -647,7 +878,7 @@ void MySqlConnection::init() {
     }
 
     if (use_mycnf) {
-        get_auth_from_config("/var/lib/nova/my.cnf", user, password);
+        get_auth_from_config(MY_CNF_PATH, user, password);
     }
 
     con = mysql_init(NULL);
@@ -677,6 +908,10 @@ void MySqlConnection::init() {
     // con = driver->connect(uri, user, password);
 }
 
+bool MySqlConnection::ping() {
+    return mysql_con(con) != 0 && mysql_ping(mysql_con(con)) == 0;
+}
+
 MySqlPreparedStatementPtr MySqlConnection::prepare_statement(
     const char * text)
 {
@@ -685,12 +920,81 @@ MySqlPreparedStatementPtr MySqlConnection::prepare_statement(
     return stmt;
 }
 
-MySqlResultSetPtr MySqlConnection::query(const char * text) {
+MySqlPreparedStatementPtr MySqlConnection::prepare_cached_statement(
+    const char * text)
+{
+    // Statements don't survive reconnecting; close() forgets them.
+    std::map<string, MySqlPreparedStatementPtr>::iterator itr
+        = statements.find(text);
+    if (itr != statements.end() && mysql_con(con) != 0) {
+        return itr->second;
+    }
+    if (statements.size() >= MAX_CACHED_STATEMENTS) {
+        statements.clear();
+    }
+    MySqlPreparedStatementPtr stmt = prepare_statement(text);
+    statements[text] = stmt;
+    return stmt;
+}
+
+void MySqlConnection::execute_batch(const vector<string> & statements) {
+    if (statements.empty()) {
+        return;
+    }
+    MYSQL * mysql = mysql_con(get_con());
+    // Multiple statements are only turned on while a batch runs, so a
+    // badly escaped value in a normal query can't smuggle in another one.
+    if (mysql_set_server_option(mysql, MYSQL_OPTION_MULTI_STATEMENTS_ON) != 0) {
+        NOVA_LOG_ERROR("Could not turn on multiple statements: %s",
+                       mysql_error(mysql));
+        throw MySqlException(MySqlException::QUERY_FAILED);
+    }
+    size_t index = 0;
+    try {
+        while(index < statements.size()) {
+            string text;
+            const size_t first = index;
+            do {
+                text += (index > first ? ";\n" : "") + statements[index];
+                index ++;
+            } while(index < statements.size()
+                    && text.size() + statements[index].size()
+                        < MAX_BATCH_LENGTH);
+            NOVA_LOG_DEBUG("Running statements %d to %d of %d.", first + 1,
+                           index, statements.size());
+            // Every statement has a result, even if it's empty, and they
+            // all have to be read before anything else can be sent.
+            size_t current = first;
+            int status = mysql_query(mysql, text.c_str());
+            while(status == 0) {
+                MYSQL_RES * result = mysql_store_result(mysql);
+                if (result != 0) {
+                    mysql_free_result(result);
+                }
+                current ++;
+                status = mysql_next_result(mysql);
+            }
+            if (status > 0) {
+                NOVA_LOG_ERROR("Statement %d of the batch failed: %s",
+                               current + 1, mysql_error(mysql));
+                throw MySqlException(MySqlException::QUERY_FAILED);
+            }
+        }
+    } catch(const MySqlException & mse) {
+        mysql_set_server_option(mysql, MYSQL_OPTION_MULTI_STATEMENTS_OFF);
+        throw;
+    }
+    mysql_set_server_option(mysql, MYSQL_OPTION_MULTI_STATEMENTS_OFF);
+}
+
+MySqlResultSetPtr MySqlConnection::query(const char * text,
+                                         MySqlResultMode mode) {
     if (mysql_query(mysql_con(get_con()), text) != 0) {
         NOVA_LOG_ERROR("Query failed:%s", mysql_error(mysql_con(con)));
         throw MySqlException(MySqlException::QUERY_FAILED);
     }
-    MySqlResultSetPtr rtn(new MySqlQueryResultSet(mysql_con(get_con())));
+    MySqlResultSetPtr rtn(new MySqlQueryResultSet(mysql_con(get_con()),
+                                                  mode));
     return rtn;
 }
 
@@ -720,4 +1024,245 @@ const char * MySqlConnectionWithDefaultDb::get_db_name() const {
     return db_name.c_str();
 }
 
+
+/**---------------------------------------------------------------------------
+ *- MySqlConnectionPool
+ *---------------------------------------------------------------------------*/
+
+MySqlConnectionPool::Options::Options(size_t max_size, double borrow_time_out,
+                                      double max_idle_time,
+                                      double max_lifetime, double ping_after)
+:   borrow_time_out(borrow_time_out),
+    max_idle_time(max_idle_time),
+    max_lifetime(max_lifetime),
+    max_size(max_size),
+    ping_after(ping_after) {
+}
+
+MySqlConnectionPool::Options MySqlConnectionPool::Options::defaults() {
+    return Options(4, 30, 300, 3600, 1);
+}
+
+/* Everything the pool owns. Borrowed connections hold a reference to it, so
+ * they can be given back (or closed) even after the pool is gone. */
+struct MySqlConnectionPool::Shared : boost::noncopyable {
+
+    struct Idle {
+        MySqlConnection * connection;
+        double created;
+        double returned;
+    };
+
+    /* Deleter for borrowed connections. */
+    struct GiveBack {
+        boost::shared_ptr<Shared> shared;
+        double created;
+
+        GiveBack(boost::shared_ptr<Shared> shared, double created)
+        :   shared(shared),
+            created(created)
+        {
+        }
+
+        void operator()(MySqlConnection * connection) {
+            shared->give_back(connection, created);
+        }
+    };
+
+    boost::condition_variable available;
+    bool closed;
+    // Most recently returned first, so the ones in use stay warm and the
+    // rest age out.
+    std::list<Idle> idle;
+    mutable boost::mutex mutex;
+    const Options options;
+    size_t out;
+    string password;
+    const string uri;
+    const bool use_mycnf;
+    string user;
+
+    Shared(const char * uri, optional<const char *> user,
+           optional<const char *> password, const Options & options)
+    :   available(),
+        closed(false),
+        idle(),
+        mutex(),
+        options(options),
+        out(0),
+        password(password.get_value_or("")),
+        uri(uri),
+        use_mycnf(!user),
+        user(user.get_value_or(""))
+    {
+    }
+
+    ~Shared() {
+        // Only happens once the pool and every borrowed connection is gone.
+        BOOST_FOREACH(Idle & entry, idle) {
+            delete entry.connection;
+        }
+    }
+
+    /* Closes idle connections which have outlived the options. Must be
+     * called with the mutex held; returns them so they can be deleted
+     * after it's released. */
+    void take_expired(std::list<Idle> & expired, double now) {
+        std::list<Idle>::iterator itr = idle.begin();
+        while(itr != idle.end()) {
+            if (closed || now - itr->returned > options.max_idle_time
+                || now - itr->created > options.max_lifetime) {
+                expired.push_back(*itr);
+                itr = idle.erase(itr);
+            } else {
+                ++ itr;
+            }
+        }
+    }
+
+    void close_all(std::list<Idle> & connections) {
+        BOOST_FOREACH(Idle & entry, connections) {
+            delete entry.connection;
+        }
+        connections.clear();
+    }
+
+    void give_back(MySqlConnection * connection, double created) {
+        const double now = monotonic_now();
+        bool keep;
+        std::list<Idle> expired;
+        {
+            boost::lock_guard<boost::mutex> lock(mutex);
+            -- out;
+            keep = !closed && now - created <= options.max_lifetime;
+            if (keep) {
+                Idle entry = { connection, created, now };
+                idle.push_front(entry);
+            }
+            take_expired(expired, now);
+        }
+        available.notify_one();
+        if (!keep) {
+            delete connection;
+        }
+        close_all(expired);
+    }
+
+    /* Connects with the cached credentials. If they're from my.cnf and
+     * don't work they're read again, as they may have been changed. */
+    MySqlConnection * open_connection() {
+        for (int attempt = 0; ; attempt ++) {
+            string user_copy;
+            string password_copy;
+            {
+                boost::lock_guard<boost::mutex> lock(mutex);
+                if (use_mycnf && (attempt > 0 || user.empty())) {
+                    MySqlConnection::get_auth_from_config(MY_CNF_PATH, user,
+                                                          password);
+                }
+                user_copy = user;
+                password_copy = password;
+            }
+            std::auto_ptr<MySqlConnection> connection(new MySqlConnection(
+                uri.c_str(), user_copy.c_str(), password_copy.c_str()));
+            try {
+                connection->init();
+                return connection.release();
+            } catch(const MySqlException & mse) {
+                if (!use_mycnf || attempt > 0
+                    || mse.code != MySqlException::COULD_NOT_CONNECT) {
+                    throw;
+                }
+                NOVA_LOG_INFO("Could not connect with the saved credentials, "
+                              "reading %s again.", MY_CNF_PATH);
+            }
+        }
+    }
+};
+
+MySqlConnectionPool::MySqlConnectionPool(const char * uri,
+                                         const Options & options)
+:   shared(new Shared(uri, boost::none, boost::none, options)) {
+}
+
+MySqlConnectionPool::MySqlConnectionPool(const char * uri, const char * user,
+                                         const char * password,
+                                         const Options & options)
+:   shared(new Shared(uri, optional<const char *>(user),
+                      optional<const char *>(password), options)) {
+}
+
+MySqlConnectionPool::~MySqlConnectionPool() {
+    std::list<Shared::Idle> expired;
+    {
+        boost::lock_guard<boost::mutex> lock(shared->mutex);
+        shared->closed = true;
+        shared->take_expired(expired, monotonic_now());
+    }
+    shared->available.notify_all();
+    shared->close_all(expired);
+}
+
+MySqlConnectionPtr MySqlConnectionPool::borrow() {
+    const double deadline = monotonic_now() + shared->options.borrow_time_out;
+    boost::unique_lock<boost::mutex> lock(shared->mutex);
+    while(true) {
+        const double now = monotonic_now();
+        std::list<Shared::Idle> expired;
+        shared->take_expired(expired, now);
+        if (!expired.empty()) {
+            lock.unlock();
+            shared->close_all(expired);
+            lock.lock();
+            continue;
+        }
+        if (!shared->idle.empty()) {
+            const Shared::Idle entry = shared->idle.front();
+            shared->idle.pop_front();
+            ++ shared->out;
+            lock.unlock();
+            if (now - entry.returned < shared->options.ping_after
+                || entry.connection->ping()) {
+                return MySqlConnectionPtr(entry.connection,
+                    Shared::GiveBack(shared, entry.created));
+            }
+            NOVA_LOG_INFO("Pooled MySQL connection went bad, closing it.");
+            delete entry.connection;
+            lock.lock();
+            -- shared->out;
+            continue;
+        }
+        if (shared->out < shared->options.max_size) {
+            ++ shared->out;
+            lock.unlock();
+            MySqlConnection * connection;
+            try {
+                connection = shared->open_connection();
+            } catch(...) {
+                {
+                    boost::lock_guard<boost::mutex> relock(shared->mutex);
+                    -- shared->out;
+                }
+                shared->available.notify_one();
+                throw;
+            }
+            return MySqlConnectionPtr(connection,
+                Shared::GiveBack(shared, monotonic_now()));
+        }
+        if (now >= deadline) {
+            NOVA_LOG_ERROR("All %d MySQL connections are in use.",
+                           shared->options.max_size);
+            throw MySqlException(MySqlException::POOL_TIMED_OUT);
+        }
+        shared->available.timed_wait(lock,
+            boost::posix_time::milliseconds((long) ((deadline - now) * 1000)
+                                            + 1));
+    }
+}
+
+size_t MySqlConnectionPool::idle_count() const {
+    boost::lock_guard<boost::mutex> lock(shared->mutex);
+    return shared->idle.size();
+}
+
 } } } // nova::guest::mysql
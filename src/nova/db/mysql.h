@@ -2,6 +2,7 @@
 #define __NOVA_DB_MYSQL_H
 
 
+#include <map>
 #include <memory>
 #include <boost/optional.hpp>
 #include <boost/smart_ptr.hpp>
@@ -29,6 +30,7 @@ namespace nova { namespace db { namespace mysql {
                 NEXT_FETCH_FAILED,
                 NO_PASSWORD_FOR_CREATE_USER,
                 PARAMETER_INDEX_OUT_OF_BOUNDS,
+                POOL_TIMED_OUT,
                 PREPARE_BIND_FAILED,
                 PREPARE_FAILED,
                 PREPARE_STATEMENT_FAILED,
@@ -69,6 +71,15 @@ namespace nova { namespace db { namespace mysql {
 
     typedef std::auto_ptr<MySqlResultSet> MySqlResultSetPtr;
 
+    /* Buffered results are copied to the client all at once, so the
+     * connection is free again right away. Streamed results are fetched a
+     * row at a time, which keeps memory flat for big or unbounded queries,
+     * but nothing else can run on the connection until they're closed. */
+    enum MySqlResultMode {
+        BUFFER_RESULTS,
+        STREAM_RESULTS
+    };
+
     class MySqlPreparedStatement;
 
     typedef boost::shared_ptr<MySqlPreparedStatement> MySqlPreparedStatementPtr;
@@ -98,6 +109,15 @@ namespace nova { namespace db { namespace mysql {
 
             std::string escape_string(const char * original);
 
+            /* Escapes a name to go between backticks, such as a database
+             * or user name, by doubling any backticks in it. */
+            static std::string escape_identifier(const char * original);
+
+            /* Runs statements which return nothing, sending as many as
+             * fit in each request to the server instead of one at a time.
+             * Stops at the first one which fails. */
+            void execute_batch(const std::vector<std::string> & statements);
+
             void flush_privileges();
 
             static void get_auth_from_config(
@@ -128,7 +148,19 @@ namespace nova { namespace db { namespace mysql {
 
             MySqlPreparedStatementPtr prepare_statement(const char * text);
 
-            MySqlResultSetPtr query(const char * text);
+            /* Like prepare_statement, but keeps the statement for as long
+             * as the connection is open and returns the same one the next
+             * time it's asked for the same text. Close any result set from
+             * it before asking again. */
+            MySqlPreparedStatementPtr prepare_cached_statement(
+                const char * text);
+
+            /* True if the connection is open and the server answers. Unlike
+             * ensure(), doesn't reconnect. */
+            bool ping();
+
+            MySqlResultSetPtr query(const char * text,
+                                    MySqlResultMode mode = BUFFER_RESULTS);
 
             bool test_connection();
 
@@ -144,6 +176,8 @@ namespace nova { namespace db { namespace mysql {
 
             std::string password;
 
+            std::map<std::string, MySqlPreparedStatementPtr> statements;
+
             const std::string uri;
 
             const bool use_mycnf;
@@ -169,6 +203,57 @@ namespace nova { namespace db { namespace mysql {
     typedef boost::shared_ptr<MySqlConnectionWithDefaultDb>
         MySqlConnectionWithDefaultDbPtr;
 
+    /** Hands out connections to one server and keeps them open between
+     *  uses, so callers on different threads each get their own without
+     *  reconnecting (and rereading my.cnf) every time. */
+    class MySqlConnectionPool : boost::noncopyable {
+        public:
+            struct Options {
+                // Seconds borrow() waits when max_size connections are out.
+                double borrow_time_out;
+                // Idle connections are closed after this many seconds.
+                double max_idle_time;
+                // Connections are closed once they're this many seconds
+                // old, even if they're healthy.
+                double max_lifetime;
+                size_t max_size;
+                // Connections idle for longer than this are pinged before
+                // being handed out again.
+                double ping_after;
+
+                Options(size_t max_size, double borrow_time_out,
+                        double max_idle_time, double max_lifetime,
+                        double ping_after);
+
+                static Options defaults();
+            };
+
+            /* The user name and password are loaded from the my.cnf file
+             * once, and again only if they stop working. */
+            MySqlConnectionPool(const char * uri, const Options & options);
+
+            MySqlConnectionPool(const char * uri, const char * user,
+                                const char * password,
+                                const Options & options);
+
+            /* Connections still borrowed are closed when they come back. */
+            ~MySqlConnectionPool();
+
+            /* Returns an open connection, which goes back to the pool once
+             * the last copy of the pointer is gone. Throws POOL_TIMED_OUT
+             * if none frees up in time. */
+            MySqlConnectionPtr borrow();
+
+            size_t idle_count() const;
+
+        private:
+            struct Shared;
+
+            boost::shared_ptr<Shared> shared;
+    };
+
+    typedef boost::shared_ptr<MySqlConnectionPool> MySqlConnectionPoolPtr;
+
     class MySqlResultSet : boost::noncopyable  {
         public:
             virtual ~MySqlResultSet();
@@ -196,6 +281,10 @@ namespace nova { namespace db { namespace mysql {
             virtual void close() = 0;
             virtual void execute(int result_count = 0) = 0;
             virtual int get_parameter_count() const = 0;
+            /* Executes the statement and returns its rows, with every
+             * field as a string. */
+            virtual MySqlResultSetPtr query(
+                MySqlResultMode mode = BUFFER_RESULTS) = 0;
             virtual void set_bool(int index, bool value);
             virtual void set_int(int index, int value);
             virtual void set_float(int index, float value);
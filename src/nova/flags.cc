@@ -301,6 +301,10 @@ const char * FlagValues::backup_restore_restore_directory() const {
     return map->get("backup_restore_restore_directory", "/var/lib/mysql");
 }
 
+list<string> FlagValues::backup_cgroup_limits() const {
+    return get_flag_value_as_string_list(*map, "backup_cgroup_limits", "", 0);
+}
+
 list<string> FlagValues::backup_process_commands() const {
     return get_flag_value_as_string_list(*map, "backup_process_commands",
         "/usr/bin/sudo,-E,/var/lib/nova/backup", 1);
@@ -318,6 +322,10 @@ const char * FlagValues::backup_restore_save_file_pattern() const {
                     "^my.cnf$|^mysql_upgrade_info$|^debian-5.1.flag$|^debian-5.5.flag$");
 }
 
+double FlagValues::backup_progress_interval() const {
+    return get_flag_value<double>(*map, "backup_progress_interval", 30.0);
+}
+
 int FlagValues::backup_segment_max_size() const {
     return get_flag_value<int>(*map, "backup_segment_max_size",
                                100 * 1024 * 1024);
@@ -331,6 +339,10 @@ double FlagValues::backup_timeout() const {
     return get_flag_value<double>(*map, "backup_timeout", 60.0);
 }
 
+optional<const char *> FlagValues::cgroup_parent() const {
+    return get_flag_value<const char *>(*map, "cgroup_parent");
+}
+
 const int FlagValues::checksum_wait_time() const {
     return get_flag_value<long>(*map, "checksum_wait_time", 5 * 60);
 }
@@ -352,6 +364,15 @@ const long long FlagValues::redis_backup_rdb_max_age_in_seconds() const {
         *map, "redis_backup_rdb_max_age_in_seconds", 60);
 }
 
+double FlagValues::redis_backup_save_time_out() const {
+    return get_flag_value<double>(*map, "redis_backup_save_time_out",
+                                  60.0 * 60);
+}
+
+bool FlagValues::redis_backup_stream_snapshot() const {
+    return get_flag_value<bool>(*map, "redis_backup_stream_snapshot", false);
+}
+
 const char * FlagValues::guest_id() const {
     return map->get("guest_id");
 }
@@ -360,10 +381,22 @@ optional<const char *> FlagValues::host() const {
     return get_flag_value<const char *>(*map, "host");
 }
 
+bool FlagValues::log_file_compress() const {
+    return get_flag_value<bool>(*map, "log_file_compress", true);
+}
+
+const char * FlagValues::log_file_format() const {
+    return map->get("log_file_format", "text");
+}
+
 optional<int> FlagValues::log_file_max_old_files() const {
     return get_flag_value<int>(*map, "log_file_max_old_files");
 }
 
+optional<size_t> FlagValues::log_file_max_old_files_size() const {
+    return get_flag_value<size_t>(*map, "log_file_max_old_files_size");
+}
+
 optional<size_t> FlagValues::log_file_max_size() const {
     return get_flag_value<size_t>(*map, "log_file_max_size");
 }
@@ -376,6 +409,18 @@ optional<const char *> FlagValues::log_file_path() const {
     return get_flag_value<const char *>(*map, "log_file_path");
 }
 
+double FlagValues::log_flush_interval() const {
+    return get_flag_value<double>(*map, "log_flush_interval", 0.5);
+}
+
+const char * FlagValues::log_flush_policy() const {
+    return map->get("log_flush_policy", "buffered");
+}
+
+size_t FlagValues::log_flush_size() const {
+    return get_flag_value<size_t>(*map, "log_flush_size", 64 * 1024);
+}
+
 bool FlagValues::log_show_trace() const {
     return get_flag_value<bool>(*map, "log_show_trace", false);
 }
@@ -413,6 +458,10 @@ unsigned long FlagValues::periodic_interval() const {
     return get_flag_value(*map, "periodic_interval", (unsigned long) 60);
 }
 
+optional<const char *> FlagValues::process_helper_path() const {
+    return get_flag_value<const char *>(*map, "process_helper_path");
+}
+
 std::list<std::string> FlagValues::datastore_packages() const {
     return get_flag_value_as_string_list(*map, "datastore_packages",
         "mysql-server,mysql-server-5.1,mysql-server-5.5,mysql-server-5.6,mariadb-server-10.0,percona-server-server-5.5,percona-server-server-5.6", 1);
@@ -455,6 +504,10 @@ bool FlagValues::register_dangerous_functions() const {
     return get_flag_value<bool>(*map, "register_dangerous_functions", false);
 }
 
+list<string> FlagValues::restore_cgroup_limits() const {
+    return get_flag_value_as_string_list(*map, "restore_cgroup_limits", "", 0);
+}
+
 bool FlagValues::skip_install_for_prepare() const {
     return get_flag_value<bool>(*map, "skip_install_for_prepare", false);
 }
@@ -492,6 +545,10 @@ const char * FlagValues::volume_mount_options() const {
     return map->get("volume_mount_options", "defaults,noatime");
 }
 
+size_t FlagValues::worker_thread_count() const {
+    return get_flag_value(*map, "worker_thread_count", (size_t) 2);
+}
+
 size_t FlagValues::worker_thread_stack_size() const {
     return get_flag_value(*map, "worker_thread_stack_size",
                           (size_t) 1024 * 1024);
@@ -99,6 +99,10 @@ class FlagValues {
 
         size_t backup_zlib_buffer_size() const;
 
+        /** Limits for the cgroup backups run in, as "file=value" pairs such
+         *  as "io.weight=50" or "memory.high=1G". */
+        std::list<std::string> backup_cgroup_limits() const;
+
         std::list<std::string> backup_process_commands() const;
 
         size_t backup_restore_zlib_buffer_size() const;
@@ -111,12 +115,18 @@ class FlagValues {
 
         const char * backup_restore_save_file_pattern() const;
 
+        double backup_progress_interval() const;
+
         int backup_segment_max_size() const;
 
         const char * backup_swift_container() const;
 
         double backup_timeout() const;
 
+        /** A cgroup v2 directory the agent may create groups in. Backups and
+         *  restores run in groups under it; if not set they run unlimited. */
+        boost::optional<const char *> cgroup_parent() const;
+
         const int checksum_wait_time() const;
 
         const char * control_exchange() const;
@@ -129,14 +139,37 @@ class FlagValues {
 
         boost::optional<const char *> host() const;
 
+        /** Gzip rotated log files in the background. On by default. */
+        bool log_file_compress() const;
+
+        /** "text" (the default), "json" for one JSON object per line or
+         *  "binary" for length prefixed records. */
+        const char * log_file_format() const;
+
         boost::optional<int> log_file_max_old_files() const;
 
+        /** Total bytes rotated log files may use; the oldest are deleted
+         *  to stay under it. */
+        boost::optional<size_t> log_file_max_old_files_size() const;
+
         boost::optional<const char *> log_file_path() const;
 
         boost::optional<size_t> log_file_max_size() const;
 
         boost::optional<double> log_file_max_time() const;
 
+        /** Longest time a line may wait to be written to the log file. */
+        double log_flush_interval() const;
+
+        /** "buffered" (the default) writes lines to the log file in
+         *  batches; "line" writes each one right away. */
+        const char * log_flush_policy() const;
+
+        /** Bytes of lines which may wait to be written to the log file. */
+        size_t log_flush_size() const;
+
+        /** Has no effect in release builds, which leave out TRACE lines
+         *  entirely. */
         bool log_show_trace() const;
 
         bool log_use_std_streams() const;
@@ -157,6 +190,11 @@ class FlagValues {
 
         unsigned long periodic_interval() const;
 
+        /** Path to sneaky-pete-helper, which runs frequently used privileged
+         *  commands without launching sudo each time. If not set, sudo is
+         *  used for everything. */
+        boost::optional<const char *> process_helper_path() const;
+
         std::list<std::string> datastore_packages() const;
 
         size_t rabbit_client_memory() const;
@@ -175,10 +213,20 @@ class FlagValues {
 
         const long long redis_backup_rdb_max_age_in_seconds() const;
 
+        /** How long a backup waits for Redis to save the RDB file. */
+        double redis_backup_save_time_out() const;
+
+        /** If true, backups read the snapshot Redis sends replicas and
+         *  compress it in process instead of tar'ing the files on disk. */
+        bool redis_backup_stream_snapshot() const;
+
         const int redis_state_change_wait_time() const;
 
         bool register_dangerous_functions() const;
 
+        /** Like backup_cgroup_limits, but for restores. */
+        std::list<std::string> restore_cgroup_limits() const;
+
         bool skip_install_for_prepare() const;
 
         size_t status_thread_stack_size() const;
@@ -199,6 +247,8 @@ class FlagValues {
 
         const char * volume_mount_options() const;
 
+        size_t worker_thread_count() const;
+
         size_t worker_thread_stack_size() const;
 
         const char * conductor_queue() const;
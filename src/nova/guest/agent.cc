@@ -89,6 +89,12 @@ void message_loop(ResilientReceiver & receiver,
     try {
 #endif
         GuestInput input = receiver.next_message();
+        LogContextScope method_context("method", input.method_name);
+        auto_ptr<LogContextScope> request_context;
+        if (input.request_id) {
+            request_context.reset(new LogContextScope(
+                "request_id", input.request_id.get()));
+        }
         NOVA_LOG_INFO("method=%s", input.method_name.c_str());
 
         GuestOutput output(run_method(handlers, input));
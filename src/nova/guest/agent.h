@@ -10,6 +10,7 @@
 #include "nova/rpc/receiver.h"
 #include <boost/tuple/tuple.hpp>
 #include "nova/Log.h"
+#include "nova/process_helper.h"
 #include "nova/rpc/sender.h"
 #include "nova/utils/threads.h"
 #include "nova/guest/utils.h"
@@ -107,12 +108,18 @@ void initialize_and_run(const char * const title,
         flags.guest_id(),
         flags.rabbit_reconnect_wait_times()));
 
+    /* Route privileged commands through the helper, if there is one. */
+    nova::process::ProcessHelperScope process_helper_scope(
+        flags.process_helper_path());
+
     /* Create the function object, in case other goodies are attached to
      * it (such as CurlScope). */
     initialize_handlers_func initialize_handlers;
 
-    /* Create job runner, but don't start it's thread until later. */
-    nova::utils::ThreadBasedJobRunner job_runner;
+    /* Create job runner, but don't start its threads until later. Only one
+     * backup may run at a time; other jobs can run next to it. */
+    nova::utils::JobScheduler job_runner;
+    job_runner.set_limit("backup", 1);
 
     /* Create JSON message handlers. */
     std::vector<MessageHandlerPtr> handlers;
@@ -132,9 +139,9 @@ void initialize_and_run(const char * const title,
                                         flags.periodic_interval());
     nova::utils::Thread statusThread(flags.status_thread_stack_size(), tasker);
 
-    NOVA_LOG_INFO("Starting job thread...");
-    nova::utils::Thread workerThread(flags.worker_thread_stack_size(),
-                                     job_runner);
+    NOVA_LOG_INFO("Starting job threads...");
+    job_runner.start(flags.worker_thread_count(),
+                     flags.worker_thread_stack_size());
 
     // If a "message" is specified we just run it and quit. Otherwise,
     // it's Rabbit time.
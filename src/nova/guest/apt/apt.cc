@@ -77,6 +77,49 @@ namespace {
         return result;
     }
 
+    const char * const DPKG_STATUS_FILE = "/var/lib/dpkg/status";
+
+    /* Finds the version of a package in dpkg's database, which is where
+     * "dpkg-query -W" gets it from, without running a process. Returns false
+     * if the database couldn't be read. Otherwise "version" is set to the
+     * version, or boost::none if the package isn't there or has none. */
+    bool read_dpkg_version(const char * package_name,
+                           optional<string> & version) {
+        std::ifstream status_file(DPKG_STATUS_FILE);
+        if (!status_file.good()) {
+            NOVA_LOG_ERROR("Could not open %s.", DPKG_STATUS_FILE);
+            return false;
+        }
+        const string package_line = str(format("Package: %s") % package_name);
+        const string version_prefix = "Version: ";
+        bool in_package = false;
+        string line;
+        version = boost::none;
+        while(std::getline(status_file, line)) {
+            if (line.empty()) {
+                // Entries are separated by blank lines.
+                if (in_package && !!version) {
+                    return true;
+                }
+                in_package = false;
+            } else if (line == package_line) {
+                in_package = true;
+            } else if (in_package
+                       && line.compare(0, version_prefix.size(),
+                                       version_prefix) == 0) {
+                version = line.substr(version_prefix.size());
+                if (version.get().empty()) {
+                    version = boost::none;
+                }
+            }
+        }
+        if (status_file.bad()) {
+            NOVA_LOG_ERROR("Error reading %s.", DPKG_STATUS_FILE);
+            return false;
+        }
+        return true;
+    }
+
     void wait_for_proc_to_finish(pid_t pid, int time_out) {
         int time_left = time_out;
         while (proc::is_pid_alive(pid) && time_left > 0) {
@@ -104,64 +147,57 @@ void AptGuest::fix(double time_out) {
     cmds += "/usr/bin/dpkg", "--configure", "-a";
     proc::Process<proc::StdErrAndStdOut> process(cmds);
 
-    // Expect just a simple EOF.
-    stringstream std_out;
-    process.read_until_pause(std_out, time_out);
+    // Expect just a simple EOF. Only the end of the output is kept, to
+    // explain things if it doesn't come.
+    proc::OutputTail tail;
+    try {
+        process.read_lines_until_exit(tail, time_out);
+    } catch(const TimeOutException & toe) {
+        // It paused for too long, which is checked below.
+    }
     if (!process.is_finished()) {
+        NOVA_LOG_ERROR("dpkg --configure didn't finish. Its output ended "
+                       "with:\n%s", tail.str().c_str());
         throw AptException(AptException::COULD_NOT_FIX);
     }
 }
 
 
-// Returns -1 on EOF, an index of a regular expression that matched.
+// Returns the match for the earliest pattern to match any line of output,
+// or none on EOF.
 template<typename ProcessClass>
 optional<ProcessResult> match_output(
     ProcessClass & process,
     const vector<string> & patterns,
     double seconds)
 {
-    typedef shared_ptr<Regex> RegexPtr;
-    vector<RegexPtr> regexes;
-    BOOST_FOREACH(const string & pattern, patterns) {
-        RegexPtr ptr(new Regex(pattern.c_str()));
-        regexes.push_back(ptr);
-    }
-    stringstream std_out;
-
+    // Lines are matched as they arrive, so the output is never stored.
+    proc::LineMatcher matcher(patterns);
+    proc::LineSplitter splitter(matcher);
+    char buffer[4096];
     Timer timer(seconds);
     while(!process.is_finished()) {
-        auto count = process.read_into(std_out, seconds);
-        NOVA_LOG_TRACE("******************************************************");
-        NOVA_LOG_TRACE(std_out.str().c_str());
-        NOVA_LOG_TRACE("******************************************************");
+        const size_t count = process.read_into(buffer, sizeof(buffer),
+                                               seconds);
         if (count == 0) {
-            //NOTE(tim.simpson): Return boost::none here if we hit the timeout?
-            //                   Kevin reports this makes the code work.
             if (!process.is_finished()) {
                 NOVA_LOG_ERROR("read should not exit until it gets data.");
                 throw AptException(AptException::GENERAL);
             }
-            return boost::none;
+            splitter.flush();
+            break;
         }
-        string output = std_out.str();
-        for (size_t index = 0; index < regexes.size(); index ++) {
-            RegexPtr & regex = regexes[index];;
-            RegexMatchesPtr matches = regex->match(output.c_str());
-            NOVA_LOG_TRACE("__________________________________________________");
-            NOVA_LOG_TRACE(output.c_str());
-            NOVA_LOG_TRACE("Trying to match %s against regex %s",
-                           output, patterns[index]);
-            NOVA_LOG_TRACE("__________________________________________________");
-            if (!!matches) {
-                ProcessResult result;
-                result.index = index;
-                result.matches = matches;
-                return optional<ProcessResult>(result);
-            }
+        if (!splitter.write(buffer, count)) {
+            break;  // Nothing can beat the first pattern.
         }
-        // Nothing matches... let's try again until time_out or eof().
     }
-    return boost::none;
+    if (!matcher.index()) {
+        return boost::none;
+    }
+    ProcessResult result;
+    result.index = (int) matcher.index().get();
+    result.matches = matcher.matches();
+    return optional<ProcessResult>(result);
 }
 
 void AptGuest::install(const char * package_name, const double time_out) {
@@ -256,6 +292,12 @@ typedef boost::optional<std::string> optional_string;
 optional<string> AptGuest::version(const char * package_name,
                                    const double time_out) {
     NOVA_LOG_DEBUG("Getting version of %s", package_name);
+    optional<string> installed_version;
+    if (read_dpkg_version(package_name, installed_version)) {
+        NOVA_LOG_DEBUG("Version of %s is %s.", package_name,
+                       installed_version.get_value_or("<none>"));
+        return installed_version;
+    }
     proc::CommandList cmds = list_of("/usr/bin/dpkg-query")("-W")(package_name);
     proc::Process<proc::StdErrAndStdOut> process(cmds);
 
@@ -50,6 +50,11 @@ JsonDataPtr BackupMessageHandler::handle_message(const GuestInput & input) {
         BackupCreationArgs args = from_input(input);
         backup_manager->run_backup(args);
         return JsonData::from_null();
+    } else if (input.method_name == "cancel_backup") {
+        NOVA_LOG_DEBUG("handling the cancel_backup method");
+        const string backup_id = input.args->get_string("backup_id");
+        return JsonData::from_boolean(
+            backup_manager->cancel_backup(backup_id));
     } else {
         return JsonDataPtr();
     }
@@ -6,6 +6,7 @@
 #include "nova/guest/guest.h"
 #include <map>
 #include <string>
+#include "nova/utils/threads.h"
 
 namespace nova { namespace guest { namespace diagnostics {
 
@@ -112,7 +113,10 @@ namespace nova { namespace guest { namespace diagnostics {
     class InterrogatorMessageHandler : public MessageHandler {
 
         public:
-          InterrogatorMessageHandler(const Interrogator & interrogator);
+          /** If given, the scheduler's queue depth and wait times are added
+           *  to the results of get_diagnostics. */
+          InterrogatorMessageHandler(const Interrogator & interrogator,
+                                     nova::utils::JobScheduler * scheduler=0);
 
           virtual nova::JsonDataPtr handle_message(const GuestInput & input);
 
@@ -121,6 +125,8 @@ namespace nova { namespace guest { namespace diagnostics {
           InterrogatorMessageHandler & operator = (const InterrogatorMessageHandler &);
 
           const Interrogator interrogator;
+
+          nova::utils::JobScheduler * const scheduler;
     };
 
 
@@ -14,6 +14,7 @@ using nova::json_obj;
 using nova::JsonObjectBuilder;
 using nova::Log;
 using nova::guest::GuestException;
+using nova::utils::JobScheduler;
 using boost::optional;
 using std::string;
 using namespace boost;
@@ -33,6 +34,15 @@ namespace {
         );
     }
 
+    void add_job_stats(JsonObjectBuilder & builder,
+                       const JobScheduler::Stats & stats) {
+        builder.add("job_queue_depth", (int) stats.queue_depth);
+        builder.add("jobs_running", (int) stats.running);
+        builder.add("job_wait_last", stats.last_wait);
+        builder.add("job_wait_max", stats.max_wait);
+        builder.add("job_wait_average", stats.average_wait);
+    }
+
     JsonObjectBuilder fs_stats_to_json_object(const FileSystemStatsPtr fs_stats) {
         return json_obj(
             "used", fs_stats->used,
@@ -49,8 +59,10 @@ namespace {
     }
 } // end of anonymous namespace
 
-InterrogatorMessageHandler::InterrogatorMessageHandler(const Interrogator & interrogator)
-: interrogator(interrogator) {
+InterrogatorMessageHandler::InterrogatorMessageHandler(
+    const Interrogator & interrogator, JobScheduler * scheduler)
+:   interrogator(interrogator),
+    scheduler(scheduler) {
 }
 
 JsonDataPtr InterrogatorMessageHandler::handle_message(const GuestInput & input) {
@@ -60,8 +72,11 @@ JsonDataPtr InterrogatorMessageHandler::handle_message(const GuestInput & input)
         DiagInfoPtr diagnostics = interrogator.get_diagnostics();
         NOVA_LOG_DEBUG("returned from the get_diagnostics");
         if (diagnostics.get() != 0) {
-            JsonDataPtr rtn(new JsonObject(
-                diagnostics_to_json_object(diagnostics)));
+            JsonObjectBuilder builder = diagnostics_to_json_object(diagnostics);
+            if (scheduler) {
+                add_job_stats(builder, scheduler->stats());
+            }
+            JsonDataPtr rtn(new JsonObject(builder));
             return rtn;
         } else {
             return JsonData::from_null();
@@ -12,6 +12,7 @@ namespace nova { namespace guest {
     struct GuestInput {
         nova::JsonObjectPtr args;
         std::string method_name;
+        boost::optional<std::string> request_id;
         boost::optional<std::string> tenant;
         boost::optional<std::string> token;
     };
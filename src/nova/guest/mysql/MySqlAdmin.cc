@@ -4,6 +4,8 @@
 #include <boost/foreach.hpp>
 #include <boost/format.hpp>
 #include <boost/algorithm/string/join.hpp>
+#include <algorithm>
+#include <limits.h>
 #include <vector>
 
 #include <fstream>
@@ -12,8 +14,10 @@
 //#include <mysql/mysql.h>
 #include "nova/guest/mysql/MySqlAdmin.h"
 #include "nova/guest/mysql/MySqlGuestException.h"
-#include "nova/utils/regex.h"
 #include <sstream>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
+#include <time.h>
 #include <uuid/uuid.h>
 
 #include "MySqlStatements.h"
@@ -23,6 +27,7 @@ using boost::format;
 using nova::db::mysql::MySqlConnection;
 using nova::db::mysql::MySqlConnectionPtr;
 using nova::db::mysql::MySqlException;
+using nova::db::mysql::MySqlResultMode;
 using nova::db::mysql::MySqlResultSet;
 using nova::db::mysql::MySqlResultSetPtr;
 using nova::db::mysql::MySqlPreparedStatementPtr;
@@ -30,8 +35,6 @@ using boost::make_tuple;
 using boost::none;
 using boost::optional;
 using nova::Log;
-using nova::utils::Regex;
-using nova::utils::RegexMatchesPtr;
 using namespace std;
 using boost::tuple;
 
@@ -40,27 +43,155 @@ namespace nova { namespace guest { namespace mysql {
 
 namespace {
     typedef map<string, MySqlUserPtr> UserMap;
-}
 
-string extract_user(const string & user) {
-    Regex regex("^'(.*)'@");
-    RegexMatchesPtr matches = regex.match(user.c_str());
-    if (matches && matches->exists_at(1)) {
-        return matches->get(1);
-    } else {
-        NOVA_LOG_ERROR("Failed to parse the grantee: %s", user.c_str());
-        throw MySqlGuestException(MySqlGuestException::GENERAL);
+    /* Pages bigger than this are streamed from the server instead of being
+     * copied into memory all at once. */
+    const unsigned int MAX_BUFFERED_ROWS = 1000;
+
+    MySqlResultMode result_mode_for_limit(unsigned int limit) {
+        return limit > MAX_BUFFERED_ROWS ? nova::db::mysql::STREAM_RESULTS
+                                         : nova::db::mysql::BUFFER_RESULTS;
     }
-}
 
-string extract_host(const string & user) {
-    Regex regex("^'.*'@'(.+)'");
-    RegexMatchesPtr matches = regex.match(user.c_str());
-    if (matches && matches->exists_at(1)) {
-        return matches->get(1);
-    } else {
-        NOVA_LOG_ERROR("Failed to parse the grantee: %s", user.c_str());
-        throw MySqlGuestException(MySqlGuestException::GENERAL);
+    /* One row past the limit is fetched to see if there's another page.
+     * LIMIT is bound as an int, so huge limits are cut down to fit. */
+    int rows_to_fetch(unsigned int limit) {
+        return (int) std::min<unsigned int>(limit, INT_MAX - 1) + 1;
+    }
+
+    /* Remembers which databases each user ("name@host") can access. It's
+     * shared as a MySqlAdmin is made for each request. Anything here which
+     * changes grants clears it, and entries expire in case someone changes
+     * them behind our back. */
+    class UserDatabaseCache : boost::noncopyable {
+    public:
+        typedef std::vector<string> Databases;
+
+        UserDatabaseCache()
+        :   entries(), generation(0), mutex()
+        {
+        }
+
+        void clear() {
+            boost::lock_guard<boost::mutex> lock(mutex);
+            entries.clear();
+            generation ++;
+        }
+
+        bool get(const string & user, Databases & databases) {
+            boost::lock_guard<boost::mutex> lock(mutex);
+            std::map<string, Entry>::iterator itr = entries.find(user);
+            if (itr == entries.end()) {
+                return false;
+            }
+            if (now() - itr->second.time > MAX_AGE) {
+                entries.erase(itr);
+                return false;
+            }
+            databases = itr->second.databases;
+            return true;
+        }
+
+        /* Call before querying; put() ignores what was read if the cache
+         * was cleared in the meantime. */
+        unsigned long get_generation() {
+            boost::lock_guard<boost::mutex> lock(mutex);
+            return generation;
+        }
+
+        void put(unsigned long read_generation, const string & user,
+                 const Databases & databases) {
+            boost::lock_guard<boost::mutex> lock(mutex);
+            if (read_generation != generation) {
+                return;
+            }
+            if (entries.size() >= MAX_ENTRIES) {
+                entries.clear();
+            }
+            Entry & entry = entries[user];
+            entry.databases = databases;
+            entry.time = now();
+        }
+
+    private:
+        struct Entry {
+            Databases databases;
+            time_t time;
+        };
+
+        static const time_t MAX_AGE = 60;
+        static const size_t MAX_ENTRIES = 1024;
+
+        std::map<string, Entry> entries;
+        unsigned long generation;
+        boost::mutex mutex;
+
+        static time_t now() {
+            timespec time;
+            clock_gettime(CLOCK_MONOTONIC, &time);
+            return time.tv_sec;
+        }
+    };
+
+    UserDatabaseCache & user_database_cache() {
+        static UserDatabaseCache cache;
+        return cache;
+    }
+
+    void add_databases(MySqlUserPtr & user,
+                       const UserDatabaseCache::Databases & names) {
+        BOOST_FOREACH(const string & name, names) {
+            MySqlDatabasePtr database(new MySqlDatabase());
+            database->set_name(name);
+            user->get_databases()->push_back(database);
+        }
+    }
+
+    /* Fills in the databases each user can access, with a single query
+     * against mysql.db for all of the users not in the cache. */
+    void attach_databases(MySqlConnection & con, UserMap & users) {
+        UserDatabaseCache & cache = user_database_cache();
+        const unsigned long generation = cache.get_generation();
+        std::map<string, UserDatabaseCache::Databases> found;
+        stringstream query;
+        query << "SELECT User, Host, Db FROM mysql.db"
+                 " WHERE (User, Host) IN (";
+        BOOST_FOREACH(UserMap::value_type & pair, users) {
+            UserDatabaseCache::Databases databases;
+            if (cache.get(pair.first, databases)) {
+                add_databases(pair.second, databases);
+                continue;
+            }
+            query << (found.empty() ? "" : ", ")
+                  << "('" << con.escape_string(pair.second->get_name().c_str())
+                  << "', '"
+                  << con.escape_string(pair.second->get_host().c_str())
+                  << "')";
+            found[pair.first];
+        }
+        if (found.empty()) {
+            return;
+        }
+        query << ") ORDER BY Db";
+        MySqlResultSetPtr res = con.query(query.str().c_str());
+        while(res->next()) {
+            const string key = res->get_string(0).get() + "@"
+                + res->get_string(1).get();
+            if (found.find(key) != found.end()) {
+                found[key].push_back(res->get_string(2).get());
+            }
+        }
+        res->close();
+        typedef std::map<string, UserDatabaseCache::Databases>::value_type
+            FoundPair;
+        BOOST_FOREACH(const FoundPair & pair, found) {
+            add_databases(users[pair.first], pair.second);
+            cache.put(generation, pair.first, pair.second);
+        }
+    }
+
+    void forget_user_databases() {
+        user_database_cache().clear();
     }
 }
 
@@ -122,6 +253,7 @@ void MySqlAdmin::update_attributes(const string & username, const string & hostn
                              % con->escape_string(found_user->get_host().c_str()));
     con->query(final_query.c_str());
     con->flush_privileges();
+    forget_user_databases();
     if (user->get_name()){
         if (!(user->get_host())){
             host_name = found_user->get_host();
@@ -134,63 +266,80 @@ void MySqlAdmin::update_attributes(const string & username, const string & hostn
 }
 
 void MySqlAdmin::create_database(MySqlDatabaseListPtr databases) {
+    vector<string> statements;
     BOOST_FOREACH(MySqlDatabasePtr & db, *databases) {
-        string text = str(format(
+        statements.push_back(str(format(
             "CREATE DATABASE IF NOT EXISTS `%s` CHARACTER SET = `%s` "
             "COLLATE = `%s`")
-            % con->escape_string(db->get_name().c_str())
-            % con->escape_string(db->get_character_set().c_str())
-            % con->escape_string(db->get_collation().c_str()));
-        con->query(text.c_str());
-        //stmt->setString(1, db->get_name());
-        //stmt->setString(2, db->get_character_set());
-        //stmt->setString(3, db->get_collation());
-        //stmt->execute();
-        //stmt->close();
+            % con->escape_identifier(db->get_name().c_str())
+            % con->escape_identifier(db->get_character_set().c_str())
+            % con->escape_identifier(db->get_collation().c_str())));
     }
+    con->execute_batch(statements);
 }
 
 void MySqlAdmin::create_user(MySqlUserPtr user, const char * const grant_stuff) {
+    vector<string> statements;
+    add_create_user_statements(statements, user, grant_stuff);
+    con->execute_batch(statements);
+    forget_user_databases();
+}
+
+void MySqlAdmin::create_users(MySqlUserListPtr users) {
+    // Everything goes in one batch so hundreds of users don't each cost
+    // several round trips.
+    vector<string> statements;
+    BOOST_FOREACH(MySqlUserPtr & user, *users) {
+        add_create_user_statements(statements, user, "USAGE");
+    }
+    try {
+        con->execute_batch(statements);
+    } catch(const MySqlException & mse) {
+        // Whatever ran before the failure still counts.
+        forget_user_databases();
+        throw;
+    }
+    con->flush_privileges();
+    forget_user_databases();
+}
+
+void MySqlAdmin::add_create_user_statements(vector<string> & statements,
+                                            MySqlUserPtr user,
+                                            const char * const grant_stuff) {
     if (!user->get_password()) {
         throw MySqlGuestException(MySqlGuestException::NO_PASSWORD_FOR_CREATE_USER);
     }
-    string text = str(format(
+    statements.push_back(str(format(
         "GRANT %s ON *.* TO '%s'@\"%s\" IDENTIFIED BY '%s'")
         % grant_stuff
         % con->escape_string(user->get_name().c_str())
         % con->escape_string(user->get_host().c_str())
-        % con->escape_string(user->get_password().get().c_str()));
-    con->query(text.c_str());
+        % con->escape_string(user->get_password().get().c_str())));
 
     BOOST_FOREACH(MySqlDatabasePtr db, *user->get_databases()) {
-        string text = str(format(
+        statements.push_back(str(format(
             "GRANT ALL PRIVILEGES ON `%s`.* TO `%s`@'%s'")
-            % con->escape_string(db->get_name().c_str())
-            % con->escape_string(user->get_name().c_str())
-            % con->escape_string(user->get_host().c_str()));
-        con->query(text.c_str());
-    }
-}
-
-void MySqlAdmin::create_users(MySqlUserListPtr users) {
-    BOOST_FOREACH(MySqlUserPtr & user, *users) {
-        create_user(user);
+            % con->escape_identifier(db->get_name().c_str())
+            % con->escape_identifier(user->get_name().c_str())
+            % con->escape_string(user->get_host().c_str())));
     }
 }
 
 void MySqlAdmin::delete_database(const string & database_name) {
     string text = str(format("DROP DATABASE IF EXISTS `%s`")
-                       % con->escape_string(database_name.c_str()));
+                       % con->escape_identifier(database_name.c_str()));
     con->query(text.c_str());
     con->flush_privileges();
+    forget_user_databases();
 }
 
 void MySqlAdmin::delete_user(const string & username, const string & hostname) {
     string text = str(format("DROP USER `%s`@`%s`")
-                       % con->escape_string(username.c_str())
-                       % con->escape_string(hostname.c_str()));
+                       % con->escape_identifier(username.c_str())
+                       % con->escape_identifier(hostname.c_str()));
     con->query(text.c_str());
     con->flush_privileges();
+    forget_user_databases();
 }
 
 MySqlUserPtr MySqlAdmin::enable_root() {
@@ -206,25 +355,27 @@ MySqlUserPtr MySqlAdmin::enable_root() {
     con->grant_all_privileges("root", "%");
     con->revoke_privileges("FILE", "*", "root", "%");
     con->flush_privileges();
+    forget_user_databases();
     return root_user;
 }
 
 MySqlUserPtr MySqlAdmin::find_user(const std::string & username, const std::string & hostname) {
-    string query = str(format(" SELECT"
-                         "   User, Host, Password"
-                         " FROM"
-                         "   mysql.user"
-                         " WHERE"
-                         "   Host != 'localhost'"
-                         " AND"
-                         "   User = '%s'"
-                         " AND"
-                         "  Host = '%s'"
-                         " ORDER BY 1")
-                         % con->escape_string(username.c_str())
-                         % con->escape_string(hostname.c_str()));
-
-    MySqlResultSetPtr res = con->query(query.c_str());
+    MySqlPreparedStatementPtr stmt = con->prepare_cached_statement(
+        " SELECT"
+        "   User, Host, Password"
+        " FROM"
+        "   mysql.user"
+        " WHERE"
+        "   Host != 'localhost'"
+        " AND"
+        "   User = ?"
+        " AND"
+        "  Host = ?"
+        " ORDER BY 1");
+    stmt->set_string(0, username.c_str());
+    stmt->set_string(1, hostname.c_str());
+
+    MySqlResultSetPtr res = stmt->query();
     if (!res->next()) {
         NOVA_LOG_ERROR("Could not find a user named %s@%s", username.c_str(), hostname.c_str());
         throw MySqlGuestException(MySqlGuestException::USER_NOT_FOUND);
@@ -234,24 +385,11 @@ MySqlUserPtr MySqlAdmin::find_user(const std::string & username, const std::stri
     user->set_name(res->get_string(0).get());
     user->set_host(res->get_string(1).get());
     user->set_password(res->get_string(2).get());
+    res->close();
 
-    // Get the list of users and their associated databases
-    MySqlResultSetPtr userDbRes = con->query(
-                "SELECT grantee, table_schema "
-                "FROM information_schema.SCHEMA_PRIVILEGES "
-                "WHERE privilege_type != 'USAGE' "
-                "GROUP BY grantee, table_schema;");
-    while(userDbRes->next()) {
-        string found_username = extract_user(userDbRes->get_string(0).get());
-        string found_hostname = extract_host(userDbRes->get_string(0).get());
-        if ((found_username == username) && (found_hostname == hostname)) {
-            MySqlDatabasePtr database(new MySqlDatabase());
-            database->set_name(userDbRes->get_string(1).get());
-            user->get_databases()->push_back(database);
-        }
-    }
-    userDbRes->close();
-
+    UserMap user_map;
+    user_map[user->get_name() + "@" + user->get_host()] = user;
+    attach_databases(*con, user_map);
     return user;
 }
 
@@ -261,6 +399,7 @@ void MySqlAdmin::grant_access(const std::string & user_name, const std::string &
         con->grant_privileges("ALL", db->get_name().c_str(), user->get_name().c_str(), user->get_host().c_str());
     }
     con->flush_privileges();
+    forget_user_databases();
 }
 
 boost::tuple<MySqlDatabaseListPtr, boost::optional<string> >
@@ -270,6 +409,8 @@ MySqlAdmin::list_databases(unsigned int limit, optional<string> marker,
     if (limit == 0) {
         throw MySqlGuestException(MySqlGuestException::INVALID_ZERO_LIMIT);
     }
+    // Only the text differs between the three marker cases, so each one is
+    // prepared once per connection.
     stringstream query;
     query << "   SELECT"
         "            schema_name as name,"
@@ -281,20 +422,22 @@ MySqlAdmin::list_databases(unsigned int limit, optional<string> marker,
         "            schema_name not in"
         "            ('mysql', 'information_schema', 'lost+found')";
     if (marker) {
-        query << "\n AND schema_name ";
-        if (include_marker) {
-            query << " >= ";
-        } else {
-            query << " > ";
-        }
-        query << "'" << con->escape_string(marker.get().c_str()) << "'";
+        query << "\n AND schema_name " << (include_marker ? ">=" : ">")
+              << " ?";
     }
     query <<
         "        ORDER BY"
         "            schema_name ASC"
-        "        LIMIT " << limit + 1;
+        "        LIMIT ?";
 
-    MySqlResultSetPtr res = con->query(query.str().c_str());
+    MySqlPreparedStatementPtr stmt
+        = con->prepare_cached_statement(query.str().c_str());
+    int index = 0;
+    if (marker) {
+        stmt->set_string(index ++, marker.get().c_str());
+    }
+    stmt->set_int(index, rows_to_fetch(limit));
+    MySqlResultSetPtr res = stmt->query(result_mode_for_limit(limit));
 
     MySqlDatabaseListPtr databases(new MySqlDatabaseList());
     MySqlDatabasePtr database;
@@ -332,17 +475,18 @@ MySqlAdmin::list_users(unsigned int limit, optional<string> marker,
              " FROM mysql.user) as innerquery"
              " WHERE host != 'localhost'";
     if (marker) {
-        query << " AND Marker ";
-        if (include_marker) {
-            query << " >= ";
-        } else {
-            query << " > ";
-        }
-        query << "'" << con->escape_string(marker.get().c_str()) << "'";
+        query << " AND Marker " << (include_marker ? ">=" : ">") << " ?";
     }
-    query << " ORDER BY Marker ASC LIMIT " << limit + 1;
+    query << " ORDER BY Marker ASC LIMIT ?";
 
-    MySqlResultSetPtr res = con->query(query.str().c_str());
+    MySqlPreparedStatementPtr stmt
+        = con->prepare_cached_statement(query.str().c_str());
+    int index = 0;
+    if (marker) {
+        stmt->set_string(index ++, marker.get().c_str());
+    }
+    stmt->set_int(index, rows_to_fetch(limit));
+    MySqlResultSetPtr res = stmt->query(result_mode_for_limit(limit));
     MySqlUserListPtr users(new MySqlUserList());
     MySqlUserPtr user;
     optional<string> next_marker(boost::none);
@@ -363,23 +507,8 @@ MySqlAdmin::list_users(unsigned int limit, optional<string> marker,
     }
     res->close();
 
-    // Get the list of users and their associated databases
-    MySqlResultSetPtr userDbRes = con->query(
-                "SELECT grantee, table_schema from information_schema.SCHEMA_PRIVILEGES "
-                "WHERE privilege_type != 'USAGE' "
-                "GROUP BY grantee, table_schema;");
-    while(userDbRes->next()) {
-        string username = extract_user(userDbRes->get_string(0).get());
-        string hostname = extract_host(userDbRes->get_string(0).get());
-        string mapkey = username + "@" + hostname;
-        if (user_map.find(mapkey) != user_map.end()) {
-            MySqlUserPtr & user = user_map[mapkey];
-            MySqlDatabasePtr database(new MySqlDatabase());
-            database->set_name(userDbRes->get_string(1).get());
-            user->get_databases()->push_back(database);
-        }
-    }
-    userDbRes->close();
+    // Get the databases for just this page of users.
+    attach_databases(*con, user_map);
 
     return boost::make_tuple(users, next_marker);
 }
@@ -403,10 +532,11 @@ void MySqlAdmin::revoke_access(const std::string & user_name, const std::string
     MySqlUserPtr user = find_user(user_name, host_name);
     con->revoke_privileges("ALL", database_name.c_str(), user_name.c_str(), host_name.c_str());
     con->flush_privileges();
+    forget_user_databases();
 }
 
 void MySqlAdmin::set_password(const char * username, const char * hostname, const char * password) {
-    MySqlPreparedStatementPtr stmt = con->prepare_statement(
+    MySqlPreparedStatementPtr stmt = con->prepare_cached_statement(
        "UPDATE mysql.user SET Password=PASSWORD(?) WHERE User=? AND Host=?");
     stmt->set_string(0, password);
     stmt->set_string(1, username);
@@ -14,8 +14,6 @@
 
 namespace nova { namespace guest { namespace mysql {
 
-    std::string extract_user(const std::string & user);
-    std::string extract_host(const std::string & user);
     std::string generate_password();
 
     typedef boost::variant<boost::blank, bool, int, double, std::string>
@@ -80,6 +78,10 @@ namespace nova { namespace guest { namespace mysql {
             MySqlAdmin(const MySqlAdmin & other);
             MySqlAdmin & operator = (const MySqlAdmin &);
 
+            void add_create_user_statements(
+                std::vector<std::string> & statements, MySqlUserPtr user,
+                const char * const grant_stuff);
+
             nova::db::mysql::MySqlConnectionPtr con;
     };
 
@@ -10,6 +10,7 @@
 #include "nova/guest/mysql/MySqlGuestException.h"
 #include <boost/optional.hpp>
 #include "nova/process.h"
+#include "nova/process_helper.h"
 #include "nova/rpc/sender.h"
 #include "nova/utils/regex.h"
 #include <boost/thread.hpp>
@@ -21,6 +22,8 @@ using namespace boost::assign; // brings CommandList += into our code.
 using nova::datastores::DatastoreStatus;
 using boost::format;
 using nova::json_obj;
+using nova::db::mysql::MySqlConnection;
+using nova::db::mysql::MySqlConnectionPool;
 using nova::db::mysql::MySqlConnectionWithDefaultDb;
 using nova::db::mysql::MySqlConnectionWithDefaultDbPtr;
 using nova::db::mysql::MySqlException;
@@ -43,7 +46,14 @@ namespace nova { namespace guest { namespace mysql {
 
 MySqlAppStatus::MySqlAppStatus(ResilientSenderPtr sender,
                                bool is_mysql_installed)
-:   DatastoreStatus(sender, is_mysql_installed) {
+:   DatastoreStatus(sender, is_mysql_installed),
+    pid_file(boost::none),
+    pid_file_mutex(),
+    // Idle connections have to outlast the time between status checks, and
+    // are always pinged before they're used.
+    pool(new MySqlConnectionPool("localhost",
+                                 MySqlConnectionPool::Options(1, 5, 600,
+                                                              3600, 0))) {
 }
 
 
@@ -55,33 +65,21 @@ DatastoreStatus::Status MySqlAppStatus::determine_actual_status() const {
     // BLOCKED = We can't ping it, but we can see the process running.
     // CRASHED = The process is dead, but left evidence it once existed.
     // SHUTDOWN = The process is dead and never existed or cleaned itself up.
-    std::stringstream out;
-    try {
-        execute(out, list_of("/usr/bin/sudo")("/usr/bin/mysqladmin")("ping"));
+    if (ping()) {
         return RUNNING;
-    } catch(const process::ProcessException & pe) {
-        if (pe.code != process::ProcessException::EXIT_CODE_NOT_ZERO) {
-            throw pe;
-        }
-        try {
-            execute(out, list_of("/usr/bin/sudo")("/bin/ps")("-C")
-                                 ("mysqld")("h"));
-            // TODO(rnirmal): Need to create new statuses for instances where
-            // the mysql service is up, but unresponsive
-            return BLOCKED;
-        } catch(const process::ProcessException & pe) {
-            if (pe.code != process::ProcessException::EXIT_CODE_NOT_ZERO) {
-                throw pe;
-            }
-            // Figure out what the PID file would be if we started.
-            // If it exists, then MySQL crashed.
-            optional<string> pid_file = find_mysql_pid_file();
-            if (!!pid_file && is_file(pid_file.get().c_str())) {
-                return CRASHED;
-            } else {
-                return SHUTDOWN;
-            }
-        }
+    }
+    if (is_mysqld_running()) {
+        // TODO(rnirmal): Need to create new statuses for instances where
+        // the mysql service is up, but unresponsive
+        return BLOCKED;
+    }
+    // Figure out what the PID file would be if we started.
+    // If it exists, then MySQL crashed.
+    optional<string> pid_file = find_mysql_pid_file();
+    if (!!pid_file && is_file(pid_file.get().c_str())) {
+        return CRASHED;
+    } else {
+        return SHUTDOWN;
     }
 }
 
@@ -89,18 +87,52 @@ DatastoreStatus::Status MySqlAppStatus::determine_actual_status() const {
 // By defining these the tests can mock out the dependencies.
 void MySqlAppStatus::execute(stringstream & out,
                                     const process::CommandList & cmds) const {
-    process::execute(out, cmds);
+    process::execute_privileged(out, cmds);
 }
 
 bool MySqlAppStatus::is_file(const char * file_path) const {
     return io::is_file(file_path);
 }
 
+bool MySqlAppStatus::is_mysqld_running() const {
+    return !process::find_pids("mysqld").empty();
+}
+
+bool MySqlAppStatus::ping() const {
+    try {
+        // The pool pings the idle connection, or opens a new one if that
+        // fails.
+        pool->borrow();
+        return true;
+    } catch(const MySqlException & mse) {
+        NOVA_LOG_DEBUG("Could not ping MySQL: %s", mse.what());
+    }
+    // Our credentials may not be in place yet. mysqladmin runs as root and
+    // also treats "access denied" as alive, so ask it, but only if there's
+    // a server to ask.
+    if (!is_mysqld_running()) {
+        return false;
+    }
+    std::stringstream out;
+    try {
+        execute(out, list_of("/usr/bin/mysqladmin")("ping"));
+        return true;
+    } catch(const process::ProcessException & pe) {
+        if (pe.code != process::ProcessException::EXIT_CODE_NOT_ZERO) {
+            throw pe;
+        }
+        return false;
+    }
+}
+
 optional<string> MySqlAppStatus::find_mysql_pid_file() const {
+    boost::lock_guard<boost::mutex> lock(pid_file_mutex);
+    if (pid_file) {
+        return pid_file;
+    }
     stringstream out;
     try {
-        execute(out, list_of("/usr/bin/sudo")("/usr/sbin/mysqld")
-                            ("--print-defaults"));
+        execute(out, list_of("/usr/sbin/mysqld")("--print-defaults"));
     } catch(const process::ProcessException & pe) {
         NOVA_LOG_ERROR("Error running mysqld --print-defaults! %s", pe.what());
         return boost::none;
@@ -113,8 +145,9 @@ optional<string> MySqlAppStatus::find_mysql_pid_file() const {
         NOVA_LOG_ERROR(out.str().c_str())
         return boost::none;
     }
-    optional<string> rtn(matches->get(1));
-    return rtn;
+    // Failures aren't remembered, so they're tried again next time.
+    pid_file = matches->get(1);
+    return pid_file;
 }
 
 } } } // end nova::guest::mysql
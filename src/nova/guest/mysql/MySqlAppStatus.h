@@ -25,12 +25,30 @@ namespace nova { namespace guest { namespace mysql {
         protected:
             virtual Status determine_actual_status() const;
 
+            /* Runs a command as root (without a leading sudo). */
             virtual void execute(std::stringstream & out,
                                  const std::list<std::string> & cmds) const;
 
+            /* Asks mysqld the first time, then remembers the answer. */
             boost::optional<std::string> find_mysql_pid_file() const;
 
             virtual bool is_file(const char * file_path) const;
+
+            /* Looks for mysqld in /proc rather than running ps. */
+            virtual bool is_mysqld_running() const;
+
+            /* Pings MySQL over a connection kept open between checks,
+             * rather than running mysqladmin. */
+            virtual bool ping() const;
+
+        private:
+            mutable boost::optional<std::string> pid_file;
+
+            mutable boost::mutex pid_file_mutex;
+
+            // Holds the one connection used to ping, so each status check
+            // is a round trip instead of a new login.
+            nova::db::mysql::MySqlConnectionPoolPtr pool;
     };
 
     typedef boost::shared_ptr<MySqlAppStatus> MySqlAppStatusPtr;
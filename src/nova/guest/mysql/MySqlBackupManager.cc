@@ -23,10 +23,14 @@ using namespace boost::assign;
 using nova::backup::BackupCreationArgs;
 using nova::backup::BackupJob;
 using nova::backup::BackupManagerInfo;
+using nova::backup::BackupProgress;
 using nova::backup::BackupRunnerData;
 using nova::process::CommandList;
+using nova::process::create_cgroup;
+using nova::process::in_cgroup;
 using nova::process::IndependentStdErrAndStdOut;
 using nova::process::Process;
+using nova::process::TransientCgroupPtr;
 using std::string;
 using namespace boost;
 using namespace std;
@@ -35,7 +39,6 @@ using nova::utils::CurlScope;
 using nova::guest::utils::IsoDateTime;
 using nova::guest::diagnostics::Interrogator;
 using nova::utils::Job;
-using nova::utils::JobRunner;
 using nova::utils::swift::SwiftClient;
 using nova::utils::swift::SwiftFileInfo;
 using nova::utils::swift::SwiftUploader;
@@ -93,15 +96,19 @@ class CabooseChecker {
 class XtraBackupReader : public zlib::InputStream {
 public:
     XtraBackupReader(CommandList cmds, size_t zlib_buffer_size,
-        optional<double> time_out)
+        optional<double> time_out, BackupProgress & progress)
     :   buffer(new char [zlib_buffer_size]),
         last_stdout_write_length(0),
         process(cmds),
+        progress(progress),
         zlib_buffer_size(zlib_buffer_size),
         time_out(time_out),
         xtrabackup_log()
     {
         xtrabackup_log.open("/tmp/xtrabackup.log");
+        // Let xtrabackup fill up as much of the buffer as it can between
+        // reads instead of stalling every 64k on the default pipe size.
+        process.set_std_out_capacity(zlib_buffer_size);
     }
 
     virtual ~XtraBackupReader() {
@@ -112,6 +119,9 @@ public:
     virtual zlib::ZlibBufferStatus advance() {
         optional<zlib::InputStream> stdout;
         while(true) {
+            // If the backup was cancelled this throws, and closing the pipes
+            // takes xtrabackup down with it.
+            progress.update();
             if (process.is_finished()) {
                 return zlib::FINISHED;
             }
@@ -123,6 +133,7 @@ public:
                 xtrabackup_log.write(buffer, result.write_length);
             } else if (result.out()) {
                 last_stdout_write_length = result.write_length;
+                progress.add_read(result.write_length);
                 return zlib::OK;
             } else {
                 if (result.time_out()) {
@@ -152,6 +163,7 @@ private:
     CabooseChecker caboose;
     size_t last_stdout_write_length;
     Process<IndependentStdErrAndStdOut> process;
+    BackupProgress & progress;
     size_t zlib_buffer_size;
     optional<double> time_out;
     std::ofstream xtrabackup_log;
@@ -164,9 +176,12 @@ typedef boost::shared_ptr<XtraBackupReader> XtraBackupReaderPtr;
 class BackupProcessReader : public SwiftUploader::Input {
 public:
 
-    BackupProcessReader(CommandList cmds, size_t zlib_buffer_size, optional<double> time_out)
-    :   process(new XtraBackupReader(cmds, zlib_buffer_size, time_out)),
-        compressor()
+    BackupProcessReader(CommandList cmds, size_t zlib_buffer_size,
+                        optional<double> time_out, BackupProgress & progress)
+    :   process(new XtraBackupReader(cmds, zlib_buffer_size, time_out,
+                                     progress)),
+        compressor(),
+        progress(progress)
     {
     }
 
@@ -182,13 +197,16 @@ public:
     }
 
     virtual size_t read(char * buffer, size_t bytes) {
-        return compressor.run_write_into(process, buffer, bytes);
+        const size_t count = compressor.run_write_into(process, buffer, bytes);
+        progress.add_compressed(count);
+        return count;
     }
 
 private:
 
     XtraBackupReaderPtr process;
     zlib::ZlibCompressor compressor;
+    BackupProgress & progress;
 };
 
 
@@ -212,7 +230,7 @@ public:
     // Copy constructor is designed mainly so we can pass instances
     // from one thread to another.
     XtraBackupJob(const XtraBackupJob & other)
-    :   BackupJob(other.data, other.args),
+    :   BackupJob(other),
         commands(other.commands),
         zlib_buffer_size(other.zlib_buffer_size) {
     }
@@ -221,6 +239,7 @@ public:
     }
 
     virtual void operator()() {
+        LogContextScope backup_context("backup_id", args.id);
         NOVA_LOG_INFO("Starting backup...");
         try {
             // Start process
@@ -254,12 +273,16 @@ private:
     const int zlib_buffer_size;
 
     void dump() {
-        CommandList cmds;
-        BackupProcessReader reader(commands, zlib_buffer_size, data.time_out);
+        // Declared first so it's removed after the process has exited.
+        const TransientCgroupPtr cgroup = create_cgroup(data.cgroup, "backup");
+        BackupProgress progress(*this, data.progress_interval);
+        BackupProcessReader reader(in_cgroup(cgroup, commands),
+                                   zlib_buffer_size, data.time_out, progress);
 
         // Setup SwiftClient
         SwiftUploader writer(args.token, data.segment_max_size, file_info,
                              data.checksum_wait_time);
+        progress.set_uploader(&writer);
 
         update_trove_to_building();
 
@@ -308,7 +331,7 @@ void MySqlBackupManager::run_backup(const BackupCreationArgs & args) {
     #endif
 
     XtraBackupJob job(data, commands, zlib_buffer_size, args);
-    runner.run(job);
+    start_job(args.id, job);
 }
 
 
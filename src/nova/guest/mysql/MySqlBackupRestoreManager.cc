@@ -48,7 +48,8 @@ class MySqlBackupRestoreManager::BackupRestoreJob {
 public:
     BackupRestoreJob(const MySqlBackupRestoreManager & manager,
                      const BackupRestoreInfo & info)
-    :   info(info),
+    :   cgroup(),
+        info(info),
         manager(manager)
     {
     }
@@ -56,6 +57,7 @@ public:
     void execute() {
         NOVA_LOG_DEBUG("Cleaning up some files in MySQL install direcotry...");
         clean_existing_files();
+        cgroup = create_cgroup(manager.cgroup, "restore");
         NOVA_LOG_DEBUG("Extracting backup...");
         extract_backup();
         NOVA_LOG_DEBUG("Preparing the backup with the database...");
@@ -64,6 +66,7 @@ public:
     }
 
 private:
+    TransientCgroupPtr cgroup;
     const BackupRestoreInfo & info;
     const MySqlBackupRestoreManager & manager;
 
@@ -148,7 +151,7 @@ private:
         CommandList cmds = list_of("/usr/bin/sudo")("-E")
                                   ("/usr/bin/xbstream")("-x")("-C")
                                   (manager.restore_directory.c_str());
-        Process<StdIn, StdErrToLogFile> xbstream_proc(cmds);
+        Process<StdIn, StdErrToLogFile> xbstream_proc(in_cgroup(cgroup, cmds));
 
         {
             zlib::ZlibDecompressor decompressor;
@@ -189,7 +192,7 @@ private:
         CommandList cmds = list_of("/usr/bin/sudo")("-E")
             ("/usr/bin/innobackupex")("--apply-log")(mysqldir)
             (default_file.c_str())("--ibbackup")("xtrabackup");
-        Process<StdErrToLogFile> innobackupex_proc(cmds);
+        Process<StdErrToLogFile> innobackupex_proc(in_cgroup(cgroup, cmds));
         innobackupex_proc.wait_forever_for_exit();
         if (!innobackupex_proc.successful()) {
             NOVA_LOG_ERROR("Error running restore innobackupex process!");
@@ -223,8 +226,10 @@ MySqlBackupRestoreManager::MySqlBackupRestoreManager(
     const std::string & delete_file_pattern,
     const std::string & restore_directory,
     const std::string & save_file_pattern,
-    const size_t zlib_buffer_size)
+    const size_t zlib_buffer_size,
+    const CgroupConfig & cgroup)
 :   BackupRestoreManager(),
+    cgroup(cgroup),
     commands(command_list),
     delete_file_pattern(delete_file_pattern.c_str()),
     restore_directory(restore_directory),
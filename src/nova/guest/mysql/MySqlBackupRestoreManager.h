@@ -3,6 +3,7 @@
 
 #include "nova/backup/BackupRestore.h"
 #include "nova/process.h"
+#include "nova/process_cgroup.h"
 #include "nova/utils/regex.h"
 #include <boost/shared_ptr.hpp>
 #include <string>
@@ -16,7 +17,8 @@ namespace nova { namespace guest { namespace mysql {
                                  const std::string & delete_file_pattern,
                                  const std::string & restore_directory,
                                  const std::string & save_file_pattern,
-                                 const size_t zlib_buffer_size);
+                                 const size_t zlib_buffer_size,
+                                 const nova::process::CgroupConfig & cgroup);
 
             template<typename Flags>
             static nova::backup::BackupRestoreManagerPtr from_flags(
@@ -28,7 +30,10 @@ namespace nova { namespace guest { namespace mysql {
                         flags.backup_restore_delete_file_pattern(),
                         flags.backup_restore_restore_directory(),
                         flags.backup_restore_save_file_pattern(),
-                        flags.backup_restore_zlib_buffer_size()
+                        flags.backup_restore_zlib_buffer_size(),
+                        nova::process::CgroupConfig(
+                            flags.cgroup_parent(),
+                            flags.restore_cgroup_limits())
                     ));
                 return ptr;
             }
@@ -38,6 +43,7 @@ namespace nova { namespace guest { namespace mysql {
         private:
             class BackupRestoreJob;
 
+            const nova::process::CgroupConfig cgroup;
             const nova::process::CommandList commands;
             const nova::utils::Regex delete_file_pattern;
             const std::string restore_directory;
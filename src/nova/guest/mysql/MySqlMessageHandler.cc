@@ -48,6 +48,8 @@ namespace nova { namespace guest { namespace mysql {
 
 namespace {
 
+    MySqlConnectionPool * local_pool = 0;
+
 }
 
 
@@ -470,12 +472,33 @@ JsonDataPtr MySqlMessageHandler::handle_message(const GuestInput & input) {
 
 MySqlAdminPtr MySqlMessageHandler::sql_admin() {
     // Creates a connection from local host with values coming from my.cnf.
-    MySqlConnectionPtr connection(new MySqlConnection("localhost"));
+    MySqlConnectionPtr connection;
+    if (local_pool) {
+        connection = local_pool->borrow();
+    } else {
+        connection.reset(new MySqlConnection("localhost"));
+    }
     MySqlAdminPtr ptr(new MySqlAdmin(connection));
     return ptr;
 }
 
 
+/**---------------------------------------------------------------------------
+ *- MySqlLocalPoolScope
+ *---------------------------------------------------------------------------*/
+
+MySqlLocalPoolScope::MySqlLocalPoolScope(
+    const MySqlConnectionPool::Options & options)
+{
+    local_pool = new MySqlConnectionPool("localhost", options);
+}
+
+MySqlLocalPoolScope::~MySqlLocalPoolScope() {
+    delete local_pool;
+    local_pool = 0;
+}
+
+
 
 /**---------------------------------------------------------------------------
  *- MySqlAppMessageHandler
@@ -3,6 +3,7 @@
 
 #include "nova/guest/guest.h"
 #include <map>
+#include "nova/db/mysql.h"
 #include "nova/guest/mysql/MySqlAdmin.h"
 #include "nova/guest/mysql/MySqlAppStatus.h"
 #include "nova/guest/mysql/MySqlApp.h"
@@ -14,6 +15,18 @@
 
 namespace nova { namespace guest { namespace mysql {
 
+    /** While one of these exists, sql_admin() borrows connections to the
+     *  local server from a pool instead of opening a new one every call.
+     *  Create it after the MySqlApiScope so it's destroyed first. */
+    class MySqlLocalPoolScope : boost::noncopyable {
+        public:
+            MySqlLocalPoolScope(
+                const nova::db::mysql::MySqlConnectionPool::Options & options
+                    = nova::db::mysql::MySqlConnectionPool::Options::defaults());
+
+            ~MySqlLocalPoolScope();
+    };
+
 
     //TODO(tim.simpson): This should probably be called MySqlGuest.
     class MySqlMessageHandler : public MessageHandler {
@@ -123,4 +123,8 @@ std::string Config::get_log_file() {
     return _get_string_value(LOG_FILE);
 }
 
+std::string Config::get_unix_socket() {
+    return _get_string_value(UNIX_SOCKET);
+}
+
 }}//end nova::redis
@@ -47,6 +47,8 @@ class Config
 
         std::string get_append_filename();
 
+        std::string get_unix_socket();
+
 
 };
 
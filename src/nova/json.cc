@@ -1,5 +1,6 @@
 #include "pch.hpp"
 #include "nova/json.h"
+#include "nova/json_escape.h"
 #include <json/json.h>
 using boost::lexical_cast;
 using boost::optional;
@@ -145,7 +146,9 @@ const char * JsonException::what() const throw() {
  *---------------------------------------------------------------------------*/
 
 std::string json_string(const char * text) {
-    return JsonData::from_string(text)->to_string();
+    std::string result;
+    json_append_string(result, text);
+    return result;
 }
 
 
@@ -47,6 +47,14 @@ namespace nova {
                 add_unescaped_value(value);
             }
 
+            void add_value(const long long value) {
+                add_unescaped_value(value);
+            }
+
+            void add_value(const unsigned long long value) {
+                add_unescaped_value(value);
+            }
+
             void add_value(const float value) {
                 add_unescaped_value(value);
             }
@@ -0,0 +1,63 @@
+#include "pch.hpp"
+#include "nova/json_escape.h"
+
+using std::string;
+
+namespace nova {
+
+namespace {
+
+    const char * const HEX_DIGITS = "0123456789abcdef";
+
+    /* Returns what follows the backslash for characters with a short escape,
+     * 'u' for other control characters or 0 if it can be copied as is. */
+    inline char escape_for(unsigned char c) {
+        switch(c) {
+            case '"':
+                return '"';
+            case '\\':
+                return '\\';
+            case '\b':
+                return 'b';
+            case '\f':
+                return 'f';
+            case '\n':
+                return 'n';
+            case '\r':
+                return 'r';
+            case '\t':
+                return 't';
+            default:
+                return c < 0x20 ? 'u' : 0;
+        }
+    }
+
+}  // end anonymous namespace
+
+
+void json_append_string(string & out, const char * text, size_t length) {
+    out.reserve(out.size() + length + 2);
+    out.push_back('"');
+    size_t start = 0;
+    for (size_t i = 0; i < length; i ++) {
+        const unsigned char c = (unsigned char) text[i];
+        const char escape = escape_for(c);
+        if (escape == 0) {
+            continue;
+        }
+        // Copy runs of plain characters in one go.
+        out.append(text + start, i - start);
+        out.push_back('\\');
+        out.push_back(escape);
+        if (escape == 'u') {
+            out.append("00");
+            out.push_back(HEX_DIGITS[c >> 4]);
+            out.push_back(HEX_DIGITS[c & 0xf]);
+        }
+        start = i + 1;
+    }
+    out.append(text + start, length - start);
+    out.push_back('"');
+}
+
+}  // end namespace nova
@@ -0,0 +1,21 @@
+#ifndef __NOVA_JSON_ESCAPE_H
+#define __NOVA_JSON_ESCAPE_H
+
+#include <string>
+#include <string.h>
+
+namespace nova {
+
+    /** Appends text to "out" as a quoted JSON string. Unlike json_string
+     *  this doesn't need json-c or allocate anything beyond what "out"
+     *  grows by, which is why the log uses it. */
+    void json_append_string(std::string & out, const char * text,
+                            size_t length);
+
+    inline void json_append_string(std::string & out, const char * text) {
+        json_append_string(out, text, strlen(text));
+    }
+
+}
+
+#endif
@@ -5,17 +5,20 @@
 #include <errno.h>
 #include <fcntl.h> // Consider moving to io.cc and using there.
 #include <boost/foreach.hpp>
+#include <boost/format.hpp>
+#include <dirent.h>
 #include <fstream>
 #include "nova/utils/io.h"
 #include <iostream>
 #include <malloc.h>  // Valgrind complains if we don't use "free" below. ;_;
+#include <poll.h>
 #include <signal.h>
-#include <sys/select.h>
 #include <spawn.h>
 #include <sstream>
 #include <stdio.h>
 #include <stdlib.h> // exit
 #include <string.h>
+#include <sys/socket.h>
 #include <time.h>
 #include <unistd.h>
 #include <sys/types.h>
@@ -58,48 +61,28 @@ namespace {
     }
 
 
-    /** Translates a CommandList to the type requried by posix_spawn. */
-    class ArgV : private boost::noncopyable
-    {
-        public:
-            ArgV(const CommandList & cmds)
-            :   new_argv_length(cmds.size() + 1),
-                new_argv(new char * [new_argv_length])
-            {
-                size_t i = 0;
-                BOOST_FOREACH(const string & cmd, cmds) {
-                    new_argv[i ++] = strndup(cmd.c_str(), cmd.size());
-                }
-                new_argv[new_argv_length - 1] = NULL;
-            }
-
-            ~ArgV() {
-                for (size_t i = 0; i < new_argv_length; ++i) {
-                    ::free(new_argv[i]);
-                }
-                delete[] new_argv;
-                new_argv = 0;
-            }
-
-            char * * get() {
-                return new_argv;
-            }
-
-        private:
-            const size_t new_argv_length;
-            char * * new_argv;
-    };
-
     const size_t BUFFER_SIZE = 1048;
 
     /** Waits for the given file descriptor to have more data for the given
      *  number of seconds. */
     bool ready(int file_desc, const optional<double> seconds) {
-        fd_set file_set;
-        FD_ZERO(&file_set);
-        FD_SET(file_desc, &file_set);
-        return io::select_with_throw(file_desc + 1, &file_set, NULL, NULL, seconds)
-               != 0;
+        pollfd poll_fd;
+        poll_fd.fd = file_desc;
+        poll_fd.events = POLLIN;
+        poll_fd.revents = 0;
+        return io::poll_with_throw(&poll_fd, 1, seconds) != 0;
+    }
+
+    /* Reads whatever is already sitting in the (non-blocking) file
+     * descriptor. Returns boost::none if nothing is available yet. Trying
+     * this before polling saves a call per chunk when a process is
+     * producing output quickly. */
+    optional<size_t> read_without_waiting(int file_desc, char * buffer,
+                                          const size_t length) {
+        if (Timer::time_out_occurred()) {
+            throw TimeOutException();
+        }
+        return io::read_if_ready(file_desc, buffer, length);
     }
 
     /* If neither file descriptor has input by the time denoted by "seconds",
@@ -107,17 +90,18 @@ namespace {
      * returned. */
     optional<int> ready(int file_desc1, int file_desc2,
                         const optional<double> seconds) {
-        fd_set file_set;
-        FD_ZERO(&file_set);
-        FD_SET(file_desc1, &file_set);
-        FD_SET(file_desc2, &file_set);
-        int nfds = std::max(file_desc1, file_desc2) + 1;
-        auto result = io::select_with_throw(nfds, &file_set, NULL,
-                                            NULL, seconds);
+        pollfd poll_fds[2];
+        poll_fds[0].fd = file_desc1;
+        poll_fds[1].fd = file_desc2;
+        for (int i = 0; i < 2; i ++) {
+            poll_fds[i].events = POLLIN;
+            poll_fds[i].revents = 0;
+        }
+        auto result = io::poll_with_throw(poll_fds, 2, seconds);
         if (0 == result) {
             return boost::none;
         } else {
-            if (FD_ISSET(file_desc1, &file_set)) {
+            if (0 != poll_fds[0].revents) {
                 return file_desc1;
             } else {
                 return file_desc2;
@@ -164,34 +148,122 @@ class SpawnFileActions : private boost::noncopyable
         posix_spawn_file_actions_t file_actions;
 };
 
+/**---------------------------------------------------------------------------
+ *- PreparedCommand
+ *---------------------------------------------------------------------------*/
+
+PreparedCommand::PreparedCommand(const CommandList & cmds)
+:   args(), buffer(), env(), text()
+{
+    pack(cmds, 0);
+}
+
+PreparedCommand::PreparedCommand(const CommandList & cmds,
+                                 const std::list<string> & environment)
+:   args(), buffer(), env(), text()
+{
+    pack(cmds, &environment);
+}
+
+void PreparedCommand::pack(const CommandList & cmds,
+                           const std::list<string> * environment) {
+    if (cmds.size() < 1) {
+        throw ProcessException(ProcessException::NO_PROGRAM_GIVEN);
+    }
+    size_t size = 0;
+    BOOST_FOREACH(const string & cmd, cmds) {
+        size += cmd.size() + 1;
+    }
+    if (environment) {
+        BOOST_FOREACH(const string & var, *environment) {
+            size += var.size() + 1;
+        }
+    }
+    // Fill the buffer first and take pointers after, as it mustn't move.
+    buffer.reserve(size);
+    BOOST_FOREACH(const string & cmd, cmds) {
+        buffer.insert(buffer.end(), cmd.begin(), cmd.end());
+        buffer.push_back('\0');
+    }
+    if (environment) {
+        BOOST_FOREACH(const string & var, *environment) {
+            buffer.insert(buffer.end(), var.begin(), var.end());
+            buffer.push_back('\0');
+        }
+    }
+    char * next = &buffer[0];
+    args.reserve(cmds.size() + 1);
+    for (size_t i = 0; i < cmds.size(); i ++) {
+        args.push_back(next);
+        next += strlen(next) + 1;
+    }
+    args.push_back(NULL);
+    if (environment) {
+        env.reserve(environment->size() + 1);
+        for (size_t i = 0; i < environment->size(); i ++) {
+            env.push_back(next);
+            next += strlen(next) + 1;
+        }
+        env.push_back(NULL);
+    }
+
+    stringstream str;
+    str << "{ ";
+    BOOST_FOREACH(const string & cmd, cmds) {
+        str << "'" << cmd << "' ";
+    }
+    str << "}";
+    text = str.str();
+}
+
+
 namespace {
+
+    /** Holds the spawn attributes, which are the same for every process. */
+    class SpawnAttributes : private boost::noncopyable
+    {
+        public:
+            SpawnAttributes() {
+                checkEqual0(posix_spawnattr_init(&attributes));
+                #ifdef POSIX_SPAWN_USEVFORK
+                    // Older glibc copies the parent's page tables on each
+                    // spawn unless told otherwise, which is costly for a big
+                    // process like ours. Newer ones always use
+                    // clone(CLONE_VM | CLONE_VFORK) and ignore this.
+                    checkEqual0(posix_spawnattr_setflags(&attributes,
+                                                        POSIX_SPAWN_USEVFORK));
+                #endif
+            }
+
+            ~SpawnAttributes() {
+                posix_spawnattr_destroy(&attributes);
+            }
+
+            inline const posix_spawnattr_t * get() const {
+                return &attributes;
+            }
+
+        private:
+            posix_spawnattr_t attributes;
+    };
+
     /* This function really does everything related to "running a process",
      * all the rest of this junk is just for monitoring that process.
      * See "execute_and_abandon" for the simplest possible way to use this. */
-    void spawn_process(const CommandList & cmds, pid_t * pid,
+    void spawn_process(const PreparedCommand & command, pid_t * pid,
                        SpawnFileActions * actions=0)
     {
-        if (cmds.size() < 1) {
-            throw ProcessException(ProcessException::NO_PROGRAM_GIVEN);
-        }
-        const string program_path = cmds.front();
-        ArgV args(cmds);
-        {
-            stringstream str;
-            str << "Running the following process: { ";
-            BOOST_FOREACH(const string & cmd, cmds) {
-                str << "'" << cmd << "'";
-                str << " ";
-            }
-            str << "}";
-            NOVA_LOG_DEBUG(str.str().c_str());
-        }
+        static const SpawnAttributes attributes;
+        NOVA_LOG_DEBUG("Running the following process: %s",
+                       command.description());
         const posix_spawn_file_actions_t * file_actions = NULL;
         if (actions != 0) {
             file_actions = actions->get();
         }
-        int status = posix_spawn(pid, program_path.c_str(), file_actions, NULL,
-                                 args.get(), environ);
+        char * const * envp = command.envp();
+        int status = posix_spawn(pid, command.program_path(), file_actions,
+                                 attributes.get(), command.argv(),
+                                 (envp ? envp : environ));
         if (status != 0) {
             throw ProcessException(ProcessException::SPAWN_FAILURE);
         }
@@ -199,6 +271,154 @@ namespace {
 } // end second anonymous namespace
 
 
+/**---------------------------------------------------------------------------
+ *- LineHandler
+ *---------------------------------------------------------------------------*/
+
+LineHandler::~LineHandler() {
+}
+
+
+/**---------------------------------------------------------------------------
+ *- LineSplitter
+ *---------------------------------------------------------------------------*/
+
+LineSplitter::LineSplitter(LineHandler & handler, size_t max_line_length)
+:   handler(handler),
+    line(),
+    max_line_length(max_line_length)
+{
+}
+
+bool LineSplitter::flush() {
+    if (line.empty()) {
+        return true;
+    }
+    const bool keep_going = handler.on_line(line);
+    line.clear();
+    return keep_going;
+}
+
+bool LineSplitter::write(const char * buffer, size_t length) {
+    const char * const end = buffer + length;
+    while(buffer < end) {
+        const char * newline = reinterpret_cast<const char *>(
+            memchr(buffer, '\n', end - buffer));
+        const char * stop = newline ? newline : end;
+        // Don't let a line without an end eat all the memory.
+        const size_t room = max_line_length - line.size();
+        if ((size_t) (stop - buffer) >= room) {
+            line.append(buffer, room);
+            buffer += room;
+            if (!flush()) {
+                return false;
+            }
+            continue;
+        }
+        line.append(buffer, stop - buffer);
+        if (!newline) {
+            break;
+        }
+        buffer = newline + 1;
+        const bool keep_going = handler.on_line(line);
+        line.clear();
+        if (!keep_going) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+/**---------------------------------------------------------------------------
+ *- OutputTail
+ *---------------------------------------------------------------------------*/
+
+OutputTail::OutputTail(size_t capacity)
+:   buffer(capacity),
+    size(0),
+    start(0)
+{
+}
+
+void OutputTail::append(const char * bytes, size_t length) {
+    const size_t capacity = buffer.size();
+    if (length >= capacity) {
+        bytes += length - capacity;
+        length = capacity;
+    }
+    for (size_t i = 0; i < length; i ++) {
+        buffer[(start + size) % capacity] = bytes[i];
+        if (size < capacity) {
+            ++ size;
+        } else {
+            start = (start + 1) % capacity;
+        }
+    }
+}
+
+bool OutputTail::on_line(const string & line) {
+    if (!buffer.empty()) {
+        append(line.c_str(), line.size());
+        append("\n", 1);
+    }
+    return true;
+}
+
+string OutputTail::str() const {
+    string result;
+    result.reserve(size);
+    for (size_t i = 0; i < size; i ++) {
+        result += buffer[(start + i) % buffer.size()];
+    }
+    // Once the buffer wraps the first line is cut off, so drop it.
+    if (size == buffer.size()) {
+        const size_t newline = result.find('\n');
+        if (newline != string::npos && newline + 1 < result.size()) {
+            result.erase(0, newline + 1);
+        }
+    }
+    return result;
+}
+
+
+/**---------------------------------------------------------------------------
+ *- LineMatcher
+ *---------------------------------------------------------------------------*/
+
+LineMatcher::LineMatcher(const std::vector<string> & patterns)
+:   last_matches(),
+    matched_index(boost::none),
+    regexes()
+{
+    BOOST_FOREACH(const string & pattern, patterns) {
+        regexes.push_back(new Regex(pattern.c_str()));
+    }
+}
+
+LineMatcher::~LineMatcher() {
+    BOOST_FOREACH(Regex * regex, regexes) {
+        delete regex;
+    }
+}
+
+bool LineMatcher::on_line(const string & line) {
+    // Only patterns listed before the best match so far can beat it.
+    const size_t end = matched_index ? matched_index.get() : regexes.size();
+    for (size_t index = 0; index < end; index ++) {
+        RegexMatchesPtr matches = regexes[index]->match(line.c_str());
+        if (matches) {
+            NOVA_LOG_TRACE("Line %s matched pattern %d.", line.c_str(),
+                           (int) index);
+            last_matches = matches;
+            matched_index = index;
+            break;
+        }
+    }
+    return !matched_index || matched_index.get() != 0;
+}
+
+
 /**---------------------------------------------------------------------------
  *- Global Functions
  *---------------------------------------------------------------------------*/
@@ -264,7 +484,7 @@ void execute(std::stringstream & out, const CommandList & cmds,
 
 pid_t execute_and_abandon(const CommandList & cmds) {
     pid_t pid;
-    spawn_process(cmds, &pid);
+    spawn_process(PreparedCommand(cmds), &pid);
     return pid;
 }
 
@@ -291,6 +511,39 @@ bool is_pid_alive(pid_t pid) {
     return result == 0;
 }
 
+std::vector<pid_t> find_pids(const char * program_name) {
+    std::vector<pid_t> pids;
+    DIR * proc = ::opendir("/proc");
+    if (0 == proc) {
+        NOVA_LOG_ERROR("Could not open /proc: %s", strerror(errno));
+        throw ProcessException(ProcessException::GENERAL);
+    }
+    dirent * entry;
+    while(0 != (entry = ::readdir(proc))) {
+        char * end;
+        const long pid = strtol(entry->d_name, &end, 10);
+        if (*end != '\0' || pid <= 0) {
+            continue;  // Not a process.
+        }
+        // The program name is in parenthesis after the pid, and may itself
+        // contain spaces or parenthesis, so look for the last ")".
+        std::ifstream stat_file(str(boost::format("/proc/%d/stat") % pid)
+                                .c_str());
+        string line;
+        if (!std::getline(stat_file, line)) {
+            continue;  // It must have just exited.
+        }
+        const size_t start = line.find('(');
+        const size_t finish = line.rfind(')');
+        if (start != string::npos && finish != string::npos && start < finish
+            && line.compare(start + 1, finish - start - 1, program_name) == 0) {
+            pids.push_back((pid_t) pid);
+        }
+    }
+    ::closedir(proc);
+    return pids;
+}
+
 void shell(const char * const cmds, bool log) {
     if (log) {
         NOVA_LOG_INFO("shell: %s", cmds);
@@ -316,8 +569,14 @@ ProcessException::~ProcessException() throw() {
 
 const char * ProcessException::what() const throw() {
     switch(code) {
+        case CGROUP_ERROR:
+            return "Could not set up a cgroup for the process.";
+        case COMMAND_NOT_ALLOWED:
+            return "The process helper is not allowed to run that command.";
         case EXIT_CODE_NOT_ZERO:
             return "The exit code was not zero.";
+        case HELPER_FAILURE:
+            return "Could not communicate with the process helper.";
         case NO_PROGRAM_GIVEN:
             return "No program to launch was given (first element was null).";
         case PROGRAM_FINISHED:
@@ -417,13 +676,17 @@ void ProcessBase::drain_io_from_file_handlers(optional<double> seconds) {
     }
 }
 
-void ProcessBase::initialize(const CommandList & cmds) { //, ProcessIOList io_list) {
+void ProcessBase::initialize(const CommandList & cmds) {
+    initialize(PreparedCommand(cmds));
+}
+
+void ProcessBase::initialize(const PreparedCommand & command) {
     SpawnFileActions file_actions;
     pre_spawn_stderr_actions(file_actions);
     pre_spawn_stdin_actions(file_actions);
     pre_spawn_stdout_actions(file_actions);
 
-    spawn_process(cmds, &(status_watcher.get_pid()), &file_actions);
+    spawn_process(command, &(status_watcher.get_pid()), &file_actions);
 
     BOOST_FOREACH(ProcessFileHandler * const ptr, io_watchers) {
         ptr->post_spawn_actions();
@@ -567,15 +830,27 @@ IndependentStdErrAndStdOut::ReadResult IndependentStdErrAndStdOut::read_into(
     if (std_out_pipe.in_is_open() != std_err_pipe.in_is_open()) {
         return _read_into(buffer, length, seconds);
     }
-    const auto result = ready(this->std_out_pipe.in(), this->std_err_pipe.in(),
-                              seconds);
-    if (!result) {
-        NOVA_LOG_TRACE("ready returned nothing. Returning TimeOut from read_into");
-        return { ReadResult::TimeOut, 0 };
+    int file_desc = std_out_pipe.in();
+    optional<size_t> count = read_without_waiting(file_desc, buffer, length);
+    if (!count) {
+        const auto result = ready(this->std_out_pipe.in(),
+                                  this->std_err_pipe.in(), seconds);
+        if (!result) {
+            NOVA_LOG_TRACE("ready returned nothing. Returning TimeOut from "
+                           "read_into");
+            return { ReadResult::TimeOut, 0 };
+        }
+        file_desc = result.get();
+        count = read_without_waiting(file_desc, buffer, length);
+    }
+    const ReadResult::FileIndex index =
+        (file_desc == std_out_pipe.in() ? ReadResult::StdOut
+                                        : ReadResult::StdErr);
+    if (!count) {
+        // poll woke us up but the data was gone by the time we got there.
+        return { index, 0 };
     }
-    const int file_desc = result.get();
-    const size_t count = io::read_with_throw(file_desc, buffer, length);
-    if (count == 0) {
+    if (count.get() == 0) {
         // If read returns zero, it means the filedesc is EOF. Set whichever
         // one it was to closed and then use the other _read_into method.
         if (file_desc == std_out_pipe.in()) {
@@ -586,11 +861,7 @@ IndependentStdErrAndStdOut::ReadResult IndependentStdErrAndStdOut::read_into(
         return _read_into(buffer, length, seconds);
     }
     // Data was read, so return info on which stream it came from.
-    return {
-        (file_desc == std_out_pipe.in() ? ReadResult::StdOut
-                                        : ReadResult::StdErr),
-        count
-    };
+    return { index, count.get() };
 }
 
 IndependentStdErrAndStdOut::ReadResult IndependentStdErrAndStdOut::_read_into(
@@ -606,18 +877,29 @@ IndependentStdErrAndStdOut::ReadResult IndependentStdErrAndStdOut::_read_into(
         index = ReadResult::FileIndex::StdErr;
     }
     NOVA_LOG_TRACE("read_into with timeout=%f", !seconds ? 0.0 : seconds.get());
-    if (!ready(filedesc, seconds)) {
-        NOVA_LOG_TRACE("ready returned false, returning zero from read_into");
-        return { ReadResult::TimeOut, 0 };
+    optional<size_t> count = read_without_waiting(filedesc, buffer, length);
+    if (!count) {
+        if (!ready(filedesc, seconds)) {
+            NOVA_LOG_TRACE("ready returned false, returning zero from "
+                           "read_into");
+            return { ReadResult::TimeOut, 0 };
+        }
+        count = read_without_waiting(filedesc, buffer, length);
+        if (!count) {
+            return { index, 0 };
+        }
     }
-    size_t count = io::read_with_throw(filedesc, buffer, length);
-    if (count == 0) {
+    if (count.get() == 0) {
         NOVA_LOG_TRACE("read returned 0, EOF");
         draining = true;  // Avoid re-draining.
         wait_forever_for_exit();
         return { ReadResult::Eof, 0 };
     }
-    return { index, count };
+    return { index, count.get() };
+}
+
+size_t IndependentStdErrAndStdOut::set_std_out_capacity(size_t bytes) {
+    return std_out_pipe.set_capacity(bytes);
 }
 
 /**---------------------------------------------------------------------------
@@ -659,6 +941,14 @@ void StdIn::write(const char * msg) {
 void StdIn::write(const char * msg, size_t length) {
     //::write(std_in_fd[0], msg, length);
     NOVA_LOG_TRACE("Writing msg with %d bytes.", length);
+    if (!!Timer::limit(boost::none)) {
+        // Don't block past the deadline if the process isn't reading.
+        pollfd poll_fd;
+        poll_fd.fd = this->std_in_pipe.out();
+        poll_fd.events = POLLOUT;
+        poll_fd.revents = 0;
+        io::poll_with_throw(&poll_fd, 1, boost::none);
+    }
     ssize_t count = ::write(this->std_in_pipe.out(), msg, length);
     if (count < 0) {
         NOVA_LOG_ERROR("write failed. errno = %d", errno);
@@ -670,6 +960,50 @@ void StdIn::write(const char * msg, size_t length) {
 }
 
 
+/**---------------------------------------------------------------------------
+ *- StdInAndStdOutSocket
+ *---------------------------------------------------------------------------*/
+
+StdInAndStdOutSocket::StdInAndStdOutSocket() {
+    if (0 != ::socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds)) {
+        NOVA_LOG_ERROR("Could not create socket pair: %s", strerror(errno));
+        throw ProcessException(ProcessException::GENERAL);
+    }
+    add_io_handler(this);
+}
+
+StdInAndStdOutSocket::~StdInAndStdOutSocket() {
+    set_eof_actions();
+    if (fds[1] >= 0) {
+        ::close(fds[1]);
+    }
+}
+
+void StdInAndStdOutSocket::post_spawn_actions() {
+    ::close(fds[1]);
+    fds[1] = -1;
+}
+
+void StdInAndStdOutSocket::pre_spawn_stdin_actions(
+    SpawnFileActions & file_actions)
+{
+    file_actions.add_dup_to(fds[1], STDIN_FILENO);
+}
+
+void StdInAndStdOutSocket::pre_spawn_stdout_actions(
+    SpawnFileActions & file_actions)
+{
+    file_actions.add_dup_to(fds[1], STDOUT_FILENO);
+}
+
+void StdInAndStdOutSocket::set_eof_actions() {
+    if (fds[0] >= 0) {
+        ::close(fds[0]);
+        fds[0] = -1;
+    }
+}
+
+
 /**---------------------------------------------------------------------------
  *- StdErr
  *---------------------------------------------------------------------------*/
@@ -760,11 +1094,18 @@ size_t StdErrAndStdOut::read_into(char * buffer, const size_t length,
     if (!std_out_pipe.in_is_open()) {
         throw ProcessException(ProcessException::PROGRAM_FINISHED);
     }
-    if (!ready(this->std_out_pipe.in(), seconds)) {
-        NOVA_LOG_TRACE("ready returned false, returning zero from read_into");
-        return 0;
+    optional<size_t> ready_count = read_without_waiting(
+        this->std_out_pipe.in(), buffer, length);
+    if (!ready_count) {
+        if (!ready(this->std_out_pipe.in(), seconds)) {
+            NOVA_LOG_TRACE("ready returned false, returning zero from "
+                           "read_into");
+            return 0;
+        }
+        ready_count = io::read_with_throw(this->std_out_pipe.in(), buffer,
+                                          length);
     }
-    size_t count = io::read_with_throw(this->std_out_pipe.in(), buffer, length);
+    const size_t count = ready_count.get();
     if (count == 0) {
         NOVA_LOG_TRACE("read returned 0, EOF");
         draining = true;  // Avoid re-draining.
@@ -774,6 +1115,26 @@ size_t StdErrAndStdOut::read_into(char * buffer, const size_t length,
     return (size_t) count;
 }
 
+bool StdErrAndStdOut::read_lines_until_exit(LineHandler & handler,
+                                            double seconds) {
+    NOVA_LOG_TRACE("read_lines_until_exit, timeout=%f", seconds);
+    LineSplitter splitter(handler);
+    char buffer[4096];
+    size_t count;
+    while((count = read_into(buffer, sizeof(buffer),
+                             optional<double>(seconds))) > 0) {
+        if (!splitter.write(buffer, count)) {
+            return false;
+        }
+    }
+    if (std_out_pipe.in_is_open()) {
+        NOVA_LOG_ERROR("Something went wrong, EOF not reached! Time out=%f",
+                       seconds);
+        throw TimeOutException();
+    }
+    return splitter.flush();
+}
+
 void StdErrAndStdOut::read_into_until_exit(stringstream & out,
                                            double seconds) {
     NOVA_LOG_TRACE("wait_for_eof, timeout=%f", seconds);
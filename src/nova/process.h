@@ -6,6 +6,7 @@
 #include <boost/optional.hpp>
 #include "nova/Log.h"
 #include <list>
+#include "nova/utils/regex.h"
 #include <sstream>
 #include <boost/utility.hpp>
 #include <vector>
@@ -48,6 +49,124 @@ namespace nova { namespace process {
 /** Simple list of commands. */
 typedef std::list<std::string> CommandList;
 
+/** A command converted once into the argv (and optionally envp) arrays
+ *  posix_spawn wants, with every string packed into a single buffer. Build
+ *  one of these up front for commands that are run over and over to skip
+ *  the conversion on each launch. */
+class PreparedCommand : boost::noncopyable {
+    public:
+        /** The process inherits the environment current at spawn time. */
+        PreparedCommand(const CommandList & cmds);
+
+        /** The process gets exactly these "NAME=value" strings as its
+         *  environment. */
+        PreparedCommand(const CommandList & cmds,
+                        const std::list<std::string> & environment);
+
+        inline char * const * argv() const {
+            return &args[0];
+        }
+
+        /** The environment to use, or NULL to inherit the current one. */
+        inline char * const * envp() const {
+            return env.empty() ? NULL : &env[0];
+        }
+
+        inline const char * program_path() const {
+            return args[0];
+        }
+
+        /** The command, formatted for log messages. */
+        inline const std::string & description() const {
+            return text;
+        }
+
+    private:
+        std::vector<char *> args;
+        std::vector<char> buffer;
+        std::vector<char *> env;
+        std::string text;
+
+        void pack(const CommandList & cmds,
+                  const std::list<std::string> * environment);
+};
+
+/** Receives a process's output one line at a time. */
+class LineHandler {
+    public:
+        virtual ~LineHandler();
+
+        /** Called with each line, minus the newline. Returning false stops
+         *  the reading early. */
+        virtual bool on_line(const std::string & line) = 0;
+};
+
+/** Cuts a stream of bytes into lines for a LineHandler. Lines longer than
+ *  max_line_length are handed over in pieces so memory stays bounded. */
+class LineSplitter : boost::noncopyable {
+    public:
+        LineSplitter(LineHandler & handler,
+                     size_t max_line_length=64 * 1024);
+
+        /** Hands over anything left over as a final line. Returns false if
+         *  the handler asked to stop. */
+        bool flush();
+
+        /** Returns false if the handler asked to stop. */
+        bool write(const char * buffer, size_t length);
+
+    private:
+        LineHandler & handler;
+        std::string line;
+        const size_t max_line_length;
+};
+
+/** Remembers only the last "capacity" bytes of the lines given to it, which
+ *  is usually what's needed to explain a failure. */
+class OutputTail : public LineHandler, boost::noncopyable {
+    public:
+        OutputTail(size_t capacity=4 * 1024);
+
+        virtual bool on_line(const std::string & line);
+
+        /** The remembered output, oldest first, one line per line. */
+        std::string str() const;
+
+    private:
+        std::vector<char> buffer;
+        size_t size;
+        size_t start;
+
+        void append(const char * bytes, size_t length);
+};
+
+/** Tries the patterns against each line as it arrives, rather than against
+ *  all the output so far. When lines match different patterns the one
+ *  listed first wins, so reading only stops early once the first pattern
+ *  matches. */
+class LineMatcher : public LineHandler, boost::noncopyable {
+    public:
+        LineMatcher(const std::vector<std::string> & patterns);
+
+        ~LineMatcher();
+
+        /** The index of the pattern that matched, if one did. */
+        inline const boost::optional<size_t> & index() const {
+            return matched_index;
+        }
+
+        inline nova::utils::RegexMatchesPtr matches() const {
+            return last_matches;
+        }
+
+        virtual bool on_line(const std::string & line);
+
+    private:
+        nova::utils::RegexMatchesPtr last_matches;
+        boost::optional<size_t> matched_index;
+        std::vector<nova::utils::Regex *> regexes;
+};
+
 /** Executes the given command, waiting until its finished. Throws an
  *  error if the exit code is not zero. */
 void execute(const CommandList & cmds, boost::optional<double> time_out=30);
@@ -81,6 +200,10 @@ void force_kill(pid_t pid);
 /** Returns true if the given pid is alive. */
 bool is_pid_alive(pid_t pid);
 
+/** Returns the pids of every process whose program name (as shown by
+ *  "ps -C") is program_name. Reads /proc directly instead of running ps. */
+std::vector<pid_t> find_pids(const char * program_name);
+
 /** Uses the system call. Throws exception if exit code is not equal to 0. */
 void shell(const char * const cmds, bool log = true);
 
@@ -89,8 +212,11 @@ class ProcessException : public std::exception {
 
     public:
         enum Code {
+            CGROUP_ERROR,
+            COMMAND_NOT_ALLOWED,
             EXIT_CODE_NOT_ZERO,
             GENERAL,
+            HELPER_FAILURE,
             KILL_SIGNAL_ERROR,
             NO_PROGRAM_GIVEN,
             PROGRAM_FINISHED,
@@ -194,6 +320,8 @@ class ProcessBase : private boost::noncopyable {
 
         void initialize(const CommandList & cmds);
 
+        void initialize(const PreparedCommand & command);
+
         virtual void pre_spawn_stderr_actions(SpawnFileActions & sp);
 
         virtual void pre_spawn_stdin_actions(SpawnFileActions & sp);
@@ -219,6 +347,10 @@ class Process : public virtual ProcessBase, public IoClasses... {
             initialize(cmds);
         }
 
+        Process(const PreparedCommand & command) {
+            initialize(command);
+        }
+
         ~Process() {
             destroy();
         }
@@ -263,6 +395,35 @@ class StdIn : public ProcessFileHandler, public virtual ProcessBase {
 };
 
 
+/* Connects the process's STDIN and STDOUT to one end of a Unix socket pair,
+ * for programs which hold a conversation with their parent. The other end is
+ * available from "socket()". */
+class StdInAndStdOutSocket : public ProcessFileHandler,
+                             public virtual ProcessBase {
+    public:
+        StdInAndStdOutSocket();
+
+        virtual ~StdInAndStdOutSocket();
+
+        inline int socket() const {
+            return fds[0];
+        }
+
+    protected:
+
+        virtual void post_spawn_actions();
+
+        virtual void pre_spawn_stdin_actions(SpawnFileActions & sp);
+
+        virtual void pre_spawn_stdout_actions(SpawnFileActions & sp);
+
+        virtual void set_eof_actions();
+
+    private:
+        int fds[2];
+};
+
+
 class StdErrToFile : public ProcessFileHandler, public virtual ProcessBase {
     public:
         StdErrToFile();
@@ -326,6 +487,10 @@ class IndependentStdErrAndStdOut : public ProcessFileHandler,
         ReadResult read_into(char * buffer, const size_t length,
                              boost::optional<double> seconds);
 
+        /* Grows the stdout pipe so the process can write more before it has
+         * to wait on us. Returns the capacity actually granted. */
+        size_t set_std_out_capacity(size_t bytes);
+
         bool std_err_closed() const {
             return !std_err_pipe.in_is_open();
         }
@@ -375,10 +540,16 @@ class StdErrAndStdOut : public ProcessFileHandler, public virtual ProcessBase {
 
         /** Waits for EOF while reading into the given stream. Note that this
          *  can result in a very large stream as all the standard output is
-         *  captured!
+         *  captured! Prefer read_lines_until_exit.
          *  Throws TimeOutException if it doesn't happen. */
         void read_into_until_exit(std::stringstream & out, double seconds);
 
+        /** Waits for EOF, handing each line to "handler" as it arrives so
+         *  memory use stays flat. Returns false if the handler stopped it
+         *  early. Throws TimeOutException if a read takes longer than
+         *  "seconds". */
+        bool read_lines_until_exit(LineHandler & handler, double seconds);
+
         /* Reads from the process's stdout into the string stream until
          * stdout does not have any data for the given number of seconds.
          * Returns the number of bytes read. If end of file is encountered,
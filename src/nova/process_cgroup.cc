@@ -0,0 +1,181 @@
+#include "pch.hpp"
+#include "nova/process_cgroup.h"
+
+#include <boost/foreach.hpp>
+#include <boost/format.hpp>
+#include <errno.h>
+#include <fcntl.h>
+#include "nova/Log.h"
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
+#include <unistd.h>
+
+using boost::optional;
+using std::string;
+
+namespace nova { namespace process {
+
+namespace {
+
+    /* Only these can be set, so a typo in the flags (or something like
+     * "cgroup.procs=1") can't be written into the group. */
+    const char * const ALLOWED_LIMITS[] = {
+        "cpu.max", "cpu.weight", "io.max", "io.weight", "memory.high",
+        "memory.max", 0
+    };
+
+    /* Controllers the limits above need enabled in the parent. */
+    const char * const CONTROLLERS[] = { "+cpu", "+io", "+memory", 0 };
+
+    unsigned long group_count = 0;
+    boost::mutex group_count_mutex;
+
+    bool is_allowed(const string & file) {
+        for (int i = 0; ALLOWED_LIMITS[i] != 0; i ++) {
+            if (file == ALLOWED_LIMITS[i]) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /* Returns errno, or 0 if the whole value was written. */
+    int write_file(const string & path, const string & value) {
+        const int fd = ::open(path.c_str(), O_WRONLY | O_CLOEXEC);
+        if (fd < 0) {
+            return errno;
+        }
+        int result = 0;
+        if (::write(fd, value.c_str(), value.size())
+            != (ssize_t) value.size()) {
+            result = errno;
+        }
+        ::close(fd);
+        return result;
+    }
+
+    string unique_name(const char * name) {
+        unsigned long count;
+        {
+            boost::lock_guard<boost::mutex> lock(group_count_mutex);
+            count = ++ group_count;
+        }
+        return str(boost::format("%s-%d-%d") % name % getpid() % count);
+    }
+
+}  // end anonymous namespace
+
+
+/**---------------------------------------------------------------------------
+ *- CgroupConfig
+ *---------------------------------------------------------------------------*/
+
+CgroupConfig::CgroupConfig(optional<const char *> parent,
+                           const CgroupLimits & limits)
+:   parent(boost::none),
+    limits(limits)
+{
+    if (parent) {
+        this->parent = string(parent.get());
+    }
+}
+
+
+/**---------------------------------------------------------------------------
+ *- TransientCgroup
+ *---------------------------------------------------------------------------*/
+
+TransientCgroup::TransientCgroup(const string & parent, const char * name,
+                                 const CgroupLimits & limits)
+:   path(parent + "/" + unique_name(name))
+{
+    // Enabling controllers fails if they already are or if the parent has
+    // processes of its own; either way the limits below will say if the
+    // ones needed aren't there.
+    for (int i = 0; CONTROLLERS[i] != 0; i ++) {
+        write_file(parent + "/cgroup.subtree_control", CONTROLLERS[i]);
+    }
+    if (::mkdir(path.c_str(), 0755) != 0) {
+        NOVA_LOG_ERROR("Could not create cgroup %s: %s", path.c_str(),
+                       strerror(errno));
+        throw ProcessException(ProcessException::CGROUP_ERROR);
+    }
+    try {
+        BOOST_FOREACH(const string & limit, limits) {
+            write_limit(limit);
+        }
+    } catch(const ProcessException & pe) {
+        remove();
+        throw;
+    }
+    NOVA_LOG_INFO("Created cgroup %s.", path.c_str());
+}
+
+TransientCgroup::~TransientCgroup() {
+    remove();
+}
+
+void TransientCgroup::remove() {
+    // This only works once every process in the group has exited, which is
+    // why the group has to outlive the Process objects using it.
+    if (::rmdir(path.c_str()) != 0) {
+        NOVA_LOG_ERROR("Could not remove cgroup %s: %s", path.c_str(),
+                       strerror(errno));
+    }
+}
+
+CommandList TransientCgroup::wrap(const CommandList & cmds) const {
+    // posix_spawn has no way to start a child in another cgroup, so the
+    // child moves itself there before exec'ing the real program. The paths
+    // are passed as arguments so nothing needs quoting.
+    CommandList wrapped(cmds);
+    wrapped.push_front(path + "/cgroup.procs");
+    wrapped.push_front("echo $$ > \"$0\" && exec \"$@\"");
+    wrapped.push_front("-c");
+    wrapped.push_front("/bin/sh");
+    return wrapped;
+}
+
+void TransientCgroup::write_limit(const string & limit) {
+    const size_t equals = limit.find('=');
+    const string file = limit.substr(0, equals);
+    if (equals == string::npos || !is_allowed(file)) {
+        NOVA_LOG_ERROR("Not a cgroup limit: %s", limit.c_str());
+        throw ProcessException(ProcessException::CGROUP_ERROR);
+    }
+    const int error = write_file(path + "/" + file, limit.substr(equals + 1));
+    if (error != 0) {
+        NOVA_LOG_ERROR("Could not set %s in cgroup %s: %s", limit.c_str(),
+                       path.c_str(), strerror(error));
+        throw ProcessException(ProcessException::CGROUP_ERROR);
+    }
+}
+
+
+/**---------------------------------------------------------------------------
+ *- Global Functions
+ *---------------------------------------------------------------------------*/
+
+TransientCgroupPtr create_cgroup(const CgroupConfig & config,
+                                 const char * job_type) {
+    TransientCgroupPtr group;
+    if (config.parent) {
+        try {
+            group.reset(new TransientCgroup(config.parent.get(), job_type,
+                                            config.limits));
+        } catch(const ProcessException & pe) {
+            NOVA_LOG_ERROR("Running %s without resource limits.", job_type);
+        }
+    }
+    return group;
+}
+
+CommandList in_cgroup(const TransientCgroupPtr & group,
+                      const CommandList & cmds) {
+    return group.get() ? group->wrap(cmds) : cmds;
+}
+
+} }  // end nova::process
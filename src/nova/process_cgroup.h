@@ -0,0 +1,82 @@
+#ifndef __NOVA_PROCESS_CGROUP_H
+#define __NOVA_PROCESS_CGROUP_H
+
+#include <boost/optional.hpp>
+#include "nova/process.h"
+#include <list>
+#include <memory>
+#include <string>
+#include <boost/utility.hpp>
+
+/**
+ *  Backup and restore programs used to run with nothing stopping them from
+ *  taking all the CPU, disk bandwidth and page cache away from the datastore
+ *  they were copying. These classes start them inside a cgroup v2 group
+ *  with limits such as io.max, io.weight, cpu.max and memory.high.
+ */
+namespace nova { namespace process {
+
+
+/** Limits to write into a group, each as "file=value", for example
+ *  "cpu.max=50000 100000", "io.weight=50" or "memory.high=1G". */
+typedef std::list<std::string> CgroupLimits;
+
+
+/** Where groups for one kind of job go and what limits they get. If parent
+ *  isn't set, the jobs run without a group. */
+struct CgroupConfig {
+    boost::optional<std::string> parent;
+    CgroupLimits limits;
+
+    CgroupConfig(boost::optional<const char *> parent,
+                 const CgroupLimits & limits);
+};
+
+
+/** A cgroup v2 group which is removed when this object is destroyed, so it
+ *  must outlive any Process started in it. */
+class TransientCgroup : boost::noncopyable {
+    public:
+        /** Creates a uniquely named group under "parent", which must be a
+         *  cgroup v2 directory the agent can write to (for example one
+         *  delegated by systemd), and writes the limits into it. Throws
+         *  ProcessException with the code CGROUP_ERROR if anything fails. */
+        TransientCgroup(const std::string & parent, const char * name,
+                        const CgroupLimits & limits);
+
+        ~TransientCgroup();
+
+        inline const std::string & get_path() const {
+            return path;
+        }
+
+        /** Returns a command which moves itself into this group and then
+         *  execs "cmds", so the program and everything it starts is in the
+         *  group from its first instruction. */
+        CommandList wrap(const CommandList & cmds) const;
+
+    private:
+        std::string path;
+
+        void remove();
+
+        void write_limit(const std::string & limit);
+};
+
+typedef std::unique_ptr<TransientCgroup> TransientCgroupPtr;
+
+
+/** Creates a group for a job if the config asks for one. Limits are worth
+ *  having but not worth failing the job over, so if the group can't be set
+ *  up this logs why and returns null. */
+TransientCgroupPtr create_cgroup(const CgroupConfig & config,
+                                 const char * job_type);
+
+/** Returns "cmds" wrapped to run in "group", or unchanged if it's null. */
+CommandList in_cgroup(const TransientCgroupPtr & group,
+                      const CommandList & cmds);
+
+
+} }  // end nova::process
+
+#endif
@@ -0,0 +1,329 @@
+#include "pch.hpp"
+#include "nova/process_helper.h"
+
+#include <boost/assign/list_of.hpp>
+#include <boost/foreach.hpp>
+#include <boost/shared_ptr.hpp>
+#include <errno.h>
+#include "nova/Log.h"
+#include <poll.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <vector>
+
+using namespace boost::assign;
+using boost::optional;
+using std::string;
+using std::stringstream;
+using nova::utils::io::TimeOutException;
+using nova::utils::io::Timer;
+
+namespace io = nova::utils::io;
+
+namespace nova { namespace process {
+
+namespace {
+
+    const uint32_t MAX_ARGUMENTS = 256;
+    const uint32_t MAX_ARGUMENT_LENGTH = 64 * 1024;
+    const uint32_t MAX_OUTPUT_LENGTH = 16 * 1024 * 1024;
+
+    typedef boost::shared_ptr<ProcessHelper> ProcessHelperPtr;
+
+    /* The helper set by ProcessHelperScope. Callers copy the pointer while
+     * holding the mutex, so the scope ending doesn't pull the helper out
+     * from under a request that's still running. */
+    boost::mutex & scoped_helper_mutex() {
+        static boost::mutex mutex;
+        return mutex;
+    }
+
+    ProcessHelperPtr & scoped_helper() {
+        static ProcessHelperPtr helper;
+        return helper;
+    }
+
+    ProcessHelperPtr get_scoped_helper() {
+        boost::lock_guard<boost::mutex> lock(scoped_helper_mutex());
+        return scoped_helper();
+    }
+
+    void send_all(int socket, const char * buffer, size_t length) {
+        while(length > 0) {
+            // MSG_NOSIGNAL, as a dead helper shouldn't take us down with it.
+            const ssize_t count = ::send(socket, buffer, length, MSG_NOSIGNAL);
+            if (count < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                NOVA_LOG_ERROR("Error writing to helper socket: %s",
+                               strerror(errno));
+                throw ProcessException(ProcessException::HELPER_FAILURE);
+            }
+            buffer += count;
+            length -= count;
+        }
+    }
+
+    /* Returns false if the other side hung up before sending anything. */
+    bool recv_all(int socket, char * buffer, size_t length) {
+        bool started = false;
+        while(length > 0) {
+            pollfd poll_fd;
+            poll_fd.fd = socket;
+            poll_fd.events = POLLIN;
+            poll_fd.revents = 0;
+            io::poll_with_throw(&poll_fd, 1, boost::none);
+            const ssize_t count = ::recv(socket, buffer, length, 0);
+            if (count < 0) {
+                if (errno == EINTR || errno == EAGAIN) {
+                    continue;
+                }
+                NOVA_LOG_ERROR("Error reading from helper socket: %s",
+                               strerror(errno));
+                throw ProcessException(ProcessException::HELPER_FAILURE);
+            }
+            if (count == 0) {
+                if (!started) {
+                    return false;
+                }
+                NOVA_LOG_ERROR("Helper socket closed mid message.");
+                throw ProcessException(ProcessException::HELPER_FAILURE);
+            }
+            started = true;
+            buffer += count;
+            length -= count;
+        }
+        return true;
+    }
+
+    void append_number(string & message, uint32_t number) {
+        message.append((const char *) &number, sizeof(number));
+    }
+
+    void append_string(string & message, const string & value) {
+        append_number(message, (uint32_t) value.size());
+        message.append(value);
+    }
+
+    bool read_number(int socket, uint32_t & number) {
+        return recv_all(socket, (char *) &number, sizeof(number));
+    }
+
+    string read_string(int socket, uint32_t max_length) {
+        uint32_t length;
+        if (!read_number(socket, length)) {
+            throw ProcessException(ProcessException::HELPER_FAILURE);
+        }
+        if (length > max_length) {
+            NOVA_LOG_ERROR("Helper message of %d bytes is too long.", length);
+            throw ProcessException(ProcessException::HELPER_FAILURE);
+        }
+        std::vector<char> buffer(length);
+        if (length > 0 && !recv_all(socket, &buffer[0], length)) {
+            throw ProcessException(ProcessException::HELPER_FAILURE);
+        }
+        return string(buffer.begin(), buffer.end());
+    }
+
+    /* Runs a single request on the helper's side. */
+    ProcessHelperReply run_request(const CommandList & cmds,
+                                   double time_out,
+                                   const ProcessHelperWhitelist & whitelist,
+                                   stringstream & out) {
+        if (cmds.empty() || whitelist.count(cmds) == 0) {
+            NOVA_LOG_ERROR("Refusing to run %s.",
+                           cmds.empty() ? "nothing" : cmds.front().c_str());
+            return REPLY_NOT_ALLOWED;
+        }
+        try {
+            Process<StdErrAndStdOut> proc(cmds);
+            try {
+                proc.read_into_until_exit(out, time_out);
+            } catch(const TimeOutException & toe) {
+                NOVA_LOG_ERROR("Timed out running %s.", cmds.front().c_str());
+                try {
+                    proc.kill(5, 15);
+                } catch(const std::exception & e) {
+                    NOVA_LOG_ERROR("Could not kill process: %s", e.what());
+                }
+                return REPLY_TIME_OUT;
+            }
+            proc.wait_forever_for_exit();
+            return proc.successful() ? REPLY_SUCCESS
+                                     : REPLY_EXIT_CODE_NOT_ZERO;
+        } catch(const ProcessException & pe) {
+            NOVA_LOG_ERROR("Error running %s: %s", cmds.front().c_str(),
+                           pe.what());
+            return REPLY_SPAWN_FAILURE;
+        }
+    }
+
+}  // end anonymous namespace
+
+
+/**---------------------------------------------------------------------------
+ *- ProcessHelper
+ *---------------------------------------------------------------------------*/
+
+ProcessHelper::ProcessHelper(const CommandList & launch_cmds)
+:   launch_cmds(launch_cmds),
+    mutex(),
+    process()
+{
+}
+
+ProcessHelper::~ProcessHelper() {
+    stop();
+}
+
+void ProcessHelper::execute(stringstream & out, const CommandList & cmds,
+                            double time_out) {
+    string request;
+    append_number(request, (uint32_t) (time_out * 1000));
+    append_number(request, (uint32_t) cmds.size());
+    BOOST_FOREACH(const string & cmd, cmds) {
+        append_string(request, cmd);
+    }
+
+    boost::lock_guard<boost::mutex> lock(mutex);
+    uint32_t reply_code;
+    string output;
+    try {
+        if (!process.get()) {
+            NOVA_LOG_INFO("Starting process helper.");
+            process.reset(new HelperProcess(launch_cmds));
+        }
+        // The helper enforces the time out itself, so this is only here in
+        // case the helper gets stuck.
+        Timer timer(time_out + 10);
+        send_all(process->socket(), request.c_str(), request.size());
+        if (!read_number(process->socket(), reply_code)) {
+            NOVA_LOG_ERROR("Process helper hung up.");
+            throw ProcessException(ProcessException::HELPER_FAILURE);
+        }
+        output = read_string(process->socket(), MAX_OUTPUT_LENGTH);
+    } catch(const TimeOutException & toe) {
+        NOVA_LOG_ERROR("Process helper didn't answer in time.");
+        stop();
+        throw;
+    } catch(const ProcessException & pe) {
+        stop();
+        throw;
+    }
+    out << output;
+    switch(reply_code) {
+        case REPLY_SUCCESS:
+            return;
+        case REPLY_EXIT_CODE_NOT_ZERO:
+            throw ProcessException(ProcessException::EXIT_CODE_NOT_ZERO);
+        case REPLY_TIME_OUT:
+            throw TimeOutException();
+        case REPLY_NOT_ALLOWED:
+            throw ProcessException(ProcessException::COMMAND_NOT_ALLOWED);
+        case REPLY_SPAWN_FAILURE:
+            throw ProcessException(ProcessException::SPAWN_FAILURE);
+        default:
+            NOVA_LOG_ERROR("Unknown reply code %d from helper.", reply_code);
+            stop();
+            throw ProcessException(ProcessException::HELPER_FAILURE);
+    }
+}
+
+void ProcessHelper::stop() {
+    if (process.get()) {
+        // Closing the socket (via eof actions) tells the helper to quit.
+        try {
+            process->wait_for_exit(5);
+        } catch(const std::exception & e) {
+            NOVA_LOG_ERROR("Process helper did not exit: %s", e.what());
+        }
+        process.reset();
+    }
+}
+
+
+/**---------------------------------------------------------------------------
+ *- ProcessHelperScope
+ *---------------------------------------------------------------------------*/
+
+ProcessHelperScope::ProcessHelperScope(optional<const char *> helper_path)
+:   active(false)
+{
+    if (helper_path) {
+        ProcessHelperPtr helper(new ProcessHelper(list_of("/usr/bin/sudo")
+                                                         (helper_path.get())));
+        boost::lock_guard<boost::mutex> lock(scoped_helper_mutex());
+        if (scoped_helper()) {
+            NOVA_LOG_ERROR("A process helper is already in scope.");
+            throw ProcessException(ProcessException::HELPER_FAILURE);
+        }
+        scoped_helper() = helper;
+        active = true;
+    }
+}
+
+ProcessHelperScope::~ProcessHelperScope() {
+    if (active) {
+        boost::lock_guard<boost::mutex> lock(scoped_helper_mutex());
+        scoped_helper().reset();
+    }
+}
+
+
+/**---------------------------------------------------------------------------
+ *- Global Functions
+ *---------------------------------------------------------------------------*/
+
+void execute_privileged(stringstream & out, const CommandList & cmds,
+                        double time_out) {
+    ProcessHelperPtr helper = get_scoped_helper();
+    if (helper) {
+        try {
+            helper->execute(out, cmds, time_out);
+            return;
+        } catch(const ProcessException & pe) {
+            if (pe.code != ProcessException::HELPER_FAILURE) {
+                throw;
+            }
+            NOVA_LOG_ERROR("Running command with sudo instead of helper.");
+        }
+    }
+    CommandList sudo_cmds(cmds);
+    sudo_cmds.push_front("/usr/bin/sudo");
+    execute(out, sudo_cmds, time_out);
+}
+
+void serve_process_helper_requests(int socket,
+                                   const ProcessHelperWhitelist & whitelist) {
+    while(true) {
+        uint32_t time_out_ms;
+        uint32_t count;
+        if (!read_number(socket, time_out_ms)) {
+            NOVA_LOG_INFO("Client hung up, exiting.");
+            return;
+        }
+        if (!read_number(socket, count) || count > MAX_ARGUMENTS) {
+            NOVA_LOG_ERROR("Bad request.");
+            throw ProcessException(ProcessException::HELPER_FAILURE);
+        }
+        CommandList cmds;
+        for (uint32_t i = 0; i < count; i ++) {
+            cmds.push_back(read_string(socket, MAX_ARGUMENT_LENGTH));
+        }
+        stringstream out;
+        const ProcessHelperReply code = run_request(
+            cmds, time_out_ms / 1000.0, whitelist, out);
+        string output = out.str();
+        if (output.size() > MAX_OUTPUT_LENGTH) {
+            output.resize(MAX_OUTPUT_LENGTH);
+        }
+        string reply;
+        append_number(reply, (uint32_t) code);
+        append_string(reply, output);
+        send_all(socket, reply.c_str(), reply.size());
+    }
+}
+
+} }  // end nova::process
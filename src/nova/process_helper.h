@@ -0,0 +1,101 @@
+#ifndef __NOVA_PROCESS_HELPER_H
+#define __NOVA_PROCESS_HELPER_H
+
+#include <boost/optional.hpp>
+#include "nova/process.h"
+#include <memory>
+#include <set>
+#include <sstream>
+#include <string>
+#include <boost/thread/mutex.hpp>
+#include <boost/utility.hpp>
+
+/**
+ *  Commands which are run over and over (like the status checks) each used to
+ *  pay for a fork of the agent plus a run of sudo. Instead, a helper program
+ *  can be started once with sudo and then asked to run whitelisted commands
+ *  over a Unix socket.
+ */
+namespace nova { namespace process {
+
+
+/** Every request and reply is a series of unsigned 32 bit integers and
+ *  strings (a length followed by the bytes). A request is the time out in
+ *  milliseconds, the number of arguments, then the arguments. A reply is one
+ *  of these codes and then the output. */
+enum ProcessHelperReply {
+    REPLY_SUCCESS = 0,
+    REPLY_EXIT_CODE_NOT_ZERO = 1,
+    REPLY_TIME_OUT = 2,
+    REPLY_NOT_ALLOWED = 3,
+    REPLY_SPAWN_FAILURE = 4
+};
+
+
+/** The commands the helper may run. A request must match one of these
+ *  exactly, program and every argument, so the helper can't be talked into
+ *  running a whitelisted program with arguments of the caller's choosing. */
+typedef std::set<CommandList> ProcessHelperWhitelist;
+
+
+/** Client side of the helper. Starts the helper the first time it's needed,
+ *  and again if it dies. Thread safe; requests are handled one at a time. */
+class ProcessHelper : boost::noncopyable {
+    public:
+        /** "launch_cmds" runs the helper, for example
+         *  "/usr/bin/sudo /usr/bin/sneaky-pete-helper". */
+        ProcessHelper(const CommandList & launch_cmds);
+
+        ~ProcessHelper();
+
+        /** Runs the command through the helper and writes its STDOUT and
+         *  STDERR to "out". Like "execute", throws ProcessException if the
+         *  exit code isn't zero and TimeOutException if it runs longer than
+         *  "time_out". Throws ProcessException with the code HELPER_FAILURE
+         *  if the helper can't be reached. */
+        void execute(std::stringstream & out, const CommandList & cmds,
+                     double time_out=30);
+
+    private:
+        typedef Process<StdInAndStdOutSocket> HelperProcess;
+
+        const CommandList launch_cmds;
+        boost::mutex mutex;
+        std::unique_ptr<HelperProcess> process;
+
+        void stop();
+};
+
+
+/** While one of these exists "execute_privileged" uses a ProcessHelper
+ *  launched from helper_path with sudo. If helper_path isn't set, it does
+ *  nothing. Only one may be active at a time. */
+class ProcessHelperScope : boost::noncopyable {
+    public:
+        ProcessHelperScope(boost::optional<const char *> helper_path);
+
+        ~ProcessHelperScope();
+
+    private:
+        bool active;
+};
+
+
+/** Runs a command as root. The command should not begin with sudo; it's
+ *  sent to the helper if there is one, and otherwise run with sudo.
+ *  Throws the same exceptions as "execute". */
+void execute_privileged(std::stringstream & out, const CommandList & cmds,
+                        double time_out=30);
+
+
+/** The helper's side. Reads requests from the socket until it's closed and
+ *  runs the ones found in the whitelist, answering REPLY_NOT_ALLOWED to the
+ *  rest. Throws ProcessException with the code HELPER_FAILURE if a request
+ *  is malformed or the socket fails. */
+void serve_process_helper_requests(int socket,
+                                   const ProcessHelperWhitelist & whitelist);
+
+
+} }  // end nova::process
+
+#endif
@@ -28,7 +28,9 @@ namespace nova { namespace redis {
 
 RedisAppStatus::RedisAppStatus(ResilientSenderPtr sender,
                                bool is_redis_installed) :
-                               DatastoreStatus(sender, is_redis_installed)
+                               DatastoreStatus(sender, is_redis_installed),
+                               client(),
+                               client_mutex()
 {
 }
 
@@ -55,14 +57,22 @@ DatastoreStatus::Status RedisAppStatus::determine_actual_status() const
     // BLOCKED = We can't ping it, but we can see the process running.
     // CRASHED = The process is dead, but left evidence it once existed.
     // SHUTDOWN = The process is dead and never existed or cleaned itself up.
-    try {
-        NOVA_LOG_INFO("Attempting to get redis-server status");
-        RedisClient client;
-        client.ping();
-        return RUNNING;
-    } catch(const RedisException & re) {
-        NOVA_LOG_INFO("Error pinging Redis, getting pid instead.");
+    NOVA_LOG_INFO("Attempting to get redis-server status");
+    // If Redis restarted since the last check, the first ping finds the old
+    // connection dead and the second one reconnects.
+    for (int attempt = 0; attempt < 2; attempt ++) {
+        try {
+            boost::lock_guard<boost::mutex> lock(client_mutex);
+            if (!client) {
+                client.reset(new RedisClient());
+            }
+            client->ping();
+            return RUNNING;
+        } catch(const RedisException & re) {
+            NOVA_LOG_INFO("Error pinging Redis.");
+        }
     }
+    NOVA_LOG_INFO("Couldn't ping Redis, getting pid instead.");
     auto pid = get_pid();
     if (pid) {
         if (is_pid_alive(pid.get())) {
@@ -4,8 +4,11 @@
 
 #include <list>
 #include "nova/datastores/DatastoreStatus.h"
+#include "nova/redis/RedisClient.h"
 #include "nova/rpc/sender.h"
 #include <boost/optional.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread/mutex.hpp>
 #include <string>
 
 
@@ -24,6 +27,12 @@ class RedisAppStatus : public nova::datastores::DatastoreStatus {
     protected:
         virtual Status determine_actual_status() const;
 
+    private:
+        // Kept between checks so each one is a PING rather than a new
+        // connection and AUTH. Made on the first check Redis is up for.
+        mutable boost::scoped_ptr<RedisClient> client;
+
+        mutable boost::mutex client_mutex;
 };
 
 typedef boost::shared_ptr<RedisAppStatus> RedisAppStatusPtr;
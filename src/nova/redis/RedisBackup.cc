@@ -1,5 +1,6 @@
 #include "pch.hpp"
 #include "RedisBackup.h"
+#include <algorithm>
 #include <boost/assign/list_of.hpp>
 #include "nova/Log.h"
 #include "nova/utils/ls.h"
@@ -7,28 +8,37 @@
 #include "nova/redis/RedisException.h"
 #include "nova/process.h"
 #include <sstream>
+#include <stdio.h>
+#include <string.h>
 #include <boost/thread.hpp>
 #include <time.h>
 #include <vector>
+#include "nova/utils/zlib.h"
 
 using namespace boost::assign;
 using nova::backup::BackupCreationArgs;
 using nova::backup::BackupManagerInfo;
+using nova::backup::BackupProgress;
 using nova::backup::BackupRunnerData;
 using nova::backup::BackupRestoreInfo;
+using nova::process::CgroupConfig;
 using nova::process::CommandList;
+using nova::process::create_cgroup;
 using nova::process::execute;
+using nova::process::in_cgroup;
 using nova::utils::ls;
 using nova::process::IndependentStdErrAndStdOut;
 using nova::process::Process;
 using nova::process::StdOutOnly;
 using nova::process::StdIn;
+using nova::process::TransientCgroupPtr;
 using boost::format;
 using boost::optional;
 using std::string;
 using std::stringstream;
 using namespace nova::utils::swift;
 using std::vector;
+namespace zlib = nova::utils::zlib;
 
 #define SHELL(cmd) { \
     NOVA_LOG_INFO(cmd); \
@@ -48,6 +58,40 @@ namespace {
     const char * const MANDATED_BACKUP_DIR="/var/lib/redis";
     const char * const MANDATED_RDB_LOCATION="/var/lib/redis/dump.rdb";
     const char * const MANDATED_AOF_LOCATION="/var/lib/redis/appendonly.aof";
+    const char * const MANDATED_CONF_LOCATION="/etc/redis/redis.conf";
+
+    // How often to check on a BGSAVE. See RdbPersistence::wait_for_save.
+    const double MIN_SAVE_POLL_INTERVAL = 0.05;
+    const double MAX_SAVE_POLL_INTERVAL = 1.0;
+    const double SAVE_LOG_INTERVAL = 60.0;
+
+    bool bgsave_status_is_ok(const RedisClient::Info & info) {
+        return info.get_optional("rdb_last_bgsave_status")
+            .get_value_or("ok") == "ok";
+    }
+
+    double monotonic_now() {
+        timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return now.tv_sec + (now.tv_nsec / 1000000000.0);
+    }
+
+    const size_t SNAPSHOT_BUFFER_SIZE = 64 * 1024;
+
+    /* Writes a number to a tar header field as octal, or as base-256 (which
+     * GNU tar reads) if it has too many digits to fit. */
+    void set_tar_number(char * field, size_t length,
+                        unsigned long long value) {
+        if (value < (1ULL << (3 * (length - 1)))) {
+            snprintf(field, length, "%0*llo", (int) (length - 1), value);
+        } else {
+            field[0] = (char) 0x80;
+            for (size_t i = length - 1; i > 0; i --) {
+                field[i] = (char) (value & 0xff);
+                value >>= 8;
+            }
+        }
+    }
 
     vector<string> list_var_lib_redis_files() {
         vector<string> files;
@@ -88,68 +132,217 @@ string find_rdb_file(RedisClient & client) {
         .get_value_or(MANDATED_RDB_LOCATION);
 }
 
+string tar_header(const string & name, unsigned long long size) {
+    char header[TAR_BLOCK_SIZE];
+    memset(header, 0, sizeof(header));
+    strncpy(header, name.c_str(), 99);
+    set_tar_number(header + 100, 8, 0644);  // mode
+    set_tar_number(header + 108, 8, 0);  // uid
+    set_tar_number(header + 116, 8, 0);  // gid
+    set_tar_number(header + 124, 12, size);
+    set_tar_number(header + 136, 12, ::time(NULL));  // mtime
+    header[156] = '0';  // regular file
+    memcpy(header + 257, "ustar", 6);
+    memcpy(header + 263, "00", 2);
+    // The checksum is figured with its own field full of spaces.
+    memset(header + 148, ' ', 8);
+    unsigned int checksum = 0;
+    for (size_t i = 0; i < sizeof(header); i ++) {
+        checksum += (unsigned char) header[i];
+    }
+    snprintf(header + 148, 7, "%06o", checksum);
+    return string(header, sizeof(header));
+}
+
+string tar_padding(unsigned long long size) {
+    return string((TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE,
+                  '\0');
+}
+
 /**---------------------------------------------------------------------------
  *- RdbPersistence
  *---------------------------------------------------------------------------*/
 
-RdbPersistence::RdbPersistence(long long tolerance)
-:   client(),
-    tolerance(tolerance) {
+RdbPersistence::RdbPersistence(RedisClient & client, long long tolerance,
+                               double time_out)
+:   client(&client),
+    tolerance(tolerance),
+    time_out(time_out) {
 }
 
+RdbPersistence::RdbPersistence(long long tolerance, double time_out)
+:   client(0),
+    tolerance(tolerance),
+    time_out(time_out) {
+}
 
-bool RdbPersistence::bgsave_or_aof_rewrite_ocurring() {
-    auto info = client.info();
-    return (info.get("rdb_bgsave_in_progress") != "0"
-            || info.get("aof_rewrite_in_progress") != "0");
+RdbPersistence::~RdbPersistence() {
 }
 
-void RdbPersistence::save() {
-    // TODO(tim.simpson): Check memory, go with BGSAVE if there's enough memory
-    // call save since we're a slave
-    client.command("BGSAVE").expect_status();
+void RdbPersistence::bgsave(bool schedule) {
+    client->command(schedule ? "BGSAVE SCHEDULE" : "BGSAVE").expect_status();
 }
 
-void RdbPersistence::update() {
-    NOVA_LOG_INFO("Performing backup.");
+RedisClient::Info RdbPersistence::get_persistence_info() {
+    return client->info("persistence");
+}
 
-    const boost::posix_time::seconds one_second(1);
-    bool wait_count = 0;
-    while (bgsave_or_aof_rewrite_ocurring()) {
-        if (0 == wait_count % 60) {
-            NOVA_LOG_INFO("aof rewrite or bgsave in progress, waiting...");
-        } else {
-            NOVA_LOG_TRACE("aof rewrite or bgsave in progress, waiting...");
-        }
-        boost::this_thread::sleep(one_second);
-        ++ wait_count;
-    }
+double RdbPersistence::monotonic_time() const {
+    return monotonic_now();
+}
 
-    save();
+void RdbPersistence::sleep(double seconds) {
+    boost::this_thread::sleep(boost::posix_time::milliseconds(
+        (long) (seconds * 1000)));
+}
 
-    //TODO(tim.simpson): Have some kind of time out here for the bgsave.
-    while(wait_for_save()) {
-        NOVA_LOG_TRACE("Still saving...");
-        boost::this_thread::sleep(one_second);
-    }
+long long RdbPersistence::wall_time() const {
+    return ::time(NULL);
+}
 
+bool RdbPersistence::is_fresh(const RedisClient::Info & info) const {
+    if (info.is_bgsave_in_progress() || info.is_aof_rewrite_in_progress()
+        || !bgsave_status_is_ok(info)) {
+        return false;
+    }
+    // Nothing has changed since a recent save, so that dump will do.
+    const auto changes = info.get_int("rdb_changes_since_last_save");
+    const auto last_save = info.get_int("rdb_last_save_time");
+    return changes && changes.get() == 0 && last_save
+        && wall_time() - last_save.get() <= tolerance;
+}
 
-    // Check to see that LASTSAVE is very recent.
-    // save_again_ig
-    // upload_to_swift();
+long long RdbPersistence::start_save(const RedisClient::Info & info,
+                                     double deadline,
+                                     BackupProgress * progress,
+                                     bool & status_is_ours) {
+    long long last_save = info.get_int("rdb_last_save_time").get_value_or(0);
+    if (info.is_aof_rewrite_in_progress()) {
+        // Redis 3.2 and later can start the BGSAVE the moment the rewrite
+        // ends. Older versions reply with an error, so wait ourselves.
+        try {
+            const long long started = wait_for_next_second(last_save);
+            bgsave(true);
+            NOVA_LOG_INFO("AOF rewrite in progress, scheduled a BGSAVE.");
+            // Until the save starts, an error can only be an old one.
+            status_is_ours = bgsave_status_is_ok(info);
+            return started;
+        } catch(const RedisException & re) {
+            if (re.code != RedisException::REPLY_ERROR) {
+                throw;
+            }
+        }
+        NOVA_LOG_INFO("AOF rewrite in progress, waiting for it to finish.");
+        wait_for_save(0, false, deadline, progress);
+        last_save = get_persistence_info()
+            .get_int("rdb_last_save_time").get_value_or(0);
+    }
+    const long long started = wait_for_next_second(last_save);
+    bgsave(false);
+    // Redis has forked by the time it replies, so the next status is ours.
+    status_is_ours = true;
+    return started;
 }
 
-bool RdbPersistence::wait_for_save() {
-    //TODO: Move
-    const auto last_save = client.command("LASTSAVE").expect_int();
-    const auto now = ::time(NULL);
+long long RdbPersistence::wait_for_next_second(long long last_save) {
+    // LASTSAVE only counts seconds, so ours must finish in a later one to
+    // be told apart from the last save. Once this second is past it, our
+    // save can't finish before the time returned.
+    if (last_save >= wall_time()) {
+        sleep(1.0);
+    }
+    return wall_time();
+}
 
-    NOVA_LOG_INFO("LASTSAVE? %s", last_save);
-    NOVA_LOG_INFO("NOW?      %s", now);
+void RdbPersistence::update(BackupProgress * progress) {
+    NOVA_LOG_INFO("Performing backup.");
+    const double deadline = monotonic_time() + time_out;
+    while(true) {
+        const auto info = get_persistence_info();
+        if (is_fresh(info)) {
+            NOVA_LOG_INFO("The RDB file is already up to date.");
+            return;
+        }
+        const long long last_save
+            = info.get_int("rdb_last_save_time").get_value_or(0);
+        if (info.is_bgsave_in_progress()) {
+            // A save that started recently enough is as good as our own.
+            // It updates the save time only if it works, so anything at
+            // or past the last one will do, and its status is the next.
+            const long long age = info.get_int("rdb_current_bgsave_time_sec")
+                .get_value_or(-1);
+            NOVA_LOG_INFO("BGSAVE in progress for %d seconds, waiting...",
+                          age);
+            wait_for_save(last_save, true, deadline, progress);
+            if (age >= 0 && age <= tolerance) {
+                return;
+            }
+            continue;
+        }
+        long long since;
+        bool status_is_ours = false;
+        try {
+            since = start_save(info, deadline, progress, status_is_ours);
+        } catch(const RedisException & re) {
+            // Someone else probably started a save between INFO and BGSAVE,
+            // so look again.
+            if (re.code != RedisException::REPLY_ERROR
+                || monotonic_time() >= deadline) {
+                throw;
+            }
+            sleep(1.0);
+            continue;
+        }
+        wait_for_save(since, status_is_ours, deadline, progress);
+        return;
+    }
+}
 
-    long long diff = now - last_save;
-    NOVA_LOG_INFO("   diff = %s", diff);
-    return (diff > tolerance);
+void RdbPersistence::wait_for_save(long long since, bool status_is_ours,
+                                   double deadline,
+                                   BackupProgress * progress) {
+    // Starts out polling often so short saves are noticed right away, then
+    // backs off so long ones don't flood Redis with INFO requests.
+    double interval = MIN_SAVE_POLL_INTERVAL;
+    double next_log = monotonic_time() + SAVE_LOG_INTERVAL;
+    while(true) {
+        const auto info = get_persistence_info();
+        if (info.is_bgsave_in_progress()) {
+            status_is_ours = true;
+        } else if (status_is_ours && !bgsave_status_is_ok(info)) {
+            // A failed save leaves the save time alone, so this is the only
+            // sign of it.
+            NOVA_LOG_ERROR("BGSAVE failed, status=%s",
+                           info.get("rdb_last_bgsave_status"));
+            throw RedisException(RedisException::BGSAVE_FAILED);
+        } else if (!info.is_aof_rewrite_in_progress()
+                   && info.get_int("rdb_last_save_time").get_value_or(0)
+                      >= since) {
+            // The AOF file is backed up too, so a rewrite has to finish as
+            // well.
+            NOVA_LOG_INFO("Save finished.");
+            return;
+        }
+        const double now = monotonic_time();
+        if (now >= deadline) {
+            NOVA_LOG_ERROR("Gave up waiting for Redis to save after %f "
+                           "seconds.", time_out);
+            throw RedisException(RedisException::BGSAVE_TIMED_OUT);
+        }
+        if (now >= next_log) {
+            NOVA_LOG_INFO("Still saving, BGSAVE has run for %s seconds.",
+                          info.get_optional("rdb_current_bgsave_time_sec")
+                              .get_value_or("-1"));
+            next_log = now + SAVE_LOG_INTERVAL;
+        } else {
+            NOVA_LOG_TRACE("Still saving...");
+        }
+        if (progress) {
+            progress->update();
+        }
+        sleep(std::min(interval, deadline - now));
+        interval = std::min(interval * 2, MAX_SAVE_POLL_INTERVAL);
+    }
 }
 
 
@@ -159,9 +352,10 @@ bool RdbPersistence::wait_for_save() {
 
 class TarInputProcess : public SwiftUploader::Input {
 public:
-    TarInputProcess(CommandList cmds)
+    TarInputProcess(CommandList cmds, BackupProgress & progress)
     :   error_out("/tmp/backup-errors.txt"),
-        process(cmds)
+        process(cmds),
+        progress(progress)
     {
     }
 
@@ -181,10 +375,14 @@ public:
 
     virtual size_t read(char * buffer, size_t bytes) {
         while(!process.is_finished()) {
+            progress.update();
             const auto result = process.read_into(buffer, bytes, boost::none);
             if (result.err()) {
                 error_out.write(buffer, bytes);
             } else if (result.out()) {
+                // Tar does the compression, so both counts are the same.
+                progress.add_read(result.write_length);
+                progress.add_compressed(result.write_length);
                 return result.write_length;
             } else if (result.time_out()) {
                 NOVA_LOG_ERROR("Time out reading from process. Trying again...");
@@ -197,6 +395,79 @@ public:
 private:
     std::ofstream error_out;
     Process<IndependentStdErrAndStdOut> process;
+    BackupProgress & progress;
+};
+
+SnapshotTarReader::SnapshotTarReader(const string & conf,
+                                     RdbSnapshot & snapshot,
+                                     BackupProgress & progress)
+:   buffer(SNAPSHOT_BUFFER_SIZE),
+    buffer_size(0),
+    ended(false),
+    pending(),
+    progress(progress),
+    snapshot(snapshot)
+{
+    pending = tar_header("etc/redis/redis.conf", conf.size()) + conf
+        + tar_padding(conf.size())
+        + tar_header("var/lib/redis/dump.rdb", snapshot.get_size());
+}
+
+zlib::ZlibBufferStatus SnapshotTarReader::advance() {
+    // If the backup was cancelled this throws, which drops the replica
+    // connection.
+    progress.update();
+    if (pending.empty() && 0 == snapshot.get_remaining() && !ended) {
+        // Tar ends with two empty blocks.
+        pending = tar_padding(snapshot.get_size())
+            + string(2 * TAR_BLOCK_SIZE, '\0');
+        ended = true;
+    }
+    if (!pending.empty()) {
+        buffer_size = std::min(pending.size(), buffer.size());
+        memcpy(&buffer[0], pending.data(), buffer_size);
+        pending.erase(0, buffer_size);
+    } else if (snapshot.get_remaining() > 0) {
+        buffer_size = snapshot.read(&buffer[0], buffer.size());
+    } else {
+        return zlib::FINISHED;
+    }
+    progress.add_read(buffer_size);
+    return zlib::OK;
+}
+
+char * SnapshotTarReader::get_buffer() {
+    return &buffer[0];
+}
+
+size_t SnapshotTarReader::get_buffer_size() {
+    return buffer_size;
+}
+
+class SnapshotInput : public SwiftUploader::Input {
+public:
+    SnapshotInput(const string & conf, RdbSnapshot & snapshot,
+                  BackupProgress & progress)
+    :   compressor(zlib::GZIP_FORMAT),
+        progress(progress),
+        reader(new SnapshotTarReader(conf, snapshot, progress))
+    {
+    }
+
+    virtual bool eof() const {
+        return compressor.is_finished();
+    }
+
+    virtual size_t read(char * buffer, size_t bytes) {
+        const size_t count = compressor.run_write_into(reader, buffer, bytes);
+        progress.add_compressed(count);
+        return count;
+    }
+
+private:
+    zlib::ZlibCompressor compressor;
+    BackupProgress & progress;
+    zlib::InputStreamPtr reader;
 };
 
 class TarOutputProcess : public SwiftDownloader::Output {
@@ -215,17 +486,21 @@ private:
 RedisBackupJob::RedisBackupJob(BackupRunnerData data,
                                bool allow_master_to_backup,
                                long long tolerance,
+                               double save_time_out,
+                               bool stream_snapshot,
                                const BackupCreationArgs & args)
 :   BackupJob(data, args),
     allow_master_to_backup(allow_master_to_backup),
-    client(),
+    save_time_out(save_time_out),
+    stream_snapshot(stream_snapshot),
     tolerance(tolerance) {
 }
 
 RedisBackupJob::RedisBackupJob(const RedisBackupJob & other)
-:   BackupJob(other.data, other.args),
+:   BackupJob(other),
     allow_master_to_backup(other.allow_master_to_backup),
-    client(),
+    save_time_out(other.save_time_out),
+    stream_snapshot(other.stream_snapshot),
     tolerance(other.tolerance) {
 }
 
@@ -233,6 +508,7 @@ RedisBackupJob::~RedisBackupJob() {
 }
 
 void RedisBackupJob::operator()() {
+    LogContextScope backup_context("backup_id", args.id);
     try {
         update_trove_to_building();
         update_trove_to_completed(run());
@@ -252,7 +528,9 @@ nova::utils::Job * RedisBackupJob::clone() const {
     return new RedisBackupJob(*this);
 }
 
-vector<string> RedisBackupJob::determine_files_to_backup() {
+vector<string> RedisBackupJob::determine_files_to_backup(
+    RedisClient & client)
+{
     // Even once Redis says its done, we may need to wait for the files to
     // become available in the directory listing. Calling fsync seems to solve
     // this entirely, but due to paranoia from edge cases we still check
@@ -278,14 +556,19 @@ vector<string> RedisBackupJob::determine_files_to_backup() {
     boost::this_thread::sleep(boost::posix_time::seconds(3));
 
 
-    auto info = client.info();
-    const bool aof = info.get("aof_enabled") != "0";
+    // Both questions are asked in one round trip.
+    RedisClient::Replies replies = client.pipeline(
+        RedisClient::Pipeline()
+            .add(list_of<string>("INFO")("persistence"))
+            .add(list_of<string>("CONFIG")("GET")("save")));
+    const RedisClient::Info info(replies[0].expect_string());
+    const bool aof = info.is_aof_enabled();
     NOVA_LOG_INFO("AOF enabled=%s", aof ? "true" : "false");
 
     // If rdb is disabled this returns an empty string, or so I was told.
     bool rdb;
     try {
-        rdb = client.command("CONFIG GET save").expect_string() != "";
+        rdb = replies[1].expect_string() != "";
     } catch(...) {
         rdb = true;
     }
@@ -323,32 +606,47 @@ const char * RedisBackupJob::get_backup_type() const {
     return "rdb";
 }
 
-bool RedisBackupJob::is_slave() {
-    const string role = client.info().get("role");
-    return role == "slave";
-}
-
 string RedisBackupJob::run() {
-    if (!is_slave() && !allow_master_to_backup) {
+    // One connection is used for the whole backup.
+    RedisClient client;
+    const RedisClient::Info info = client.info();
+    if (info.get_role() != string("slave") && !allow_master_to_backup) {
         NOVA_LOG_ERROR("We're not a slave, so avoid the backup.");
         throw RedisException(RedisException::INVALID_BACKUP_TARGET);
     }
-    if (find_rdb_file(client) != MANDATED_RDB_LOCATION) {
+    if (info.get_optional("dbfilename").get_value_or(MANDATED_RDB_LOCATION)
+        != MANDATED_RDB_LOCATION) {
         NOVA_LOG_ERROR("The RDB file has been moved. The current "
             "implementation is too stupid to work with such outrageous "
             "customizations.");
         throw RedisException(RedisException::INVALID_BACKUP_TARGET);
     }
-    RdbPersistence rdb(tolerance);
-    rdb.update();
+    // Made first so waiting on the save reports progress and can be
+    // cancelled.
+    BackupProgress progress(*this, data.progress_interval);
+    if (stream_snapshot) {
+        // The AOF file can't be had that way, and restores need it.
+        if (info.is_aof_enabled()) {
+            NOVA_LOG_INFO("AOF is enabled, so backing up the files instead "
+                          "of a snapshot.");
+        } else {
+            RdbSnapshot snapshot;
+            if (wait_for_snapshot(snapshot, progress)) {
+                return upload(snapshot, progress);
+            }
+        }
+    }
+    RdbPersistence rdb(client, tolerance, save_time_out);
+    rdb.update(&progress);
 
-    auto files = determine_files_to_backup();
+    auto files = determine_files_to_backup(client);
 
-    return upload(files);
+    return upload(files, progress);
 }
 
 
-string RedisBackupJob::upload(vector<string> files) {
+string RedisBackupJob::upload(vector<string> files,
+                              BackupProgress & progress) {
     NOVA_LOG_INFO("Uploading to Swift.");
     SwiftUploader writer(args.token, data.segment_max_size, file_info,
                          data.checksum_wait_time);
@@ -359,22 +657,70 @@ string RedisBackupJob::upload(vector<string> files) {
     BOOST_FOREACH(const auto & file, files) {
         cmds.push_back(file);
     }
-    TarInputProcess process(cmds);
+    const TransientCgroupPtr cgroup = create_cgroup(data.cgroup, "backup");
+    progress.set_uploader(&writer);
+    TarInputProcess process(in_cgroup(cgroup, cmds), progress);
     return writer.write(process);
 }
 
 
 
+string RedisBackupJob::upload(RdbSnapshot & snapshot,
+                              BackupProgress & progress) {
+    std::ifstream file(MANDATED_CONF_LOCATION);
+    if (!file.is_open()) {
+        NOVA_LOG_ERROR("Couldn't read %s.", MANDATED_CONF_LOCATION);
+        throw RedisException(RedisException::LOCAL_CONF_READ_ERROR);
+    }
+    stringstream conf;
+    conf << file.rdbuf();
+    NOVA_LOG_INFO("Uploading snapshot to Swift.");
+    SwiftUploader writer(args.token, data.segment_max_size, file_info,
+                         data.checksum_wait_time);
+    progress.set_uploader(&writer);
+    SnapshotInput input(conf.str(), snapshot, progress);
+    return writer.write(input);
+}
+
+bool RedisBackupJob::wait_for_snapshot(RdbSnapshot & snapshot,
+                                       BackupProgress & progress) {
+    const double deadline = monotonic_now() + save_time_out;
+    try {
+        while(!snapshot.wait_for_start()) {
+            progress.update();
+            if (monotonic_now() >= deadline) {
+                NOVA_LOG_ERROR("Gave up waiting for Redis to make a "
+                               "snapshot.");
+                throw RedisException(RedisException::BGSAVE_TIMED_OUT);
+            }
+        }
+    } catch(const RedisException & re) {
+        // Such as when a replica has lost its master.
+        if (re.code != RedisException::REPLY_ERROR) {
+            throw;
+        }
+        NOVA_LOG_INFO("Backing up the files instead.");
+        return false;
+    }
+    return true;
+}
+
+
+
 /**---------------------------------------------------------------------------
  *- RedisBackupManager
  *---------------------------------------------------------------------------*/
 
 RedisBackupManager::RedisBackupManager(const BackupManagerInfo & info,
                                        const bool allow_master_to_backup,
-                                       const long long tolerance)
+                                       const long long tolerance,
+                                       const double save_time_out,
+                                       const bool stream_snapshot)
 :   BackupManager(info),
     allow_master_to_backup(allow_master_to_backup),
-    tolerance(tolerance)
+    tolerance(tolerance),
+    save_time_out(save_time_out),
+    stream_snapshot(stream_snapshot)
 {
 
 }
@@ -387,8 +733,9 @@ RedisBackupManager::~RedisBackupManager() {
 void RedisBackupManager::run_backup(const BackupCreationArgs & args) {
     NOVA_LOG_INFO("Starting backup for tenant %s, backup_id=%d",
                    args.tenant.c_str(), args.id.c_str());
-    RedisBackupJob job(data, allow_master_to_backup, tolerance, args);
-    runner.run(job);
+    RedisBackupJob job(data, allow_master_to_backup, tolerance, save_time_out,
+                       stream_snapshot, args);
+    start_job(args.id, job);
 }
 
 
@@ -397,7 +744,10 @@ void RedisBackupManager::run_backup(const BackupCreationArgs & args) {
  *---------------------------------------------------------------------------*/
 
 
-RedisBackupRestoreManager::RedisBackupRestoreManager() {
+RedisBackupRestoreManager::RedisBackupRestoreManager(
+    const CgroupConfig & cgroup)
+:   cgroup(cgroup)
+{
 }
 
 void RedisBackupRestoreManager::run(const BackupRestoreInfo & restore) {
@@ -406,12 +756,13 @@ void RedisBackupRestoreManager::run(const BackupRestoreInfo & restore) {
     SHELL("sudo mkdir -p /tmp/restore");
 
     {
+        const TransientCgroupPtr group = create_cgroup(cgroup, "restore");
         SwiftDownloader downloader(restore.get_token(),
                                    restore.get_backup_url(),
                                    restore.get_backup_checksum());
         CommandList cmds = list_of("/usr/bin/sudo")
             ("/bin/tar")("zxf")("-")("--directory")("/tmp/restore");
-        TarOutputProcess process(cmds);
+        TarOutputProcess process(in_cgroup(group, cmds));
         downloader.read(process);
     }
 
@@ -4,10 +4,13 @@
 #include "nova/backup/BackupManager.h"
 #include "nova/backup/BackupRestore.h"
 #include "nova/process.h"
+#include "nova/process_cgroup.h"
 #include "nova/redis/RedisClient.h"
 #include "nova/utils/regex.h"
+#include "nova/utils/zlib.h"
 #include <boost/shared_ptr.hpp>
 #include <string>
+#include <vector>
 
 
 namespace nova { namespace redis {
@@ -15,24 +18,91 @@ namespace nova { namespace redis {
 std::string find_aof_file(RedisClient & client);
 std::string find_rdb_file(RedisClient & client);
 
+const size_t TAR_BLOCK_SIZE = 512;
+
+/** Returns the ustar header tar would write for a regular file. The name
+ *  is relative, as tar strips the leading slash. */
+std::string tar_header(const std::string & name, unsigned long long size);
+
+/** The zeroes filling out the last block of a file of the given size. */
+std::string tar_padding(unsigned long long size);
+
+/** Makes the same tar stream "tar cf" would from the config file and the RDB
+ *  snapshot, so restoring works the same no matter how the backup was made.
+ *  The snapshot must have started. */
+class SnapshotTarReader : public nova::utils::zlib::InputStream {
+public:
+    SnapshotTarReader(const std::string & conf, RdbSnapshot & snapshot,
+                      nova::backup::BackupProgress & progress);
+
+    virtual nova::utils::zlib::ZlibBufferStatus advance();
+
+    virtual char * get_buffer();
+
+    virtual size_t get_buffer_size();
+
+private:
+    std::vector<char> buffer;
+    size_t buffer_size;
+    bool ended;
+    // Everything but the snapshot is small, so it's queued up here.
+    std::string pending;
+    nova::backup::BackupProgress & progress;
+    RdbSnapshot & snapshot;
+};
+
 /** Allows the RDB file to be refreshed. */
 class RdbPersistence {
 public:
-    RdbPersistence(long long tolerance);
+    /** tolerance is how old (in seconds) the dump can be and still be used
+     *  without saving again; time_out is how long to wait for a save. */
+    RdbPersistence(RedisClient & client, long long tolerance,
+                   double time_out);
+
+    virtual ~RdbPersistence();
 
     std::string get_dump_file();
 
-    void update();
+    /** Makes sure the dump file is fresh, starting a BGSAVE if needed and
+     *  returning as soon as it's done. If given, progress is updated while
+     *  waiting, which also stops the wait if the job is cancelled. */
+    void update(nova::backup::BackupProgress * progress=0);
+
+protected:
+    /** For subclasses which override everything below that uses Redis. */
+    RdbPersistence(long long tolerance, double time_out);
+
+    // These are the normal production methods.
+    // By defining these the tests can fake Redis and the clocks.
+    virtual void bgsave(bool schedule);
+
+    virtual RedisClient::Info get_persistence_info();
+
+    virtual double monotonic_time() const;
+
+    virtual void sleep(double seconds);
+
+    virtual long long wall_time() const;
 
 private:
-    RedisClient client;
+    RedisClient * client;
     long long tolerance;
+    double time_out;
+
+    bool is_fresh(const RedisClient::Info & info) const;
 
-    bool bgsave_or_aof_rewrite_ocurring();
+    /* Returns the earliest save time the new save can have. Sets
+     * status_is_ours if rdb_last_bgsave_status can only be about it. */
+    long long start_save(const RedisClient::Info & info, double deadline,
+                         nova::backup::BackupProgress * progress,
+                         bool & status_is_ours);
 
-    void save();
+    long long wait_for_next_second(long long last_save);
 
-    bool wait_for_save();
+    /* Waits for a save time of at least since. Once status_is_ours, or a
+     * save is seen running, an error status means it failed. */
+    void wait_for_save(long long since, bool status_is_ours, double deadline,
+                       nova::backup::BackupProgress * progress);
 };
 
 
@@ -46,6 +116,8 @@ public:
     RedisBackupJob(nova::backup::BackupRunnerData data,
                    bool allow_master_to_backup,
                    long long tolerance,
+                   double save_time_out,
+                   bool stream_snapshot,
                    const nova::backup::BackupCreationArgs & args);
 
     RedisBackupJob(const RedisBackupJob & other);
@@ -62,20 +134,27 @@ protected:
 private:
     bool allow_master_to_backup;
 
-    RedisClient client;
-
-    std::vector<std::string> determine_files_to_backup();
+    std::vector<std::string> determine_files_to_backup(RedisClient & client);
 
     void ensure_file_exists_in(std::vector<std::string> files,
                                const char * const filepath);
 
-    bool is_slave();
-
     std::string run();
 
+    double save_time_out;
+
+    bool stream_snapshot;
+
     long long tolerance;
 
-    std::string upload(std::vector<std::string> files);
+    std::string upload(std::vector<std::string> files,
+                       nova::backup::BackupProgress & progress);
+
+    std::string upload(RdbSnapshot & snapshot,
+                       nova::backup::BackupProgress & progress);
+
+    bool wait_for_snapshot(RdbSnapshot & snapshot,
+                           nova::backup::BackupProgress & progress);
 };
 
 
@@ -83,7 +162,9 @@ class RedisBackupManager : public nova::backup::BackupManager {
     public:
         RedisBackupManager(const nova::backup::BackupManagerInfo & info,
                            const bool allow_master_to_backup,
-                           const long long tolerance);
+                           const long long tolerance,
+                           const double save_time_out,
+                           const bool stream_snapshot);
 
         virtual ~RedisBackupManager();
 
@@ -98,7 +179,9 @@ class RedisBackupManager : public nova::backup::BackupManager {
             result.reset(new RedisBackupManager(
                 BackupManagerInfo::from_flags(flags, args...),
                 flags.redis_allow_master_to_backup(),
-                flags.redis_backup_rdb_max_age_in_seconds()));
+                flags.redis_backup_rdb_max_age_in_seconds(),
+                flags.redis_backup_save_time_out(),
+                flags.redis_backup_stream_snapshot()));
             return result;
         }
 
@@ -110,19 +193,24 @@ class RedisBackupManager : public nova::backup::BackupManager {
         bool allow_master_to_backup;
         // How recent the dump file must be before we begin.
         long long tolerance;
+        // How long to wait for a BGSAVE to finish.
+        double save_time_out;
+        // If true, back up the snapshot sent to replicas instead of files.
+        bool stream_snapshot;
 };
 
 
 class RedisBackupRestoreManager : public nova::backup::BackupRestoreManager {
     public:
-        RedisBackupRestoreManager();
+        RedisBackupRestoreManager(const nova::process::CgroupConfig & cgroup);
 
         template<typename Flags>
         static nova::backup::BackupRestoreManagerPtr from_flags(
             const Flags & flags)
         {
             nova::backup::BackupRestoreManagerPtr ptr(
-                new RedisBackupRestoreManager());
+                new RedisBackupRestoreManager(nova::process::CgroupConfig(
+                    flags.cgroup_parent(), flags.restore_cgroup_limits())));
             return ptr;
         }
 
@@ -132,6 +220,8 @@ class RedisBackupRestoreManager : public nova::backup::BackupRestoreManager {
 
     private:
         class Job;
+
+        const nova::process::CgroupConfig cgroup;
 };
 
 } }  // end nova::redis
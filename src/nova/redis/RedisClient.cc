@@ -3,10 +3,17 @@
 #include <boost/algorithm/string/predicate.hpp>
 #include <boost/algorithm/string.hpp>
 #include <boost/assert.hpp>
+#include <errno.h>
+#include <boost/foreach.hpp>
 #include <hiredis/hiredis.h>
+#include <boost/lexical_cast.hpp>
+#include <poll.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string>
+#include <string.h>
+#include <unistd.h>
 #include "nova/Log.h"
 #include "nova/guest/redis/config.h"
 #include "nova/redis/RedisException.h"
@@ -23,14 +30,26 @@ namespace nova { namespace redis {
  *****************************************************************************/
 
 RedisClient::Info::Info(const std::string & info)
-:   info_stream(info) {
-}
-
-RedisClient::Info::Info(const RedisClient::Info & other)
-:   info_stream(other.info_stream.str()) {
+:   values() {
+    // Lines are "key:value", with "# Section" headers and blank lines
+    // between sections.
+    size_t start = 0;
+    while(start < info.size()) {
+        size_t end = info.find('\n', start);
+        if (end == string::npos) {
+            end = info.size();
+        }
+        const size_t colon = info.find(':', start);
+        if (info[start] != '#' && colon < end) {
+            string value = info.substr(colon + 1, end - colon - 1);
+            boost::trim(value);
+            values[info.substr(start, colon - start)] = value;
+        }
+        start = end + 1;
+    }
 }
 
-string RedisClient::Info::get(const std::string & key) {
+string RedisClient::Info::get(const std::string & key) const {
     const auto value = get_optional(key);
     if (value) {
         return value.get();
@@ -39,18 +58,54 @@ string RedisClient::Info::get(const std::string & key) {
     throw RedisException(RedisException::UNKNOWN_INFO_VALUE);
 }
 
-optional<string> RedisClient::Info::get_optional(const std::string & key) {
-    info_stream.seekg(0, std::ios_base::beg);
-    const string find = key + ":";
-    string line;
-    while(std::getline(info_stream, line)) {
-        if (boost::starts_with(line, find)) {
-            line = line.substr(find.length());
-            boost::trim(line);
-            return line;
-        }
+optional<long long> RedisClient::Info::get_int(const std::string & key)
+    const
+{
+    const auto value = get_optional(key);
+    if (!value) {
+        return boost::none;
     }
-    return boost::none;
+    try {
+        return boost::lexical_cast<long long>(value.get());
+    } catch(const boost::bad_lexical_cast & blc) {
+        NOVA_LOG_ERROR("Redis info value %s isn't a number: %s", key,
+                       value.get());
+        throw RedisException(RedisException::UNKNOWN_INFO_VALUE);
+    }
+}
+
+optional<string> RedisClient::Info::get_optional(const std::string & key)
+    const
+{
+    const auto itr = values.find(key);
+    if (itr == values.end()) {
+        return boost::none;
+    }
+    return itr->second;
+}
+
+bool RedisClient::Info::is_aof_enabled() const {
+    return get("aof_enabled") != "0";
+}
+
+bool RedisClient::Info::is_aof_rewrite_in_progress() const {
+    return get("aof_rewrite_in_progress") != "0";
+}
+
+bool RedisClient::Info::is_bgsave_in_progress() const {
+    return get("rdb_bgsave_in_progress") != "0";
+}
+
+optional<long long> RedisClient::Info::get_replication_offset() const {
+    return get_int("master_repl_offset");
+}
+
+optional<string> RedisClient::Info::get_role() const {
+    return get_optional("role");
+}
+
+optional<long long> RedisClient::Info::get_used_memory() const {
+    return get_int("used_memory");
 }
 
 /*****************************************************************************
@@ -58,11 +113,7 @@ optional<string> RedisClient::Info::get_optional(const std::string & key) {
  *****************************************************************************/
 
 RedisClient::Reply::Reply(redisReply * r)
-:   r(r) {
-}
-
-RedisClient::Reply::~Reply() {
-    freeReplyObject(r);
+:   r(r, freeReplyObject) {
 }
 
 string RedisClient::Reply::expect_status() const {
@@ -107,7 +158,7 @@ long long RedisClient::Reply::expect_int() const  {
 }
 
 redisReply * RedisClient::Reply::get() {
-    return r;
+    return r.get();
 }
 
 void RedisClient::Reply::throw_if_error() const {
@@ -119,10 +170,116 @@ void RedisClient::Reply::throw_if_error() const {
 
 
 
+/*****************************************************************************
+ * RedisClient::Pipeline
+ *****************************************************************************/
+
+RedisClient::Pipeline & RedisClient::Pipeline::add(const Command & command) {
+    BOOST_ASSERT(!command.empty());
+    commands.push_back(command);
+    return *this;
+}
+
+
 namespace {
 
     const timeval default_timeout = { 1, 500000 };
 
+    // Reading the snapshot can stall for a while if Redis is busy.
+    const timeval snapshot_timeout = { 60, 0 };
+
+    redisReply * expect_reply(redisContext * context, void * result) {
+        if (NULL == result) {
+            NOVA_LOG_ERROR("redisContext error: %s", context->errstr);
+            throw RedisException(RedisException::CONNECTION_ERROR);
+        }
+        return static_cast<redisReply *>(result);
+    }
+
+    /* hiredis writes with plain write(), so a command sent after Redis has
+     * closed the connection raises SIGPIPE and would kill the agent. This
+     * blocks it on the current thread while in scope and discards any that
+     * was raised, so the write just fails with EPIPE. */
+    class SigPipeGuard : boost::noncopyable {
+    public:
+        SigPipeGuard() {
+            sigemptyset(&pipe_only);
+            sigaddset(&pipe_only, SIGPIPE);
+            sigset_t pending;
+            sigpending(&pending);
+            already_pending = sigismember(&pending, SIGPIPE);
+            pthread_sigmask(SIG_BLOCK, &pipe_only, &old_mask);
+        }
+
+        ~SigPipeGuard() {
+            if (!already_pending) {
+                sigset_t pending;
+                sigpending(&pending);
+                if (sigismember(&pending, SIGPIPE)) {
+                    const timespec no_wait = { 0, 0 };
+                    sigtimedwait(&pipe_only, NULL, &no_wait);
+                }
+            }
+            pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+        }
+
+    private:
+        bool already_pending;
+        sigset_t old_mask;
+        sigset_t pipe_only;
+    };
+
+    optional<string> configured_unix_socket() {
+        Config config;
+        const string socket = config.get_unix_socket();
+        if (socket.empty()) {
+            return boost::none;
+        }
+        return socket;
+    }
+
+    /* Connects and logs in, returning a context ready for commands. */
+    redisContext * open_context(const optional<string> & unix_socket) {
+        redisContext * context;
+        if (unix_socket) {
+            context = redisConnectUnixWithTimeout(unix_socket.get().c_str(),
+                                                  default_timeout);
+        } else {
+            context = redisConnectWithTimeout("localhost", 6379,
+                                              default_timeout);
+        }
+        if (NULL == context) {
+            NOVA_LOG_ERROR("Error allocating Redis client memory.");
+            throw RedisException(RedisException::CONNECTION_ERROR);
+        } else if (context->err) {
+            NOVA_LOG_ERROR("Redis connection error: %s\n", context->errstr);
+            redisFree(context);
+            throw RedisException(RedisException::CONNECTION_ERROR);
+        }
+        BOOST_ASSERT((context->flags | REDIS_BLOCK) != REDIS_BLOCK);
+        // Commands also time out, so a hung Redis can't hang the status
+        // thread.
+        redisSetTimeout(context, default_timeout);
+        // The password is read again each time, as it may have changed.
+        Config config;
+        const string password = config.get_require_pass();
+        SigPipeGuard sig_pipe_guard;
+        try {
+            if (password.length() > 0) {
+                RedisClient::Reply(expect_reply(context,
+                    redisCommand(context, "AUTH %s", password.c_str())))
+                    .expect_ok();
+            }
+            RedisClient::Reply(expect_reply(context,
+                redisCommand(context, "CLIENT SETNAME trove-guestagent")))
+                .expect_ok();
+        } catch(const RedisException & re) {
+            redisFree(context);
+            throw;
+        }
+        return context;
+    }
+
 }  // end anon namespace
 
 
@@ -131,30 +288,44 @@ namespace {
  *****************************************************************************/
 
 RedisClient::RedisClient()
-:   context(redisConnectWithTimeout("localhost", 6379, default_timeout)) {
-    if (NULL == context) {
-        NOVA_LOG_ERROR("Error allocating Redis client memory.");
-        throw RedisException(RedisException::CONNECTION_ERROR);
-    } else if (context->err) {
-        NOVA_LOG_ERROR("Redis connection error: %s\n", context->errstr);
-        throw RedisException(RedisException::CONNECTION_ERROR);
-    }
-    BOOST_ASSERT((context->flags | REDIS_BLOCK) != REDIS_BLOCK);
-    Config config;
-    string password = config.get_require_pass();
-    if (password.length() > 0) {
-        command("AUTH %s", password.c_str())
-            .expect_ok();
-    }
-    command("CLIENT SETNAME trove-guestagent")
-        .expect_ok();
+:   context(0),
+    mutex(),
+    unix_socket(configured_unix_socket()) {
+    boost::lock_guard<boost::mutex> lock(mutex);
+    connect();
+}
+
+RedisClient::RedisClient(const string & unix_socket)
+:   context(0),
+    mutex(),
+    unix_socket(unix_socket) {
+    boost::lock_guard<boost::mutex> lock(mutex);
+    connect();
 }
 
 RedisClient::~RedisClient() {
-     redisFree(context);
+    disconnect();
+}
+
+void RedisClient::connect() {
+    context = open_context(unix_socket);
+}
+
+void RedisClient::disconnect() {
+    if (context) {
+        redisFree(context);
+        context = 0;
+    }
 }
 
 RedisClient::Reply RedisClient::command(const char * format, ...) {
+    boost::lock_guard<boost::mutex> lock(mutex);
+    SigPipeGuard sig_pipe_guard;
+    if (!context) {
+        NOVA_LOG_INFO("Reconnecting to Redis.");
+        connect();
+    }
+
     va_list vargs;  // Careful: don't throw exceptions between here and va_end.
     va_start(vargs, format);
     void * result = redisvCommand(context, format, vargs);
@@ -165,6 +336,9 @@ RedisClient::Reply RedisClient::command(const char * format, ...) {
         if (context->err) {
             NOVA_LOG_ERROR("redisContext error: %s", context->errstr);
         }
+        // The context can't be used after an error, so start over with the
+        // next command.
+        disconnect();
         throw RedisException(RedisException::COMMAND_ERROR);
     }
     //Note: I'm not sure why hiredis returns void, but this
@@ -173,7 +347,7 @@ RedisClient::Reply RedisClient::command(const char * format, ...) {
 }
 
 void RedisClient::config_rewrite() {
-    command("CONFIG", "REWRITE")
+    command("CONFIG REWRITE")
         .expect_ok();
 }
 
@@ -183,16 +357,7 @@ void RedisClient::config_set(const string & key, const string & value) {
 }
 
 optional<string> RedisClient::get_role() {
-    stringstream info;
-    info << command("INFO").expect_string();
-    string line;
-    while(std::getline(info, line)) {
-        if (boost::starts_with(line, "role:")) {
-            line = line.substr(5);
-            return line;
-        }
-    }
-    return boost::none;
+    return info("replication").get_role();
 }
 
 RedisClient::Info RedisClient::info() {
@@ -200,12 +365,206 @@ RedisClient::Info RedisClient::info() {
     return i;
 }
 
+RedisClient::Info RedisClient::info(const string & section) {
+    Info i(command("INFO %s", section.c_str()).expect_string());
+    return i;
+}
+
 void RedisClient::ping() {
     string res = command("PING").expect_status();
     NOVA_LOG_INFO("PING? %s", res);
 }
 
+RedisClient::Replies RedisClient::pipeline(const Pipeline & commands) {
+    boost::lock_guard<boost::mutex> lock(mutex);
+    SigPipeGuard sig_pipe_guard;
+    if (!context) {
+        NOVA_LOG_INFO("Reconnecting to Redis.");
+        connect();
+    }
+    BOOST_FOREACH(const Pipeline::Command & args, commands.get_commands()) {
+        std::vector<const char *> argv;
+        std::vector<size_t> argv_lengths;
+        BOOST_FOREACH(const string & arg, args) {
+            argv.push_back(arg.c_str());
+            argv_lengths.push_back(arg.size());
+        }
+        if (REDIS_OK != redisAppendCommandArgv(context, argv.size(), &argv[0],
+                                               &argv_lengths[0])) {
+            NOVA_LOG_ERROR("Error appending Redis command: %s",
+                           context->errstr);
+            disconnect();
+            throw RedisException(RedisException::COMMAND_ERROR);
+        }
+    }
+    // Every reply has to be read, even after one is an error, or they'd
+    // turn up as the answers to later commands.
+    Replies replies;
+    for (size_t i = 0; i < commands.get_commands().size(); i ++) {
+        void * result = 0;
+        if (REDIS_OK != redisGetReply(context, &result)) {
+            NOVA_LOG_ERROR("Error reading pipelined Redis reply: %s",
+                           context->errstr);
+            disconnect();
+            throw RedisException(RedisException::COMMAND_ERROR);
+        }
+        replies.push_back(Reply(static_cast<redisReply *>(result)));
+    }
+    return replies;
+}
+
+
+/*****************************************************************************
+ * RdbSnapshot
+ *****************************************************************************/
+
+RdbSnapshot::RdbSnapshot()
+:   context(open_context(configured_unix_socket())),
+    line(),
+    remaining(0),
+    size(boost::none),
+    tried_sync(false) {
+    start();
+}
+
+RdbSnapshot::RdbSnapshot(const string & unix_socket)
+:   context(open_context(unix_socket)),
+    line(),
+    remaining(0),
+    size(boost::none),
+    tried_sync(false) {
+    start();
+}
 
+RdbSnapshot::~RdbSnapshot() {
+    redisFree(context);
+}
 
+size_t RdbSnapshot::read(char * buffer, size_t buffer_size) {
+    BOOST_ASSERT(size);
+    if (0 == remaining) {
+        return 0;
+    }
+    const size_t wanted = (size_t) std::min<unsigned long long>(
+        buffer_size, remaining);
+    while(true) {
+        const ssize_t count = ::read(context->fd, buffer, wanted);
+        if (count < 0 && EINTR == errno) {
+            continue;
+        }
+        if (count < 0 && (EAGAIN == errno || EWOULDBLOCK == errno)) {
+            NOVA_LOG_ERROR("Timed out reading the snapshot with %d bytes "
+                           "left.", remaining);
+            throw RedisException(RedisException::RESPONSE_TIMEOUT);
+        }
+        if (count <= 0) {
+            NOVA_LOG_ERROR("Lost the connection reading the snapshot with %d "
+                           "bytes left: %s", remaining,
+                           (count < 0 ? strerror(errno) : "closed"));
+            throw RedisException(RedisException::CONNECTION_ERROR);
+        }
+        remaining -= count;
+        return count;
+    }
+}
+
+void RdbSnapshot::read_line(const string & reply) {
+    if (reply.empty()) {
+        // Redis sends newlines to keep the connection alive while it
+        // makes the snapshot.
+        NOVA_LOG_TRACE("Still waiting for the snapshot...");
+    } else if (boost::starts_with(reply, "+FULLRESYNC")) {
+        NOVA_LOG_INFO("Redis is making a snapshot: %s", reply);
+    } else if (boost::starts_with(reply, "-") && !tried_sync
+               && boost::icontains(reply, "unknown command")) {
+        // PSYNC is new in 2.8.
+        NOVA_LOG_INFO("PSYNC isn't supported, trying SYNC.");
+        tried_sync = true;
+        send("SYNC");
+    } else if (boost::starts_with(reply, "-")) {
+        NOVA_LOG_ERROR("Redis won't send a snapshot: %s", reply);
+        throw RedisException(RedisException::REPLY_ERROR);
+    } else if (boost::starts_with(reply, "$")
+               && reply.find(':') == string::npos) {
+        // "$EOF:" would mean the size isn't known ahead of time, which only
+        // happens to replicas that say they can take it.
+        try {
+            size = boost::lexical_cast<unsigned long long>(reply.substr(1));
+        } catch(const boost::bad_lexical_cast & blc) {
+            NOVA_LOG_ERROR("Bad snapshot size from Redis: %s", reply);
+            throw RedisException(RedisException::UNEXPECTED_RESPONSE);
+        }
+        remaining = size.get();
+        NOVA_LOG_INFO("Reading a %d byte snapshot.", remaining);
+    } else {
+        NOVA_LOG_ERROR("Unexpected reply from Redis: %s", reply);
+        throw RedisException(RedisException::UNEXPECTED_RESPONSE);
+    }
+}
+
+void RdbSnapshot::send(const char * command) {
+    SigPipeGuard sig_pipe_guard;
+    int done = 0;
+    if (REDIS_OK != redisAppendCommand(context, command)) {
+        NOVA_LOG_ERROR("Error sending %s: %s", command, context->errstr);
+        throw RedisException(RedisException::COMMAND_ERROR);
+    }
+    while(!done) {
+        if (REDIS_OK != redisBufferWrite(context, &done)) {
+            NOVA_LOG_ERROR("Error sending %s: %s", command, context->errstr);
+            throw RedisException(RedisException::COMMAND_ERROR);
+        }
+    }
+}
+
+void RdbSnapshot::start() {
+    redisSetTimeout(context, snapshot_timeout);
+    // Asking for offset -1 of an unknown replication ID always gets a full
+    // snapshot.
+    try {
+        send("PSYNC ? -1");
+    } catch(const RedisException & re) {
+        // The destructor won't run to free it.
+        redisFree(context);
+        throw;
+    }
+}
+
+bool RdbSnapshot::wait_for_start() {
+    // The header lines are read a byte at a time so none of the snapshot
+    // after them is read by accident.
+    while(!size) {
+        pollfd ready = { context->fd, POLLIN, 0 };
+        const int result = ::poll(&ready, 1, 1000);
+        if (result < 0 && EINTR != errno) {
+            NOVA_LOG_ERROR("Error waiting for the snapshot: %s",
+                           strerror(errno));
+            throw RedisException(RedisException::CONNECTION_ERROR);
+        }
+        if (result <= 0) {
+            return false;
+        }
+        char c;
+        const ssize_t count = ::read(context->fd, &c, 1);
+        if (count < 0 && EINTR == errno) {
+            continue;
+        }
+        if (count <= 0) {
+            NOVA_LOG_ERROR("Lost the connection waiting for the snapshot.");
+            throw RedisException(RedisException::CONNECTION_ERROR);
+        }
+        if ('\n' != c) {
+            line += c;
+            continue;
+        }
+        if (!line.empty() && '\r' == line[line.size() - 1]) {
+            line.erase(line.size() - 1);
+        }
+        const string complete = line;
+        line.clear();
+        read_line(complete);
+    }
+    return true;
+}
 
 } }
@@ -2,7 +2,12 @@
 #define __NOVA_REDIS_REDISCLIENT_H
 
 #include <boost/optional.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/shared_ptr.hpp>
 #include <string>
+#include <boost/unordered_map.hpp>
+#include <boost/utility.hpp>
+#include <vector>
 
 class redisContext;
 class redisReply;
@@ -10,30 +15,47 @@ class redisReply;
 namespace nova { namespace redis {
 
 
-class RedisClient {
+/* Keeps its connection open between commands, reconnecting on the next
+ * command if it's lost. Safe to share between threads. */
+class RedisClient : boost::noncopyable {
 public:
-    /* Redis Info string. */
+    /* Redis Info string, split into its values once when it's made. */
     class Info {
     public:
         Info(const std::string & info);
 
-        Info(const Info & other);
+        std::string get(const std::string & key) const;
 
-        std::string get(const std::string & key);
+        boost::optional<std::string> get_optional(const std::string & key)
+            const;
 
-        boost::optional<std::string> get_optional(const std::string & key);
+        /* Throws UNKNOWN_INFO_VALUE if the value isn't a number. */
+        boost::optional<long long> get_int(const std::string & key) const;
+
+        // The values most often needed, from the "persistence",
+        // "replication" and "memory" sections.
+        bool is_aof_enabled() const;
+
+        bool is_aof_rewrite_in_progress() const;
+
+        bool is_bgsave_in_progress() const;
+
+        boost::optional<long long> get_replication_offset() const;
+
+        boost::optional<std::string> get_role() const;
+
+        boost::optional<long long> get_used_memory() const;
 
     private:
-        std::stringstream info_stream;
+        boost::unordered_map<std::string, std::string> values;
     };
 
-    /* Manages a reply object to ensure it's always freed. */
+    /* Manages a reply object to ensure it's always freed. Copies share
+     * the same reply. */
     class Reply {
     public:
         Reply(redisReply * r);
 
-        ~Reply();
-
         std::string expect_status() const;
 
         std::string expect_string() const;
@@ -47,14 +69,35 @@ public:
         void throw_if_error() const;
 
     private:
-        redisReply * r;
+        boost::shared_ptr<redisReply> r;
+    };
+
+    typedef std::vector<Reply> Replies;
+
+    /* Commands to send together. Each is given as its arguments, which are
+     * sent as they are, so values may hold spaces or anything else. */
+    class Pipeline {
+    public:
+        typedef std::vector<std::string> Command;
+
+        Pipeline & add(const Command & command);
+
+        const std::vector<Command> & get_commands() const {
+            return commands;
+        }
+
+    private:
+        std::vector<Command> commands;
     };
 
     // Connects to an assumed port, host, etc using a password grabbed from
-    // the Redis file. If more is needed feel free to write another
-    // constructor.
+    // the Redis file. If the file names a unix socket, that's used instead
+    // of TCP.
     RedisClient();
 
+    // Connects over the given unix socket.
+    explicit RedisClient(const std::string & unix_socket);
+
     ~RedisClient();
 
     void auth();
@@ -69,10 +112,72 @@ public:
 
     Info info();
 
+    /* Asks for just one section (such as "persistence"), which is much
+     * smaller than everything. */
+    Info info(const std::string & section);
+
     void ping();
 
+    /* Sends every command before reading any replies, so they all cost a
+     * single round trip. The replies are in the same order. */
+    Replies pipeline(const Pipeline & commands);
+
 private:
     ::redisContext * context;
+    boost::mutex mutex;
+    boost::optional<std::string> unix_socket;
+
+    // These must be called with the mutex locked.
+    void connect();
+    void disconnect();
+};
+
+
+/* Connects the way a replica does and reads the RDB snapshot Redis sends in
+ * reply to PSYNC (or SYNC) straight off the socket, so nothing has to read
+ * the dump file back from disk. Redis streams commands after the snapshot;
+ * those are never read, and the connection is closed when this is deleted.
+ */
+class RdbSnapshot : boost::noncopyable {
+public:
+    RdbSnapshot();
+
+    // Connects over the given unix socket.
+    explicit RdbSnapshot(const std::string & unix_socket);
+
+    ~RdbSnapshot();
+
+    /* Bytes of the snapshot not yet read. */
+    unsigned long long get_remaining() const {
+        return remaining;
+    }
+
+    /* Only known once wait_for_start returns true. */
+    unsigned long long get_size() const {
+        return size.get();
+    }
+
+    /* Reads up to buffer_size bytes of the snapshot, returning 0 once all of
+     * it has been read. */
+    size_t read(char * buffer, size_t buffer_size);
+
+    /* Waits up to a second for Redis to start sending the snapshot, and
+     * returns true once it has. Redis may take a while to make one, so call
+     * this until it's true. Throws REPLY_ERROR if Redis refuses. */
+    bool wait_for_start();
+
+private:
+    ::redisContext * context;
+    std::string line;
+    unsigned long long remaining;
+    boost::optional<unsigned long long> size;
+    bool tried_sync;
+
+    void read_line(const std::string & reply);
+
+    void send(const char * command);
+
+    void start();
 };
 
 }}//end nova::redis namespace
@@ -16,6 +16,10 @@ const char * RedisException::what() const throw() {
     switch(code) {
         case BACKUP_FILE_MISSING:
             return "Backup file is missing.";
+        case BGSAVE_FAILED:
+            return "Redis failed to save the RDB file.";
+        case BGSAVE_TIMED_OUT:
+            return "Timed out waiting for Redis to save the RDB file.";
         case CHANGE_PASSWORD_ERROR:
             return "Error changing passwords.";
         case COMMAND_ERROR:
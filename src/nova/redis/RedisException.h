@@ -9,6 +9,8 @@ class RedisException : public std::exception {
     public:
         enum Code {
             BACKUP_FILE_MISSING,
+            BGSAVE_FAILED,
+            BGSAVE_TIMED_OUT,
             CANT_SET_NAME,
             CHANGE_PASSWORD_ERROR,
             COMMAND_ERROR,
@@ -1,14 +1,18 @@
 #include "pch.hpp"
 #include "nova/utils/io.h"
 
+#include <algorithm>
+#include <cmath>
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include "nova/Log.h"
 #include <signal.h>
 #include <sys/select.h>
 #include <stdio.h>
 #include <stdlib.h> // exit
 #include <string.h>
+#include <sys/syscall.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <time.h>
@@ -22,17 +26,14 @@ using boost::optional;
 
 namespace {
 
-    void assert_only_one_timer(int increment) {
-        static int instance_count = 0;
-        instance_count += increment;
-        if (instance_count > 1 || instance_count < 0) {
-            NOVA_LOG_ERROR("Two timers cannot be used at a time. Destroy one "
-                           "before creating another.");
-            NOVA_LOG_ERROR("Count = %d", instance_count);
-            #ifdef _DEBUG
-                std::abort();  // This is what you get, criminal!
-            #endif
-        }
+    /* The deadline of the innermost Timer on this thread, in seconds on the
+     * monotonic clock. Zero if no Timer is active. */
+    __thread double thread_deadline = 0.0;
+
+    double monotonic_now() {
+        timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return now.tv_sec + (now.tv_nsec / 1000000000.0);
     }
 
     inline void checkGE0(LogPtr & log, const int return_code,
@@ -130,7 +131,12 @@ const char * IOException::what() const throw() {
  *---------------------------------------------------------------------------*/
 
 Pipe::Pipe() {
-    if (0 != pipe(fd)) {
+    // Close on exec so the ends don't leak into every other process spawned
+    // while this one is alive (the dup2 done by posix_spawn clears the flag on
+    // the copy the child is meant to get). Besides wasting descriptors, a
+    // leaked write end keeps the reader from seeing EOF until that other
+    // process exits.
+    if (0 != pipe2(fd, O_CLOEXEC)) {
         NOVA_LOG_ERROR("System error : %s", strerror(errno));
         throw IOException(IOException::PIPE_CREATION_ERROR);
     }
@@ -159,6 +165,21 @@ void Pipe::close_out() {
     close(1);
 }
 
+size_t Pipe::set_capacity(size_t bytes) {
+    const int fd_to_change = is_open[IN] ? fd[IN] : fd[OUT];
+    if (::fcntl(fd_to_change, F_SETPIPE_SZ, (int) bytes) < 0) {
+        NOVA_LOG_ERROR("Could not resize pipe to %d bytes: %s", bytes,
+                       strerror(errno));
+    }
+    const int capacity = ::fcntl(fd_to_change, F_GETPIPE_SZ);
+    if (capacity < 0) {
+        NOVA_LOG_ERROR("Could not get pipe size: %s", strerror(errno));
+        return 0;
+    }
+    NOVA_LOG_TRACE("Pipe capacity is now %d bytes.", capacity);
+    return (size_t) capacity;
+}
+
 
 /**---------------------------------------------------------------------------
  *- TimeOutException
@@ -179,82 +200,32 @@ const char * TimeOutException::what() const throw() {
  *- Timer
  *---------------------------------------------------------------------------*/
 
-Timer::Timer(double seconds) {
-    assert_only_one_timer(1);
-    set_interrupt_handler();
-    // Initialize timer.
-    itimerspec value;
-    //TODO(tim.simpson): Valgrind thinks id is not initialized.
-    // However even if you use memset on it this error will not go away.
-    // http://stackoverflow.com/questions/6122594/timer-create-gives-memory-leaks-issue-syscall-param-timer-createevp-points-to
-    // ;_;
-    LogPtr log = Log::get_instance();
-    checkEqual0(log, timer_create(CLOCK_REALTIME, NULL, &id),
-                IOException::TIMER_ENABLE_ERROR);
-    value.it_value = timespec_from_seconds(seconds);
-    value.it_interval = timespec_from_seconds(0.0);  // Not periodic.
-    time_out_occurred() = false;
-    // 0 for relative time.
-    checkEqual0(log, timer_settime(id, 0, &value, NULL),
-                IOException::TIMER_ENABLE_ERROR);
-}
-
-Timer::~Timer() {
-    assert_only_one_timer(-1);
-    LogPtr log = Log::get_instance();
-    if (0 != ::timer_delete(id)) {
-        NOVA_LOG_ERROR("Error deleting timer! OH NO! : %s", strerror(errno));
+Timer::Timer(double seconds)
+:   previous_deadline(thread_deadline)
+{
+    const double deadline = monotonic_now() + seconds;
+    if (0.0 == thread_deadline || deadline < thread_deadline) {
+        thread_deadline = deadline;
     }
-    time_out_occurred() = false;
-    remove_interrupt_handler();
 }
 
-void Timer::interrupt(int signal_number, siginfo_t * info,
-                             void * context) {
-    NOVA_LOG_ERROR("Interruptin'");
-    time_out_occurred() = true;
-    remove_interrupt_handler();
-    //raise(SIGALRM);
-    //signal(SIGALRM, SIG_IGN);
+Timer::~Timer() {
+    thread_deadline = previous_deadline;
 }
 
-void Timer::remove_interrupt_handler() {
-    // Unblock all signals. The alarm may happen right now.
-    sigset_t blocked_signals;
-    sigemptyset(&blocked_signals);         /* Block SIGINT */
-    sigaddset(&blocked_signals, SIGALRM);
-    sigprocmask(SIGALRM, &blocked_signals, NULL);
-
-    // Remove signal handler
-    struct sigaction action;
-    action.sa_flags = SA_RESETHAND;
-    action.sa_sigaction = NULL;
-    if ((sigemptyset(&action.sa_mask) == -1) ||
-        (sigaction(SIGALRM, &action, NULL) == -1)) {
-        throw IOException(IOException::SIGNAL_HANDLER_DESTROY_ERROR);
+optional<double> Timer::limit(optional<double> seconds) {
+    if (0.0 == thread_deadline) {
+        return seconds;
     }
-}
-
-void Timer::set_interrupt_handler() {
-    // Block the very signal we're generating so nothing catches it.
-    sigset_t blocked_signals;
-    sigemptyset(&blocked_signals);         /* Block SIGINT */
-    sigaddset(&blocked_signals, SIGALRM);
-    sigprocmask(SIGALRM, &blocked_signals, NULL);
-
-    struct sigaction action;
-    action.sa_handler = SIG_IGN;
-    action.sa_flags = SA_SIGINFO;
-    action.sa_sigaction = interrupt;
-    if ((sigemptyset(&action.sa_mask) == -1) ||
-        (sigaction(SIGALRM, &action, NULL) == -1)) {
-        throw IOException(IOException::SIGNAL_HANDLER_INITIALIZE_ERROR);
+    const double remaining = std::max(0.0, thread_deadline - monotonic_now());
+    if (!seconds || remaining < seconds.get()) {
+        return remaining;
     }
+    return seconds;
 }
 
-bool & Timer::time_out_occurred() {
-    static bool time_out(false);
-    return time_out;
+bool Timer::time_out_occurred() {
+    return 0.0 != thread_deadline && monotonic_now() >= thread_deadline;
 }
 
 
@@ -288,9 +259,21 @@ size_t read_with_throw(int fd, char * const buf, size_t count) {
     return (size_t) bytes_read;
 }
 
+optional<size_t> read_if_ready(int fd, char * const buf, size_t count) {
+    ssize_t bytes_read;
+    while ((bytes_read = ::read(fd, buf, count)) < 0 && errno == EINTR) {
+    }
+    if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return boost::none;
+    }
+    LogPtr log = Log::get_instance();
+    checkGE0(log, bytes_read, IOException::READ_ERROR);
+    return optional<size_t>((size_t) bytes_read);
+}
+
 // Throws exceptions if errors are detected.
-// Also unblocks time out signals before proceeding and throws
-// ProcessTimeOutExceptions if they happen.
+// If a Timer is active on this thread the wait is cut short at its deadline,
+// in which case a TimeOutException is thrown.
 int select_with_throw(int nfds, fd_set * readfds, fd_set * writefds,
                       fd_set * errorfds, optional<double> seconds) {
     NOVA_LOG_TRACE("select_with_throw, seconds for timeout? %f",
@@ -300,35 +283,23 @@ int select_with_throw(int nfds, fd_set * readfds, fd_set * writefds,
                        "time out exception is being thrown.");
         throw TimeOutException();
     }
-    timespec time_out = timespec_from_seconds(!seconds ? 0.0 : seconds.get());
     sigset_t empty_set;
     sigemptyset(&empty_set);
     // Unblock all signals for the duration of select.
     int ready = -1;
     while(ready < 0)
     {
-        //TODO(tim.simpson): Consider surrounding this call with the
-        //                   assert_only_one_timer calls seen in the Timer
-        //                   class.
+        const optional<double> wait = Timer::limit(seconds);
+        timespec time_out = timespec_from_seconds(!wait ? 0.0 : wait.get());
         ready = pselect(nfds, readfds, writefds, errorfds,
-                        (!seconds ? NULL: &time_out), &empty_set);
-        if (ready == 0) {
-            // Zero can be returned if there are no file descriptors with data,
-            // meaning the time out was triggered.
-            if (Timer::time_out_occurred()) {
-                throw TimeOutException();
-            }
+                        (!wait ? NULL: &time_out), &empty_set);
+        if (ready == 0 && wait != seconds) {
+            // Nothing had data before the Timer's deadline.
+            throw TimeOutException();
         }
         if (ready < 0) {
             if (errno == EINTR) {
-                // Not sure if throwing this is 100% accurate, though it is
-                // possible pselect could be interrupted by the Timer class
-                // which sets a signal.
-                if (Timer::time_out_occurred()) {
-                    throw TimeOutException();
-                } else {
-                    NOVA_LOG_ERROR("pselect was interrupted, restarting.");
-                }
+                NOVA_LOG_ERROR("pselect was interrupted, restarting.");
             } else {
                 NOVA_LOG_ERROR("Select returned < 0. errno = %d: %s\n "
                                 "EINTR=%d", errno, strerror(errno), EINTR);
@@ -339,26 +310,103 @@ int select_with_throw(int nfds, fd_set * readfds, fd_set * writefds,
     return ready;
 }
 
-int wait_pid_with_throw(pid_t pid, int * status, int options) {
+int poll_with_throw(pollfd * fds, nfds_t nfds, optional<double> seconds) {
     if (Timer::time_out_occurred()) {
-        NOVA_LOG_ERROR("Not even attempting a waitpid call as an unhandled"
+        NOVA_LOG_ERROR("Not even attempting a poll call as an unhandled"
                        "time out exception is being thrown.");
         throw TimeOutException();
     }
-    int child_pid;
-    while(((child_pid = ::waitpid(pid, status, options)) == -1)
-          && (errno == EINTR)) {
-        if (errno == EINTR) {
-            if (Timer::time_out_occurred()) {
-                throw TimeOutException();
+    sigset_t empty_set;
+    sigemptyset(&empty_set);
+    int ready = -1;
+    while(ready < 0)
+    {
+        const optional<double> wait = Timer::limit(seconds);
+        timespec time_out = timespec_from_seconds(!wait ? 0.0 : wait.get());
+        ready = ::ppoll(fds, nfds, (!wait ? NULL: &time_out), &empty_set);
+        if (ready == 0 && wait != seconds) {
+            throw TimeOutException();
+        }
+        if (ready < 0) {
+            if (errno == EINTR) {
+                NOVA_LOG_ERROR("ppoll was interrupted, restarting.");
             } else {
-                NOVA_LOG_ERROR("waitpid was interrupted, retrying.");
+                NOVA_LOG_ERROR("ppoll returned < 0. errno = %d: %s\n "
+                               "EINTR=%d", errno, strerror(errno), EINTR);
+                throw IOException(IOException::GENERAL);
+            }
+        }
+    }
+    return ready;
+}
+
+namespace {
+
+    /* Waits for the process to exit without reaping it, giving up at the
+     * current Timer's deadline. */
+    void wait_for_exit_until_deadline(pid_t pid) {
+        #ifdef SYS_pidfd_open
+            const int pid_fd = ::syscall(SYS_pidfd_open, pid, 0);
+            if (pid_fd >= 0) {
+                pollfd poll_fd;
+                poll_fd.fd = pid_fd;
+                poll_fd.events = POLLIN;
+                poll_fd.revents = 0;
+                try {
+                    poll_with_throw(&poll_fd, 1, boost::none);
+                } catch(const TimeOutException & toe) {
+                    ::close(pid_fd);
+                    throw;
+                }
+                ::close(pid_fd);
+                return;
             }
-        } else {
-            NOVA_LOG_ERROR("Error calling waitpid:%s", strerror(errno));
-            throw IOException(IOException::WAITPID_ERROR);
+        #endif
+        // No pidfds on this kernel, so check in now and then. Signalfd
+        // isn't an option as it needs SIGCHLD blocked in every thread.
+        siginfo_t info;
+        double nap = 0.001;
+        while(true) {
+            info.si_pid = 0;
+            const int result = ::waitid(P_PID, pid, &info,
+                                        WEXITED | WNOHANG | WNOWAIT);
+            if (result == 0) {
+                if (info.si_pid != 0) {
+                    return;
+                }
+            } else if (errno != EINTR) {
+                return;  // ECHILD or worse; let waitpid report it.
+            }
+            const double wait = Timer::limit(nap).get();
+            if (wait <= 0.0) {
+                throw TimeOutException();
+            }
+            const timespec time = timespec_from_seconds(wait);
+            nanosleep(&time, NULL);
+            nap = std::min(nap * 2, 0.05);
         }
     }
+
+}
+
+int wait_pid_with_throw(pid_t pid, int * status, int options) {
+    if (!(options & WNOHANG)) {
+        if (Timer::time_out_occurred()) {
+            NOVA_LOG_ERROR("Not even attempting a waitpid call as an unhandled"
+                           "time out exception is being thrown.");
+            throw TimeOutException();
+        }
+        if (pid > 0 && !!Timer::limit(boost::none)) {
+            // Rather than have a signal interrupt waitpid, wait for the exit
+            // in a way that can time out and then reap it.
+            wait_for_exit_until_deadline(pid);
+        }
+    }
+    int child_pid;
+    while(((child_pid = ::waitpid(pid, status, options)) == -1)
+          && (errno == EINTR)) {
+        NOVA_LOG_ERROR("waitpid was interrupted, retrying.");
+    }
     return child_pid;
 }
 
@@ -2,6 +2,7 @@
 #define _NOVA_UTILS_IO_H
 
 #include <boost/optional.hpp>
+#include <poll.h>
 #include <sys/select.h>
 #include <signal.h>
 #include <time.h>
@@ -59,6 +60,13 @@ class Pipe : private boost::noncopyable
             return is_open[OUT];
         }
 
+        /** Asks the kernel to resize the pipe's buffer (F_SETPIPE_SZ) so a
+         *  chatty writer can get further ahead of the reader, meaning fewer
+         *  wake ups and reads. Unprivileged processes are capped at
+         *  /proc/sys/fs/pipe-max-size, so failure isn't fatal; the actual
+         *  capacity of the pipe is returned either way. */
+        size_t set_capacity(size_t bytes);
+
     private:
 
         int fd[2];
@@ -69,9 +77,11 @@ class Pipe : private boost::noncopyable
 
 
 /**
- * Create this to cause the functions here to throw TimeOutExceptions.
- * Only one of these can be used at a time. Unexpected behavior may
- * occur if multiple timers are used at once.
+ * Create this to put a deadline on the wait functions here, which throw
+ * TimeOutExceptions once it passes. The deadline belongs to the thread that
+ * created the Timer, so several threads can each time their own operations.
+ * Timers can be nested: the earliest deadline wins, and the previous one is
+ * restored when the inner Timer is destroyed.
  */
 class Timer : boost::noncopyable {
     public:
@@ -79,20 +89,18 @@ class Timer : boost::noncopyable {
 
         ~Timer();
 
-        static void interrupt(int signal_number, siginfo_t * info,
-                              void * context);
-
-        static void remove_interrupt_handler();
-
-        static void set_interrupt_handler();
+        /** Shortens a wait of "seconds" (none meaning forever) so it ends
+         *  by this thread's deadline, if there is one. */
+        static boost::optional<double> limit(boost::optional<double> seconds);
 
-        static bool & time_out_occurred();
+        /** True if this thread's deadline has passed. */
+        static bool time_out_occurred();
 
     private:
         Timer(const Timer &);
         Timer & operator = (const Timer &);
 
-        timer_t id;
+        double previous_deadline;
 };
 
 bool is_directory(const char * directory_path);
@@ -106,15 +114,27 @@ void ls(const std::string & directory, std::vector<std::string> & output);
 /** Throws exceptions if errors are detected. */
 size_t read_with_throw(int fd, char * const buf, size_t count);
 
+/** Reads from a non-blocking file descriptor without waiting. Returns
+ *  boost::none if no data is available yet (EAGAIN), otherwise the number of
+ *  bytes read (zero meaning EOF). Throws exceptions for any other errors. */
+boost::optional<size_t> read_if_ready(int fd, char * const buf, size_t count);
+
 /** Throws exceptions if errors are detected.
- * Also unblocks time out signals before proceeding and throws
- * ProcessTimeOutExceptions if they happen. */
+ * Waits no longer than the current thread's Timer allows, throwing
+ * TimeOutException if its deadline is what ended the wait. */
 int select_with_throw(int nfds, fd_set * readfds, fd_set * writefds,
                       fd_set * errorfds, boost::optional<double> seconds);
 
 
+/** Like select_with_throw, but uses ppoll. This avoids rebuilding fd_sets
+ *  on every call and works with descriptors past FD_SETSIZE. */
+int poll_with_throw(pollfd * fds, nfds_t nfds,
+                    boost::optional<double> seconds);
+
 /** Calls the waitpid function, but automatically retries in the event
- *  of an interrupt and throws TimeOutException if a time out occurs. */
+ *  of an interrupt and throws TimeOutException if the current thread's
+ *  Timer expires first. Blocking waits on a single pid use a pidfd (or
+ *  polling on older kernels) so they can honor the deadline. */
 int wait_pid_with_throw(pid_t pid, int * status, int options);
 
 class IOException : public std::exception {
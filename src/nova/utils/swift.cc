@@ -11,6 +11,7 @@
 #include "nova/utils/Md5.h"
 #include "nova/Log.h"
 #include <boost/assign/list_of.hpp>
+#include <exception>
 
 using namespace std;
 using namespace boost;
@@ -28,6 +29,7 @@ namespace nova { namespace utils { namespace swift {
 struct SwiftUploader::SegmentInfo {
     size_t bytes_read;
     Md5 checksum; // segment checksum
+    std::exception_ptr error;  // Thrown by the input, rethrown after Curl.
     Md5 & file_checksum; // total file checksum
     SwiftUploader::Input & input;
     SwiftUploader & writer;
@@ -36,6 +38,7 @@ struct SwiftUploader::SegmentInfo {
                 Md5 & file_checksum)
     :   bytes_read(0),
         checksum(),
+        error(),
         file_checksum(file_checksum),
         input(input),
         writer(writer)
@@ -62,7 +65,14 @@ struct SwiftUploader::SegmentInfo {
     static size_t curl_callback(void * ptr, size_t size, size_t nmemb,
                                 void * user_ptr) {
         auto * self = reinterpret_cast<SegmentInfo *>(user_ptr);
-        return self->callback(reinterpret_cast<char *>(ptr), size * nmemb);
+        // Exceptions can't unwind through Curl, so stop the upload and save
+        // the exception for later.
+        try {
+            return self->callback(reinterpret_cast<char *>(ptr), size * nmemb);
+        } catch(...) {
+            self->error = std::current_exception();
+            return CURL_READFUNC_ABORT;
+        }
     }
 };
 
@@ -234,7 +244,8 @@ SwiftUploader::SwiftUploader(const string & token,
     swift_checksum(),
     file_info(file_info),
     file_number(0),
-    max_bytes(max_bytes)
+    max_bytes(max_bytes),
+    uploaded(0)
 {
 }
 
@@ -348,13 +359,22 @@ string SwiftUploader::write_segment(const string & url,
     session.set_opt(CURLOPT_READDATA, &info);
 
     /* Let's do this! */
-    session.perform(list_of(201)(202));
+    try {
+        session.perform(list_of(201)(202));
+    } catch(...) {
+        if (info.error) {
+            std::rethrow_exception(info.error);
+        }
+        throw;
+    }
 
     const string checksum = info.checksum.finalize();
-    return await_etag_match(url, checksum,
+    const string etag = await_etag_match(url, checksum,
         "Checksum match failed on segment.",
         SwiftException::SWIFT_UPLOAD_SEGMENT_CHECKSUM_MATCH_FAIL,
         false);
+    uploaded += info.bytes_read;
+    return etag;
 }
 
 string SwiftUploader::write(SwiftUploader::Input & input){
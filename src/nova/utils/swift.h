@@ -142,6 +142,11 @@ public:
                   const SwiftFileInfo & file_info,
                   const int checksum_wait_time);
 
+    /* Bytes in the segments Swift has confirmed so far. */
+    unsigned long long bytes_uploaded() const {
+        return uploaded;
+    }
+
     std::string write(Input & reader);
 
 private:
@@ -153,6 +158,7 @@ private:
     SwiftFileInfo file_info;
     int file_number;
     const size_t max_bytes;
+    unsigned long long uploaded;
 
     std::string await_etag_match(const std::string & url,
                                  const std::string & checksum,
@@ -1,12 +1,22 @@
 #include "pch.hpp"
 #include "threads.h"
+#include <algorithm>
+#include <boost/foreach.hpp>
+#include <boost/optional.hpp>
 #include "../Log.h"
+#include <time.h>
 
 namespace nova { namespace utils {
 
 
 namespace {
 
+    double monotonic_now() {
+        timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return now.tv_sec + now.tv_nsec / 1000000000.0;
+    }
+
     void * thread_start(void * arg) {
         Thread::Runner & runner = *(reinterpret_cast<Thread::Runner *>(arg));
         runner();
@@ -67,6 +77,75 @@ Thread::~Thread() {
 }
 
 
+/**---------------------------------------------------------------------------
+ *- CancellationToken
+ *---------------------------------------------------------------------------*/
+
+CancellationToken::CancellationToken()
+:   state(new State())
+{
+    state->cancelled = false;
+}
+
+void CancellationToken::cancel() {
+    boost::lock_guard<boost::mutex> lock(state->mutex);
+    state->cancelled = true;
+}
+
+bool CancellationToken::is_cancelled() const {
+    boost::lock_guard<boost::mutex> lock(state->mutex);
+    return state->cancelled;
+}
+
+void CancellationToken::throw_if_cancelled() const {
+    if (is_cancelled()) {
+        throw ThreadException(ThreadException::JOB_CANCELLED);
+    }
+}
+
+
+/**---------------------------------------------------------------------------
+ *- JobProgress
+ *---------------------------------------------------------------------------*/
+
+JobProgress::JobProgress()
+:   bytes_read(0),
+    bytes_processed(0),
+    bytes_written(0),
+    elapsed(0)
+{
+}
+
+double JobProgress::throughput() const {
+    return elapsed > 0 ? bytes_read / elapsed : 0;
+}
+
+
+/**---------------------------------------------------------------------------
+ *- Job
+ *---------------------------------------------------------------------------*/
+
+Job::Job()
+:   progress_callback(0),
+    token()
+{
+}
+
+void Job::cancel() {
+    token.cancel();
+}
+
+void Job::report_progress(const JobProgress & progress) const {
+    if (progress_callback) {
+        (*progress_callback)(*this, progress);
+    }
+}
+
+void Job::set_progress_callback(ProgressCallback * callback) {
+    progress_callback = callback;
+}
+
+
 /**---------------------------------------------------------------------------
  *- ThreadException
  *---------------------------------------------------------------------------*/
@@ -92,6 +171,10 @@ const char * ThreadException::what() const throw() {
             return "Error constructing thread.";
         case DTOR_ERROR:
             return "Error destroying thread.";
+        case JOB_CANCELLED:
+            return "The job was cancelled.";
+        case SCHEDULER_SHUT_DOWN:
+            return "The job scheduler is shutting down.";
         default:
             return "An error occurred.";
     }
@@ -99,38 +182,88 @@ const char * ThreadException::what() const throw() {
 
 
 /**---------------------------------------------------------------------------
- *- ThreadBasedJobRunner
+ *- JobScheduler
  *---------------------------------------------------------------------------*/
 
-ThreadBasedJobRunner::ThreadBasedJobRunner()
+JobScheduler::JobScheduler()
 :   condition(),
-    job(0),
+    limits(),
     mutex(),
-    shutdown_completed(false),
-    shutdown_requested(false)
+    next_id(1),
+    queue(),
+    running(),
+    running_by_type(),
+    shutdown_requested(false),
+    totals(),
+    total_wait(0),
+    worker_count(0)
 {
+    totals.queue_depth = 0;
+    totals.running = 0;
+    totals.started = 0;
+    totals.last_wait = 0;
+    totals.max_wait = 0;
+    totals.average_wait = 0;
 }
 
-ThreadBasedJobRunner::~ThreadBasedJobRunner() {
-    if (0 != job) {
-        NOVA_LOG_ERROR("Destroying the job runner, but the last job was never "
-                       "finished!");
-        delete job;
-        job = 0;
+JobScheduler::~JobScheduler() {
+    boost::lock_guard<boost::mutex> lock(mutex);
+    if (!running.empty()) {
+        NOVA_LOG_ERROR("Destroying the job scheduler, but %d jobs were never "
+                       "finished!", (int) running.size());
+    }
+    BOOST_FOREACH(Entry & entry, queue) {
+        delete entry.job;
     }
 }
 
-void ThreadBasedJobRunner::execute_job() {
-    if (0 == job) {
-        NOVA_LOG_ERROR("Error- can't execute null job!");
-        return;
+void JobScheduler::abandon(const Entry & entry) {
+    // Outside the lock, as the job may take a while to report itself.
+    try {
+        entry.job->abandon();
+    } catch(const std::exception & e) {
+        NOVA_LOG_ERROR("Error abandoning job %lu: %s", entry.id, e.what());
+    } catch(...) {
+        NOVA_LOG_ERROR("Error abandoning job %lu! Exception type unknown.",
+                       entry.id);
     }
-    NOVA_LOG_INFO("Running job!");
+    delete entry.job;
+}
+
+bool JobScheduler::cancel(JobId id) {
+    boost::optional<Entry> abandoned;
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        for (std::list<Entry>::iterator itr = queue.begin();
+             itr != queue.end(); ++ itr) {
+            if (itr->id == id) {
+                NOVA_LOG_INFO("Removing job %lu from the queue.", id);
+                abandoned = *itr;
+                queue.erase(itr);
+                break;
+            }
+        }
+        if (!abandoned) {
+            std::map<JobId, Entry>::iterator itr = running.find(id);
+            if (itr == running.end()) {
+                return false;
+            }
+            NOVA_LOG_INFO("Cancelling running job %lu.", id);
+            itr->second.job->cancel();
+            return true;
+        }
+    }
+    abandon(abandoned.get());
+    return true;
+}
+
+void JobScheduler::execute_job(Entry & entry) {
+    NOVA_LOG_INFO("Running job %lu (%s)!", entry.id, entry.type.c_str());
 #ifndef _DEBUG
     try {
 #endif
-        (*job)();
-        NOVA_LOG_INFO("Job finished successfully.");
+        (*entry.job)();
+        NOVA_LOG_INFO("Job %lu finished successfully.", entry.id);
 #ifndef _DEBUG
     } catch (const std::exception & e) {
         NOVA_LOG_ERROR("Error running job!: %s", e.what());
@@ -140,77 +273,152 @@ void ThreadBasedJobRunner::execute_job() {
 #endif
     {
         boost::lock_guard<boost::mutex> lock(mutex);
-        delete job;  // Kill job variable.
-        job = 0;
+        running.erase(entry.id);
+        -- running_by_type[entry.type];
     }
+    delete entry.job;
+    // Another job of the same type may be waiting, and shutdown waits for
+    // running jobs, so everyone needs to look again.
+    condition.notify_all();
 }
 
-void ThreadBasedJobRunner::operator()() {
+bool JobScheduler::is_idle() {
+    boost::lock_guard<boost::mutex> lock(mutex);
+    return queue.empty() && running.empty();
+}
+
+std::list<JobScheduler::Entry>::iterator JobScheduler::next_runnable() {
+    for (std::list<Entry>::iterator itr = queue.begin(); itr != queue.end();
+         ++ itr) {
+        std::map<std::string, size_t>::const_iterator limit
+            = limits.find(itr->type);
+        if (limit == limits.end() || limit->second == 0
+            || running_by_type[itr->type] < limit->second) {
+            return itr;
+        }
+    }
+    return queue.end();
+}
+
+void JobScheduler::operator()() {
     Log::initialize_job_thread();
-    NOVA_LOG_INFO("Starting Job Runner thread...");
-    while(!is_shutdown_requested()) {
-        NOVA_LOG_INFO("Waiting for job...");
-        {
-            while (_is_idle() && !is_shutdown_requested()) {
-                boost::posix_time::seconds time(1);
-                boost::this_thread::sleep(time);
-            }
+    NOVA_LOG_INFO("Starting job worker thread...");
+    boost::unique_lock<boost::mutex> lock(mutex);
+    while(true) {
+        std::list<Entry>::iterator next = queue.end();
+        while(!shutdown_requested
+              && (next = next_runnable()) == queue.end()) {
+            condition.wait(lock);
         }
-        if (!is_shutdown_requested()) {
-            execute_job();
+        if (shutdown_requested) {
+            break;
         }
+        Entry entry = *next;
+        queue.erase(next);
+        running[entry.id] = entry;
+        ++ running_by_type[entry.type];
+
+        const double wait = monotonic_now() - entry.queued_at;
+        ++ totals.started;
+        totals.last_wait = wait;
+        totals.max_wait = std::max(totals.max_wait, wait);
+        total_wait += wait;
+
+        lock.unlock();
+        execute_job(entry);
+        lock.lock();
     }
-    {
-        boost::lock_guard<boost::mutex> lock(mutex);
-        shutdown_completed = true;
-    }
+    -- worker_count;
+    condition.notify_all();
 }
 
-bool ThreadBasedJobRunner::is_idle() {
-    boost::lock_guard<boost::mutex> lock(mutex);
-    return _is_idle();
+bool JobScheduler::run(const Job & job) {
+    try {
+        submit(job);
+        return true;
+    } catch(const ThreadException & te) {
+        NOVA_LOG_ERROR("Can't run job: %s", te.what());
+        return false;
+    }
 }
 
-bool ThreadBasedJobRunner::_is_idle() {
-    return 0 == job;
+void JobScheduler::set_limit(const char * type, size_t max_running) {
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        limits[type] = max_running;
+    }
+    condition.notify_all();
 }
 
-bool ThreadBasedJobRunner::is_shutdown_completed() {
-    boost::lock_guard<boost::mutex> lock(mutex);
-    return shutdown_completed;
+void JobScheduler::start(size_t count, size_t stack_size) {
+    for (size_t i = 0; i < count; i ++) {
+        {
+            boost::lock_guard<boost::mutex> lock(mutex);
+            ++ worker_count;
+        }
+        try {
+            Thread worker(stack_size, *this);
+        } catch(const ThreadException & te) {
+            boost::lock_guard<boost::mutex> lock(mutex);
+            -- worker_count;
+            throw;
+        }
+    }
 }
 
-bool ThreadBasedJobRunner::is_shutdown_requested() {
+JobScheduler::Stats JobScheduler::stats() {
     boost::lock_guard<boost::mutex> lock(mutex);
-    return shutdown_requested;
+    Stats rtn = totals;
+    rtn.queue_depth = queue.size();
+    rtn.running = running.size();
+    rtn.average_wait = totals.started > 0 ? total_wait / totals.started : 0;
+    return rtn;
 }
 
-bool ThreadBasedJobRunner::run(const Job & job) {
+JobScheduler::JobId JobScheduler::submit(const Job & job) {
+    JobId id;
     {
         boost::lock_guard<boost::mutex> lock(mutex);
-        if (!_is_idle()) {
-            NOVA_LOG_INFO("Can't run job because thread isn't idle.");
-            return false;
+        if (shutdown_requested) {
+            throw ThreadException(ThreadException::SCHEDULER_SHUT_DOWN);
+        }
+        Entry entry;
+        entry.id = id = next_id ++;
+        entry.job = job.clone();
+        entry.priority = job.priority();
+        entry.type = job.type();
+        entry.queued_at = monotonic_now();
+        // Keep the queue sorted by priority, first come first served.
+        std::list<Entry>::iterator itr = queue.begin();
+        while(itr != queue.end() && itr->priority >= entry.priority) {
+            ++ itr;
         }
-        this->job = job.clone();
+        queue.insert(itr, entry);
+        NOVA_LOG_INFO("Queued job %lu (%s), %d jobs waiting.", id,
+                      entry.type.c_str(), (int) queue.size());
     }
-    condition.notify_one();
-    return true;
+    condition.notify_all();
+    return id;
 }
 
-void ThreadBasedJobRunner::shutdown() {
-    {
-        boost::lock_guard<boost::mutex> lock(mutex);
-        shutdown_requested = true;
-    }
-    while(!is_shutdown_completed()) {
-        boost::posix_time::seconds time(1);
-        boost::this_thread::sleep(time);
+void JobScheduler::shutdown() {
+    boost::unique_lock<boost::mutex> lock(mutex);
+    shutdown_requested = true;
+    if (!queue.empty()) {
+        NOVA_LOG_INFO("Abandoning %d queued jobs.", (int) queue.size());
+        // Nothing is queued once shutdown is requested, so the lock can be
+        // let go while the jobs report themselves.
+        std::list<Entry> abandoned;
+        abandoned.swap(queue);
+        lock.unlock();
+        BOOST_FOREACH(const Entry & entry, abandoned) {
+            abandon(entry);
+        }
+        lock.lock();
     }
-
-    {
-        boost::lock_guard<boost::mutex> lock(mutex);
-        shutdown_completed = true;
+    condition.notify_all();
+    while(worker_count > 0 || !running.empty()) {
+        condition.wait(lock);
     }
 }
 
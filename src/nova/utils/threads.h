@@ -2,9 +2,13 @@
 #define _NOVA_UTILS_THREADS_H
 
 #include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
 #include <functional>
+#include <list>
+#include <map>
 #include <pthread.h>
 #include <boost/shared_ptr.hpp>
+#include <string>
 #include <boost/utility.hpp>
 
 
@@ -43,7 +47,9 @@ class ThreadException : public std::exception {
             ATTR_INIT_ERROR,
             ATTR_SET_STACKSIZE_ERROR,
             CTOR_ERROR,
-            DTOR_ERROR
+            DTOR_ERROR,
+            JOB_CANCELLED,
+            SCHEDULER_SHUT_DOWN
         };
 
         ThreadException(Code code) throw();
@@ -57,16 +63,107 @@ class ThreadException : public std::exception {
 };
 
 
-/* A class which runs an action when called and can be safely cloned. */
+/* A flag a job checks now and then to see if it should stop. Copies share
+ * the same flag, so it can be handed to whatever the job is waiting on. */
+class CancellationToken {
+public:
+    CancellationToken();
+
+    void cancel();
+
+    bool is_cancelled() const;
+
+    /* Throws ThreadException with the code JOB_CANCELLED if cancel was
+     * called. */
+    void throw_if_cancelled() const;
+
+private:
+    struct State {
+        boost::mutex mutex;
+        bool cancelled;
+    };
+
+    boost::shared_ptr<State> state;
+};
+
+
+/* How far along a job is. Jobs which read, transform and write a stream of
+ * data (like backups) fill in all three counts; others use what fits. */
+struct JobProgress {
+    unsigned long long bytes_read;
+    unsigned long long bytes_processed;
+    unsigned long long bytes_written;
+    double elapsed;  // Seconds since the job started.
+
+    JobProgress();
+
+    /* Bytes read per second. */
+    double throughput() const;
+};
+
+
+/* A class which runs an action when called and can be safely cloned.
+ * Copies share the cancellation token and progress callback. */
 class Job {
 public:
+    /* Told about a job's progress. Called on the job's thread. */
+    class ProgressCallback {
+    public:
+        virtual ~ProgressCallback()
+        {
+        }
+
+        virtual void operator()(const Job & job,
+                                const JobProgress & progress) = 0;
+    };
+
+    Job();
+
     virtual ~Job()
     {
     }
 
     virtual void operator()() = 0;
 
+    /* Called instead of operator() when the job is cancelled while it's
+     * still queued, so it can tell whoever is waiting on it. Called from the
+     * cancelling thread. Does nothing by default. */
+    virtual void abandon()
+    {
+    }
+
     virtual Job * clone() const = 0;
+
+    /* Asks a running job to stop early by cancelling its token. Jobs which
+     * never check the token run to the end. Called from another thread. */
+    virtual void cancel();
+
+    const CancellationToken & cancellation() const {
+        return token;
+    }
+
+    /* Jobs with a higher priority are started first. */
+    virtual int priority() const
+    {
+        return 0;
+    }
+
+    /* Passes progress on to the callback, if there is one. */
+    void report_progress(const JobProgress & progress) const;
+
+    /* The callback isn't owned by the job and must outlive it. */
+    void set_progress_callback(ProgressCallback * callback);
+
+    /* Names the kind of job, so the number of jobs of each kind running at
+     * once can be limited. */
+    virtual const char * type() const
+    {
+        return "default";
+    }
+
+private:
+    ProgressCallback * progress_callback;
+    CancellationToken token;
 };
 
 
@@ -81,46 +178,102 @@ public:
 };
 
 
-/* A class which operates a job runner on another thread. */
-class ThreadBasedJobRunner
+/* Runs jobs on a pool of worker threads. Jobs wait in a single queue
+ * ordered by priority and then by the order they were submitted in. A worker
+ * takes the first queued job whose type is under its limit, so a long job
+ * (such as a backup) only holds up jobs of its own type. */
+class JobScheduler
 :   public JobRunner,
-    public Thread::Runner,
+    private Thread::Runner,
     private boost::noncopyable
 {
 public:
-    ThreadBasedJobRunner();
+    typedef unsigned long JobId;
+
+    struct Stats {
+        size_t queue_depth;
+        size_t running;
+        unsigned long started;
+        double last_wait;     // Seconds the last job to start was queued.
+        double max_wait;
+        double average_wait;
+    };
 
-    virtual ~ThreadBasedJobRunner();
+    JobScheduler();
 
-    virtual bool is_idle();
+    virtual ~JobScheduler();
 
-    virtual void operator()();
+    /* Removes the job from the queue and calls its abandon method, or if
+     * it's already running calls its cancel method. Returns false if there
+     * is no such job. */
+    bool cancel(JobId id);
+
+    /* True if nothing is running or queued. */
+    virtual bool is_idle();
 
+    /* Queues a copy of the job. Returns false if the scheduler is shutting
+     * down. */
     virtual bool run(const Job & job);
 
-    /* Shuts down the runner, causing its thread to exit.
-     * This is not a big deal in production but is necessary for unit tests. */
+    /* Limits how many jobs of the given type may run at once. Zero means
+     * there is no limit, which is the default. */
+    void set_limit(const char * type, size_t max_running);
+
+    /* Creates the worker threads. */
+    void start(size_t count, size_t stack_size);
+
+    Stats stats();
+
+    /* Queues a copy of the job and returns an id which can cancel it.
+     * Throws ThreadException if the scheduler is shutting down. */
+    JobId submit(const Job & job);
+
+    /* Stops starting jobs, abandons the ones still queued and waits for
+     * the running ones to finish and the workers to exit. */
     void shutdown();
-private:
-    boost::condition_variable condition;
 
-    void execute_job();
+private:
+    struct Entry {
+        JobId id;
+        Job * job;
+        int priority;
+        std::string type;
+        double queued_at;
+    };
 
-    bool _is_idle();
+    boost::condition_variable condition;
 
-    Job * job;
+    std::map<std::string, size_t> limits;
 
     boost::mutex mutex;
 
-    // True if the main routine has finished.
-    bool is_shutdown_completed();
+    JobId next_id;
 
-    // True if the main routine is currently running.
-    bool is_shutdown_requested();
+    std::list<Entry> queue;
 
-    bool shutdown_completed;
+    std::map<JobId, Entry> running;
+
+    std::map<std::string, size_t> running_by_type;
 
     bool shutdown_requested;
+
+    Stats totals;
+
+    double total_wait;
+
+    size_t worker_count;
+
+    // Tells a job taken off the queue it won't run, then deletes it. Must
+    // be called without the lock.
+    static void abandon(const Entry & entry);
+
+    void execute_job(Entry & entry);
+
+    // Worker thread routine.
+    virtual void operator()();
+
+    // Returns the first queued entry which may start now. Needs the lock.
+    std::list<Entry>::iterator next_runnable();
 };
 
 
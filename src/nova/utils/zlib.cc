@@ -249,14 +249,19 @@ void ZlibBase::set_output_buffer(OutputStreamPtr output) {
  *- ZlibCompressor
  *---------------------------------------------------------------------------*/
 
-ZlibCompressor::ZlibCompressor()
+ZlibCompressor::ZlibCompressor(ZlibFormat format)
 :   ZlibBase(),
     last_input(false)
 {
     MY_Z_STREAM->zalloc = Z_NULL;
     MY_Z_STREAM->zfree = Z_NULL;
     MY_Z_STREAM->opaque = Z_NULL;
-    const int result = deflateInit(MY_Z_STREAM, Z_DEFAULT_COMPRESSION);
+    // Adding 16 to the window bits makes deflate write a gzip header and
+    // trailer instead of the zlib ones.
+    const int window_bits = MAX_WBITS + (GZIP_FORMAT == format ? 16 : 0);
+    const int result = deflateInit2(MY_Z_STREAM, Z_DEFAULT_COMPRESSION,
+                                    Z_DEFLATED, window_bits, 8,
+                                    Z_DEFAULT_STRATEGY);
     if (Z_OK != result) {
         NOVA_LOG_ERROR("Error initializing deflate operation!");
         throw ZlibException();
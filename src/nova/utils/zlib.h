@@ -43,6 +43,13 @@ struct OutputStream : public InputStream{
 };
 
 
+/* What's written around the compressed data. */
+enum ZlibFormat {
+    ZLIB_FORMAT = 1,  // What deflate writes by default.
+    GZIP_FORMAT = 2   // Can be read by gunzip and "tar z".
+};
+
+
 typedef boost::shared_ptr<InputStream> InputStreamPtr;
 
 typedef boost::shared_ptr<OutputStream> OutputStreamPtr;
@@ -114,7 +121,7 @@ class ZlibBase {
 
 class ZlibCompressor : public ZlibBase {
     public:
-        ZlibCompressor();
+        ZlibCompressor(ZlibFormat format=ZLIB_FORMAT);
 
         ~ZlibCompressor();
 
@@ -70,7 +70,7 @@ using nova::rpc::ResilientSenderPtr;
 using namespace nova::rpc;
 using std::string;
 using nova::utils::Thread;
-using nova::utils::ThreadBasedJobRunner;
+using nova::utils::JobScheduler;
 using nova::VolumeManager;
 using std::vector;
 
@@ -116,7 +116,7 @@ struct Func {
     boost::tuple<vector<MessageHandlerPtr>, PeriodicTasksPtr>
         operator() (const FlagValues & flags,
                     ResilientSenderPtr & sender,
-                    ThreadBasedJobRunner & job_runner)
+                    JobScheduler & job_runner)
     {
         /* Create JSON message handlers. */
         vector<MessageHandlerPtr> handlers;
@@ -141,7 +141,7 @@ struct Func {
 
         Interrogator interrogator(MOUNT_POINT);
         MessageHandlerPtr handler_interrogator(
-            new InterrogatorMessageHandler(interrogator));
+            new InterrogatorMessageHandler(interrogator, &job_runner));
         handlers.push_back(handler_interrogator);
 
         handlers.push_back(handler_redis);
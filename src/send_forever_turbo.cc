@@ -11,7 +11,7 @@ using nova::guest::agent::execute_main;
 using namespace nova::flags;
 using namespace nova::guest;
 using namespace nova::rpc;
-using nova::utils::ThreadBasedJobRunner;
+using nova::utils::JobScheduler;
 using std::vector;
 using nova::JsonData;
 using nova::JsonDataPtr;
@@ -65,7 +65,7 @@ struct Func {
     boost::tuple<vector<MessageHandlerPtr>, EmptyAppUpdatePtr>
         operator() (const FlagValues & flags,
                     ResilientSenderPtr & sender,
-                    ThreadBasedJobRunner & job_runner)
+                    JobScheduler & job_runner)
     {
         quit = false;
 
@@ -0,0 +1,44 @@
+#include "pch.hpp"
+#include <boost/assign/list_of.hpp>
+#include <fcntl.h>
+#include "nova/Log.h"
+#include "nova/process_helper.h"
+#include <string>
+#include <unistd.h>
+
+using namespace boost::assign;
+using nova::LogApiScope;
+using nova::LogOptions;
+using nova::process::ProcessHelperWhitelist;
+using std::string;
+
+/*
+ * Started once by the agent with sudo. Runs the commands it's sent over
+ * STDIN (a Unix socket) as root and answers over the same socket, exiting
+ * when the agent closes it. See nova/process_helper.h.
+ *
+ * Only the exact commands below may be run, arguments included, so access
+ * to this helper isn't the same as blanket sudo access.
+ */
+int main(int argc, char* argv[]) {
+    // STDOUT is the socket, so logging anywhere near it would corrupt the
+    // replies. The agent also leaves STDERR closed; point it at /dev/null so
+    // nothing we open lands on descriptor 2 by accident.
+    if (::fcntl(STDERR_FILENO, F_GETFD) < 0) {
+        const int dev_null = ::open("/dev/null", O_WRONLY);
+        if (dev_null >= 0 && dev_null != STDERR_FILENO) {
+            ::dup2(dev_null, STDERR_FILENO);
+            ::close(dev_null);
+        }
+    }
+    LogApiScope log(LogOptions::silent());
+    ProcessHelperWhitelist whitelist;
+    whitelist.insert(list_of<string>("/usr/bin/mysqladmin")("ping"));
+    whitelist.insert(list_of<string>("/usr/sbin/mysqld")("--print-defaults"));
+    try {
+        nova::process::serve_process_helper_requests(STDIN_FILENO, whitelist);
+    } catch(const std::exception & e) {
+        return 1;
+    }
+    return 0;
+}
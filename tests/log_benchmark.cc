@@ -0,0 +1,91 @@
+#include <iostream>
+#include <boost/format.hpp>
+#include "nova/Log.h"
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <vector>
+
+using namespace nova;
+using std::string;
+
+/*
+ * Measures what logging costs the backup data path when TRACE is turned off.
+ * It copies and checksums a "backup" in 16KB chunks (the size Curl hands to
+ * the Swift upload callback) and logs the same TRACE line the callback does
+ * for each one. Takes the number of megabytes to copy.
+ *
+ * "formatted" is what NOVA_LOG_TRACE used to do: get the Log instance,
+ * format the line, then throw it away. "macro" is NOVA_LOG_TRACE as it is
+ * now; build with -DNOVA_LOG_MIN_LEVEL=NOVA_LOG_LEVEL_DEBUG to see the cost
+ * when it's compiled out.
+ */
+
+namespace {
+
+    const size_t CHUNK_SIZE = 16 * 1024;
+
+    double now() {
+        timeval tv;
+        gettimeofday(&tv, NULL);
+        return tv.tv_sec + (tv.tv_usec / 1000000.0);
+    }
+
+    enum Mode {
+        NONE,
+        FORMATTED,
+        MACRO
+    };
+
+    /* Copies "source" into "dest" once per chunk and returns a checksum so
+     * the compiler can't skip the work. */
+    unsigned long run(Mode mode, const std::vector<char> & source,
+                      std::vector<char> & dest, size_t chunks) {
+        unsigned long checksum = 0;
+        size_t total = 0;
+        for (size_t i = 0; i < chunks; i ++) {
+            memcpy(&dest[0], &source[0], CHUNK_SIZE);
+            for (size_t j = 0; j < CHUNK_SIZE; j += 64) {
+                checksum += dest[j];
+            }
+            total += CHUNK_SIZE;
+            if (mode == FORMATTED) {
+                // queue_line formats before it checks the level.
+                LogPtr log = Log::get_instance();
+                Log::queue_line(__FILE__, __LINE__, Log::LEVEL_TRACE,
+                                "Curl upload call back.\n bytes_read=%d, "
+                                "total bytes_read=%d", CHUNK_SIZE, total);
+            } else if (mode == MACRO) {
+                NOVA_LOG_TRACE("Curl upload call back.\n bytes_read=%d, "
+                               "total bytes_read=%d", CHUNK_SIZE, total);
+            }
+        }
+        return checksum;
+    }
+
+}
+
+int main(int argc, const char ** argv) {
+    const size_t megabytes = argc > 1 ? atoi(argv[1]) : 1024;
+    const size_t chunks = megabytes * 1024 * 1024 / CHUNK_SIZE;
+    LogApiScope log(LogOptions(boost::none, false, false));
+    std::vector<char> source(CHUNK_SIZE, 'x');
+    std::vector<char> dest(CHUNK_SIZE);
+
+    const char * names[] = { "no logging", "formatted", "macro" };
+    double base = 0;
+    for (int mode = NONE; mode <= MACRO; mode ++) {
+        const double start = now();
+        const unsigned long checksum = run((Mode) mode, source, dest, chunks);
+        const double elapsed = now() - start;
+        if (mode == NONE) {
+            base = elapsed;
+        }
+        std::cout << str(boost::format(
+            "%-10s %8.3fs %8.1f ns per chunk over the copy (checksum %d)")
+            % names[mode] % elapsed
+            % ((elapsed - base) * 1000000000.0 / chunks) % checksum)
+            << std::endl;
+    }
+    return 0;
+}
@@ -5,11 +5,13 @@
 #include <boost/format.hpp>
 #include <fstream>
 #include <iostream>
+#include <boost/lexical_cast.hpp>
 #include "nova/Log.h"
 #include "nova/utils/regex.h"
 #include <string>
 #include <boost/thread.hpp>
 #include <vector>
+#include <zlib.h>
 
 // Confirm the macros works everywhere by not using nova::Log.
 using boost::format;
@@ -60,7 +62,8 @@ struct LogTestsFixture {
     string log_file;
 
     LogTestsFixture(boost::optional<double> max_time_in_seconds=boost::none,
-                    bool test_append=false)
+                    bool test_append=false,
+                    boost::optional<size_t> max_size=10000)
     : log_file()
     {
         if (test_append) {
@@ -72,7 +75,7 @@ struct LogTestsFixture {
             // Otherwise, first destroy the log file.
             remove(log_file.c_str());
         }
-        LogFileOptions file_options(log_file, boost::optional<size_t>(10000),
+        LogFileOptions file_options(log_file, max_size,
                     max_time_in_seconds, 3);
         LogOptions options(optional<LogFileOptions>(file_options), false, false);
         nova::Log::initialize(options);
@@ -84,6 +87,8 @@ struct LogTestsFixture {
     }
 
     void read_file(vector<string> & lines, int index=0) {
+        // Lines are written by a background thread.
+        nova::Log::flush();
         string path = (index == 0) ? log_file
                       : (str(format("%s.%d") % log_file % index));
         std::ifstream file(path.c_str());
@@ -417,3 +422,277 @@ BOOST_AUTO_TEST_CASE(writing_some_lines_and_waiting_for_rotate) {
 
 
 }
+
+namespace {
+    void log_numbered_lines(int id, int count) {
+        for (int i = 0; i < count; i ++) {
+            NOVA_LOG_INFO("thread=%d line=%d", id, i);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(queued_lines_are_all_written_in_order) {
+    // More lines than fit in a thread's buffer, so the threads have to wait
+    // for the writer now and then.
+    const int thread_count = 4;
+    const int line_count = 3000;
+    // Far more than max_size, so leave that out to keep them in one file.
+    LogTestsFixture log_fixture(boost::none, false, boost::none);
+    {
+        vector<boost::thread *> threads;
+        for (int i = 0; i < thread_count; i ++) {
+            threads.push_back(new boost::thread(&log_numbered_lines, i,
+                                                line_count));
+        }
+        BOOST_FOREACH(boost::thread * thread, threads) {
+            thread->join();
+            delete thread;
+        }
+    }
+    vector<string> lines;
+    log_fixture.read_file(lines);
+    vector<int> next_line(thread_count, 0);
+    Regex regex("thread=([0-9]+) line=([0-9]+)");
+    BOOST_FOREACH(const string & line, lines) {
+        RegexMatchesPtr matches = regex.match(line.c_str());
+        if (!!matches) {
+            const int id = boost::lexical_cast<int>(matches->get(1));
+            const int number = boost::lexical_cast<int>(matches->get(2));
+            BOOST_REQUIRE_EQUAL(number, next_line[id]);
+            ++ next_line[id];
+        }
+    }
+    for (int i = 0; i < thread_count; i ++) {
+        BOOST_REQUIRE_EQUAL(next_line[i], line_count);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(disabled_levels_do_not_evaluate_arguments) {
+    LogTestsFixture log_fixture;  // Trace is off.
+    int calls = 0;
+    NOVA_LOG_TRACE("calls=%d", ++ calls);
+    BOOST_REQUIRE_EQUAL(calls, 0);
+    NOVA_LOG_DEBUG("calls=%d", ++ calls);
+    BOOST_REQUIRE_EQUAL(calls, 1);
+}
+
+namespace {
+    size_t file_size(const string & path) {
+        std::ifstream file(path.c_str(), std::ios::in | std::ios::ate);
+        return file.good() ? (size_t) file.tellg() : 0;
+    }
+}
+
+BOOST_AUTO_TEST_CASE(buffered_lines_wait_for_an_error) {
+    const string path = "bin/log_tests_buffered";
+    remove(path.c_str());
+    LogFileOptions file_options(path, boost::none, boost::none, 3);
+    // Long enough that only the ERROR line can cause a write.
+    nova::LogFlushPolicy flush(false, 60, 1024 * 1024);
+    nova::Log::initialize(LogOptions(file_options, false, false, flush));
+    NOVA_LOG_INFO("This waits.");
+    boost::this_thread::sleep(boost::posix_time::milliseconds(200));
+    BOOST_REQUIRE_EQUAL(file_size(path), 0);
+
+    NOVA_LOG_ERROR("This doesn't.");
+    for (int i = 0; i < 100 && file_size(path) == 0; i ++) {
+        boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+    }
+    nova::Log::shutdown();
+    std::ifstream file(path.c_str());
+    string line;
+    std::getline(file, line);
+    check_log_line("buffered line 0", line, "INFO ", "This waits\\.");
+    std::getline(file, line);
+    check_log_line("buffered line 1", line, "ERROR", "This doesn't\\.");
+}
+
+namespace {
+    string read_gzip_file(const string & path) {
+        gzFile file = gzopen(path.c_str(), "rb");
+        BOOST_REQUIRE(file != 0);
+        string contents;
+        char buffer[1024];
+        int count;
+        while((count = gzread(file, buffer, sizeof(buffer))) > 0) {
+            contents.append(buffer, count);
+        }
+        gzclose(file);
+        return contents;
+    }
+}
+
+BOOST_AUTO_TEST_CASE(old_files_are_compressed_and_kept_under_budget) {
+    const string path = "bin/log_tests_compressed";
+    for (int i = 0; i <= 4; i ++) {
+        const string old_file = str(format("%s.%d") % path % i);
+        remove(old_file.c_str());
+        remove((old_file + ".gz").c_str());
+    }
+    remove(path.c_str());
+    // Big enough for a couple of compressed files, but not four.
+    LogFileOptions file_options(path, boost::none, boost::none, 4, true,
+                                boost::optional<size_t>(150));
+    nova::Log::initialize(LogOptions(file_options, false, false));
+    for (int i = 0; i < 4; i ++) {
+        NOVA_LOG_INFO("This is file number %d.", i);
+        nova::Log::rotate_files();
+    }
+    // Waits for the compression to finish.
+    nova::Log::shutdown();
+
+    const string newest = read_gzip_file(path + ".1.gz");
+    BOOST_REQUIRE(newest.find("This is file number 3.") != string::npos);
+    BOOST_REQUIRE(!std::ifstream((path + ".1").c_str()).good());
+    // The oldest were deleted to stay under the budget.
+    BOOST_REQUIRE(!std::ifstream((path + ".4.gz").c_str()).good());
+    size_t total = 0;
+    for (int i = 1; i <= 4; i ++) {
+        total += file_size(str(format("%s.%d.gz") % path % i));
+    }
+    BOOST_REQUIRE(total <= 150);
+    BOOST_REQUIRE(total > 0);
+}
+
+BOOST_AUTO_TEST_CASE(rotating_while_compressing_keeps_the_order) {
+    const string path = "bin/log_tests_compressing";
+    for (int i = 0; i <= 3; i ++) {
+        const string old_file = str(format("%s.%d") % path % i);
+        remove(old_file.c_str());
+        remove((old_file + ".gz").c_str());
+    }
+    remove(path.c_str());
+    LogFileOptions file_options(path, boost::none, boost::none, 3, true);
+    nova::Log::initialize(LogOptions(file_options, false, false));
+    // Rotations don't wait for the compressor, so these usually land
+    // while a file is still being compressed.
+    for (int i = 0; i < 3; i ++) {
+        for (int line = 0; line < 2000; line ++) {
+            NOVA_LOG_INFO("This is file number %d.", i);
+        }
+        nova::Log::rotate_files();
+    }
+    nova::Log::shutdown();
+
+    for (int i = 1; i <= 3; i ++) {
+        const string old_file = str(format("%s.%d") % path % i);
+        const string expected = str(format("This is file number %d.")
+                                    % (3 - i));
+        BOOST_REQUIRE(read_gzip_file(old_file + ".gz").find(expected)
+                      != string::npos);
+        BOOST_REQUIRE(!std::ifstream(old_file.c_str()).good());
+    }
+    BOOST_REQUIRE(!std::ifstream((path + ".compressing").c_str()).good());
+}
+
+namespace {
+    string read_whole_file(const string & path) {
+        std::ifstream file(path.c_str(), std::ios::binary);
+        return string(std::istreambuf_iterator<char>(file),
+                      std::istreambuf_iterator<char>());
+    }
+
+    unsigned long long read_number(const string & data, size_t & index,
+                                   int bytes) {
+        unsigned long long number = 0;
+        for (int i = 0; i < bytes; i ++) {
+            number = (number << 8) | (unsigned char) data[index ++];
+        }
+        return number;
+    }
+
+    string read_string(const string & data, size_t & index) {
+        const size_t length = read_number(data, index, 4);
+        const string result = data.substr(index, length);
+        index += length;
+        return result;
+    }
+}
+
+BOOST_AUTO_TEST_CASE(structured_formats_carry_the_context) {
+    const string json_path = "bin/log_tests_structured.json";
+    const string binary_path = "bin/log_tests_structured.bin";
+    remove(json_path.c_str());
+    remove(binary_path.c_str());
+
+    LogFileOptions json_options(json_path, boost::none, boost::none, 1,
+                                false, boost::none,
+                                LogFileOptions::FORMAT_JSON_LINES);
+    nova::Log::initialize(LogOptions(json_options, false, false));
+    {
+        nova::LogContextScope method("method", "create_backup");
+        nova::LogContextScope backup("backup_id", "a\"b");
+        NOVA_LOG_INFO("Line\none");
+    }
+    NOVA_LOG_ERROR("No context.");
+    nova::Log::shutdown();
+
+    vector<string> lines;
+    std::ifstream json_file(json_path.c_str());
+    string line;
+    while(std::getline(json_file, line)) {
+        lines.push_back(line);
+    }
+    BOOST_REQUIRE_EQUAL(lines.size(), 2);
+    Regex json_regex("^\\{\"time_ns\":[0-9]{19},\"level\":\"INFO\","
+                     "\"thread\":\"main\",\"file\":\"[^\"]+log_tests.cc\","
+                     "\"line\":[0-9]+,\"message\":\"Line\\\\none\","
+                     "\"context\":\\{\"method\":\"create_backup\","
+                     "\"backup_id\":\"a\\\\\"b\"\\}\\}$");
+    BOOST_REQUIRE(json_regex.has_match(lines[0].c_str()));
+    BOOST_REQUIRE(lines[1].find("\"level\":\"ERROR\"") != string::npos);
+    BOOST_REQUIRE(lines[1].find("\"context\"") == string::npos);
+
+    LogFileOptions binary_options(binary_path, boost::none, boost::none, 1,
+                                  false, boost::none,
+                                  LogFileOptions::FORMAT_BINARY);
+    nova::Log::initialize(LogOptions(binary_options, false, false));
+    const time_t before = ::time(0);
+    {
+        nova::LogContextScope request("request_id", "req-1");
+        NOVA_LOG_DEBUG("Binary line.");
+    }
+    nova::Log::shutdown();
+
+    const string data = read_whole_file(binary_path);
+    size_t index = 0;
+    BOOST_REQUIRE_EQUAL(read_number(data, index, 4), data.size() - 4);
+    const unsigned long long seconds = read_number(data, index, 8)
+                                       / 1000000000ULL;
+    BOOST_REQUIRE(seconds >= (unsigned long long) before);
+    BOOST_REQUIRE(seconds <= (unsigned long long) ::time(0));
+    BOOST_REQUIRE_EQUAL(read_number(data, index, 1), NOVA_LOG_LEVEL_DEBUG);
+    BOOST_REQUIRE(read_number(data, index, 4) > 0);
+    BOOST_REQUIRE_EQUAL(read_string(data, index), "main");
+    BOOST_REQUIRE(read_string(data, index).find("log_tests.cc")
+                  != string::npos);
+    BOOST_REQUIRE_EQUAL(read_string(data, index), "Binary line.");
+    BOOST_REQUIRE_EQUAL(read_number(data, index, 4), 1);
+    BOOST_REQUIRE_EQUAL(read_string(data, index), "request_id");
+    BOOST_REQUIRE_EQUAL(read_string(data, index), "req-1");
+    BOOST_REQUIRE_EQUAL(index, data.size());
+}
+
+BOOST_AUTO_TEST_CASE(files_rotate_once_they_reach_max_size) {
+    const string path = "bin/log_tests_max_size";
+    for (int i = 0; i <= 3; i ++) {
+        remove((i == 0 ? path : str(format("%s.%d") % path % i)).c_str());
+    }
+    // Writing every line makes the rotation happen right at the limit.
+    LogFileOptions file_options(path, boost::optional<size_t>(1000),
+                                boost::none, 3);
+    nova::Log::initialize(LogOptions(file_options, false, false,
+                                     nova::LogFlushPolicy(true, 0, 0)));
+    for (int i = 0; i < 30; i ++) {
+        NOVA_LOG_INFO("Line number %d.", i);
+    }
+    // Nothing called rotate_logs_if_needed.
+    nova::Log::shutdown();
+
+    BOOST_REQUIRE(file_size(path) < 1000);
+    for (int i = 1; i <= 2; i ++) {
+        const size_t size = file_size(str(format("%s.%d") % path % i));
+        BOOST_REQUIRE(size >= 1000);
+        BOOST_REQUIRE(size < 1100);
+    }
+}
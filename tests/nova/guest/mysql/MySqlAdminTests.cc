@@ -29,18 +29,6 @@ BOOST_AUTO_TEST_CASE(password_must_be_kind_of_long)
     BOOST_CHECK_GT(password.length(), 10);
 }
 
-BOOST_AUTO_TEST_CASE(extract_user_test)
-{
-    string user = nova::guest::mysql::extract_user("'test'@'%'");
-    BOOST_CHECK_EQUAL(user, "test");
-}
-
-BOOST_AUTO_TEST_CASE(extract_host_test)
-{
-    string user = nova::guest::mysql::extract_host("'test'@'%'");
-    BOOST_CHECK_EQUAL(user, "%");
-}
-
 struct StringEscaper {
     const std::string escape_string(const char * const original) {
         return "I must escape this string!";
@@ -82,3 +70,16 @@ BOOST_AUTO_TEST_CASE(test_create_global_stmt)
     BOOST_CHECK_EQUAL_COLLECTIONS(expected_output, expected_output+7,
                                   output, output+7);
 }
+
+BOOST_AUTO_TEST_CASE(identifiers_cannot_end_their_backticks)
+{
+    using nova::db::mysql::MySqlConnection;
+    BOOST_CHECK_EQUAL("plain_name",
+                      MySqlConnection::escape_identifier("plain_name"));
+    BOOST_CHECK_EQUAL("a``b", MySqlConnection::escape_identifier("a`b"));
+    BOOST_CHECK_EQUAL("x``; DROP DATABASE mysql; -- ",
+        MySqlConnection::escape_identifier("x`; DROP DATABASE mysql; -- "));
+    // Quotes and backslashes have no special meaning between backticks.
+    BOOST_CHECK_EQUAL("it's\\here",
+                      MySqlConnection::escape_identifier("it's\\here"));
+}
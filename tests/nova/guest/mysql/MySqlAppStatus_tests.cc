@@ -6,6 +6,7 @@
 #define protected public
 
 #include "nova/flags.h"
+#include <boost/assign/list_of.hpp>
 #include <boost/optional.hpp>
 #include "nova/Log.h"
 #include "nova/db/mysql.h"
@@ -15,6 +16,7 @@
 
 #define CHECK_POINT() BOOST_CHECK_EQUAL(2,2);
 
+using namespace boost::assign;
 using namespace nova::rpc;
 using namespace nova::datastores;
 using namespace nova::flags;
@@ -60,6 +62,27 @@ class TestMySqlStatus : public MySqlAppStatus {
             mutable_this->on_execute();
         }
 
+        // Route the native checks through "execute" so each test can
+        // decide what the ping, the process check and finding the pid file
+        // return based on the call number.
+        virtual bool ping() const {
+            return succeeds(list_of("/usr/bin/mysqladmin")("ping"));
+        }
+
+        virtual bool is_mysqld_running() const {
+            return succeeds(list_of("/bin/ps")("-C")("mysqld")("h"));
+        }
+
+        bool succeeds(const std::list<std::string> & cmds) const {
+            std::stringstream out;
+            try {
+                execute(out, cmds);
+                return true;
+            } catch(const ProcessException & pe) {
+                return false;
+            }
+        }
+
         virtual void on_execute() = 0;
 
         int call_number;
@@ -235,6 +258,45 @@ BOOST_AUTO_TEST_CASE(After_mysql_is_marked_as_installed_but_mysql_not_there) {
                       DatastoreStatus::SHUTDOWN);
 }
 
+BOOST_AUTO_TEST_CASE(pid_file_is_only_looked_up_once) {
+    // MySQL stays down, so every update wants the pid file.
+    struct Updater : public TestMySqlStatus {
+        int print_defaults_count;
+
+        Updater()
+        :   TestMySqlStatus(false),
+            print_defaults_count(0)
+        {
+        }
+
+        virtual bool is_file(const char * file_path) const {
+            return true;
+        }
+
+        virtual void execute(std::stringstream & out,
+                             const std::list<std::string> & cmds) const {
+            if (cmds.back() != "--print-defaults") {
+                throw ProcessException(ProcessException::EXIT_CODE_NOT_ZERO);
+            }
+            Updater * mutable_this = const_cast<Updater *>(this);
+            mutable_this->print_defaults_count += 1;
+            out << "--pid-file=/var/run/mysqld/mysqld.pid ";
+        }
+
+        virtual void on_execute() {
+        }
+
+    } updater;
+
+    updater.end_install_or_restart();
+    BOOST_CHECK_EQUAL(updater.last_sent_status.get(),
+                      MySqlAppStatus::CRASHED);
+    updater.update();
+    updater.update();
+    BOOST_CHECK_EQUAL(updater.last_sent_status.get(),
+                      MySqlAppStatus::CRASHED);
+    BOOST_CHECK_EQUAL(updater.print_defaults_count, 1);
+}
 
 } } } // end namespace
 
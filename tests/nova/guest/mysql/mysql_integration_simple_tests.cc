@@ -3,6 +3,8 @@
 
 #include "nova/guest/apt.h"
 #include "nova/flags.h"
+#include <algorithm>
+#include <boost/algorithm/string/join.hpp>
 #include <boost/foreach.hpp>
 #include <boost/format.hpp>
 #include <boost/optional.hpp>
@@ -10,7 +12,10 @@
 #include <memory>
 #include "nova/db/mysql.h"
 #include "nova/db/MySqlConfigReader.h"
+#include "nova/guest/mysql/MySqlAdmin.h"
+#include "nova/guest/mysql/MySqlGuestException.h"
 #include "nova/utils/regex.h"
+#include <limits.h>
 #include <stdlib.h>
 
 using nova::Log;
@@ -54,6 +59,7 @@ using namespace nova::flags;
 using boost::format;
 using nova::Log;
 using namespace nova::db::mysql;
+using namespace nova::guest::mysql;
 using boost::optional;
 using std::string;
 using std::stringstream;
@@ -101,10 +107,14 @@ BOOST_AUTO_TEST_CASE(config_reader)
     BOOST_REQUIRE_EQUAL("right_password", result.get().password);
 }
 
-BOOST_AUTO_TEST_CASE(integration_tests)
-{
-    MySqlApiScope mysql_api_scope;
+struct ConnectionInfo {
+    string user;
+    string password;
+    string host;
+    string database;
+};
 
+ConnectionInfo get_connection_info() {
     FlagValues flags(get_flags());
 
     const char * sql_connection_string = flags.sql_connection();
@@ -115,10 +125,23 @@ BOOST_AUTO_TEST_CASE(integration_tests)
     for (int i = 0; i < 4; i ++) {
         BOOST_REQUIRE(matches->exists_at(i));
     }
-    const string user(matches->get(1));
-    const string password(matches->get(2));
-    const string host(matches->get(3));
-    const string database(matches->get(4));
+    ConnectionInfo info;
+    info.user = matches->get(1);
+    info.password = matches->get(2);
+    info.host = matches->get(3);
+    info.database = matches->get(4);
+    return info;
+}
+
+BOOST_AUTO_TEST_CASE(integration_tests)
+{
+    MySqlApiScope mysql_api_scope;
+
+    const ConnectionInfo info = get_connection_info();
+    const string & user = info.user;
+    const string & password = info.password;
+    const string & host = info.host;
+    const string & database = info.database;
 
     MySqlConnectionWithDefaultDb connection(host.c_str(), user.c_str(),
                                             password.c_str(), database.c_str());
@@ -204,9 +227,6 @@ BOOST_AUTO_TEST_CASE(integration_tests)
 
 
     // Now its on to prepared statements.
-    //TODO: These aren't working. The special result set type can't convert
-    // every fetched argument to string, and using the same result set type
-    // as Query causes it to return nothing but empty strings. :(
     {
         MySqlPreparedStatementPtr stmt = connection.prepare_statement(
             "SELECT * FROM test_table WHERE name= ?");
@@ -218,38 +238,333 @@ BOOST_AUTO_TEST_CASE(integration_tests)
                         PARAMETER_INDEX_OUT_OF_BOUNDS);
         stmt->set_string(0, "hub_cap");
 
-        stmt->execute();
-/*
+        MySqlResultSetPtr result = stmt->query();
+
         // row 0 (not real)
         BOOST_CHECK_EQUAL(result->get_row_count(), 0);
         BOOST_CHECK_EQUAL(result->get_field_count(), 2);
-        CHECK_EXCEPTION({ result->get_string(0); }, QUERY_RESULT_SET_NOT_STARTED); //RESULT_SET_NOT_STARTED);
-        CHECK_EXCEPTION({ result->get_string(1); }, QUERY_RESULT_SET_NOT_STARTED); // RESULT_SET_NOT_STARTED);
-        CHECK_EXCEPTION({ result->get_string(2); }, FIELD_INDEX_OUT_OF_BOUNDS); //RESULT_INDEX_OUT_OF_BOUNDS);
+        CHECK_EXCEPTION({ result->get_string(0); }, QUERY_RESULT_SET_NOT_STARTED);
+        CHECK_EXCEPTION({ result->get_string(2); }, FIELD_INDEX_OUT_OF_BOUNDS);
 
         // row 1
         BOOST_REQUIRE_EQUAL(result->next(), true);
         BOOST_CHECK_EQUAL(result->get_row_count(), 1);
-        BOOST_CHECK_EQUAL(result->get_field_count(), 2);
-        //BOOST_CHECK_EQUAL(result->get_string(0).get(), "hub_cap");
-        //BOOST_CHECK_EQUAL(result->get_string(1).get(), "273");
-        CHECK_EXCEPTION({ result->get_string(2); }, FIELD_INDEX_OUT_OF_BOUNDS); //RESULT_INDEX_OUT_OF_BOUNDS);
+        BOOST_CHECK_EQUAL(result->get_string(0).get(), "hub_cap");
+        BOOST_CHECK_EQUAL(result->get_string(1).get(), "273");
 
          // No more
         BOOST_REQUIRE_EQUAL(result->next(), false);
         BOOST_CHECK_EQUAL(result->get_row_count(), 1);
+        CHECK_EXCEPTION({ result->get_string(0); }, QUERY_RESULT_SET_FINISHED);
+    }
+
+    // Cached statements are reused, take numbers for LIMIT, and grow their
+    // buffers for values that don't fit.
+    {
+        const char * text
+            = "SELECT name, REPEAT('x', ?) FROM test_table "
+              "WHERE name IS NOT NULL ORDER BY name LIMIT ?";
+        MySqlPreparedStatementPtr stmt
+            = connection.prepare_cached_statement(text);
+        BOOST_REQUIRE(stmt == connection.prepare_cached_statement(text));
+
+        stmt->set_int(0, 1000);
+        stmt->set_int(1, 1);
+        MySqlResultSetPtr result = stmt->query();
+        BOOST_REQUIRE_EQUAL(result->next(), true);
+        BOOST_CHECK_EQUAL(result->get_string(0).get(), "grapex");
+        BOOST_CHECK_EQUAL(result->get_string(1).get(), string(1000, 'x'));
+        BOOST_REQUIRE_EQUAL(result->next(), false);
+        result->close();
+
+        stmt->set_int(0, 3);
+        stmt->set_int(1, 5);
+        result = stmt->query();
+        BOOST_REQUIRE_EQUAL(result->next(), true);
+        BOOST_REQUIRE_EQUAL(result->next(), true);
+        BOOST_CHECK_EQUAL(result->get_string(0).get(), "hub_cap");
+        BOOST_CHECK_EQUAL(result->get_string(1).get(), "xxx");
+        BOOST_REQUIRE_EQUAL(result->next(), false);
+    }
+
+    // Streamed results can be abandoned part way, leaving the connection
+    // usable.
+    {
+        MySqlResultSetPtr result = connection.query(
+            "SELECT * FROM test_table ORDER BY name", STREAM_RESULTS);
         BOOST_CHECK_EQUAL(result->get_field_count(), 2);
-        CHECK_EXCEPTION({ result->get_string(0); }, QUERY_RESULT_SET_FINISHED); //RESULT_SET_FINISHED);
-        CHECK_EXCEPTION({ result->get_string(1); }, QUERY_RESULT_SET_FINISHED); //RESULT_SET_FINISHED);
-        CHECK_EXCEPTION({ result->get_string(2); }, FIELD_INDEX_OUT_OF_BOUNDS); //RESULT_INDEX_OUT_OF_BOUNDS);
+        BOOST_REQUIRE_EQUAL(result->next(), true);
+        BOOST_CHECK(!result->get_string(0));
+        BOOST_REQUIRE_EQUAL(result->next(), true);
+        BOOST_CHECK_EQUAL(result->get_string(0).get(), "grapex");
+        result->close();
+        BOOST_REQUIRE(connection.test_connection());
 
-        // no more
-        CHECK_POINT();
-        BOOST_CHECK_EQUAL(result->next(), false);
-        CHECK_POINT();
-*/
-        //stmt->
-        //MySqlResultSetPtr result = connection.query(
+        MySqlPreparedStatementPtr stmt = connection.prepare_statement(
+            "SELECT age FROM test_table WHERE name = ?");
+        stmt->set_string(0, "grapex");
+        result = stmt->query(STREAM_RESULTS);
+        BOOST_REQUIRE_EQUAL(result->next(), true);
+        BOOST_CHECK_EQUAL(result->get_string(0).get(), "-9500");
+        BOOST_REQUIRE_EQUAL(result->next(), false);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(batched_statements)
+{
+    MySqlApiScope mysql_api_scope;
+
+    const ConnectionInfo info = get_connection_info();
+    MySqlConnection connection(info.host.c_str(), info.user.c_str(),
+                               info.password.c_str());
+    connection.query("CREATE DATABASE IF NOT EXISTS simple_test");
+    connection.query("USE simple_test");
+    connection.query("DROP TABLE IF EXISTS batch_table");
+    connection.query("CREATE TABLE batch_table(id INT)");
+
+    std::vector<string> statements;
+    for (int i = 0; i < 5000; i ++) {
+        statements.push_back(str(format("INSERT INTO batch_table VALUES(%d)")
+                                 % i));
+    }
+    connection.execute_batch(statements);
+    {
+        MySqlResultSetPtr result = connection.query(
+            "SELECT COUNT(*) FROM batch_table");
+        BOOST_REQUIRE(result->next());
+        BOOST_CHECK_EQUAL(result->get_string(0).get(), "5000");
+    }
+
+    // Stops at the first failure, but what ran before it stays.
+    statements.clear();
+    statements.push_back("INSERT INTO batch_table VALUES(-1)");
+    statements.push_back("INSERT INTO not_a_table VALUES(1)");
+    statements.push_back("INSERT INTO batch_table VALUES(-2)");
+    CHECK_EXCEPTION({ connection.execute_batch(statements); }, QUERY_FAILED);
+    {
+        MySqlResultSetPtr result = connection.query(
+            "SELECT COUNT(*) FROM batch_table WHERE id < 0");
+        BOOST_REQUIRE(result->next());
+        BOOST_CHECK_EQUAL(result->get_string(0).get(), "1");
+    }
+
+    // Multiple statements are turned back off afterwards.
+    CHECK_EXCEPTION({ connection.query("SELECT 1; SELECT 2"); },
+                    QUERY_FAILED);
+}
+
+BOOST_AUTO_TEST_CASE(connection_pool_tests)
+{
+    MySqlApiScope mysql_api_scope;
+
+    const ConnectionInfo info = get_connection_info();
+    MySqlConnectionPool::Options options(2, 0.5, 60, 60, 0);
+    MySqlConnectionPool pool(info.host.c_str(), info.user.c_str(),
+                             info.password.c_str(), options);
+    BOOST_REQUIRE_EQUAL(pool.idle_count(), 0);
+
+    {
+        MySqlConnectionPtr first = pool.borrow();
+        MySqlConnectionPtr second = pool.borrow();
+        BOOST_REQUIRE(first.get() != second.get());
+        BOOST_REQUIRE(first->test_connection());
+        // Both are out, so this waits for the time out.
+        CHECK_EXCEPTION({ pool.borrow(); }, POOL_TIMED_OUT);
+    }
+    BOOST_REQUIRE_EQUAL(pool.idle_count(), 2);
+
+    // The last one returned is handed out again, after being pinged.
+    {
+        MySqlConnectionPtr again = pool.borrow();
+        BOOST_REQUIRE(again->test_connection());
+        BOOST_REQUIRE_EQUAL(pool.idle_count(), 1);
+    }
+
+    // Connections past their lifetime are closed rather than reused.
+    MySqlConnectionPool::Options short_lived(1, 0.5, 60, 0, 0);
+    MySqlConnectionPool short_pool(info.host.c_str(), info.user.c_str(),
+                                   info.password.c_str(), short_lived);
+    {
+        MySqlConnectionPtr connection = short_pool.borrow();
+    }
+    BOOST_REQUIRE_EQUAL(short_pool.idle_count(), 0);
+}
+
+namespace {
+
+    const char * const CACHE_TEST_USER = "db_cache_user";
+
+    MySqlDatabaseListPtr database_list(const char * name) {
+        MySqlDatabasePtr database(new MySqlDatabase());
+        database->set_name(name);
+        database->set_character_set("utf8");
+        database->set_collation("utf8_general_ci");
+        MySqlDatabaseListPtr databases(new MySqlDatabaseList());
+        databases->push_back(database);
+        return databases;
+    }
+
+    /* The user's database names, sorted and joined with commas. */
+    string database_names(MySqlUserPtr user) {
+        std::vector<string> names;
+        BOOST_FOREACH(const MySqlDatabasePtr & database,
+                      *user->get_databases()) {
+            names.push_back(database->get_name());
+        }
+        std::sort(names.begin(), names.end());
+        return boost::algorithm::join(names, ",");
+    }
+
+    /* The databases find_user and list_users see for the test user, which
+     * must agree. */
+    string user_databases(MySqlAdmin & admin) {
+        const string found = database_names(
+            admin.find_user(CACHE_TEST_USER, "%"));
+        MySqlUserListPtr users = admin.list_users(
+            1, string(CACHE_TEST_USER) + "@%", true).get<0>();
+        BOOST_REQUIRE_EQUAL(users->size(), 1);
+        BOOST_REQUIRE_EQUAL(users->front()->get_name(), CACHE_TEST_USER);
+        BOOST_CHECK_EQUAL(database_names(users->front()), found);
+        return found;
+    }
+
+    /* Grants access without going through MySqlAdmin, so its cache isn't
+     * told. */
+    void grant_behind_admins_back(MySqlConnection & con, const char * db) {
+        con.query(str(format("GRANT ALL PRIVILEGES ON `%s`.* TO '%s'@'%%'")
+                      % db % CACHE_TEST_USER).c_str());
+        con.flush_privileges();
+    }
+
+}
+
+BOOST_AUTO_TEST_CASE(user_databases_are_found_and_cached)
+{
+    MySqlApiScope mysql_api_scope;
+
+    const ConnectionInfo info = get_connection_info();
+    MySqlConnectionPtr con(new MySqlConnection(
+        info.host.c_str(), info.user.c_str(), info.password.c_str()));
+    MySqlAdmin admin(con);
+
+    try {
+        admin.delete_user(CACHE_TEST_USER, "%");
+    } catch(const MySqlException & mse) {
+        // It's fine if the last run cleaned up after itself.
+    }
+    const char * names[] = { "db_cache_a", "db_cache_b", "db_cache_c" };
+    BOOST_FOREACH(const char * name, names) {
+        admin.delete_database(name);
+        admin.create_database(database_list(name));
+    }
+
+    MySqlUserPtr user(new MySqlUser());
+    user->set_name(CACHE_TEST_USER);
+    user->set_host("%");
+    user->set_password(string("password"));
+    user->get_databases()->push_back(database_list("db_cache_a")->front());
+    admin.create_user(user);
+    BOOST_CHECK_EQUAL(user_databases(admin), "db_cache_a");
+
+    // Grants made by the admin show up right away.
+    admin.grant_access(CACHE_TEST_USER, "%", database_list("db_cache_b"));
+    BOOST_CHECK_EQUAL(user_databases(admin), "db_cache_a,db_cache_b");
+
+    admin.revoke_access(CACHE_TEST_USER, "%", "db_cache_b");
+    BOOST_CHECK_EQUAL(user_databases(admin), "db_cache_a");
+
+    // Grants made elsewhere aren't seen until the cache is cleared, which
+    // dropping any database does.
+    grant_behind_admins_back(*con, "db_cache_c");
+    BOOST_CHECK_EQUAL(user_databases(admin), "db_cache_a");
+    admin.delete_database("db_cache_b");
+    BOOST_CHECK_EQUAL(user_databases(admin), "db_cache_a,db_cache_c");
+
+    // Deleting the user forgets its databases, so one recreated behind our
+    // back doesn't inherit them.
+    admin.delete_user(CACHE_TEST_USER, "%");
+    BOOST_CHECK_THROW(admin.find_user(CACHE_TEST_USER, "%"),
+                      MySqlGuestException);
+    con->query(str(format("GRANT USAGE ON *.* TO '%s'@'%%' "
+                          "IDENTIFIED BY 'password'")
+                   % CACHE_TEST_USER).c_str());
+    con->flush_privileges();
+    BOOST_CHECK_EQUAL(user_databases(admin), "");
+
+    admin.delete_user(CACHE_TEST_USER, "%");
+    BOOST_FOREACH(const char * name, names) {
+        admin.delete_database(name);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(backticks_in_names_stay_in_the_names)
+{
+    MySqlApiScope mysql_api_scope;
+
+    const ConnectionInfo info = get_connection_info();
+    MySqlConnectionPtr con(new MySqlConnection(
+        info.host.c_str(), info.user.c_str(), info.password.c_str()));
+    MySqlAdmin admin(con);
+
+    // Either would add a statement to the batch if its backtick ended the
+    // name.
+    const char * const DB_NAME = "bt`; CREATE DATABASE bt_injected; --";
+    const char * const USER_NAME = "bt`user";
+    try {
+        admin.delete_user(USER_NAME, "%");
+    } catch(const MySqlException & mse) {
+        // It's fine if the last run cleaned up after itself.
+    }
+    admin.delete_database(DB_NAME);
+    admin.delete_database("bt_injected");
+
+    admin.create_database(database_list(DB_NAME));
+    MySqlUserPtr user(new MySqlUser());
+    user->set_name(USER_NAME);
+    user->set_host("%");
+    user->set_password(string("password"));
+    user->get_databases()->push_back(database_list(DB_NAME)->front());
+    admin.create_user(user);
+
+    MySqlPreparedStatementPtr stmt = con->prepare_statement(
+        "SELECT COUNT(*) FROM information_schema.SCHEMATA "
+        "WHERE SCHEMA_NAME = ?");
+    stmt->set_string(0, DB_NAME);
+    MySqlResultSetPtr result = stmt->query();
+    BOOST_REQUIRE(result->next());
+    BOOST_CHECK_EQUAL(result->get_string(0).get(), "1");
+    result->close();
+    stmt->set_string(0, "bt_injected");
+    result = stmt->query();
+    BOOST_REQUIRE(result->next());
+    BOOST_CHECK_EQUAL(result->get_string(0).get(), "0");
+    result->close();
+    stmt->close();
+
+    BOOST_CHECK_EQUAL(database_names(admin.find_user(USER_NAME, "%")),
+                      DB_NAME);
+
+    admin.delete_user(USER_NAME, "%");
+    admin.delete_database(DB_NAME);
+}
+
+BOOST_AUTO_TEST_CASE(the_biggest_limits_list_everything)
+{
+    MySqlApiScope mysql_api_scope;
 
+    const ConnectionInfo info = get_connection_info();
+    MySqlConnectionPtr con(new MySqlConnection(
+        info.host.c_str(), info.user.c_str(), info.password.c_str()));
+    MySqlAdmin admin(con);
+
+    // One more than these doesn't fit in the int given to LIMIT.
+    const unsigned int limits[] = { INT_MAX, UINT_MAX };
+    BOOST_FOREACH(const unsigned int limit, limits) {
+        MySqlDatabaseListPtr databases
+            = admin.list_databases(limit, boost::none, false).get<0>();
+        BOOST_CHECK(!databases->empty());
+        MySqlUserListPtr users
+            = admin.list_users(limit, boost::none, false).get<0>();
+        BOOST_CHECK(!users->empty());
     }
 }
@@ -0,0 +1,153 @@
+#include <iostream>
+#include <boost/format.hpp>
+#include "nova/Log.h"
+#include "nova/db/mysql.h"
+#include <fstream>
+#include <stdlib.h>
+#include <string>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace nova;
+using namespace nova::db::mysql;
+using boost::format;
+using std::string;
+
+/*
+ * Compares how much memory reading a big result set takes when it's
+ * buffered (mysql_store_result) and when it's streamed (mysql_use_result).
+ * Takes the host, user, password and optionally the number of rows to read.
+ * A table of that many rows is made in a "result_set_benchmark" database,
+ * then each mode reads it all in its own child process so the peak RSS
+ * (VmHWM) of one doesn't hide the other's.
+ */
+
+namespace {
+
+    const char * const DATABASE = "result_set_benchmark";
+
+    double now() {
+        timeval tv;
+        gettimeofday(&tv, NULL);
+        return tv.tv_sec + (tv.tv_usec / 1000000.0);
+    }
+
+    /* Returns the peak resident set size in kilobytes. */
+    long peak_rss() {
+        std::ifstream status("/proc/self/status");
+        string line;
+        while(std::getline(status, line)) {
+            if (line.compare(0, 6, "VmHWM:") == 0) {
+                return atol(line.c_str() + 6);
+            }
+        }
+        return -1;
+    }
+
+    void create_table(MySqlConnection & con, long row_count) {
+        con.query(str(format("CREATE DATABASE IF NOT EXISTS %s")
+                      % DATABASE).c_str());
+        con.query(str(format("USE %s") % DATABASE).c_str());
+        con.query("DROP TABLE IF EXISTS benchmark_rows");
+        con.query("CREATE TABLE benchmark_rows("
+                  "id INT AUTO_INCREMENT PRIMARY KEY, name VARCHAR(255))");
+        con.query("INSERT INTO benchmark_rows(name) "
+                  "VALUES(REPEAT('x', 200))");
+        // Double the table until it's big enough.
+        for (long count = 1; count < row_count; count *= 2) {
+            con.query("INSERT INTO benchmark_rows(name) "
+                      "SELECT name FROM benchmark_rows");
+        }
+    }
+
+    /* What a child sends its parent once it's read the table. */
+    struct Result {
+        long rows;
+        size_t bytes;
+        long rss_growth;
+        double seconds;
+    };
+
+    Result read_all(const char * host, const char * user,
+                    const char * password, MySqlResultMode mode) {
+        MySqlConnection con(host, user, password);
+        con.query(str(format("USE %s") % DATABASE).c_str());
+        const long before = peak_rss();
+        const double start = now();
+        MySqlResultSetPtr result = con.query(
+            "SELECT id, name FROM benchmark_rows", mode);
+        size_t bytes = 0;
+        while(result->next()) {
+            bytes += result->get_string(1).get().size();
+        }
+        const Result totals = { (long) result->get_row_count(), bytes,
+                                peak_rss() - before, now() - start };
+        return totals;
+    }
+
+    /* The log's writer thread doesn't survive the fork, so the child logs
+     * nothing itself and hands its numbers to the parent over a pipe. */
+    void in_child(const char * host, const char * user, const char * password,
+                  MySqlResultMode mode) {
+        const char * const name = (mode == STREAM_RESULTS ? "Streamed"
+                                                          : "Buffered");
+        int fds[2];
+        if (pipe(fds) != 0) {
+            NOVA_LOG_ERROR("Could not create pipe.");
+            return;
+        }
+        const pid_t pid = fork();
+        if (pid == 0) {
+            ::close(fds[0]);
+            int exit_code = 1;
+            try {
+                const Result result = read_all(host, user, password, mode);
+                if (write(fds[1], &result, sizeof(result))
+                    == sizeof(result)) {
+                    exit_code = 0;
+                }
+            } catch(const std::exception & e) {
+                std::cerr << name << " read failed: " << e.what()
+                          << std::endl;
+            }
+            _exit(exit_code);
+        }
+        ::close(fds[1]);
+        Result result;
+        const ssize_t count = (pid < 0) ? -1
+                                        : read(fds[0], &result, sizeof(result));
+        ::close(fds[0]);
+        int status = 0;
+        if (pid > 0) {
+            waitpid(pid, &status, 0);
+        }
+        if (count != sizeof(result)) {
+            NOVA_LOG_ERROR("%s read failed (status %d).", name, status);
+            return;
+        }
+        NOVA_LOG_INFO("%s: %d rows, %d bytes, peak RSS grew by %d KB, "
+                      "%f seconds.", name, result.rows, result.bytes,
+                      result.rss_growth, result.seconds);
+    }
+
+}
+
+int main(int argc, char* argv[]) {
+    LogApiScope log_api_scope(LogOptions::simple());
+    if (argc < 4) {
+        std::cerr << "Usage: " << argv[0] << " host user password [rows]"
+                  << std::endl;
+        return 1;
+    }
+    const long row_count = argc > 4 ? atol(argv[4]) : 1000000;
+    MySqlApiScope mysql_api_scope;
+    {
+        MySqlConnection con(argv[1], argv[2], argv[3]);
+        create_table(con, row_count);
+    }
+    in_child(argv[1], argv[2], argv[3], BUFFER_RESULTS);
+    in_child(argv[1], argv[2], argv[3], STREAM_RESULTS);
+    return 0;
+}
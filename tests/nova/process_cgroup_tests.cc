@@ -0,0 +1,88 @@
+#define BOOST_TEST_MODULE process_cgroup_tests
+#include <boost/test/unit_test.hpp>
+
+#include <boost/assign/list_of.hpp>
+#include "nova/Log.h"
+#include "nova/process_cgroup.h"
+#include <sstream>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace boost::assign;
+using nova::LogApiScope;
+using nova::LogOptions;
+using std::string;
+using std::stringstream;
+using namespace nova::process;
+
+namespace {
+    /* A cgroup v2 hierarchy root can make groups in. The test does nothing
+     * if it isn't there or isn't writable. */
+    const char * const PARENT = "/sys/fs/cgroup/unified";
+
+    bool can_use_cgroups() {
+        if (::access((string(PARENT) + "/cgroup.procs").c_str(), W_OK) != 0) {
+            NOVA_LOG_INFO("Skipping test, can't write to %s.", PARENT);
+            return false;
+        }
+        return true;
+    }
+
+    bool exists(const string & path) {
+        struct stat info;
+        return ::stat(path.c_str(), &info) == 0;
+    }
+}
+
+BOOST_AUTO_TEST_CASE(config_without_parent_does_nothing)
+{
+    LogApiScope log(LogOptions::simple());
+    const CgroupConfig config(boost::none, CgroupLimits());
+    const TransientCgroupPtr group = create_cgroup(config, "backup");
+    BOOST_REQUIRE(!group.get());
+    CommandList cmds = list_of("/bin/true");
+    BOOST_REQUIRE(in_cgroup(group, cmds) == cmds);
+}
+
+BOOST_AUTO_TEST_CASE(processes_start_inside_the_group)
+{
+    LogApiScope log(LogOptions::simple());
+    if (!can_use_cgroups()) {
+        return;
+    }
+    string path;
+    {
+        const CgroupConfig config(PARENT, CgroupLimits());
+        const TransientCgroupPtr group = create_cgroup(config, "test");
+        BOOST_REQUIRE(group.get());
+        path = group->get_path();
+        BOOST_REQUIRE(exists(path));
+
+        stringstream out;
+        CommandList cmds = list_of("/bin/cat")("/proc/self/cgroup");
+        execute(out, in_cgroup(group, cmds));
+        const string name = path.substr(path.rfind('/'));
+        BOOST_REQUIRE(out.str().find("0::" + name + "\n") != string::npos);
+    }
+    // The group goes away once the process is done with it.
+    BOOST_REQUIRE(!exists(path));
+}
+
+BOOST_AUTO_TEST_CASE(bad_limits_are_refused)
+{
+    LogApiScope log(LogOptions::simple());
+    if (!can_use_cgroups()) {
+        return;
+    }
+    CgroupLimits limits = list_of("cgroup.procs=1");
+    BOOST_REQUIRE_THROW(TransientCgroup(PARENT, "test", limits),
+                        ProcessException);
+    limits = list_of("io.weight");
+    BOOST_REQUIRE_THROW(TransientCgroup(PARENT, "test", limits),
+                        ProcessException);
+    // Backups go ahead without limits rather than failing.
+    limits = list_of("memory.high=nonsense");
+    const CgroupConfig config(PARENT, limits);
+    BOOST_REQUIRE(!create_cgroup(config, "test").get());
+}
@@ -0,0 +1,258 @@
+#define BOOST_TEST_MODULE process_helper_tests
+#include <boost/test/unit_test.hpp>
+
+#include <boost/assign/list_of.hpp>
+#include <boost/thread.hpp>
+#include "nova/Log.h"
+#include "nova/process_helper.h"
+#include <stdint.h>
+#include <string>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace nova;
+using namespace nova::process;
+using namespace boost::assign;
+using boost::optional;
+using std::string;
+using std::vector;
+
+struct GlobalFixture {
+
+    LogApiScope log;
+
+    GlobalFixture()
+    : log(LogOptions::simple()) {
+    }
+
+};
+
+BOOST_GLOBAL_FIXTURE(GlobalFixture);
+
+
+/**---------------------------------------------------------------------------
+ *- Helpers
+ *---------------------------------------------------------------------------*/
+
+namespace {
+
+    /* Runs serve_process_helper_requests on one end of a socket pair in its
+     * own thread; the test plays the agent on the other end. */
+    class HelperServer {
+        public:
+            HelperServer(const ProcessHelperWhitelist & whitelist)
+            :   code(),
+                finished(false),
+                whitelist(whitelist)
+            {
+                BOOST_REQUIRE_EQUAL(0, ::socketpair(AF_UNIX, SOCK_STREAM, 0,
+                                                    sockets));
+                thread = boost::thread(boost::bind(&HelperServer::serve,
+                                                   this));
+            }
+
+            ~HelperServer() {
+                finish();
+                ::close(sockets[1]);
+            }
+
+            int client() const {
+                return sockets[0];
+            }
+
+            /* Closes the agent's end and waits for the helper to finish. */
+            void finish() {
+                hang_up();
+                if (thread.joinable()) {
+                    thread.join();
+                }
+            }
+
+            /* Set if the helper threw a ProcessException. */
+            optional<ProcessException::Code> code;
+            bool finished;
+
+        private:
+            int sockets[2];
+            boost::thread thread;
+            const ProcessHelperWhitelist whitelist;
+
+            void hang_up() {
+                if (sockets[0] >= 0) {
+                    ::close(sockets[0]);
+                    sockets[0] = -1;
+                }
+            }
+
+            void serve() {
+                try {
+                    serve_process_helper_requests(sockets[1], whitelist);
+                } catch(const ProcessException & pe) {
+                    code = pe.code;
+                }
+                finished = true;
+            }
+    };
+
+    void append_number(string & message, uint32_t number) {
+        message.append((const char *) &number, sizeof(number));
+    }
+
+    void append_string(string & message, const string & value) {
+        append_number(message, (uint32_t) value.size());
+        message.append(value);
+    }
+
+    void send_raw(int socket, const string & message) {
+        BOOST_REQUIRE_EQUAL((ssize_t) message.size(),
+                            ::send(socket, message.c_str(), message.size(),
+                                   MSG_NOSIGNAL));
+    }
+
+    void send_request(int socket, const CommandList & cmds,
+                      uint32_t time_out_ms=5000) {
+        string request;
+        append_number(request, time_out_ms);
+        append_number(request, (uint32_t) cmds.size());
+        for (CommandList::const_iterator it = cmds.begin(); it != cmds.end();
+             ++ it) {
+            append_string(request, *it);
+        }
+        send_raw(socket, request);
+    }
+
+    void recv_exactly(int socket, char * buffer, size_t length) {
+        while(length > 0) {
+            const ssize_t count = ::recv(socket, buffer, length, 0);
+            BOOST_REQUIRE(count > 0);
+            buffer += count;
+            length -= count;
+        }
+    }
+
+    uint32_t read_reply(int socket, string & output) {
+        uint32_t code;
+        uint32_t length;
+        recv_exactly(socket, (char *) &code, sizeof(code));
+        recv_exactly(socket, (char *) &length, sizeof(length));
+        vector<char> buffer(length);
+        if (length > 0) {
+            recv_exactly(socket, &buffer[0], length);
+        }
+        output = string(buffer.begin(), buffer.end());
+        return code;
+    }
+
+    ProcessHelperWhitelist test_whitelist() {
+        ProcessHelperWhitelist whitelist;
+        whitelist.insert(list_of<string>("/bin/echo")("hello"));
+        whitelist.insert(list_of<string>("/bin/false"));
+        whitelist.insert(list_of<string>("/bin/sh")("-c")("exit 3"));
+        whitelist.insert(list_of<string>("/bin/sleep")("5"));
+        return whitelist;
+    }
+
+}  // end anonymous namespace
+
+
+/**---------------------------------------------------------------------------
+ *- Tests
+ *---------------------------------------------------------------------------*/
+
+BOOST_AUTO_TEST_CASE(runs_whitelisted_command) {
+    HelperServer server(test_whitelist());
+    string output;
+    send_request(server.client(), list_of<string>("/bin/echo")("hello"));
+    BOOST_CHECK_EQUAL(REPLY_SUCCESS, read_reply(server.client(), output));
+    BOOST_CHECK_EQUAL("hello\n", output);
+    server.finish();
+    BOOST_CHECK(server.finished);
+    BOOST_CHECK(!server.code);
+}
+
+BOOST_AUTO_TEST_CASE(propagates_exit_status) {
+    HelperServer server(test_whitelist());
+    string output;
+    send_request(server.client(), list_of<string>("/bin/false"));
+    BOOST_CHECK_EQUAL(REPLY_EXIT_CODE_NOT_ZERO,
+                      read_reply(server.client(), output));
+    send_request(server.client(), list_of<string>("/bin/sh")("-c")("exit 3"));
+    BOOST_CHECK_EQUAL(REPLY_EXIT_CODE_NOT_ZERO,
+                      read_reply(server.client(), output));
+    // A failed command doesn't stop the helper from serving the next one.
+    send_request(server.client(), list_of<string>("/bin/echo")("hello"));
+    BOOST_CHECK_EQUAL(REPLY_SUCCESS, read_reply(server.client(), output));
+}
+
+BOOST_AUTO_TEST_CASE(times_out_long_commands) {
+    HelperServer server(test_whitelist());
+    string output;
+    send_request(server.client(), list_of<string>("/bin/sleep")("5"), 100);
+    BOOST_CHECK_EQUAL(REPLY_TIME_OUT, read_reply(server.client(), output));
+}
+
+BOOST_AUTO_TEST_CASE(refuses_commands_not_in_whitelist) {
+    HelperServer server(test_whitelist());
+    string output;
+    send_request(server.client(), list_of<string>("/bin/rm")("-rf")("/"));
+    BOOST_CHECK_EQUAL(REPLY_NOT_ALLOWED, read_reply(server.client(), output));
+    // Whitelisted programs are refused with different arguments...
+    send_request(server.client(), list_of<string>("/bin/echo")("goodbye"));
+    BOOST_CHECK_EQUAL(REPLY_NOT_ALLOWED, read_reply(server.client(), output));
+    send_request(server.client(),
+                 list_of<string>("/bin/echo")("hello")("again"));
+    BOOST_CHECK_EQUAL(REPLY_NOT_ALLOWED, read_reply(server.client(), output));
+    send_request(server.client(), list_of<string>("/bin/sleep")("500"));
+    BOOST_CHECK_EQUAL(REPLY_NOT_ALLOWED, read_reply(server.client(), output));
+    // ... or through a relative path to the same program.
+    send_request(server.client(), list_of<string>("echo")("hello"));
+    BOOST_CHECK_EQUAL(REPLY_NOT_ALLOWED, read_reply(server.client(), output));
+    send_request(server.client(), CommandList());
+    BOOST_CHECK_EQUAL(REPLY_NOT_ALLOWED, read_reply(server.client(), output));
+    BOOST_CHECK_EQUAL("", output);
+}
+
+BOOST_AUTO_TEST_CASE(rejects_too_many_arguments) {
+    HelperServer server(test_whitelist());
+    string request;
+    append_number(request, 1000);
+    append_number(request, 100000);
+    send_raw(server.client(), request);
+    server.finish();
+    BOOST_REQUIRE(server.code);
+    BOOST_CHECK_EQUAL(ProcessException::HELPER_FAILURE, server.code.get());
+}
+
+BOOST_AUTO_TEST_CASE(rejects_overlong_argument) {
+    HelperServer server(test_whitelist());
+    string request;
+    append_number(request, 1000);
+    append_number(request, 1);
+    append_number(request, 0x7FFFFFFF);
+    send_raw(server.client(), request);
+    server.finish();
+    BOOST_REQUIRE(server.code);
+    BOOST_CHECK_EQUAL(ProcessException::HELPER_FAILURE, server.code.get());
+}
+
+BOOST_AUTO_TEST_CASE(rejects_truncated_request) {
+    HelperServer server(test_whitelist());
+    string request;
+    append_number(request, 1000);
+    append_number(request, 2);
+    append_string(request, "/bin/echo");
+    // Half of the second argument's length, then the agent hangs up.
+    request.append("\x05\x00", 2);
+    send_raw(server.client(), request);
+    server.finish();
+    BOOST_REQUIRE(server.code);
+    BOOST_CHECK_EQUAL(ProcessException::HELPER_FAILURE, server.code.get());
+}
+
+BOOST_AUTO_TEST_CASE(exits_quietly_when_client_hangs_up) {
+    HelperServer server(test_whitelist());
+    server.finish();
+    BOOST_CHECK(server.finished);
+    BOOST_CHECK(!server.code);
+}
@@ -2,6 +2,7 @@
 #include <boost/test/unit_test.hpp>
 
 #include <boost/assign/list_of.hpp>
+#include <boost/thread.hpp>
 #include "nova/Log.h"
 #include "nova/process.h"
 #include <stdlib.h>
@@ -221,3 +222,206 @@ BOOST_AUTO_TEST_CASE(test_giga_flood) {
     BOOST_REQUIRE_EQUAL(actual_stdout_count, 1024 * 1024);
     BOOST_REQUIRE_EQUAL(actual_stderr_count, 1024 * 1024);
 }
+
+BOOST_AUTO_TEST_CASE(reading_from_a_bigger_std_out_pipe) {
+    CommandList cmds = list_of(parrot_path())("duo");
+    Process<IndependentStdErrAndStdOut> process(cmds);
+    BOOST_CHECK(process.set_std_out_capacity(256 * 1024) >= 64 * 1024);
+    stringstream out;
+    stringstream err;
+    char buffer[64];
+    IndependentStdErrAndStdOut::ReadResult result;
+    while(!(result = process.read_into(buffer, sizeof(buffer) - 1,
+                                       60)).eof()) {
+        if (result.out()) {
+            out.write(buffer, result.write_length);
+        } else if (result.err()) {
+            err.write(buffer, result.write_length);
+        }
+    }
+    BOOST_CHECK_EQUAL("(@'> <( Hi from StdOut. AWK! )\n", out.str());
+    BOOST_CHECK_EQUAL("(@'> <( Hi from StdErr. )\n", err.str());
+}
+
+namespace {
+
+    /* Waits on a parrot which never says anything more, and records how
+     * long it took for its Timer to go off. */
+    struct TimedWait {
+        double seconds;
+        double elapsed;
+        bool timed_out;
+
+        TimedWait(double seconds)
+        :   seconds(seconds), elapsed(0.0), timed_out(false) {
+        }
+
+        void operator()() {
+            CommandList cmds = list_of(parrot_path())("wake");
+            Process<StdErrAndStdOut, StdIn> process(cmds);
+            const boost::posix_time::ptime start =
+                boost::posix_time::microsec_clock::universal_time();
+            try {
+                nova::utils::io::Timer timer(seconds);
+                stringstream std_out;
+                while(true) {
+                    process.read_into(std_out);
+                }
+            } catch(const nova::utils::io::TimeOutException & toe) {
+                timed_out = true;
+            }
+            elapsed = (boost::posix_time::microsec_clock::universal_time()
+                       - start).total_milliseconds() / 1000.0;
+            process.write("die\n");
+        }
+    };
+}
+
+BOOST_AUTO_TEST_CASE(timers_in_different_threads_are_independent) {
+    TimedWait quick(0.25);
+    TimedWait slow(1.5);
+    boost::thread quick_thread(boost::ref(quick));
+    boost::thread slow_thread(boost::ref(slow));
+    quick_thread.join();
+    slow_thread.join();
+    BOOST_CHECK(quick.timed_out);
+    BOOST_CHECK(slow.timed_out);
+    BOOST_CHECK(quick.elapsed >= 0.25);
+    BOOST_CHECK(quick.elapsed < 1.0);
+    BOOST_CHECK(slow.elapsed >= 1.5);
+}
+
+BOOST_AUTO_TEST_CASE(find_pids_sees_running_process) {
+    CommandList cmds = list_of(parrot_path())("wake");
+    Process<StdErrAndStdOut, StdIn> process(cmds);
+    const std::vector<pid_t> pids = find_pids("parrot_e");
+    BOOST_CHECK(std::find(pids.begin(), pids.end(), process.get_pid())
+                != pids.end());
+    BOOST_CHECK(find_pids("no-such-program-here").empty());
+    process.write("die\n");
+    process.wait_for_exit(5);
+}
+
+namespace {
+
+    template<typename CommandType>
+    double spawns_per_second(const CommandType & command, int count) {
+        const boost::posix_time::ptime start =
+            boost::posix_time::microsec_clock::universal_time();
+        for (int i = 0; i < count; i ++) {
+            Process<> process(command);
+            process.wait_for_exit(5);
+            BOOST_REQUIRE(process.successful());
+        }
+        const double elapsed =
+            (boost::posix_time::microsec_clock::universal_time() - start)
+            .total_microseconds() / 1000000.0;
+        return count / elapsed;
+    }
+}
+
+BOOST_AUTO_TEST_CASE(spawn_rate_benchmark) {
+    const int count = 200;
+    const CommandList cmds = list_of("/bin/true");
+    const PreparedCommand prepared(cmds);
+    // Warm up, so the first run doesn't pay for loading /bin/true.
+    spawns_per_second(cmds, 10);
+    const double list_rate = spawns_per_second(cmds, count);
+    const double prepared_rate = spawns_per_second(prepared, count);
+    NOVA_LOG_INFO("Spawned %d processes per second from a CommandList and %d "
+                  "per second from a PreparedCommand.", (int) list_rate,
+                  (int) prepared_rate);
+}
+
+BOOST_AUTO_TEST_CASE(prepared_command_with_environment) {
+    const PreparedCommand command(list_of(parrot_path())("eat"),
+                                  list_of("food=birdseed"));
+    Process<StdErrAndStdOut> process(command);
+    stringstream out;
+    process.read_into_until_exit(out, 30);
+    BOOST_CHECK_EQUAL("(@'> < * crunch * )\n", out.str());
+}
+
+namespace {
+    struct LineCollector : public LineHandler {
+        std::vector<string> lines;
+
+        virtual bool on_line(const string & line) {
+            lines.push_back(line);
+            return true;
+        }
+    };
+
+    struct LineCounter : public LineHandler {
+        size_t count;
+        string last;
+
+        LineCounter() : count(0), last() {}
+
+        virtual bool on_line(const string & line) {
+            ++ count;
+            last = line;
+            return true;
+        }
+    };
+}
+
+BOOST_AUTO_TEST_CASE(line_splitter_handles_partial_and_long_lines) {
+    LineCollector collector;
+    LineSplitter splitter(collector, 8);
+    BOOST_REQUIRE(splitter.write("ab", 2));
+    BOOST_REQUIRE(splitter.write("c\nde\n\n0123456789", 16));
+    BOOST_REQUIRE(splitter.flush());
+    BOOST_REQUIRE_EQUAL(collector.lines.size(), 5);
+    BOOST_CHECK_EQUAL(collector.lines[0], "abc");
+    BOOST_CHECK_EQUAL(collector.lines[1], "de");
+    BOOST_CHECK_EQUAL(collector.lines[2], "");
+    BOOST_CHECK_EQUAL(collector.lines[3], "01234567");
+    BOOST_CHECK_EQUAL(collector.lines[4], "89");
+
+    OutputTail tail(12);
+    tail.on_line("first");
+    BOOST_CHECK_EQUAL(tail.str(), "first\n");
+    tail.on_line("second");
+    tail.on_line("third");
+    // Only whole lines from the last 12 bytes are kept.
+    BOOST_CHECK_EQUAL(tail.str(), "third\n");
+}
+
+BOOST_AUTO_TEST_CASE(read_lines_from_chatty_process) {
+    const CommandList cmds = list_of("/usr/bin/seq")("1")("200000");
+    {
+        Process<StdErrAndStdOut> process(cmds);
+        LineCounter counter;
+        BOOST_REQUIRE(process.read_lines_until_exit(counter, 30));
+        process.wait_forever_for_exit();
+        BOOST_CHECK_EQUAL(counter.count, 200000);
+        BOOST_CHECK_EQUAL(counter.last, "200000");
+    }
+    {
+        // Without a match for the first pattern every line is read.
+        Process<StdErrAndStdOut> process(cmds);
+        LineMatcher matcher(list_of("^nope$")("^(12)(345)$"));
+        BOOST_REQUIRE(process.read_lines_until_exit(matcher, 30));
+        BOOST_REQUIRE(!!matcher.index());
+        BOOST_CHECK_EQUAL(matcher.index().get(), 1);
+        BOOST_CHECK_EQUAL(matcher.matches()->get(2), "345");
+    }
+    {
+        // A later line matching an earlier pattern wins, and stops it.
+        Process<StdErrAndStdOut> process(cmds);
+        LineMatcher matcher(list_of("^(199)(999)$")("^(12)(345)$"));
+        BOOST_REQUIRE(!process.read_lines_until_exit(matcher, 30));
+        BOOST_REQUIRE(!!matcher.index());
+        BOOST_CHECK_EQUAL(matcher.index().get(), 0);
+        BOOST_CHECK_EQUAL(matcher.matches()->get(2), "999");
+    }
+    {
+        // Only the end of a long output is kept around.
+        Process<StdErrAndStdOut> process(list_of("/usr/bin/seq")("1")("5000"));
+        OutputTail tail(64);
+        BOOST_REQUIRE(process.read_lines_until_exit(tail, 30));
+        BOOST_CHECK(tail.str().size() <= 64);
+        BOOST_CHECK(tail.str().find("5000\n") != string::npos);
+    }
+}
@@ -0,0 +1,265 @@
+#ifndef __NOVA_REDIS_FAKEREDIS_H
+#define __NOVA_REDIS_FAKEREDIS_H
+
+#include <boost/test/unit_test.hpp>
+
+#include <boost/bind.hpp>
+#include <boost/format.hpp>
+#include <boost/thread.hpp>
+#include <boost/utility.hpp>
+#include <map>
+#include <poll.h>
+#include <stdlib.h>
+#include <string>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <vector>
+
+
+namespace nova { namespace redis {
+
+/* Just enough of a Redis server on a Unix socket to talk to hiredis.
+ * Serves one connection at a time. PING, ECHO, AUTH and CLIENT work,
+ * as does anything given an answer with set_answer (such as PSYNC with a
+ * snapshot); anything else gets an error. Shared by the Redis tests. */
+class FakeRedis : boost::noncopyable {
+public:
+    typedef std::vector<std::string> Command;
+
+    FakeRedis()
+    :   answers(),
+        connection_count(0),
+        drop_requested(false),
+        held_replies(0),
+        path(str(boost::format("/tmp/fake_redis_%d.sock") % getpid())),
+        server(-1),
+        stopping(false)
+    {
+        ::unlink(path.c_str());
+        server = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        BOOST_REQUIRE(server >= 0);
+        sockaddr_un address;
+        memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        strncpy(address.sun_path, path.c_str(),
+                sizeof(address.sun_path) - 1);
+        BOOST_REQUIRE_EQUAL(0, ::bind(server, (sockaddr *) &address,
+                                      sizeof(address)));
+        BOOST_REQUIRE_EQUAL(0, ::listen(server, 5));
+        thread = boost::thread(boost::bind(&FakeRedis::serve, this));
+    }
+
+    ~FakeRedis() {
+        {
+            boost::lock_guard<boost::mutex> lock(mutex);
+            stopping = true;
+        }
+        thread.join();
+        ::close(server);
+        ::unlink(path.c_str());
+    }
+
+    /* Closes the client's connection, as a restarted Redis would. */
+    void drop_connection() {
+        {
+            boost::lock_guard<boost::mutex> lock(mutex);
+            drop_requested = true;
+        }
+        for (int i = 0; i < 200 && drop_pending(); i ++) {
+            boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+        }
+        BOOST_REQUIRE(!drop_pending());
+    }
+
+    int get_connection_count() {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        return connection_count;
+    }
+
+    const std::string & get_path() const {
+        return path;
+    }
+
+    std::vector<Command> get_received() {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        return received;
+    }
+
+    /* Sends the given bytes, just as they are, whenever the command
+     * comes in. */
+    void set_answer(const std::string & name, const std::string & answer) {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        answers[name] = answer;
+    }
+
+    /* Answers nothing until this many commands have come in, so a
+     * client waiting for each reply before sending the next command
+     * would time out. */
+    void hold_replies(size_t count) {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        held_replies = count;
+    }
+
+private:
+    std::map<std::string, std::string> answers;
+    int connection_count;
+    bool drop_requested;
+    size_t held_replies;
+    boost::mutex mutex;
+    const std::string path;
+    std::vector<Command> received;
+    int server;
+    bool stopping;
+    boost::thread thread;
+
+    bool drop_pending() {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        return drop_requested;
+    }
+
+    std::string answer(const Command & command) {
+        const std::string & name = command[0];
+        {
+            boost::lock_guard<boost::mutex> lock(mutex);
+            if (answers.count(name)) {
+                return answers[name];
+            }
+        }
+        if (name == "PING") {
+            return "+PONG\r\n";
+        } else if (name == "AUTH" || name == "CLIENT") {
+            return "+OK\r\n";
+        } else if (name == "ECHO" && command.size() == 2) {
+            return str(boost::format("$%d\r\n%s\r\n")
+                       % command[1].size() % command[1]);
+        }
+        return "-ERR unknown command '" + name + "'\r\n";
+    }
+
+    /* Takes one command off the front of the buffer, if it's all
+     * there. Commands from hiredis are always arrays of bulk strings. */
+    static bool parse(std::string & buffer, Command & command) {
+        size_t position = 0;
+        long count;
+        if (!read_header(buffer, '*', position, count)) {
+            return false;
+        }
+        command.clear();
+        for (long i = 0; i < count; i ++) {
+            long length;
+            if (!read_header(buffer, '$', position, length)
+                || buffer.size() < position + length + 2) {
+                return false;
+            }
+            command.push_back(buffer.substr(position, length));
+            position += length + 2;
+        }
+        buffer.erase(0, position);
+        return true;
+    }
+
+    static bool read_header(const std::string & buffer, char type,
+                            size_t & position, long & value) {
+        const size_t end = buffer.find("\r\n", position);
+        if (end == std::string::npos) {
+            return false;
+        }
+        BOOST_REQUIRE_EQUAL(buffer[position], type);
+        value = atol(buffer.substr(position + 1, end - position - 1)
+                     .c_str());
+        position = end + 2;
+        return true;
+    }
+
+    /* Snapshots can be bigger than the socket's buffer. */
+    static void send_all(int client, const std::string & data) {
+        size_t sent = 0;
+        while(sent < data.size()) {
+            const ssize_t count = ::send(client, data.data() + sent,
+                                         data.size() - sent, MSG_NOSIGNAL);
+            if (count <= 0) {
+                return;
+            }
+            sent += count;
+        }
+    }
+
+    void serve() {
+        int client = -1;
+        std::string buffer;
+        std::string replies;
+        size_t reply_count = 0;
+        while(true) {
+            {
+                boost::lock_guard<boost::mutex> lock(mutex);
+                if (stopping) {
+                    break;
+                }
+                if (drop_requested) {
+                    if (client >= 0) {
+                        ::close(client);
+                        client = -1;
+                    }
+                    drop_requested = false;
+                }
+            }
+            pollfd fds[2] = { { server, POLLIN, 0 },
+                              { client, POLLIN, 0 } };
+            if (::poll(fds, client >= 0 ? 2 : 1, 20) <= 0) {
+                continue;
+            }
+            if (fds[0].revents & POLLIN) {
+                if (client >= 0) {
+                    ::close(client);
+                }
+                client = ::accept(server, 0, 0);
+                buffer.clear();
+                replies.clear();
+                reply_count = 0;
+                boost::lock_guard<boost::mutex> lock(mutex);
+                ++ connection_count;
+                continue;
+            }
+            if (client < 0 || !(fds[1].revents & (POLLIN | POLLHUP))) {
+                continue;
+            }
+            char chunk[4096];
+            const ssize_t count = ::recv(client, chunk, sizeof(chunk), 0);
+            if (count <= 0) {
+                ::close(client);
+                client = -1;
+                continue;
+            }
+            buffer.append(chunk, count);
+            Command command;
+            while(parse(buffer, command)) {
+                replies += answer(command);
+                ++ reply_count;
+                boost::lock_guard<boost::mutex> lock(mutex);
+                received.push_back(command);
+            }
+            bool hold;
+            {
+                boost::lock_guard<boost::mutex> lock(mutex);
+                hold = reply_count < held_replies;
+                if (!hold) {
+                    held_replies = 0;
+                }
+            }
+            if (!hold && !replies.empty()) {
+                send_all(client, replies);
+                replies.clear();
+                reply_count = 0;
+            }
+        }
+        if (client >= 0) {
+            ::close(client);
+        }
+    }
+};
+
+} }  // end nova::redis
+
+#endif
@@ -0,0 +1,492 @@
+#define BOOST_TEST_MODULE RedisBackup_tests
+#include <boost/test/unit_test.hpp>
+
+#include <boost/assign/list_of.hpp>
+#include <boost/foreach.hpp>
+#include <boost/format.hpp>
+#include <boost/thread.hpp>
+#include <deque>
+#include <fstream>
+#include "FakeRedis.h"
+#include "nova/Log.h"
+#include "nova/process.h"
+#include "nova/redis/RedisBackup.h"
+#include "nova/redis/RedisException.h"
+#include <sstream>
+#include <stdlib.h>
+#include <string>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace boost::assign;
+using nova::backup::BackupProgress;
+using nova::LogApiScope;
+using nova::LogOptions;
+using nova::process::execute;
+using nova::redis::FakeRedis;
+using nova::redis::RdbPersistence;
+using nova::redis::RdbSnapshot;
+using nova::redis::RedisClient;
+using nova::redis::RedisException;
+using nova::redis::SnapshotTarReader;
+using nova::redis::TAR_BLOCK_SIZE;
+using nova::redis::tar_header;
+using nova::redis::tar_padding;
+namespace zlib = nova::utils::zlib;
+using std::string;
+using std::stringstream;
+using std::vector;
+
+struct GlobalFixture {
+
+    LogApiScope log;
+
+    GlobalFixture()
+    : log(LogOptions::simple()) {
+    }
+
+};
+
+BOOST_GLOBAL_FIXTURE(GlobalFixture);
+
+
+/**---------------------------------------------------------------------------
+ *- RdbPersistence
+ *---------------------------------------------------------------------------*/
+
+namespace {
+
+    const long long START_TIME = 1000000;
+
+    /* The persistence section of INFO, as Redis would report it. */
+    string persistence(bool bgsave_in_progress, bool aof_rewrite_in_progress,
+                       long long last_save, long long changes,
+                       const char * status="ok", long long bgsave_age=-1) {
+        return str(boost::format(
+            "# Persistence\r\n"
+            "rdb_changes_since_last_save:%d\r\n"
+            "rdb_bgsave_in_progress:%d\r\n"
+            "rdb_last_save_time:%d\r\n"
+            "rdb_last_bgsave_status:%s\r\n"
+            "rdb_current_bgsave_time_sec:%d\r\n"
+            "aof_rewrite_in_progress:%d\r\n")
+            % changes % (bgsave_in_progress ? 1 : 0) % last_save % status
+            % bgsave_age % (aof_rewrite_in_progress ? 1 : 0));
+    }
+
+    /* Feeds canned INFO replies to RdbPersistence, one per request with the
+     * last one repeating, and runs it on a fake clock sleeping advances. */
+    class CannedRdbPersistence : public RdbPersistence {
+        public:
+            struct Bgsave {
+                bool schedule;
+                long long wall_time;
+            };
+
+            CannedRdbPersistence(long long tolerance, double time_out)
+            :   RdbPersistence(tolerance, time_out),
+                bgsave_errors(0),
+                bgsaves(),
+                infos(),
+                info_requests(0),
+                now(START_TIME) {
+            }
+
+            /* How many BGSAVEs fail with an error before one works. */
+            int bgsave_errors;
+            vector<Bgsave> bgsaves;
+            std::deque<string> infos;
+            int info_requests;
+            double now;
+
+        protected:
+            virtual void bgsave(bool schedule) {
+                Bgsave call = { schedule, wall_time() };
+                bgsaves.push_back(call);
+                if (bgsave_errors > 0) {
+                    -- bgsave_errors;
+                    throw RedisException(RedisException::REPLY_ERROR);
+                }
+            }
+
+            virtual RedisClient::Info get_persistence_info() {
+                BOOST_REQUIRE(!infos.empty());
+                ++ info_requests;
+                const string info = infos.front();
+                if (infos.size() > 1) {
+                    infos.pop_front();
+                }
+                return RedisClient::Info(info);
+            }
+
+            virtual double monotonic_time() const {
+                return now;
+            }
+
+            virtual void sleep(double seconds) {
+                BOOST_REQUIRE(seconds >= 0);
+                now += seconds;
+            }
+
+            virtual long long wall_time() const {
+                return (long long) now;
+            }
+    };
+
+}  // end anonymous namespace
+
+BOOST_AUTO_TEST_CASE(fresh_dump_is_used_as_is) {
+    CannedRdbPersistence rdb(60, 30);
+    rdb.infos.push_back(persistence(false, false, START_TIME - 10, 0));
+    rdb.update();
+    BOOST_CHECK_EQUAL(0, rdb.bgsaves.size());
+    BOOST_CHECK_EQUAL(1, rdb.info_requests);
+}
+
+BOOST_AUTO_TEST_CASE(recent_save_in_progress_is_waited_for) {
+    CannedRdbPersistence rdb(60, 30);
+    rdb.infos.push_back(persistence(true, false, START_TIME - 100, 5, "ok",
+                                    10));
+    rdb.infos.push_back(persistence(true, false, START_TIME - 100, 5, "ok",
+                                    11));
+    rdb.infos.push_back(persistence(false, false, START_TIME + 2, 0));
+    rdb.update();
+    BOOST_CHECK_EQUAL(0, rdb.bgsaves.size());
+    BOOST_CHECK_EQUAL(3, rdb.info_requests);
+}
+
+BOOST_AUTO_TEST_CASE(old_save_in_progress_is_followed_by_another) {
+    CannedRdbPersistence rdb(60, 30);
+    rdb.infos.push_back(persistence(true, false, START_TIME - 1000, 5, "ok",
+                                    600));
+    rdb.infos.push_back(persistence(false, false, START_TIME, 3));
+    rdb.infos.push_back(persistence(false, false, START_TIME, 3));
+    rdb.infos.push_back(persistence(false, false, START_TIME + 2, 0));
+    rdb.update();
+    BOOST_REQUIRE_EQUAL(1, rdb.bgsaves.size());
+    BOOST_CHECK(!rdb.bgsaves[0].schedule);
+    // The old save finished this second, so ours had to start in the next.
+    BOOST_CHECK(rdb.bgsaves[0].wall_time > START_TIME);
+}
+
+BOOST_AUTO_TEST_CASE(bgsave_already_in_progress_error_is_retried) {
+    CannedRdbPersistence rdb(60, 30);
+    rdb.bgsave_errors = 1;
+    // Someone else's BGSAVE starts between our INFO and BGSAVE.
+    rdb.infos.push_back(persistence(false, false, START_TIME - 100, 3));
+    rdb.infos.push_back(persistence(true, false, START_TIME - 100, 3, "ok",
+                                    1));
+    rdb.infos.push_back(persistence(false, false, START_TIME + 2, 0));
+    rdb.update();
+    BOOST_CHECK_EQUAL(1, rdb.bgsaves.size());
+    BOOST_CHECK_EQUAL(3, rdb.info_requests);
+}
+
+BOOST_AUTO_TEST_CASE(bgsave_errors_past_the_deadline_are_thrown) {
+    CannedRdbPersistence rdb(60, 5);
+    rdb.bgsave_errors = 100;
+    rdb.infos.push_back(persistence(false, false, START_TIME - 100, 3));
+    try {
+        rdb.update();
+        BOOST_FAIL("Should have thrown.");
+    } catch(const RedisException & re) {
+        BOOST_CHECK_EQUAL(RedisException::REPLY_ERROR, re.code);
+    }
+    BOOST_CHECK(rdb.now >= START_TIME + 5);
+}
+
+BOOST_AUTO_TEST_CASE(save_past_the_deadline_times_out) {
+    CannedRdbPersistence rdb(60, 30);
+    rdb.infos.push_back(persistence(false, false, START_TIME - 100, 3));
+    rdb.infos.push_back(persistence(true, false, START_TIME - 100, 3, "ok",
+                                    0));
+    try {
+        rdb.update();
+        BOOST_FAIL("Should have thrown.");
+    } catch(const RedisException & re) {
+        BOOST_CHECK_EQUAL(RedisException::BGSAVE_TIMED_OUT, re.code);
+    }
+    BOOST_CHECK_EQUAL(1, rdb.bgsaves.size());
+    // Gave up at the deadline, not a poll interval past it.
+    BOOST_CHECK_CLOSE(START_TIME + 30.0, rdb.now, 0.0001);
+}
+
+BOOST_AUTO_TEST_CASE(failed_save_is_reported) {
+    CannedRdbPersistence rdb(60, 30);
+    rdb.infos.push_back(persistence(false, false, START_TIME - 100, 3));
+    rdb.infos.push_back(persistence(true, false, START_TIME - 100, 3, "ok",
+                                    0));
+    // Redis leaves the save time alone when a save fails.
+    rdb.infos.push_back(persistence(false, false, START_TIME - 100, 3,
+                                    "err"));
+    try {
+        rdb.update();
+        BOOST_FAIL("Should have thrown.");
+    } catch(const RedisException & re) {
+        BOOST_CHECK_EQUAL(RedisException::BGSAVE_FAILED, re.code);
+    }
+    BOOST_CHECK_EQUAL(3, rdb.info_requests);
+    BOOST_CHECK(rdb.now < START_TIME + 1);
+}
+
+BOOST_AUTO_TEST_CASE(save_failing_between_polls_is_reported) {
+    CannedRdbPersistence rdb(60, 30);
+    rdb.infos.push_back(persistence(false, false, START_TIME - 100, 3));
+    rdb.infos.push_back(persistence(false, false, START_TIME - 100, 3,
+                                    "err"));
+    try {
+        rdb.update();
+        BOOST_FAIL("Should have thrown.");
+    } catch(const RedisException & re) {
+        BOOST_CHECK_EQUAL(RedisException::BGSAVE_FAILED, re.code);
+    }
+    BOOST_CHECK_EQUAL(2, rdb.info_requests);
+}
+
+BOOST_AUTO_TEST_CASE(failed_save_in_progress_is_reported) {
+    CannedRdbPersistence rdb(60, 30);
+    rdb.infos.push_back(persistence(true, false, START_TIME - 100, 5, "ok",
+                                    10));
+    rdb.infos.push_back(persistence(false, false, START_TIME - 100, 5,
+                                    "err"));
+    try {
+        rdb.update();
+        BOOST_FAIL("Should have thrown.");
+    } catch(const RedisException & re) {
+        BOOST_CHECK_EQUAL(RedisException::BGSAVE_FAILED, re.code);
+    }
+    BOOST_CHECK_EQUAL(0, rdb.bgsaves.size());
+}
+
+BOOST_AUTO_TEST_CASE(old_failure_is_ignored_until_scheduled_save_starts) {
+    CannedRdbPersistence rdb(60, 30);
+    // An earlier save failed, and the scheduled one waits for the rewrite.
+    rdb.infos.push_back(persistence(false, true, START_TIME - 100, 3, "err"));
+    rdb.infos.push_back(persistence(false, true, START_TIME - 100, 3, "err"));
+    rdb.infos.push_back(persistence(false, false, START_TIME - 100, 3,
+                                    "err"));
+    rdb.infos.push_back(persistence(true, false, START_TIME - 100, 3, "err",
+                                    0));
+    rdb.infos.push_back(persistence(false, false, START_TIME + 2, 0));
+    rdb.update();
+    BOOST_REQUIRE_EQUAL(1, rdb.bgsaves.size());
+    BOOST_CHECK(rdb.bgsaves[0].schedule);
+    BOOST_CHECK_EQUAL(5, rdb.info_requests);
+}
+
+BOOST_AUTO_TEST_CASE(failed_scheduled_save_is_reported) {
+    CannedRdbPersistence rdb(60, 30);
+    rdb.infos.push_back(persistence(false, true, START_TIME - 100, 3));
+    rdb.infos.push_back(persistence(false, false, START_TIME - 100, 3,
+                                    "err"));
+    try {
+        rdb.update();
+        BOOST_FAIL("Should have thrown.");
+    } catch(const RedisException & re) {
+        BOOST_CHECK_EQUAL(RedisException::BGSAVE_FAILED, re.code);
+    }
+    BOOST_CHECK_EQUAL(2, rdb.info_requests);
+}
+
+BOOST_AUTO_TEST_CASE(scheduled_save_waits_for_the_next_second) {
+    CannedRdbPersistence rdb(60, 30);
+    // The last save finished this very second while an AOF rewrite runs.
+    rdb.infos.push_back(persistence(false, true, START_TIME, 3));
+    // A save time from the second the BGSAVE was scheduled in isn't ours.
+    rdb.infos.push_back(persistence(false, false, START_TIME, 3));
+    rdb.infos.push_back(persistence(false, false, START_TIME + 1, 0));
+    rdb.update();
+    BOOST_REQUIRE_EQUAL(1, rdb.bgsaves.size());
+    BOOST_CHECK(rdb.bgsaves[0].schedule);
+    BOOST_CHECK_EQUAL(START_TIME + 1, rdb.bgsaves[0].wall_time);
+    BOOST_CHECK_EQUAL(3, rdb.info_requests);
+}
+
+BOOST_AUTO_TEST_CASE(unscheduled_save_waits_for_the_rewrite) {
+    CannedRdbPersistence rdb(60, 30);
+    // Versions before 3.2 don't know BGSAVE SCHEDULE.
+    rdb.bgsave_errors = 1;
+    rdb.infos.push_back(persistence(false, true, START_TIME - 100, 3));
+    rdb.infos.push_back(persistence(false, true, START_TIME - 100, 3));
+    rdb.infos.push_back(persistence(false, false, START_TIME - 100, 3));
+    rdb.infos.push_back(persistence(false, false, START_TIME - 100, 3));
+    rdb.infos.push_back(persistence(false, false, START_TIME + 5, 0));
+    rdb.update();
+    BOOST_REQUIRE_EQUAL(2, rdb.bgsaves.size());
+    BOOST_CHECK(rdb.bgsaves[0].schedule);
+    BOOST_CHECK(!rdb.bgsaves[1].schedule);
+    BOOST_CHECK_EQUAL(5, rdb.info_requests);
+}
+
+
+/**---------------------------------------------------------------------------
+ *- Tar
+ *---------------------------------------------------------------------------*/
+
+namespace {
+
+    /* Sums the header the way tar does to check it. */
+    unsigned int tar_checksum(const string & header) {
+        unsigned int checksum = 0;
+        for (size_t i = 0; i < header.size(); i ++) {
+            checksum += (148 <= i && i < 156) ? ' '
+                : (unsigned char) header[i];
+        }
+        return checksum;
+    }
+
+    /* Runs tar over the archive and returns what it writes. */
+    string run_tar(const string & archive, vector<string> args) {
+        const string path = str(boost::format("/tmp/redis_backup_tests_%d.tar")
+                                % getpid());
+        {
+            std::ofstream file(path.c_str(), std::ios::binary);
+            file.write(archive.data(), archive.size());
+        }
+        nova::process::CommandList cmds = list_of<string>("/bin/tar");
+        cmds.insert(cmds.end(), args.begin(), args.end());
+        cmds.push_back("-f");
+        cmds.push_back(path);
+        stringstream out;
+        try {
+            execute(out, cmds);
+        } catch(...) {
+            ::unlink(path.c_str());
+            throw;
+        }
+        ::unlink(path.c_str());
+        return out.str();
+    }
+
+    string tar_file(const string & name, const string & contents) {
+        return tar_header(name, contents.size()) + contents
+            + tar_padding(contents.size());
+    }
+
+    const string TAR_END(2 * TAR_BLOCK_SIZE, '\0');
+
+}  // end anonymous namespace
+
+BOOST_AUTO_TEST_CASE(tar_header_is_checksummed_octal) {
+    const string header = tar_header("var/lib/redis/dump.rdb", 1000);
+    BOOST_REQUIRE_EQUAL(TAR_BLOCK_SIZE, header.size());
+    BOOST_CHECK_EQUAL("var/lib/redis/dump.rdb", string(header.c_str()));
+    BOOST_CHECK_EQUAL("00000001750", string(header.c_str() + 124));
+    BOOST_CHECK_EQUAL(tar_checksum(header),
+                      strtoul(header.c_str() + 148, 0, 8));
+    BOOST_CHECK_EQUAL("ustar", string(header.c_str() + 257));
+}
+
+BOOST_AUTO_TEST_CASE(tar_header_sizes_too_big_for_octal_are_base_256) {
+    // Eleven octal digits hold sizes up to 8 GiB.
+    const unsigned long long largest_octal = 077777777777ULL;
+    string header = tar_header("big", largest_octal);
+    BOOST_CHECK_EQUAL("77777777777", string(header.c_str() + 124));
+
+    const unsigned long long size = largest_octal + 2;
+    header = tar_header("big", size);
+    BOOST_CHECK_EQUAL((unsigned char) header[124], 0x80);
+    unsigned long long decoded = 0;
+    for (size_t i = 125; i < 136; i ++) {
+        decoded = (decoded << 8) | (unsigned char) header[i];
+    }
+    BOOST_CHECK_EQUAL(size, decoded);
+    BOOST_CHECK_EQUAL(tar_checksum(header),
+                      strtoul(header.c_str() + 148, 0, 8));
+}
+
+BOOST_AUTO_TEST_CASE(tar_padding_fills_the_last_block) {
+    BOOST_CHECK_EQUAL(0, tar_padding(0).size());
+    BOOST_CHECK_EQUAL(511, tar_padding(1).size());
+    BOOST_CHECK_EQUAL(1, tar_padding(511).size());
+    BOOST_CHECK_EQUAL(0, tar_padding(512).size());
+    BOOST_CHECK_EQUAL(511, tar_padding(513).size());
+    BOOST_CHECK_EQUAL(string(511, '\0'), tar_padding(1));
+}
+
+BOOST_AUTO_TEST_CASE(tar_reads_what_tar_header_writes) {
+    const string contents = "port 6379\n";
+    const string archive = tar_file("etc/redis/redis.conf", contents)
+        + tar_file("var/lib/redis/empty", "") + TAR_END;
+    const string listing = run_tar(archive, list_of<string>("tv"));
+    BOOST_CHECK(listing.find(" 10 ") != string::npos);
+    BOOST_CHECK(listing.find("etc/redis/redis.conf") != string::npos);
+    BOOST_CHECK(listing.find("var/lib/redis/empty") != string::npos);
+    BOOST_CHECK_EQUAL(contents, run_tar(archive, list_of<string>("xO")
+                                        ("etc/redis/redis.conf")));
+}
+
+
+/**---------------------------------------------------------------------------
+ *- SnapshotTarReader
+ *---------------------------------------------------------------------------*/
+
+namespace {
+
+    class NothingJob : public nova::utils::Job {
+    public:
+        virtual void operator()() {
+        }
+
+        virtual Job * clone() const {
+            return new NothingJob(*this);
+        }
+    };
+
+    /* Makes a snapshot of the given size, with every byte counting. */
+    string make_snapshot(size_t size) {
+        string snapshot(size, '\0');
+        for (size_t i = 0; i < size; i ++) {
+            snapshot[i] = (char) ('a' + (i * 7) % 26);
+        }
+        return snapshot;
+    }
+
+    /* Runs the reader the way zlib would, returning everything it gives. */
+    string read_all(zlib::InputStream & reader) {
+        string stream;
+        while(zlib::OK == reader.advance()) {
+            stream.append(reader.get_buffer(), reader.get_buffer_size());
+        }
+        return stream;
+    }
+
+}  // end anonymous namespace
+
+BOOST_AUTO_TEST_CASE(snapshot_tar_is_framed_for_any_size) {
+    const string conf = "port 6379\nrequirepass secret\n";
+    const size_t sizes[] = { 0, 1, 511, 512, 513, 1024, 64 * 1024 + 1 };
+    BOOST_FOREACH(const size_t size, sizes) {
+        BOOST_TEST_MESSAGE("Snapshot of " << size << " bytes.");
+        const string rdb = make_snapshot(size);
+        FakeRedis redis;
+        redis.set_answer("PSYNC", str(boost::format(
+            "+FULLRESYNC 0123abcd 1\r\n$%d\r\n") % rdb.size()) + rdb);
+        RdbSnapshot snapshot(redis.get_path());
+        BOOST_REQUIRE(snapshot.wait_for_start()
+                      || snapshot.wait_for_start());
+        NothingJob job;
+        BackupProgress progress(job, 60);
+        SnapshotTarReader reader(conf, snapshot, progress);
+        const string stream = read_all(reader);
+
+        // Byte for byte what tar would write for the two files.
+        const string expected = tar_file("etc/redis/redis.conf", conf)
+            + tar_file("var/lib/redis/dump.rdb", rdb) + TAR_END;
+        BOOST_REQUIRE_EQUAL(expected.size(), stream.size());
+        BOOST_CHECK_EQUAL(0, stream.size() % TAR_BLOCK_SIZE);
+        // The headers differ only in their mtime and checksum.
+        const size_t rdb_start = 2 * TAR_BLOCK_SIZE;
+        BOOST_CHECK(stream.substr(TAR_BLOCK_SIZE, rdb_start - TAR_BLOCK_SIZE)
+                    == expected.substr(TAR_BLOCK_SIZE,
+                                       rdb_start - TAR_BLOCK_SIZE));
+        BOOST_CHECK(stream.substr(rdb_start + TAR_BLOCK_SIZE)
+                    == expected.substr(rdb_start + TAR_BLOCK_SIZE));
+
+        BOOST_CHECK_EQUAL(conf, run_tar(stream, list_of<string>("xO")
+                                        ("etc/redis/redis.conf")));
+        BOOST_CHECK(rdb == run_tar(stream, list_of<string>("xO")
+                                   ("var/lib/redis/dump.rdb")));
+    }
+}
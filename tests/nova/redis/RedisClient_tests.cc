@@ -0,0 +1,258 @@
+#define BOOST_TEST_MODULE RedisClient_tests
+#include <boost/test/unit_test.hpp>
+
+#include <boost/assign/list_of.hpp>
+#include "FakeRedis.h"
+#include "nova/Log.h"
+#include "nova/redis/RedisClient.h"
+#include "nova/redis/RedisException.h"
+#include <string>
+#include <vector>
+
+using namespace boost::assign;
+using nova::LogApiScope;
+using nova::LogOptions;
+using nova::redis::FakeRedis;
+using nova::redis::RdbSnapshot;
+using nova::redis::RedisClient;
+using nova::redis::RedisException;
+using std::string;
+using std::vector;
+
+namespace {
+    const char * const INFO =
+        "# Server\r\n"
+        "redis_version:2.8.19\r\n"
+        "\r\n"
+        "# Memory\r\n"
+        "used_memory:1048576\r\n"
+        "used_memory_human:1.00M\r\n"
+        "\r\n"
+        "# Persistence\r\n"
+        "rdb_bgsave_in_progress:1\r\n"
+        "aof_enabled:0\r\n"
+        "aof_rewrite_in_progress:0\r\n"
+        "\r\n"
+        "# Replication\r\n"
+        "role:slave\r\n"
+        "master_host:10.0.0.2\r\n"
+        "master_repl_offset:12345\r\n";
+}
+
+BOOST_AUTO_TEST_CASE(info_is_parsed_into_values)
+{
+    LogApiScope log(LogOptions::simple());
+    const RedisClient::Info info(INFO);
+    BOOST_REQUIRE_EQUAL(info.get("redis_version"), "2.8.19");
+    BOOST_REQUIRE_EQUAL(info.get("used_memory_human"), "1.00M");
+    BOOST_REQUIRE_EQUAL(info.get("master_host"), "10.0.0.2");
+    // Section headers aren't values.
+    BOOST_REQUIRE(!info.get_optional("# Server"));
+    BOOST_REQUIRE(!info.get_optional("nothing"));
+    BOOST_REQUIRE_THROW(info.get("nothing"), RedisException);
+    BOOST_REQUIRE_THROW(info.get_int("role"), RedisException);
+
+    BOOST_REQUIRE(info.is_bgsave_in_progress());
+    BOOST_REQUIRE(!info.is_aof_enabled());
+    BOOST_REQUIRE(!info.is_aof_rewrite_in_progress());
+    BOOST_REQUIRE_EQUAL(info.get_role().get(), "slave");
+    BOOST_REQUIRE_EQUAL(info.get_used_memory().get(), 1048576);
+    BOOST_REQUIRE_EQUAL(info.get_replication_offset().get(), 12345);
+}
+
+BOOST_AUTO_TEST_CASE(info_without_a_trailing_newline)
+{
+    LogApiScope log(LogOptions::simple());
+    const RedisClient::Info info("role:master");
+    BOOST_REQUIRE_EQUAL(info.get_role().get(), "master");
+    BOOST_REQUIRE(!info.get_used_memory());
+}
+
+
+/**---------------------------------------------------------------------------
+ *- RedisClient
+ *---------------------------------------------------------------------------*/
+
+BOOST_AUTO_TEST_CASE(pipeline_sends_commands_before_reading_replies)
+{
+    LogApiScope log(LogOptions::simple());
+    FakeRedis redis;
+    RedisClient client(redis.get_path());
+
+    // The fake answers none of these until it has all three.
+    redis.hold_replies(3);
+    RedisClient::Replies replies = client.pipeline(
+        RedisClient::Pipeline()
+            .add(list_of<string>("ECHO")("spaces stay put"))
+            .add(list_of<string>("NOT_A_COMMAND"))
+            .add(list_of<string>("PING")));
+    BOOST_REQUIRE_EQUAL(replies.size(), 3);
+    BOOST_CHECK_EQUAL(replies[0].expect_string(), "spaces stay put");
+    BOOST_CHECK_THROW(replies[1].expect_ok(), RedisException);
+    BOOST_CHECK_EQUAL(replies[2].expect_status(), "PONG");
+
+    // Each argument arrives on its own, just as it was added.
+    const vector<FakeRedis::Command> received = redis.get_received();
+    BOOST_REQUIRE_EQUAL(received.size(), 4);  // After CLIENT SETNAME.
+    BOOST_REQUIRE_EQUAL(received[1].size(), 2);
+    BOOST_CHECK_EQUAL(received[1][1], "spaces stay put");
+
+    // The error didn't leave a reply behind to confuse the next command.
+    client.ping();
+    BOOST_CHECK_EQUAL(redis.get_connection_count(), 1);
+}
+
+BOOST_AUTO_TEST_CASE(client_reconnects_after_connection_is_dropped)
+{
+    LogApiScope log(LogOptions::simple());
+    FakeRedis redis;
+    RedisClient client(redis.get_path());
+    client.ping();
+    BOOST_CHECK_EQUAL(redis.get_connection_count(), 1);
+
+    // The command which finds the connection gone fails...
+    redis.drop_connection();
+    BOOST_CHECK_THROW(client.ping(), RedisException);
+
+    // ... and the next one starts a new connection.
+    client.ping();
+    BOOST_CHECK_EQUAL(redis.get_connection_count(), 2);
+    RedisClient::Replies replies = client.pipeline(
+        RedisClient::Pipeline().add(list_of<string>("ECHO")("again")));
+    BOOST_CHECK_EQUAL(replies[0].expect_string(), "again");
+
+    // Pipelines reconnect the same way.
+    redis.drop_connection();
+    BOOST_CHECK_THROW(client.pipeline(
+        RedisClient::Pipeline().add(list_of<string>("PING"))),
+        RedisException);
+    replies = client.pipeline(
+        RedisClient::Pipeline().add(list_of<string>("PING")));
+    BOOST_CHECK_EQUAL(replies[0].expect_status(), "PONG");
+    BOOST_CHECK_EQUAL(redis.get_connection_count(), 3);
+}
+
+
+/**---------------------------------------------------------------------------
+ *- RdbSnapshot
+ *---------------------------------------------------------------------------*/
+
+namespace {
+
+    bool wait_for_snapshot(RdbSnapshot & snapshot) {
+        for (int i = 0; i < 5; i ++) {
+            if (snapshot.wait_for_start()) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    string read_snapshot(RdbSnapshot & snapshot) {
+        string data;
+        char buffer[4];
+        size_t count;
+        while((count = snapshot.read(buffer, sizeof(buffer))) > 0) {
+            data.append(buffer, count);
+        }
+        return data;
+    }
+
+}  // end anonymous namespace
+
+BOOST_AUTO_TEST_CASE(snapshot_is_read_after_full_resync)
+{
+    LogApiScope log(LogOptions::simple());
+    FakeRedis redis;
+    // Newlines keep the connection alive while the snapshot is made, and
+    // the commands streamed after it must be left alone.
+    redis.set_answer("PSYNC", "\n\n+FULLRESYNC 0123abcd 1\r\n\n"
+                              "$11\r\nREDIS0006\r\n*1\r\n$4\r\nPING\r\n");
+    RdbSnapshot snapshot(redis.get_path());
+    BOOST_REQUIRE(wait_for_snapshot(snapshot));
+    BOOST_CHECK_EQUAL(snapshot.get_size(), 11);
+    BOOST_CHECK_EQUAL(snapshot.get_remaining(), 11);
+    BOOST_CHECK_EQUAL(read_snapshot(snapshot), "REDIS0006\r\n");
+    BOOST_CHECK_EQUAL(snapshot.get_remaining(), 0);
+
+    const vector<FakeRedis::Command> received = redis.get_received();
+    BOOST_REQUIRE_EQUAL(received.size(), 2);  // After CLIENT SETNAME.
+    BOOST_CHECK_EQUAL(received[1].size(), 3);
+    BOOST_CHECK_EQUAL(received[1][0], "PSYNC");
+}
+
+BOOST_AUTO_TEST_CASE(empty_snapshot_is_read)
+{
+    LogApiScope log(LogOptions::simple());
+    FakeRedis redis;
+    redis.set_answer("PSYNC", "+FULLRESYNC 0123abcd 1\r\n$0\r\n");
+    RdbSnapshot snapshot(redis.get_path());
+    BOOST_REQUIRE(wait_for_snapshot(snapshot));
+    BOOST_CHECK_EQUAL(snapshot.get_size(), 0);
+    BOOST_CHECK_EQUAL(read_snapshot(snapshot), "");
+}
+
+BOOST_AUTO_TEST_CASE(snapshot_without_a_size_is_rejected)
+{
+    LogApiScope log(LogOptions::simple());
+    FakeRedis redis;
+    // Only replicas which say they can take it get a snapshot this way.
+    redis.set_answer("PSYNC", "+FULLRESYNC 0123abcd 1\r\n"
+        "$EOF:0123456789012345678901234567890123456789\r\n");
+    RdbSnapshot snapshot(redis.get_path());
+    try {
+        wait_for_snapshot(snapshot);
+        BOOST_FAIL("Should have thrown.");
+    } catch(const RedisException & re) {
+        BOOST_CHECK_EQUAL(re.code, RedisException::UNEXPECTED_RESPONSE);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(sync_is_tried_when_psync_is_unknown)
+{
+    LogApiScope log(LogOptions::simple());
+    FakeRedis redis;
+    // PSYNC gets the fake's usual "unknown command" error.
+    redis.set_answer("SYNC", "\n$3\r\nabc");
+    RdbSnapshot snapshot(redis.get_path());
+    BOOST_REQUIRE(wait_for_snapshot(snapshot));
+    BOOST_CHECK_EQUAL(read_snapshot(snapshot), "abc");
+
+    const vector<FakeRedis::Command> received = redis.get_received();
+    BOOST_REQUIRE_EQUAL(received.size(), 3);
+    BOOST_CHECK_EQUAL(received[1][0], "PSYNC");
+    BOOST_CHECK_EQUAL(received[2][0], "SYNC");
+}
+
+BOOST_AUTO_TEST_CASE(refused_snapshot_is_a_reply_error)
+{
+    LogApiScope log(LogOptions::simple());
+    FakeRedis redis;
+    // The backup falls back to the files on REPLY_ERROR, whether SYNC is
+    // refused too...
+    redis.set_answer("SYNC", "-ERR unknown command 'SYNC'\r\n");
+    {
+        RdbSnapshot snapshot(redis.get_path());
+        try {
+            wait_for_snapshot(snapshot);
+            BOOST_FAIL("Should have thrown.");
+        } catch(const RedisException & re) {
+            BOOST_CHECK_EQUAL(re.code, RedisException::REPLY_ERROR);
+        }
+    }
+    // ... or PSYNC is refused for some other reason, such as a replica
+    // which has lost its master.
+    redis.set_answer("PSYNC", "-NOMASTERLINK Can't SYNC while not "
+                              "connected with my master\r\n");
+    RdbSnapshot snapshot(redis.get_path());
+    try {
+        wait_for_snapshot(snapshot);
+        BOOST_FAIL("Should have thrown.");
+    } catch(const RedisException & re) {
+        BOOST_CHECK_EQUAL(re.code, RedisException::REPLY_ERROR);
+    }
+    const vector<FakeRedis::Command> received = redis.get_received();
+    BOOST_REQUIRE_EQUAL(received.size(), 5);
+    BOOST_CHECK_EQUAL(received[2][0], "SYNC");
+    BOOST_CHECK_EQUAL(received[4][0], "PSYNC");
+}
@@ -1,12 +1,17 @@
 #define BOOST_TEST_MODULE SwiftTests
 #include <boost/test/unit_test.hpp>
 
+#include <algorithm>
 #include "nova/Log.h"
 #include <boost/thread.hpp>
 #include "nova/utils/threads.h"
+#include <string>
+#include <vector>
 
 using nova::LogApiScope;
 using nova::LogOptions;
+using std::string;
+using std::vector;
 using namespace nova::utils;
 
 
@@ -15,6 +20,10 @@ void sleep_one() {
     boost::this_thread::sleep(time);
 }
 
+void nap() {
+    boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+}
+
 
 namespace {
     int start_count;
@@ -45,15 +54,109 @@ namespace {
         }
 
     };
+
+    /* Records its name when it starts, then runs until it's released or
+     * cancelled. */
+    struct GateJob : public Job {
+
+        struct Shared {
+            boost::mutex mutex;
+            vector<string> started;
+            vector<string> finished;
+            vector<string> abandoned;
+            bool open;
+            Shared() : open(false) {}
+        };
+
+        Shared & shared;
+        const string name;
+        const string job_type;
+        const int job_priority;
+        volatile bool cancelled;
+
+        GateJob(Shared & shared, const string & name,
+                const string & job_type="default", int job_priority=0)
+        :   shared(shared),
+            name(name),
+            job_type(job_type),
+            job_priority(job_priority),
+            cancelled(false)
+        {}
+
+        GateJob(const GateJob & other)
+        :   shared(other.shared),
+            name(other.name),
+            job_type(other.job_type),
+            job_priority(other.job_priority),
+            cancelled(false)
+        {}
+
+        virtual void operator()() {
+            {
+                boost::lock_guard<boost::mutex> lock(shared.mutex);
+                shared.started.push_back(name);
+            }
+            while(!cancelled) {
+                {
+                    boost::lock_guard<boost::mutex> lock(shared.mutex);
+                    if (shared.open) {
+                        break;
+                    }
+                }
+                nap();
+            }
+            boost::lock_guard<boost::mutex> lock(shared.mutex);
+            shared.finished.push_back(name);
+        }
+
+        virtual void abandon() {
+            boost::lock_guard<boost::mutex> lock(shared.mutex);
+            shared.abandoned.push_back(name);
+        }
+
+        virtual void cancel() {
+            cancelled = true;
+        }
+
+        virtual Job * clone() const {
+            return new GateJob(*this);
+        }
+
+        virtual int priority() const {
+            return job_priority;
+        }
+
+        virtual const char * type() const {
+            return job_type.c_str();
+        }
+
+    };
+
+    size_t count(GateJob::Shared & shared, vector<string> GateJob::Shared::*list) {
+        boost::lock_guard<boost::mutex> lock(shared.mutex);
+        return (shared.*list).size();
+    }
+
+    void wait_for(GateJob::Shared & shared,
+                  vector<string> GateJob::Shared::*list, size_t expected) {
+        for (int i = 0; i < 500 && count(shared, list) < expected; i ++) {
+            nap();
+        }
+        BOOST_REQUIRE_EQUAL(count(shared, list), expected);
+    }
+
+    void open_gate(GateJob::Shared & shared) {
+        boost::lock_guard<boost::mutex> lock(shared.mutex);
+        shared.open = true;
+    }
 }
 
 BOOST_AUTO_TEST_CASE(job_runner_tests)
 {
     LogApiScope log(LogOptions::simple());
 
-    ThreadBasedJobRunner runner;
-    Thread thread(1024 * 1024, runner);
-
+    JobScheduler runner;
+    runner.start(1, 1024 * 1024);
 
     BOOST_REQUIRE(runner.is_idle());
 
@@ -62,12 +165,11 @@ BOOST_AUTO_TEST_CASE(job_runner_tests)
 
     TestJob job;
 
-    runner.run(job);
+    BOOST_REQUIRE(runner.run(job));
     // Wait an unbearably long (from the tests perspective) time.
     sleep_one();
     BOOST_REQUIRE(!runner.is_idle());
     BOOST_REQUIRE_EQUAL(start_count, 1);
-    BOOST_REQUIRE_EQUAL(1, start_count);
     BOOST_REQUIRE(job.cycle_count == 0); // Prove job is being copied.
 
     quit = true;  // End job.
@@ -77,25 +179,203 @@ BOOST_AUTO_TEST_CASE(job_runner_tests)
     BOOST_REQUIRE_EQUAL(1, finish_count);;
     BOOST_REQUIRE(runner.is_idle());
 
-    // Now, set number back to 0 so the job won't quit, and as it is run,
-    // try to run other jobs.
+    // Jobs run while the only worker is busy are queued instead of refused.
     quit = false;
-    runner.run(job);
+    BOOST_REQUIRE(runner.run(job));
+    BOOST_REQUIRE(runner.run(job));
     sleep_one();
     BOOST_REQUIRE_EQUAL(start_count, 2);
     BOOST_REQUIRE_EQUAL(finish_count, 1);
-    BOOST_REQUIRE(job.cycle_count == 0); // Prove job is being copied.
+    BOOST_REQUIRE_EQUAL(runner.stats().queue_depth, 1);
+    BOOST_REQUIRE_EQUAL(runner.stats().running, 1);
 
-    for (unsigned int i = 0; i < 10000; i ++) {
-        bool result = runner.run(job);
-        BOOST_REQUIRE_EQUAL(result, false);
-        BOOST_REQUIRE(!runner.is_idle());
-        // Make sure no other jobs are run.
-        BOOST_REQUIRE_EQUAL(start_count, 2);
-        BOOST_REQUIRE_EQUAL(finish_count, 1);
-    }
-
-    // Let the job finish.
     quit = true;
+    sleep_one();
+    sleep_one();
+    BOOST_REQUIRE_EQUAL(start_count, 3);
+    BOOST_REQUIRE_EQUAL(finish_count, 3);
+    BOOST_REQUIRE(runner.is_idle());
+    BOOST_REQUIRE_EQUAL(runner.stats().started, 3);
+    // The queued job had to wait for the first one to quit.
+    BOOST_REQUIRE(runner.stats().max_wait > 0.5);
+
     runner.shutdown(); // Avoid errors due to thread still running dead object.
+    BOOST_REQUIRE(!runner.run(job));
+}
+
+BOOST_AUTO_TEST_CASE(limited_types_do_not_block_other_jobs)
+{
+    LogApiScope log(LogOptions::simple());
+
+    JobScheduler runner;
+    runner.set_limit("backup", 1);
+    runner.start(3, 1024 * 1024);
+
+    GateJob::Shared shared;
+    runner.run(GateJob(shared, "backup 1", "backup"));
+    runner.run(GateJob(shared, "backup 2", "backup"));
+    runner.run(GateJob(shared, "restart", "default"));
+
+    // The second backup waits behind the first, but the restart doesn't.
+    wait_for(shared, &GateJob::Shared::started, 2);
+    nap();
+    BOOST_REQUIRE_EQUAL(count(shared, &GateJob::Shared::started), 2);
+    // Two workers pick these up at once, so either may start first.
+    BOOST_REQUIRE(std::find(shared.started.begin(), shared.started.end(),
+                            "restart") != shared.started.end());
+    BOOST_REQUIRE(std::find(shared.started.begin(), shared.started.end(),
+                            "backup 2") == shared.started.end());
+    BOOST_REQUIRE_EQUAL(runner.stats().queue_depth, 1);
+
+    open_gate(shared);
+    wait_for(shared, &GateJob::Shared::finished, 3);
+    BOOST_REQUIRE_EQUAL(shared.started[2], "backup 2");
+    runner.shutdown();
+}
+
+BOOST_AUTO_TEST_CASE(priorities_and_cancellation)
+{
+    LogApiScope log(LogOptions::simple());
+
+    JobScheduler runner;
+    runner.start(1, 1024 * 1024);
+
+    GateJob::Shared shared;
+    const JobScheduler::JobId first = runner.submit(GateJob(shared, "first"));
+    wait_for(shared, &GateJob::Shared::started, 1);
+
+    runner.submit(GateJob(shared, "low", "default", -1));
+    const JobScheduler::JobId doomed = runner.submit(
+        GateJob(shared, "doomed"));
+    runner.submit(GateJob(shared, "high", "default", 5));
+    BOOST_REQUIRE_EQUAL(runner.stats().queue_depth, 3);
+
+    // Queued jobs are removed and told they won't run.
+    BOOST_REQUIRE(runner.cancel(doomed));
+    BOOST_REQUIRE(!runner.cancel(doomed));
+    BOOST_REQUIRE_EQUAL(runner.stats().queue_depth, 2);
+    BOOST_REQUIRE_EQUAL(shared.abandoned.size(), 1);
+    BOOST_REQUIRE_EQUAL(shared.abandoned[0], "doomed");
+
+    // Running jobs are asked to stop.
+    BOOST_REQUIRE(runner.cancel(first));
+    wait_for(shared, &GateJob::Shared::finished, 1);
+
+    open_gate(shared);
+    wait_for(shared, &GateJob::Shared::finished, 3);
+    BOOST_REQUIRE_EQUAL(shared.started.size(), 3);
+    BOOST_REQUIRE_EQUAL(shared.started[1], "high");
+    BOOST_REQUIRE_EQUAL(shared.started[2], "low");
+    // Running jobs are cancelled, not abandoned.
+    BOOST_REQUIRE_EQUAL(shared.abandoned.size(), 1);
+    BOOST_REQUIRE(!runner.cancel(first));
+    runner.shutdown();
+}
+
+BOOST_AUTO_TEST_CASE(shutdown_abandons_queued_jobs)
+{
+    LogApiScope log(LogOptions::simple());
+
+    JobScheduler runner;
+    runner.start(1, 1024 * 1024);
+
+    GateJob::Shared shared;
+    runner.submit(GateJob(shared, "running"));
+    wait_for(shared, &GateJob::Shared::started, 1);
+    runner.submit(GateJob(shared, "queued 1"));
+    runner.submit(GateJob(shared, "queued 2"));
+
+    // Queued jobs are told they won't run while the running one finishes.
+    boost::thread shutdown(boost::bind(&JobScheduler::shutdown, &runner));
+    wait_for(shared, &GateJob::Shared::abandoned, 2);
+    BOOST_REQUIRE_EQUAL(shared.abandoned[0], "queued 1");
+    BOOST_REQUIRE_EQUAL(shared.abandoned[1], "queued 2");
+    BOOST_REQUIRE_THROW(runner.submit(GateJob(shared, "late")),
+                        ThreadException);
+
+    open_gate(shared);
+    shutdown.join();
+    BOOST_REQUIRE_EQUAL(shared.started.size(), 1);
+    BOOST_REQUIRE_EQUAL(shared.finished.size(), 1);
+    BOOST_REQUIRE_EQUAL(runner.stats().queue_depth, 0);
+}
+
+namespace {
+    struct ProgressRecorder : public Job::ProgressCallback {
+        vector<unsigned long long> bytes_read;
+
+        virtual void operator()(const Job & job, const JobProgress & progress) {
+            bytes_read.push_back(progress.bytes_read);
+        }
+    };
+
+    /* Copies bytes a chunk at a time until it's done or cancelled. */
+    struct CopyJob : public Job {
+        boost::mutex & mutex;
+        bool & stopped_early;
+
+        CopyJob(boost::mutex & mutex, bool & stopped_early)
+        :   mutex(mutex),
+            stopped_early(stopped_early)
+        {}
+
+        virtual void operator()() {
+            JobProgress progress;
+            try {
+                for (int i = 0; i < 500; i ++) {
+                    cancellation().throw_if_cancelled();
+                    progress.bytes_read += 1024;
+                    report_progress(progress);
+                    nap();
+                }
+            } catch(const ThreadException & te) {
+                boost::lock_guard<boost::mutex> lock(mutex);
+                stopped_early = true;
+            }
+        }
+
+        virtual Job * clone() const {
+            return new CopyJob(*this);
+        }
+    };
+}
+
+BOOST_AUTO_TEST_CASE(cancellation_tokens_are_shared_by_copies)
+{
+    CancellationToken token;
+    CancellationToken copy(token);
+    BOOST_REQUIRE(!copy.is_cancelled());
+    token.cancel();
+    BOOST_REQUIRE(copy.is_cancelled());
+    BOOST_REQUIRE_THROW(copy.throw_if_cancelled(), ThreadException);
+}
+
+BOOST_AUTO_TEST_CASE(running_jobs_report_progress_and_can_be_cancelled)
+{
+    LogApiScope log(LogOptions::simple());
+
+    boost::mutex mutex;
+    bool stopped_early = false;
+    ProgressRecorder recorder;
+    CopyJob job(mutex, stopped_early);
+    job.set_progress_callback(&recorder);
+    job.report_progress(JobProgress());
+    BOOST_REQUIRE_EQUAL(recorder.bytes_read.size(), 1);
+
+    JobScheduler runner;
+    runner.start(1, 1024 * 1024);
+    const JobScheduler::JobId id = runner.submit(job);
+    for (int i = 0; i < 500 && runner.stats().running == 0; i ++) {
+        nap();
+    }
+    nap();
+    BOOST_REQUIRE(runner.cancel(id));
+    runner.shutdown();
+
+    BOOST_REQUIRE(stopped_early);
+    // The copy shares the callback, and stopped well short of the end.
+    BOOST_REQUIRE(recorder.bytes_read.size() > 1);
+    BOOST_REQUIRE(recorder.bytes_read.back() < 500 * 1024);
+    // The copy shares the original's token too.
+    BOOST_REQUIRE(job.cancellation().is_cancelled());
 }
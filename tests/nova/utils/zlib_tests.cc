@@ -4,6 +4,7 @@
 #include "nova/Log.h"
 #include "nova/utils/zlib.h"
 #include <iostream>
+#include <zlib.h>
 
 using nova::LogApiScope;
 using nova::LogOptions;
@@ -197,7 +198,8 @@ void compress_test(std::stringstream & compressed_buffer, size_t source_size) {
 
 
 // This version uses the char buffer.
-void compress_test2(std::stringstream & compressed_buffer, size_t source_size) {
+void compress_test2(std::stringstream & compressed_buffer, size_t source_size,
+                    ZlibFormat format=ZLIB_FORMAT) {
     RepeatingAlphabetInput alphabet(source_size);
 
     class Reader : public InputStream {
@@ -235,7 +237,7 @@ void compress_test2(std::stringstream & compressed_buffer, size_t source_size) {
     //                   error.
     reader.reset(static_cast<InputStream *>(new Reader(alphabet)));
 
-    ZlibCompressor zlib;
+    ZlibCompressor zlib(format);
 
     char output_buffer[1024];
     // size_t last_write_count;
@@ -524,3 +526,36 @@ BOOST_AUTO_TEST_CASE(compress_and_decompress_3)
     NOVA_LOG_DEBUG("Ratio is %d", ratio);
     BOOST_REQUIRE_MESSAGE(ratio < .014, "Compression was less than expected.");
 }
+
+
+BOOST_AUTO_TEST_CASE(compress_to_gzip)
+{
+    LogApiScope log(LogOptions::simple());
+
+    const size_t source_size = 2000 * 26 * letters_in_a_row;
+
+    std::stringstream compressed_buffer;
+    compress_test2(compressed_buffer, source_size, GZIP_FORMAT);
+    const std::string compressed = compressed_buffer.str();
+    BOOST_REQUIRE(compressed.size() > 2);
+    BOOST_REQUIRE_EQUAL((unsigned char) compressed[0], 0x1f);
+    BOOST_REQUIRE_EQUAL((unsigned char) compressed[1], 0x8b);
+
+    // Decompress it the way gunzip would, since ZlibDecompressor can't.
+    std::string decompressed(source_size + 1, '\0');
+    z_stream stream;
+    stream.zalloc = Z_NULL;
+    stream.zfree = Z_NULL;
+    stream.opaque = Z_NULL;
+    stream.next_in = (Bytef *) compressed.data();
+    stream.avail_in = compressed.size();
+    stream.next_out = (Bytef *) &decompressed[0];
+    stream.avail_out = decompressed.size();
+    BOOST_REQUIRE_EQUAL(inflateInit2(&stream, 16 + MAX_WBITS), Z_OK);
+    BOOST_REQUIRE_EQUAL(inflate(&stream, Z_FINISH), Z_STREAM_END);
+    BOOST_REQUIRE_EQUAL(stream.total_out, source_size);
+    inflateEnd(&stream);
+
+    std::stringstream decompressed_buffer(decompressed);
+    confirm_stringstream_matches_input(decompressed_buffer, source_size);
+}
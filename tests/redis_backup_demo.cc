@@ -35,11 +35,12 @@ using namespace nova::redis;
 int main(int argc, char **argv)
 {
     const long long tolerance = 4;
+    const double save_time_out = 60 * 60;
     LogApiScope log(LogOptions::simple());
     CurlScope scope;
 
     if (argc < 2) {
-        NOVA_LOG_ERROR("Usage: %s [info|rdb|all|dbfilename]",
+        NOVA_LOG_ERROR("Usage: %s [info|rdb|all|stream|dbfilename]",
                        (argc < 1 ? "program" : argv[0]));
         return 1;
     }
@@ -55,10 +56,11 @@ int main(int argc, char **argv)
         return 0;
     } else if (option == "rdb") {
         NOVA_LOG_INFO("Updating rdb.");
-        RdbPersistence rdb(tolerance);
+        RedisClient client;
+        RdbPersistence rdb(client, tolerance, save_time_out);
         rdb.update();
         return 0;
-    } else if (option == "all") {
+    } else if (option == "all" || option == "stream") {
         NOVA_LOG_INFO("Running entire backup.");
         nova::rpc::ResilientSenderPtr null;
         nova::guest::diagnostics::Interrogator interrogator("/var/lib/redis");
@@ -68,7 +70,10 @@ int main(int argc, char **argv)
             1024 * 1024,        // max backup segment size
             30,                 // checksum wait time
             "TEST_CONTAINER",   // container
-            300                 // Timeout
+            300,                // Timeout
+            30,                 // progress interval
+            nova::process::CgroupConfig(boost::none,
+                                        nova::process::CgroupLimits())
         };
         const string tenant = "1000";
         if (argc < 3) {
@@ -82,7 +87,8 @@ int main(int argc, char **argv)
             "id",
             "swift-url"
         };
-        RedisBackupJob job(data, true, tolerance, backup_info);
+        RedisBackupJob job(data, true, tolerance, save_time_out,
+                           option == "stream", backup_info);
         job();
         return 0;
     } else {